@@ -8,9 +8,14 @@
 #
 
 # Add additional subfolders to the build bath
-COMPONENT_SRCDIRS += interfaces resources
+COMPONENT_SRCDIRS += interfaces resources services
 COMPONENT_ADD_INCLUDEDIRS := include
 
+ifdef CONFIG_IOTNODE_COAP_DTLS
+# Not committed, see Readme.md
+COMPONENT_EMBED_TXTFILES += ../certs/coap_server.crt ../certs/coap_server.key
+endif
+
 SHELL := /bin/bash
 SECRETS := ${PROJECT_PATH}/secrets
 SECRETS := $(shell cat ${SECRETS} | sed -r 's/^\#.*$$//g; s/^([^=]+)$$/ -D\1/m; s/^([^=]+=)(.*)$$/ -D\1"\2"/' | tr -d '\n')
@@ -4,13 +4,18 @@
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <initializer_list>
+#include <string>
 #include <tuple>
 #include <type_traits>
 #include <vector>
 
+#include "sdkconfig.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/event_groups.h"
 
+#include "latencytrace.h"
+
 enum class CoapResult
 {
     OK = 0,
@@ -21,7 +26,8 @@ enum class CoapResult
 // TODO: Adjust these max sizes
 enum CoapConstraints : unsigned long long
 {
-    MaxResourceSize = 50,
+    // Resources are mostly pointers, 80 bytes on the ESP32
+    MaxResourceSize = 20 * sizeof(void *),
     MaxMessageSize = 10,
     MaxOptionSize = 10,
 };
@@ -41,17 +47,32 @@ enum CoapOptionValue : int {
     UriHost = 3,
     ETag = 4,
     IfNoneMatch = 5,
+    Observe = 6,
     UriPort = 7,
     LocationPath = 8,
+    Oscore = 9,
     UriPath = 11,
     ContentFormat = 12,
     MaxAge = 14,
     UriQuery = 15,
     Accept = 17,
     LocationQuery = 20,
+    Block2 = 23,
+    Block1 = 27,
+    Size2 = 28,
     ProxyUri = 35,
     ProxyScheme = 39,
     Size1 = 60,
+    Echo = 252,
+    NoResponse = 258,
+};
+
+enum class CoapMessageType
+{
+    Confirmable = 0,
+    NonConfirmable = 1,
+    Acknowledgement = 2,
+    Reset = 3,
 };
 
 enum class CoapOptionType
@@ -78,6 +99,7 @@ enum CoapMessageCode : int {
     Valid   = MESSAGE_CODE_FROM_CLASS_CODE( 2, 03),
     Changed = MESSAGE_CODE_FROM_CLASS_CODE( 2, 04),
     Content = MESSAGE_CODE_FROM_CLASS_CODE( 2, 05),
+    Continue = MESSAGE_CODE_FROM_CLASS_CODE( 2, 31),
     // 4.xx Client Error
     BadRequest               = MESSAGE_CODE_FROM_CLASS_CODE( 4, 00),
     Unauthorized             = MESSAGE_CODE_FROM_CLASS_CODE( 4, 01),
@@ -86,6 +108,7 @@ enum CoapMessageCode : int {
     NotFound                 = MESSAGE_CODE_FROM_CLASS_CODE( 4, 04),
     MethodNotAllowed         = MESSAGE_CODE_FROM_CLASS_CODE( 4, 05),
     NotAcceptable            = MESSAGE_CODE_FROM_CLASS_CODE( 4, 06),
+    RequestEntityIncomplete  = MESSAGE_CODE_FROM_CLASS_CODE( 4,  8),
     PreconditionFailed       = MESSAGE_CODE_FROM_CLASS_CODE( 4, 12),
     RequestEntityTooLarge    = MESSAGE_CODE_FROM_CLASS_CODE( 4, 13),
     UnsupportedContentFormat = MESSAGE_CODE_FROM_CLASS_CODE( 4, 15),
@@ -101,7 +124,7 @@ enum CoapMessageCode : int {
 template<class TInterface, int MaxSize>
 class StackAllocator
 {
-    char _allocation[MaxSize];
+    alignas(8) char _allocation[MaxSize];
 public:
     TInterface *operator->()
     {
@@ -129,6 +152,26 @@ struct CoapDtlsOptions
     size_t cert_key_len;
 };
 
+// One OSCORE security context (RFC 8613 section 3), byte strings. Master salt and ID context
+// may be left empty.
+struct CoapOscoreOptions
+{
+    const unsigned char *master_secret_ptr;
+    size_t master_secret_len;
+
+    const unsigned char *master_salt_ptr;
+    size_t master_salt_len;
+
+    const unsigned char *sender_id_ptr;
+    size_t sender_id_len;
+
+    const unsigned char *recipient_id_ptr;
+    size_t recipient_id_len;
+
+    const unsigned char *id_context_ptr;
+    size_t id_context_len;
+};
+
 struct CoapOptions
 {
     struct {
@@ -144,17 +187,26 @@ class ICoapResource;
 class ICoapMessage;
 class ICoapOption;
 class ICoapObserver;
+class StateWriter;
 using CoapResource = StackAllocator<ICoapResource, CoapConstraints::MaxResourceSize>;
 using CoapMessage = StackAllocator<ICoapMessage, CoapConstraints::MaxMessageSize>;
 using CoapOption = StackAllocator<ICoapOption, CoapConstraints::MaxOptionSize>;
 
 using Payload = std::basic_string<uint8_t>;
 
+// Constructs the matching ICoapOption type in `option` from the option's raw (wire format) value
+void CoapOptionFromBytes(CoapOption &option, const uint16_t number, const uint8_t *value, size_t length, CoapResult &result);
+
 class IApplicationResource
 {
 public:
     virtual void HandleNotify(ICoapObserver const *observer, ICoapMessage *response, CoapResult &result) { result = CoapResult::Error; };
     virtual void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result) { result = CoapResult::Error; };
+    // Numeric representation of the resource's state, used for conditional observe attributes (gt, lt, st)
+    virtual bool GetObservedValue(float &value) const { return false; }
+    // Writes the current state as fields of an already opened map. Lets composites such as /state
+    // include the resource with the same serializer it uses for its own responses.
+    virtual bool WriteState(StateWriter &writer) const { return false; }
     virtual ~IApplicationResource() {};
 };
 
@@ -179,14 +231,20 @@ public:
     // virtual void GetOption_uint(const uint16_t option, uint32_t *value, CoapResult &result);
     // virtual void AddOption_uint(uint16_t option, uint32_t code, CoapResult &result);
     virtual void GetOption(CoapOption &option,const uint16_t number, CoapResult &result) const = 0;
+    // Gets the values of every instance of a repeatable string option (e.g. Uri-Query)
+    virtual void GetOptions(std::vector<std::string> &values, const uint16_t number, CoapResult &result) const = 0;
     virtual void AddOption(ICoapOption const *option, CoapResult &result) = 0;
     virtual void AddOption(ICoapOption const &option, CoapResult &result) { this->AddOption(&option, result); }
     virtual void SetOption(ICoapOption const *option, CoapResult &result) = 0;
     virtual void SetOption(ICoapOption const &option, CoapResult &result) { this->SetOption(&option, result); }
     virtual CoapMessageCode GetCode() const = 0;
     virtual void SetCode(CoapMessageCode code, CoapResult &result) = 0;
+    virtual CoapMessageType GetType() const = 0;
+    virtual void SetType(CoapMessageType type, CoapResult &result) = 0;
     virtual void GetPayload(Payload &payload, CoapResult &result) const = 0;
     virtual void SetPayload(Payload const &payload, CoapResult &result) = 0;
+    // Whether the request was sent to a multicast group rather than to this node
+    virtual bool IsMulticast() const { return false; }
 
     template<class T>
     void SetPayload(std::vector<T> const &something, CoapResult &result) { this->SetPayload(Payload(something.begin(), something.end()), result); }
@@ -201,6 +259,7 @@ public:
     virtual ~ICoapObserver(){}
 
     virtual void GetOption(CoapOption &option,const uint16_t number, CoapResult &result) const = 0;
+    virtual void GetOptions(std::vector<std::string> &values, const uint16_t number, CoapResult &result) const = 0;
     virtual void AddOption(ICoapOption const *option, CoapResult &result) = 0;
     virtual void AddOption(ICoapOption const &option, CoapResult &result) { this->AddOption(&option, result); }
 
@@ -216,13 +275,25 @@ public:
         : applicationResource(applicationResource) {}
     virtual void RegisterHandler(CoapMessageCode requestType, CoapResult &result) = 0;
     virtual void RegisterAsObservable(CoapResult &result) = 0;
-    virtual void NotifyObservers(CoapResult &result) = 0;
+    // Link-format (RFC 6690) rt, if and ct attributes advertised in /.well-known/core.
+    // The strings must outlive the resource.
+    virtual void SetAttributes(const char *resourceType, const char *interface, std::initializer_list<CoapContentType> contentFormats, CoapResult &result) = 0;
+    // Makes this resource a composite of `member`'s resource: whenever the member notifies its
+    // observers, so does this resource
+    virtual void AddMember(IApplicationResource const *member, CoapResult &result) = 0;
+    // `trace` follows the event that caused the notification through to the network
+    virtual void NotifyObservers(LatencyTrace const &trace, CoapResult &result) = 0;
 
     void RegisterHandler(CoapResult &result)
     {
         this->RegisterHandler(CoapMessageCode::Get, result);
     }
 
+    void NotifyObservers(CoapResult &result)
+    {
+        this->NotifyObservers(LatencyTrace(), result);
+    }
+
     virtual ~ICoapResource() {}
 };
 
@@ -321,4 +392,48 @@ inline CoapStringOption *AsString(ICoapOption *option) { assert(option->Type ==
 inline CoapUIntOption *AsUInt(ICoapOption &option) { assert(option.Type == CoapOptionType::UInt); return static_cast<CoapUIntOption*>(&option);}
 inline CoapUIntOption *AsUInt(ICoapOption *option) { assert(option->Type == CoapOptionType::UInt); return static_cast<CoapUIntOption*>(option);}
 
+// No-Response (RFC 7967) bits, one per response class the client isn't interested in
+enum CoapNoResponse : uint8_t {
+    SuppressSuccess     = (1 << 1), // 2.xx
+    SuppressClientError = (1 << 3), // 4.xx
+    SuppressServerError = (1 << 4), // 5.xx
+};
+
+// Whether the No-Response value `noResponse` covers responses of `codeClass`. Bit class - 1
+// stands for the class, only 2.xx, 4.xx and 5.xx can be suppressed (RFC 7967 section 2.1).
+inline bool IsNoResponseSuppressed(uint8_t noResponse, uint8_t codeClass)
+{
+    if (codeClass != 2 && codeClass != 4 && codeClass != 5)
+        return false;
+    return (noResponse & (1 << (codeClass - 1))) != 0;
+}
+
+// The No-Response value that applies when a request doesn't carry the option. Errors are never
+// sent in reply to a multicast request (RFC 7252 section 8.2), successes only if configured to.
+inline uint8_t CoapDefaultNoResponse(bool multicast)
+{
+    if (!multicast)
+        return 0;
+#if CONFIG_IOTNODE_COAP_MULTICAST_SUPPRESS_SUCCESS
+    return SuppressSuccess | SuppressClientError | SuppressServerError;
+#else
+    return SuppressClientError | SuppressServerError;
+#endif
+}
+
+// Whether the client asked, through No-Response, not to be sent a response with `code`.
+// Without the option CoapDefaultNoResponse applies.
+// Handlers can check this before spending time on serializing a payload nobody will read.
+template<class Message>
+inline bool IsResponseSuppressed(Message const *request, CoapMessageCode code)
+{
+    CoapResult result;
+    CoapOption option;
+    request->GetOption(option, CoapOptionValue::NoResponse, result);
+    if (result != CoapResult::OK)
+        return IsNoResponseSuppressed(CoapDefaultNoResponse(request->IsMulticast()), code >> 5);
+
+    return IsNoResponseSuppressed(static_cast<uint8_t>(AsUInt(option)->Value), code >> 5);
+}
+
 #endif /* __MAIN_COAP_ */
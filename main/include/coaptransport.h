@@ -0,0 +1,21 @@
+#ifndef _MAIN_COAPTRANSPORT_H_
+#define _MAIN_COAPTRANSPORT_H_
+
+#include "sdkconfig.h"
+#include "coap.h"
+
+// The CoAP transport the resources are built against. Normally that's the ICoapInterface
+// abstraction and every request goes through virtual calls on ICoapMessage.
+// With IOTNODE_COAP_STATIC_DISPATCH the concrete transport is a compile-time parameter: resources
+// register their own type, and requests reach Resource::Handle<CoapTransportMessage> with the
+// transport's final message class, so the compiler can resolve and inline the calls in between.
+#if CONFIG_IOTNODE_COAP_STATIC_DISPATCH
+#include "../interfaces/lobarocoap.h"
+
+using CoapTransport = LobaroCoap;
+using CoapTransportMessage = LobaroCoapMessage;
+#else
+using CoapTransport = ICoapInterface;
+#endif
+
+#endif // _MAIN_COAPTRANSPORT_H_
@@ -0,0 +1,83 @@
+#ifndef _MAIN_LATENCYTRACE_H_
+#define _MAIN_LATENCYTRACE_H_
+
+#include <atomic>
+#include <cstdint>
+
+#include "sdkconfig.h"
+#include "esp_timer.h"
+
+enum class TraceStage : uint8_t
+{
+    Wakeup,     // ISR edge -> input dispatcher task
+    Notify,     // -> ICoapResource::NotifyObservers
+    Dequeue,    // -> network task picks up the notification
+    Serialize,  // -> IApplicationResource::HandleNotify has built the response
+    Send,       // -> datagram handed to the network stack
+    Total,      // ISR edge -> datagram sent
+    Count,
+};
+
+// Histogram of latencies with power of two microsecond buckets, safe to record from any task.
+class LatencyHistogram
+{
+public:
+    static const int kBuckets = 24; // Last bucket holds everything >= 2^23 us (~8 s)
+private:
+    std::atomic<uint32_t> _buckets[kBuckets];
+    std::atomic<uint32_t> _count;
+    std::atomic<uint32_t> _max;
+public:
+    LatencyHistogram();
+
+    void Record(uint32_t usec);
+    void Reset();
+
+    uint32_t GetCount() const { return _count.load(std::memory_order_relaxed); }
+    uint32_t GetMax() const { return _max.load(std::memory_order_relaxed); }
+    uint32_t GetBucket(int bucket) const { return _buckets[bucket].load(std::memory_order_relaxed); }
+    // Upper bound (us) of the bucket that holds the given percentile
+    uint32_t GetPercentile(int percentile) const;
+};
+
+const char *TraceStageName(TraceStage stage);
+LatencyHistogram &TraceHistogram(TraceStage stage);
+
+// Follows one event (e.g. a button press) from its origin timestamp through each stage of
+// the notification path and records the time spent in every stage.
+// Empty unless CONFIG_IOTNODE_LATENCY_TRACE is set, the calls then compile down to nothing.
+struct LatencyTrace
+{
+#if CONFIG_IOTNODE_LATENCY_TRACE
+    int64_t Origin = 0;
+    int64_t Last = 0;
+
+    LatencyTrace() {}
+    explicit LatencyTrace(int64_t origin)
+        : Origin(origin), Last(origin) {}
+
+    bool IsActive() const { return Origin != 0; }
+
+    void Mark(TraceStage stage)
+    {
+        if (!IsActive())
+            return;
+
+        int64_t now = esp_timer_get_time();
+        TraceHistogram(stage).Record(static_cast<uint32_t>(now - Last));
+        Last = now;
+
+        if (stage == TraceStage::Send)
+            TraceHistogram(TraceStage::Total).Record(static_cast<uint32_t>(now - Origin));
+    }
+#else
+    LatencyTrace() {}
+    explicit LatencyTrace(int64_t origin) {}
+
+    bool IsActive() const { return false; }
+
+    void Mark(TraceStage stage) {}
+#endif
+};
+
+#endif // _MAIN_LATENCYTRACE_H_
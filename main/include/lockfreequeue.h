@@ -0,0 +1,91 @@
+#ifndef _MAIN_LOCKFREEQUEUE_H_
+#define _MAIN_LOCKFREEQUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+// Bounded multi-producer/multi-consumer queue (Dmitry Vyukov's design).
+// Never blocks or allocates, so it is safe to use between tasks on both cores and from ISRs.
+template<class T, size_t Size>
+class LockFreeQueue
+{
+    static_assert(Size >= 2 && (Size & (Size - 1)) == 0, "LockFreeQueue Size must be a power of two");
+
+    struct Cell
+    {
+        std::atomic<size_t> Sequence;
+        T Data;
+    };
+
+    Cell _cells[Size];
+    std::atomic<size_t> _enqueuePos;
+    std::atomic<size_t> _dequeuePos;
+public:
+    LockFreeQueue()
+        : _enqueuePos(0), _dequeuePos(0)
+    {
+        for (size_t i = 0; i < Size; i++)
+            _cells[i].Sequence.store(i, std::memory_order_relaxed);
+    }
+
+    LockFreeQueue(LockFreeQueue const &) = delete;
+    LockFreeQueue &operator=(LockFreeQueue const &) = delete;
+
+    bool Push(T const &data)
+    {
+        Cell *cell;
+        size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &_cells[pos & (Size - 1)];
+            size_t sequence = cell->Sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false; // Full
+            else
+                pos = _enqueuePos.load(std::memory_order_relaxed);
+        }
+
+        cell->Data = data;
+        cell->Sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool Pop(T &data)
+    {
+        Cell *cell;
+        size_t pos = _dequeuePos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &_cells[pos & (Size - 1)];
+            size_t sequence = cell->Sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            }
+            else if (diff < 0)
+                return false; // Empty
+            else
+                pos = _dequeuePos.load(std::memory_order_relaxed);
+        }
+
+        data = cell->Data;
+        cell->Sequence.store(pos + Size, std::memory_order_release);
+        return true;
+    }
+
+    bool Empty() const
+    {
+        return _enqueuePos.load(std::memory_order_acquire) == _dequeuePos.load(std::memory_order_acquire);
+    }
+};
+
+#endif // _MAIN_LOCKFREEQUEUE_H_
@@ -0,0 +1,18 @@
+#ifndef _RESOURCES_LATENCY_H_
+#define _RESOURCES_LATENCY_H_
+
+#include "coaptransport.h"
+
+// Exports the notification path latency histograms (see latencytrace.h)
+class LatencyResource : public IApplicationResource {
+    CoapTransport& _coap;
+    CoapResource _resource;
+public:
+    LatencyResource(CoapTransport& coap);
+    void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result) { Handle(request, response, result); }
+    // Instantiated for ICoapMessage and, with IOTNODE_COAP_STATIC_DISPATCH, for CoapTransportMessage
+    template<class Message>
+    void Handle(Message const *request, Message *response, CoapResult &result);
+};
+
+#endif /* _RESOURCES_LATENCY_H_ */
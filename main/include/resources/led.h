@@ -3,8 +3,11 @@
 
 #include "driver/gpio.h"
 #include "driver/ledc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
-#include "coap.h"
+#include "coaptransport.h"
+#include "seqlock.h"
 
 class LEDResource : public IApplicationResource {
 public:
@@ -13,34 +16,51 @@ public:
         ShowStatus,
         User
     };
+
+    // Shared between the CoAP task (requests) and the main task (status updates)
+    struct State
+    {
+        uint8_t Red;
+        uint8_t Green;
+        uint8_t Blue;
+        Mode LEDMode;
+    };
 private:
-    ICoapInterface& _coap;
+    CoapTransport& _coap;
     CoapResource _resource;
 
     const gpio_num_t _pinLEDRed;
     const gpio_num_t _pinLEDGreen;
     const gpio_num_t _pinLEDBlue;
 
-    uint32_t _redValue = 0;
-    uint32_t _greenValue = 0;
-    uint32_t _blueValue = 0;
-
-    Mode _mode = Mode::ShowStatus;
+    SeqLock<State> _state{State{0, 0, 0, Mode::ShowStatus}};
+    // Held from changing the state until the LED shows it, so a status fade can't land after
+    // a switch to user mode. ledc takes its own semaphores, which rules out _state's critical section.
+    SemaphoreHandle_t _ledcLock;
 
     ledc_channel_config_t _ledcRedChannel;
     ledc_channel_config_t _ledcGreenChannel;
     ledc_channel_config_t _ledcBlueChannel;
+
+    void Fade(uint8_t red, uint8_t green, uint8_t blue, int fadeTime);
+    void StateChanged();
 public:
-    LEDResource(ICoapInterface& coap, gpio_num_t red, gpio_num_t green, gpio_num_t blue);
-    void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result);
+    LEDResource(CoapTransport& coap, gpio_num_t red, gpio_num_t green, gpio_num_t blue);
+    void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result) { Handle(request, response, result); }
+    // Instantiated for ICoapMessage and, with IOTNODE_COAP_STATIC_DISPATCH, for CoapTransportMessage
+    template<class Message>
+    void Handle(Message const *request, Message *response, CoapResult &result);
+    bool WriteState(StateWriter &writer) const;
 
     void SetStatusColor(uint8_t red, uint8_t green, uint8_t blue, int fadeTime = 0);
 
     void SetMode(Mode mode);
-    Mode GetMode() const { return _mode; }
+    Mode GetMode() const { return _state.Load().LEDMode; }
 
     void SetColor(uint8_t red, uint8_t green, uint8_t blue);
     void GetColor(uint8_t &red, uint8_t &green, uint8_t &blue);
+
+    State GetState() const { return _state.Load(); }
 };
 
 #endif /* _RESOURCES_LED_H_ */
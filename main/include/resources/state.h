@@ -0,0 +1,40 @@
+#ifndef _RESOURCES_STATE_H_
+#define _RESOURCES_STATE_H_
+
+#include <initializer_list>
+
+#include "coaptransport.h"
+
+// /state: the current state of several resources in one map keyed by their name, so a poll cycle
+// takes one exchange instead of one per resource. Observable as a whole, changes to members that
+// are picked up together go out as a single notification.
+class StateResource : public IApplicationResource {
+public:
+    struct Member
+    {
+        const char *Name;
+        IApplicationResource const *Resource;
+    };
+
+    static const int kMaxMembers = 8;
+private:
+    CoapTransport& _coap;
+    CoapResource _resource;
+
+    Member _members[kMaxMembers];
+    int _memberCount;
+
+    template<class Message>
+    void Respond(Message *response, CoapContentType contentType, std::vector<std::string> const &queries, CoapResult &result);
+public:
+    // Members must already have created their resources
+    StateResource(CoapTransport& coap, std::initializer_list<Member> members);
+    void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result) { Handle(request, response, result); }
+    // Instantiated for ICoapMessage and, with IOTNODE_COAP_STATIC_DISPATCH, for CoapTransportMessage
+    template<class Message>
+    void Handle(Message const *request, Message *response, CoapResult &result);
+    void HandleNotify(ICoapObserver const *observer, ICoapMessage *response, CoapResult &result);
+    bool WriteState(StateWriter &writer) const;
+};
+
+#endif /* _RESOURCES_STATE_H_ */
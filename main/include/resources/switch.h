@@ -1,11 +1,14 @@
 #ifndef _RESOURCES_SWITCH_H_
 #define _RESOURCES_SWITCH_H_
 
+#include <atomic>
+
 #include "driver/gpio.h"
 
-#include "coap.h"
+#include "coaptransport.h"
+#include "services/inputdispatcher.h"
 
-class SwitchResource : public IApplicationResource {
+class SwitchResource : public IApplicationResource, public IInputListener {
 public:
     enum class State
     {
@@ -13,24 +16,27 @@ public:
         Pushed,
     };
 private:
-    ICoapInterface& _coap;
+    CoapTransport& _coap;
     CoapResource _resource;
-    xTaskHandle _task;
-    xSemaphoreHandle _switchSemaphore;
-
-    static void TaskHandle(void* pvParameters);
 
     const gpio_num_t _pin;
-    const uint32_t _activeLevel;
 
-    State _state = State::Idle;
+    // Written by the input dispatcher task, read by the CoAP task
+    std::atomic<State> _state{State::Idle};
 
-    static void GPIOHandler(void* arg);
-    void Respond(ICoapMessage *response, CoapContentType contentType, CoapResult &result);
+    template<class Message>
+    void Respond(Message *response, CoapContentType contentType, std::vector<std::string> const &queries, CoapResult &result);
 public:
-    SwitchResource(ICoapInterface& coap, gpio_num_t pin, uint32_t activeLevel = 0);
-    void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result);
+    SwitchResource(CoapTransport& coap, InputDispatcher& inputs, gpio_num_t pin, uint32_t activeLevel = 0);
+    void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result) { Handle(request, response, result); }
+    // Instantiated for ICoapMessage and, with IOTNODE_COAP_STATIC_DISPATCH, for CoapTransportMessage
+    template<class Message>
+    void Handle(Message const *request, Message *response, CoapResult &result);
     void HandleNotify(ICoapObserver const *observer, ICoapMessage *response, CoapResult &result);
+    bool GetObservedValue(float &value) const;
+    bool WriteState(StateWriter &writer) const;
+
+    void InputChanged(gpio_num_t pin, bool active, int64_t timestamp);
 
     State GetSate() const { return _state; }
 };
@@ -1,14 +1,22 @@
 #ifndef _RESOURCES_WIFI_H_
 #define _RESOURCES_WIFI_H_
 
-#include "coap.h"
+#include "tcpip_adapter.h"
+
+#include "coaptransport.h"
 
 class WifiResource : public IApplicationResource {
-    ICoapInterface& _coap;
+    CoapTransport& _coap;
     CoapResource _resource;
+
+    void WriteState(tcpip_adapter_ip_info_t const &ipinfo, StateWriter &writer) const;
 public:
-    WifiResource(ICoapInterface& coap);
-    void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result);
+    WifiResource(CoapTransport& coap);
+    void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result) { Handle(request, response, result); }
+    // Instantiated for ICoapMessage and, with IOTNODE_COAP_STATIC_DISPATCH, for CoapTransportMessage
+    template<class Message>
+    void Handle(Message const *request, Message *response, CoapResult &result);
+    bool WriteState(StateWriter &writer) const;
 };
 
 #endif /* _RESOURCES_WIFI_H_ */
@@ -0,0 +1,75 @@
+#ifndef _MAIN_SEQLOCK_H_
+#define _MAIN_SEQLOCK_H_
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#include "freertos/FreeRTOS.h"
+
+// Sequence lock around a small, trivially copyable value that is shared between tasks.
+// Readers never block: they copy the value and retry if a write happened in the meantime.
+// Writers are serialised with a short critical section so they can't be preempted mid-write,
+// which would otherwise leave a same-core reader spinning.
+template<class T>
+class SeqLock
+{
+    static_assert(std::is_trivially_copyable<T>::value, "SeqLock values are copied while they may be written");
+
+    portMUX_TYPE _writeLock = portMUX_INITIALIZER_UNLOCKED;
+    std::atomic<uint32_t> _sequence;
+    T _value;
+
+    void Write(T const &value)
+    {
+        auto sequence = _sequence.load(std::memory_order_relaxed);
+        _sequence.store(sequence + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        std::memcpy(&_value, &value, sizeof(T));
+        _sequence.store(sequence + 2, std::memory_order_release);
+    }
+public:
+    SeqLock(T const &value = T())
+        : _sequence(0), _value(value) {}
+
+    SeqLock(SeqLock const &) = delete;
+    SeqLock &operator=(SeqLock const &) = delete;
+
+    T Load() const
+    {
+        T value;
+        uint32_t sequence;
+        do
+        {
+            sequence = _sequence.load(std::memory_order_acquire);
+            std::memcpy(&value, &_value, sizeof(T));
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        while ((sequence & 1) || sequence != _sequence.load(std::memory_order_relaxed));
+        return value;
+    }
+
+    void Store(T const &value)
+    {
+        portENTER_CRITICAL(&_writeLock);
+        Write(value);
+        portEXIT_CRITICAL(&_writeLock);
+    }
+
+    // Atomically applies `update` to a copy of the current value and stores the result.
+    // Returns the value from before the update. `update` runs in a critical section, keep it trivial.
+    template<class TUpdate>
+    T Update(TUpdate update)
+    {
+        portENTER_CRITICAL(&_writeLock);
+        T previous = _value;
+        T value = previous;
+        update(value);
+        Write(value);
+        portEXIT_CRITICAL(&_writeLock);
+        return previous;
+    }
+};
+
+#endif // _MAIN_SEQLOCK_H_
@@ -0,0 +1,64 @@
+#ifndef _SERVICES_INPUTDISPATCHER_H_
+#define _SERVICES_INPUTDISPATCHER_H_
+
+#include <atomic>
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+
+#include "lockfreequeue.h"
+
+static const int kInputDispatcherMaxInputs = CONFIG_IOTNODE_INPUT_MAX;
+
+class IInputListener
+{
+public:
+    virtual void InputChanged(gpio_num_t pin, bool active, int64_t timestamp) = 0;
+    virtual ~IInputListener() {}
+};
+
+// Debounces any number of GPIO inputs on a single task.
+// The GPIO ISRs only timestamp the edge and push it into a lock-free queue. The task reports the
+// leading edge straight away, then ignores further edges on that pin until the debounce period
+// (measured from the ISR timestamps) has passed and re-reads the pin if it bounced in between.
+class InputDispatcher
+{
+    struct Edge
+    {
+        int64_t Timestamp;
+        uint8_t Input;
+        uint8_t Level;
+    };
+
+    struct Input
+    {
+        InputDispatcher *Dispatcher;
+        IInputListener *Listener;
+        gpio_num_t Pin;
+        uint32_t ActiveLevel;
+        int64_t LockoutUntil;
+        std::atomic<bool> Active;
+        bool Bounced;
+    };
+
+    Input _inputs[kInputDispatcherMaxInputs];
+    std::atomic<int> _inputCount;
+    LockFreeQueue<Edge, 32> _edges;
+    xTaskHandle _task;
+
+    static void GPIOHandler(void* arg);
+    static void TaskHandle(void* pvParameters);
+
+    void HandleEdge(Edge const &edge);
+    TickType_t HandleLockouts(int64_t now);
+public:
+    InputDispatcher();
+    bool Start();
+
+    bool Register(gpio_num_t pin, uint32_t activeLevel, IInputListener *listener);
+    bool IsActive(gpio_num_t pin) const;
+};
+
+#endif /* _SERVICES_INPUTDISPATCHER_H_ */
@@ -0,0 +1,71 @@
+#ifndef _MAIN_STATEWRITER_H_
+#define _MAIN_STATEWRITER_H_
+
+#include <cstdint>
+#include <initializer_list>
+#include <string>
+#include <vector>
+
+#include "coap.h"
+
+// Streams a resource's state straight into a JSON or CBOR payload, without building a DOM first.
+// Resources write their fields in IApplicationResource::WriteState, which lets the same code serve
+// the resource itself and composites such as /state.
+class StateWriter
+{
+public:
+    enum class Format : uint8_t
+    {
+        Json,
+        Cbor,
+    };
+
+    static const int kMaxDepth = 4;
+private:
+    Format const _format;
+    std::string &_output;
+    int _depth;
+    int _skip;
+    bool _first[kMaxDepth];
+    // Comma separated field selection, empty for all fields
+    std::string _fields;
+
+    bool Key(const char *name);
+    void Next();
+    void Open();
+    void Head(uint8_t major, uint32_t value);
+    void String(const char *value);
+    template<class T>
+    void Number(const char *format, T value);
+public:
+    StateWriter(Format format, std::string &output);
+
+    // The writer format for a content format, false if there is none
+    static bool FormatFor(uint32_t contentFormat, Format &format)
+    {
+        format = contentFormat == CoapContentType::ApplicationCbor ? Format::Cbor : Format::Json;
+        return contentFormat == CoapContentType::ApplicationJson || contentFormat == CoapContentType::ApplicationCbor;
+    }
+
+    // Limits the outermost map to the fields listed in an `f` Uri-Query, e.g. ?f=mode,color.
+    // Fields that weren't asked for are never encoded.
+    void Select(std::vector<std::string> const &queries);
+    // Whether a field of the current map will be written. Only worth asking before computing
+    // an expensive value, Field() checks it anyway.
+    bool Wants(const char *name) const;
+
+    // Maps are opened before and closed after WriteState, nested ones are written with a name
+    void BeginMap();
+    void BeginMap(const char *name);
+    void EndMap();
+
+    void Field(const char *name, const char *value);
+    void Field(const char *name, std::string const &value) { Field(name, value.c_str()); }
+    void Field(const char *name, uint32_t value);
+    void Field(const char *name, int32_t value);
+    void Field(const char *name, bool value);
+    void Field(const char *name, float value);
+    void Field(const char *name, std::initializer_list<uint32_t> values);
+};
+
+#endif // _MAIN_STATEWRITER_H_
@@ -0,0 +1,25 @@
+#ifndef _MAIN_TASKCONFIG_H_
+#define _MAIN_TASKCONFIG_H_
+
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+
+// Where tasks are placed on the ESP32's two cores. Network I/O (the CoAP task) runs on one core and
+// application work (status loop, GPIO inputs, request workers) on the other, they only meet through
+// lock-free queues.
+#if CONFIG_FREERTOS_UNICORE || !CONFIG_IOTNODE_PIN_TASKS
+static const BaseType_t kNetworkCore = tskNO_AFFINITY;
+static const BaseType_t kApplicationCore = tskNO_AFFINITY;
+#else
+static const BaseType_t kNetworkCore = CONFIG_IOTNODE_NETWORK_CORE;
+static const BaseType_t kApplicationCore = CONFIG_IOTNODE_NETWORK_CORE ? 0 : 1;
+#endif
+
+// Request workers stay with the application unless allowed onto either core
+#if CONFIG_IOTNODE_COAP_WORKER_POOL && !CONFIG_IOTNODE_COAP_WORKER_PINNED
+static const BaseType_t kWorkerCore = tskNO_AFFINITY;
+#else
+static const BaseType_t kWorkerCore = kApplicationCore;
+#endif
+
+#endif // _MAIN_TASKCONFIG_H_
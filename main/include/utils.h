@@ -20,4 +20,25 @@ inline std::string to_string(const ip4_addr_t &ip)
     return output;
 }
 
+// Decodes a hex string into `bytes`, returns the number of bytes written
+inline size_t HexToBytes(const char *hex, uint8_t *bytes, size_t capacity)
+{
+    auto nibble = [](char c) -> int {
+        if (c >= '0' && c <= '9') return c - '0';
+        if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+        if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+        return -1;
+    };
+
+    size_t length = 0;
+    for (; length < capacity && hex[0] != '\0' && hex[1] != '\0'; hex += 2)
+    {
+        int high = nibble(hex[0]), low = nibble(hex[1]);
+        if (high < 0 || low < 0)
+            break;
+        bytes[length++] = (high << 4) | low;
+    }
+    return length;
+}
+
 #endif // _MAIN_UTILS_H_
@@ -0,0 +1,133 @@
+#include <algorithm>
+#include <cstring>
+
+#include "bufferedmessage.h"
+#include "coappacket.h"
+
+static Payload _EncodeOption(ICoapOption const *option)
+{
+    // Empty options may have no buffer at all
+    if (option->GetSize() == 0)
+        return Payload();
+    if (option->Type != CoapOptionType::UInt)
+        return Payload(static_cast<const uint8_t *>(option->GetPtr()), option->GetSize());
+
+    // CoapUIntOption doesn't expose its bytes, encode it as a minimal length network order uint
+    auto value = static_cast<CoapUIntOption const *>(option)->Value;
+    Payload encoded;
+    for (int i = option->GetSize() - 1; i >= 0; i--)
+        encoded.push_back(static_cast<uint8_t>(value >> (i * 8)));
+    return encoded;
+}
+
+void BufferedCoapMessage::AddRawOption(uint16_t number, const uint8_t *value, size_t length)
+{
+    // Keep options sorted by number (stable for repeated options) just like they are on the wire
+    auto it = std::upper_bound(_options.begin(), _options.end(), number,
+        [](uint16_t n, Option const &o) { return n < o.Number; });
+    _options.insert(it, Option{number, Payload(value, length)});
+}
+
+void BufferedCoapMessage::AddOption(ICoapOption const *option, CoapResult &result)
+{
+    auto encoded = _EncodeOption(option);
+    AddRawOption(option->Number, encoded.data(), encoded.length());
+    result = CoapResult::OK;
+}
+
+void BufferedCoapMessage::SetOption(ICoapOption const *option, CoapResult &result)
+{
+    RemoveOption(option->Number);
+    AddOption(option, result);
+}
+
+void BufferedCoapMessage::RemoveOption(uint16_t number)
+{
+    _options.erase(std::remove_if(_options.begin(), _options.end(),
+        [number](Option const &o) { return o.Number == number; }), _options.end());
+}
+
+void BufferedCoapMessage::GetOption(CoapOption &option, const uint16_t number, CoapResult &result) const
+{
+    for (auto it = _options.begin(); it != _options.end(); it++)
+    {
+        if (it->Number == number)
+        {
+            CoapOptionFromBytes(option, number, it->Value.data(), it->Value.length(), result);
+            return;
+        }
+    }
+    result = CoapResult::Error;
+}
+
+void BufferedCoapMessage::GetOptions(std::vector<std::string> &values, const uint16_t number, CoapResult &result) const
+{
+    values.clear();
+    for (auto it = _options.begin(); it != _options.end(); it++)
+    {
+        if (it->Number == number)
+            values.emplace_back(reinterpret_cast<const char *>(it->Value.data()), it->Value.length());
+    }
+    result = values.empty() ? CoapResult::Error : CoapResult::OK;
+}
+
+void BufferedCoapMessage::GetPayload(Payload &payload, CoapResult &result) const
+{
+    if (!_hasPayload)
+    {
+        result = CoapResult::Error;
+        return;
+    }
+
+    result = CoapResult::OK;
+    payload = _payload;
+}
+
+void BufferedCoapMessage::SetPayload(const Payload &payload, CoapResult &result)
+{
+    _payload = payload;
+    _hasPayload = true;
+    result = CoapResult::OK;
+}
+
+void BufferedCoapMessage::Clear()
+{
+    _options.clear();
+    _payload.clear();
+    _hasPayload = false;
+    _multicast = false;
+    _code = CoapMessageCode::None;
+    _type = CoapMessageType::Confirmable;
+}
+
+bool BufferedCoapMessage::Serialize(uint8_t *buffer, size_t capacity, uint16_t messageId, const uint8_t *token, size_t tokenLength, size_t &size) const
+{
+    if (capacity < kCoapHeaderSize + tokenLength)
+        return false;
+
+    buffer[0] = (1 << 6) | (static_cast<uint8_t>(_type) << 4) | tokenLength;
+    buffer[1] = _code;
+    buffer[2] = messageId >> 8;
+    buffer[3] = messageId & 0xFF;
+    memcpy(buffer + kCoapHeaderSize, token, tokenLength);
+
+    size_t offset = kCoapHeaderSize + tokenLength;
+    uint16_t previous = 0;
+    for (auto &option : _options)
+    {
+        if (!CoapWriteOption(buffer, capacity, offset, previous, option.Number, option.Value.data(), option.Value.length()))
+            return false;
+    }
+
+    if (_hasPayload && !_payload.empty())
+    {
+        if (offset + 1 + _payload.length() > capacity)
+            return false;
+        buffer[offset++] = 0xFF;
+        memcpy(buffer + offset, _payload.data(), _payload.length());
+        offset += _payload.length();
+    }
+
+    size = offset;
+    return true;
+}
@@ -0,0 +1,58 @@
+#ifndef _INTERFACES_BUFFEREDMESSAGE_H_
+#define _INTERFACES_BUFFEREDMESSAGE_H_
+
+#include <vector>
+#include "coap.h"
+
+// A transport independent ICoapMessage that owns copies of its options and payload.
+// Used to hand a request/response to code that runs outside of the transport's task.
+class BufferedCoapMessage : public ICoapMessage
+{
+public:
+    struct Option
+    {
+        uint16_t Number;
+        Payload Value;
+    };
+private:
+    std::vector<Option> _options;
+    CoapMessageCode _code = CoapMessageCode::None;
+    CoapMessageType _type = CoapMessageType::Confirmable;
+    Payload _payload;
+    bool _hasPayload = false;
+    bool _multicast = false;
+public:
+    ~BufferedCoapMessage(){}
+
+    void AddOption(ICoapOption const *option, CoapResult &result);
+    void GetOption(CoapOption &option,const uint16_t number, CoapResult &result) const;
+    void GetOptions(std::vector<std::string> &values, const uint16_t number, CoapResult &result) const;
+    void SetOption(ICoapOption const *option, CoapResult &result);
+    // Removes every option with `number`
+    void RemoveOption(uint16_t number);
+    using ICoapMessage::AddOption;
+    using ICoapMessage::SetOption;
+
+    CoapMessageCode GetCode() const { return _code; }
+    void SetCode(CoapMessageCode code, CoapResult &result) { _code = code; result = CoapResult::OK; }
+    CoapMessageType GetType() const { return _type; }
+    void SetType(CoapMessageType type, CoapResult &result) { _type = type; result = CoapResult::OK; }
+
+    void GetPayload(Payload &payload, CoapResult &result) const;
+    void SetPayload(const Payload &payload, CoapResult &result);
+    using ICoapMessage::SetPayload;
+    bool IsMulticast() const { return _multicast; }
+    void SetMulticast(bool multicast) { _multicast = multicast; }
+
+    void AddRawOption(uint16_t number, const uint8_t *value, size_t length);
+    std::vector<Option> const &GetOptions() const { return _options; }
+    bool HasPayload() const { return _hasPayload; }
+    Payload const &GetPayload() const { return _payload; }
+
+    void Clear();
+
+    // Writes the message as a datagram (RFC 7252 section 3), false if it doesn't fit in `capacity`
+    bool Serialize(uint8_t *buffer, size_t capacity, uint16_t messageId, const uint8_t *token, size_t tokenLength, size_t &size) const;
+};
+
+#endif // _INTERFACES_BUFFEREDMESSAGE_H_
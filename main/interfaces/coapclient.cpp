@@ -0,0 +1,397 @@
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_CLIENT
+
+#include <algorithm>
+#include <cstring>
+
+#include "esp_log.h"
+#include "esp_system.h"
+
+#include "coapclient.h"
+
+extern "C" {
+    #include "interface/network/net_Endpoint.h"
+}
+
+static const char *kTag = "CoAP-Client";
+
+// Transmission parameters (RFC 7252 section 4.8)
+static const int64_t kCoapAckTimeoutUs = 2 * 1000 * 1000;
+static const uint32_t kCoapAckRandomUs = 1 * 1000 * 1000;
+static const uint8_t kCoapMaxRetransmit = 4;
+// How long to wait for a separate response, or any response to a NON request
+static const int64_t kCoapClientResponseTimeoutUs = 30 * 1000 * 1000;
+
+// Request bodies go out in 1024 byte blocks unless the server asks for smaller ones
+static const uint8_t kCoapClientBlockSzx = 6;
+
+static inline size_t _BlockSize(uint8_t szx)
+{
+    return 16 << szx;
+}
+
+static uint32_t _GetUInt(BufferedCoapMessage const &message, uint16_t number, bool &present)
+{
+    for (auto &option : message.GetOptions())
+    {
+        if (option.Number == number)
+        {
+            present = true;
+            return CoapDecodeUInt(option.Value.data(), option.Value.length());
+        }
+    }
+    present = false;
+    return 0;
+}
+
+CoapClient::CoapClient()
+    : _outstanding(0), _messageId(0), _transmit(nullptr), _context(nullptr),
+      _completed(0), _retransmitted(0), _failed(0)
+{
+}
+
+CoapClient::~CoapClient()
+{
+    Exchange *submitted = nullptr;
+    while (_submitted.Pop(submitted))
+        delete submitted;
+    for (auto exchange : _exchanges)
+        delete exchange;
+}
+
+void CoapClient::Setup(Transmit transmit, void *context)
+{
+    _transmit = transmit;
+    _context = context;
+    // Shares the socket with lobaro's own confirmable messages, a random start keeps the two
+    // sequences apart
+    _messageId = esp_random() & 0xFFFF;
+}
+
+void CoapClient::Submit(NetEp_t const &remote, BufferedCoapMessage const &request, CoapResponseHandler handler, void *context, CoapResult &result)
+{
+    if (request.GetCode() < CoapMessageCode::Get || request.GetCode() > CoapMessageCode::Delete)
+    {
+        ESP_LOGE(kTag, "CoapClient::Submit: not a request");
+        result = CoapResult::Error;
+        return;
+    }
+
+    if (_outstanding.fetch_add(1) >= kCoapClientMaxRequests)
+    {
+        _outstanding--;
+        ESP_LOGW(kTag, "CoapClient::Submit: too many outstanding requests");
+        result = CoapResult::Error;
+        return;
+    }
+
+    auto exchange = new Exchange();
+    exchange->Remote = remote;
+    exchange->Request = request;
+    exchange->Handler = handler;
+    exchange->Context = context;
+
+    if (!_submitted.Push(exchange))
+    {
+        delete exchange;
+        _outstanding--;
+        ESP_LOGW(kTag, "CoapClient::Submit: _submitted is full");
+        result = CoapResult::Error;
+        return;
+    }
+
+    result = CoapResult::OK;
+}
+
+int CoapClient::Outstanding(NetEp_t const &remote) const
+{
+    int count = 0;
+    for (auto exchange : _exchanges)
+    {
+        if (exchange->Started && !exchange->Done && EpAreEqual(&exchange->Remote, &remote))
+            count++;
+    }
+    return count;
+}
+
+void CoapClient::Start(Exchange &exchange, int64_t now)
+{
+    exchange.Started = true;
+    auto token = esp_random();
+    memcpy(exchange.Token, &token, kCoapClientTokenLength);
+    exchange.Block1Offset = 0;
+    exchange.Block1Szx = kCoapClientBlockSzx;
+    exchange.Block2Num = 0;
+
+    if (!Send(exchange, now))
+        Complete(&exchange, CoapResult::Error, nullptr);
+}
+
+void CoapClient::BuildMessage(Exchange const &exchange, BufferedCoapMessage &message) const
+{
+    CoapResult result;
+    auto &request = exchange.Request;
+    message.SetCode(request.GetCode(), result);
+    message.SetType(request.GetType(), result);
+    for (auto &option : request.GetOptions())
+        message.AddRawOption(option.Number, option.Value.data(), option.Value.length());
+
+    auto &body = request.GetPayload();
+    if (exchange.Block2Num > 0)
+    {
+        // Asking for the rest of the response, the request body has been delivered
+        message.SetOption(CoapUIntOption(CoapOptionValue::Block2, exchange.Block2Num << 4 | exchange.Block2Szx), result);
+    }
+    else if (body.length() > _BlockSize(exchange.Block1Szx) || exchange.Block1Offset > 0)
+    {
+        auto size = _BlockSize(exchange.Block1Szx);
+        auto more = exchange.Block1Offset + size < body.length();
+        message.SetOption(CoapUIntOption(CoapOptionValue::Block1, (exchange.Block1Offset / size) << 4 | (more ? 0x08 : 0) | exchange.Block1Szx), result);
+        if (exchange.Block1Offset == 0)
+            message.SetOption(CoapUIntOption(CoapOptionValue::Size1, body.length()), result);
+        message.SetPayload(body.substr(exchange.Block1Offset, size), result);
+    }
+    else if (request.HasPayload())
+        message.SetPayload(body, result);
+}
+
+bool CoapClient::Send(Exchange &exchange, int64_t now)
+{
+    BufferedCoapMessage message;
+    BuildMessage(exchange, message);
+
+    // Every message of an exchange gets a new message ID, the token stays
+    exchange.MessageId = _messageId++;
+    if (!message.Serialize(exchange.Wire, sizeof(exchange.Wire), exchange.MessageId, exchange.Token, kCoapClientTokenLength, exchange.WireSize))
+    {
+        ESP_LOGE(kTag, "Request doesn't fit in a datagram");
+        return false;
+    }
+
+    exchange.Acknowledged = false;
+    exchange.Retransmissions = 0;
+    exchange.Timeout = kCoapAckTimeoutUs + esp_random() % (kCoapAckRandomUs + 1);
+    exchange.NextTransmit = now + (message.GetType() == CoapMessageType::Confirmable ? exchange.Timeout : kCoapClientResponseTimeoutUs);
+
+    // A failed send is retried like a lost datagram
+    if (!_transmit(_context, exchange.Remote, exchange.Wire, exchange.WireSize))
+        ESP_LOGW(kTag, "Failed to send request %04X", exchange.MessageId);
+    return true;
+}
+
+bool CoapClient::Receive(NetEp_t const &remote, CoapPacket const &packet, int64_t now)
+{
+    auto type = packet.GetType();
+    Exchange *exchange = nullptr;
+
+    if (type == CoapMessageType::Acknowledgement || type == CoapMessageType::Reset)
+    {
+        for (auto candidate : _exchanges)
+        {
+            if (candidate->Started && !candidate->Done && candidate->MessageId == packet.GetMessageId() && EpAreEqual(&candidate->Remote, &remote))
+                exchange = candidate;
+        }
+        if (exchange == nullptr)
+            return false;
+
+        if (type == CoapMessageType::Reset)
+        {
+            ESP_LOGW(kTag, "Request %04X was reset", exchange->MessageId);
+            Complete(exchange, CoapResult::Error, nullptr);
+            Sweep();
+            return true;
+        }
+
+        if (packet.GetCode() == 0)
+        {
+            exchange->Acknowledged = true;
+            exchange->NextTransmit = now + kCoapClientResponseTimeoutUs;
+            return true;
+        }
+
+        // A piggybacked response for someone else's token is bogus
+        if (packet.GetTokenLength() != kCoapClientTokenLength || memcmp(packet.GetToken(), exchange->Token, kCoapClientTokenLength) != 0)
+            return true;
+    }
+    else if (packet.IsResponse())
+    {
+        for (auto candidate : _exchanges)
+        {
+            if (candidate->Started && !candidate->Done && packet.GetTokenLength() == kCoapClientTokenLength
+                && memcmp(packet.GetToken(), candidate->Token, kCoapClientTokenLength) == 0 && EpAreEqual(&candidate->Remote, &remote))
+                exchange = candidate;
+        }
+        if (exchange == nullptr)
+            return false;
+
+        // Separate response
+        if (type == CoapMessageType::Confirmable)
+        {
+            uint8_t ack[kCoapHeaderSize];
+            auto size = CoapPacket::WriteEmpty(ack, CoapMessageType::Acknowledgement, packet.GetMessageId());
+            _transmit(_context, remote, ack, size);
+        }
+    }
+    else
+        return false;
+
+    HandleResponse(*exchange, packet, now);
+    Sweep();
+    return true;
+}
+
+void CoapClient::HandleResponse(Exchange &exchange, CoapPacket const &packet, int64_t now)
+{
+    BufferedCoapMessage response;
+    CoapResult result;
+    response.SetCode(static_cast<CoapMessageCode>(packet.GetCode()), result);
+    response.SetType(packet.GetType(), result);
+
+    size_t offset = packet.GetOptionsOffset();
+    uint16_t number = 0;
+    const uint8_t *value;
+    size_t length;
+    while (CoapNextOption(packet.GetData(), packet.GetSize(), offset, number, value, length))
+        response.AddRawOption(number, value, length);
+
+    auto payloadOffset = packet.GetPayloadOffset();
+    Payload payload(packet.GetData() + payloadOffset, packet.GetSize() - payloadOffset);
+
+    // Request body still being sent block by block
+    auto &body = exchange.Request.GetPayload();
+    auto blockSize = _BlockSize(exchange.Block1Szx);
+    if (exchange.Block2Num == 0 && exchange.Block1Offset + blockSize < body.length())
+    {
+        bool present;
+        auto block1 = _GetUInt(response, CoapOptionValue::Block1, present);
+        if (response.GetCode() == CoapMessageCode::Continue && present)
+        {
+            // Servers asking for smaller blocks echo the number in either size
+            auto num = block1 >> 4;
+            if (num != exchange.Block1Offset / blockSize && num * _BlockSize(block1 & 0x07) != exchange.Block1Offset)
+                return;
+
+            // The server may ask for smaller blocks, offsets stay aligned as sizes are powers of two
+            exchange.Block1Offset += blockSize;
+            exchange.Block1Szx = std::min<uint8_t>(exchange.Block1Szx, block1 & 0x07);
+            if (!Send(exchange, now))
+                Complete(&exchange, CoapResult::Error, nullptr);
+            return;
+        }
+
+        // Anything else ends the transfer early (e.g. 4.13 Request Entity Too Large)
+        response.SetPayload(payload, result);
+        Complete(&exchange, CoapResult::OK, &response);
+        return;
+    }
+
+    bool present;
+    auto block2 = _GetUInt(response, CoapOptionValue::Block2, present);
+    if (!present)
+    {
+        if (!payload.empty())
+            response.SetPayload(payload, result);
+        Complete(&exchange, CoapResult::OK, &response);
+        return;
+    }
+
+    // A late duplicate of an earlier block
+    if ((block2 >> 4) * _BlockSize(block2 & 0x07) != exchange.Body.length())
+        return;
+
+    if (exchange.Body.length() + payload.length() > kCoapClientMaxBody)
+    {
+        ESP_LOGW(kTag, "Response to %04X is larger than %d bytes", exchange.MessageId, static_cast<int>(kCoapClientMaxBody));
+        Complete(&exchange, CoapResult::Error, nullptr);
+        return;
+    }
+    exchange.Body += payload;
+
+    if (block2 & 0x08)
+    {
+        // Every block but the last is full, so the next one starts where the body ends
+        exchange.Block2Szx = std::min<uint8_t>(block2 & 0x07, kCoapClientBlockSzx);
+        exchange.Block2Num = exchange.Body.length() / _BlockSize(exchange.Block2Szx);
+        if (!Send(exchange, now))
+            Complete(&exchange, CoapResult::Error, nullptr);
+        return;
+    }
+
+    // The body is whole now, the block options only described its last block
+    response.RemoveOption(CoapOptionValue::Block2);
+    response.RemoveOption(CoapOptionValue::Size2);
+    response.SetPayload(exchange.Body, result);
+    Complete(&exchange, CoapResult::OK, &response);
+}
+
+void CoapClient::Complete(Exchange *exchange, CoapResult result, BufferedCoapMessage const *response)
+{
+    if (exchange->Done)
+        return;
+    exchange->Done = true;
+
+    if (result == CoapResult::OK)
+        _completed++;
+    else
+        _failed++;
+
+    if (exchange->Handler != nullptr)
+        exchange->Handler(exchange->Context, result, response);
+    _outstanding--;
+
+    ESP_LOGD(kTag, "%u requests completed, %u failed, %u retransmissions", _completed, _failed, _retransmitted);
+}
+
+void CoapClient::Sweep()
+{
+    auto end = std::remove_if(_exchanges.begin(), _exchanges.end(), [](Exchange *exchange) {
+        if (!exchange->Done)
+            return false;
+        delete exchange;
+        return true;
+    });
+    _exchanges.erase(end, _exchanges.end());
+}
+
+void CoapClient::Poll(int64_t now)
+{
+    Exchange *submitted = nullptr;
+    while (_submitted.Pop(submitted))
+        _exchanges.push_back(submitted);
+
+    // In submission order, so a server's waiting requests start in the order they were made
+    for (size_t i = 0; i < _exchanges.size(); i++)
+    {
+        auto &exchange = *_exchanges[i];
+        if (exchange.Done)
+            continue;
+
+        if (!exchange.Started)
+        {
+            if (Outstanding(exchange.Remote) < kCoapClientNStart)
+                Start(exchange, now);
+            continue;
+        }
+
+        if (now < exchange.NextTransmit)
+            continue;
+
+        if (exchange.Request.GetType() != CoapMessageType::Confirmable || exchange.Acknowledged || exchange.Retransmissions == kCoapMaxRetransmit)
+        {
+            ESP_LOGW(kTag, "Request %04X timed out", exchange.MessageId);
+            Complete(&exchange, CoapResult::Error, nullptr);
+            continue;
+        }
+
+        exchange.Retransmissions++;
+        exchange.Timeout *= 2;
+        exchange.NextTransmit = now + exchange.Timeout;
+        _retransmitted++;
+        _transmit(_context, exchange.Remote, exchange.Wire, exchange.WireSize);
+    }
+
+    Sweep();
+}
+
+#endif // CONFIG_IOTNODE_COAP_CLIENT
@@ -0,0 +1,106 @@
+#ifndef _INTERFACES_COAPCLIENT_H_
+#define _INTERFACES_COAPCLIENT_H_
+
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_CLIENT
+
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+#include "coap.h"
+#include "bufferedmessage.h"
+#include "coappacket.h"
+#include "lockfreequeue.h"
+
+extern "C" {
+    #include "liblobaro_coap.h"
+}
+
+static const int kCoapClientNStart = CONFIG_IOTNODE_COAP_CLIENT_NSTART;
+static const int kCoapClientMaxRequests = CONFIG_IOTNODE_COAP_CLIENT_MAX_REQUESTS;
+static const size_t kCoapClientMaxBody = CONFIG_IOTNODE_COAP_CLIENT_MAX_BODY;
+static const size_t kCoapClientTokenLength = 4;
+static const size_t kCoapClientMaxMessageSize = 1152;
+
+// Called on the network task when a request completes. `response` is null when the request
+// timed out, was reset or couldn't be sent; otherwise it holds the whole response, reassembled
+// if the server sent it in blocks. Must not block.
+typedef void (*CoapResponseHandler)(void *context, CoapResult result, BufferedCoapMessage const *response);
+
+// Client side of CoAP over the server's own socket, driven by the network task. Requests are
+// handed in from any task and run as exchanges: a token and message ID each, confirmable
+// retransmission with exponential back-off, separate responses, and Block1 (request body) and
+// Block2 (response body) transfers. Up to kCoapClientNStart exchanges per server are in flight
+// at once, later ones wait for a free slot in submission order.
+class CoapClient
+{
+public:
+    typedef bool (*Transmit)(void *context, NetEp_t const &remote, const uint8_t *data, size_t length);
+
+    CoapClient();
+    ~CoapClient();
+
+    void Setup(Transmit transmit, void *context);
+
+    // Safe to call from any task, the exchange starts on the network task's next pass
+    void Submit(NetEp_t const &remote, BufferedCoapMessage const &request, CoapResponseHandler handler, void *context, CoapResult &result);
+
+    // True when the datagram belonged to one of our exchanges, lobaro mustn't see it then
+    bool Receive(NetEp_t const &remote, CoapPacket const &packet, int64_t now);
+
+    // Starts waiting exchanges, retransmits and times out
+    void Poll(int64_t now);
+private:
+    struct Exchange
+    {
+        NetEp_t Remote;
+        BufferedCoapMessage Request;
+        CoapResponseHandler Handler;
+        void *Context;
+        bool Started;
+        bool Done;
+        // Empty ACK received, the response follows separately
+        bool Acknowledged;
+        uint8_t Token[kCoapClientTokenLength];
+        uint16_t MessageId;
+        uint8_t Retransmissions;
+        int64_t Timeout;
+        int64_t NextTransmit;
+        // Request body sent so far and the block size the server asked for
+        size_t Block1Offset;
+        uint8_t Block1Szx;
+        // Response body so far, the next block to ask for and its size
+        uint32_t Block2Num;
+        uint8_t Block2Szx;
+        Payload Body;
+        // The last message sent, kept for retransmission
+        uint8_t Wire[kCoapClientMaxMessageSize];
+        size_t WireSize;
+    };
+
+    LockFreeQueue<Exchange*, 32> _submitted;
+    std::atomic<int> _outstanding;
+    std::vector<Exchange*> _exchanges;
+    uint16_t _messageId;
+
+    Transmit _transmit;
+    void *_context;
+
+    uint32_t _completed;
+    uint32_t _retransmitted;
+    uint32_t _failed;
+
+    void Start(Exchange &exchange, int64_t now);
+    void BuildMessage(Exchange const &exchange, BufferedCoapMessage &message) const;
+    bool Send(Exchange &exchange, int64_t now);
+    void HandleResponse(Exchange &exchange, CoapPacket const &packet, int64_t now);
+    void Complete(Exchange *exchange, CoapResult result, BufferedCoapMessage const *response);
+    void Sweep();
+    int Outstanding(NetEp_t const &remote) const;
+};
+
+#endif // CONFIG_IOTNODE_COAP_CLIENT
+
+#endif // _INTERFACES_COAPCLIENT_H_
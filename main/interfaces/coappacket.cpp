@@ -0,0 +1,149 @@
+#include <cstring>
+#include <initializer_list>
+
+#include "coappacket.h"
+
+bool CoapNextOption(const uint8_t *data, size_t size, size_t &offset, uint16_t &number, const uint8_t *&value, size_t &length)
+{
+    if (offset >= size || data[offset] == 0xFF)
+        return false;
+
+    uint32_t delta = data[offset] >> 4;
+    uint32_t optionLength = data[offset] & 0x0F;
+    offset++;
+
+    for (auto field : { &delta, &optionLength })
+    {
+        if (*field == 13)
+        {
+            if (offset + 1 > size)
+                return false;
+            *field = data[offset] + 13;
+            offset += 1;
+        }
+        else if (*field == 14)
+        {
+            if (offset + 2 > size)
+                return false;
+            *field = ((data[offset] << 8) | data[offset + 1]) + 269;
+            offset += 2;
+        }
+        else if (*field == 15)
+            return false;
+    }
+
+    if (offset + optionLength > size)
+        return false;
+
+    number += delta;
+    value = data + offset;
+    length = optionLength;
+    offset += optionLength;
+    return true;
+}
+
+void CoapPacket::Parse(CoapResult &result)
+{
+    result = CoapResult::Error;
+
+    if (_data == nullptr || _size < kCoapHeaderSize)
+        return;
+
+    // Version must be 1
+    if ((_data[0] >> 6) != 1)
+        return;
+
+    if (GetTokenLength() > kCoapMaxTokenLength || kCoapHeaderSize + GetTokenLength() > _size)
+        return;
+
+    _optionsOffset = kCoapHeaderSize + GetTokenLength();
+    result = CoapResult::OK;
+}
+
+void CoapPacket::GetOption(uint16_t number, const uint8_t *&value, size_t &length, CoapResult &result) const
+{
+    size_t offset = _optionsOffset;
+    uint16_t current = 0;
+    while (CoapNextOption(_data, _size, offset, current, value, length))
+    {
+        // Options are sorted, no point looking further
+        if (current > number)
+            break;
+
+        if (current == number)
+        {
+            result = CoapResult::OK;
+            return;
+        }
+    }
+
+    result = CoapResult::Error;
+}
+
+size_t CoapPacket::GetPayloadOffset() const
+{
+    size_t offset = _optionsOffset;
+    uint16_t number = 0;
+    const uint8_t *value;
+    size_t length;
+    while (CoapNextOption(_data, _size, offset, number, value, length))
+        ;
+
+    return offset < _size ? offset + 1 : _size;
+}
+
+size_t CoapPacket::WriteEmpty(uint8_t *buffer, CoapMessageType type, uint16_t messageId)
+{
+    buffer[0] = (1 << 6) | (static_cast<uint8_t>(type) << 4);
+    buffer[1] = 0;
+    buffer[2] = messageId >> 8;
+    buffer[3] = messageId & 0xFF;
+    return kCoapHeaderSize;
+}
+
+bool CoapWriteOption(uint8_t *buffer, size_t capacity, size_t &offset, uint16_t &previous, uint16_t number, const uint8_t *value, size_t length)
+{
+    uint32_t delta = number - previous;
+    uint8_t extended[4];
+    size_t extendedLength = 0;
+    uint8_t nibbles[2];
+
+    int i = 0;
+    for (auto field : { delta, static_cast<uint32_t>(length) })
+    {
+        if (field < 13)
+            nibbles[i] = field;
+        else if (field < 269)
+        {
+            nibbles[i] = 13;
+            extended[extendedLength++] = field - 13;
+        }
+        else
+        {
+            nibbles[i] = 14;
+            extended[extendedLength++] = (field - 269) >> 8;
+            extended[extendedLength++] = (field - 269) & 0xFF;
+        }
+        i++;
+    }
+
+    if (number < previous || offset + 1 + extendedLength + length > capacity)
+        return false;
+
+    buffer[offset++] = (nibbles[0] << 4) | nibbles[1];
+    memcpy(buffer + offset, extended, extendedLength);
+    offset += extendedLength;
+    if (length > 0)
+        memmove(buffer + offset, value, length);
+    offset += length;
+    previous = number;
+    return true;
+}
+
+uint32_t CoapDecodeUInt(const uint8_t *value, size_t length)
+{
+    uint32_t result = 0;
+    for (size_t i = 0; i < length && i < sizeof(result); i++)
+        result = (result << 8) | value[i];
+    return result;
+}
@@ -0,0 +1,60 @@
+#ifndef _INTERFACES_COAPPACKET_H_
+#define _INTERFACES_COAPPACKET_H_
+
+#include <cstddef>
+#include <cstdint>
+
+#include "coap.h"
+
+static const size_t kCoapHeaderSize = 4;
+static const size_t kCoapMaxTokenLength = 8;
+
+// Read-only view over a raw CoAP datagram (RFC 7252 section 3). Lets the transport look at
+// headers and options of packets going past it without handing them to lobaro first.
+class CoapPacket
+{
+    const uint8_t *_data;
+    size_t _size;
+    size_t _optionsOffset;
+public:
+    CoapPacket(const uint8_t *data, size_t size)
+        : _data(data), _size(size), _optionsOffset(0) {}
+
+    // Validates the fixed header and token. Nothing else may be called unless this succeeded.
+    void Parse(CoapResult &result);
+
+    CoapMessageType GetType() const { return static_cast<CoapMessageType>((_data[0] >> 4) & 0x03); }
+    uint8_t GetCode() const { return _data[1]; }
+    uint8_t GetCodeClass() const { return _data[1] >> 5; }
+    uint16_t GetMessageId() const { return (_data[2] << 8) | _data[3]; }
+    uint8_t GetTokenLength() const { return _data[0] & 0x0F; }
+    const uint8_t *GetToken() const { return _data + kCoapHeaderSize; }
+    const uint8_t *GetData() const { return _data; }
+    size_t GetSize() const { return _size; }
+    size_t GetOptionsOffset() const { return _optionsOffset; }
+
+    bool IsRequest() const { return GetCodeClass() == 0 && GetCode() != 0; }
+    bool IsResponse() const { return GetCodeClass() >= 2; }
+
+    // Finds the first option with `number`, result is Error if the packet doesn't carry it
+    void GetOption(uint16_t number, const uint8_t *&value, size_t &length, CoapResult &result) const;
+
+    // Offset of the payload (after the 0xFF marker), or the packet size when there is none
+    size_t GetPayloadOffset() const;
+
+    // Writes an empty message (e.g. a bare ACK) with `messageId` into `buffer`, which must hold kCoapHeaderSize bytes
+    static size_t WriteEmpty(uint8_t *buffer, CoapMessageType type, uint16_t messageId);
+};
+
+// Reads the option header at `offset` and advances past its value, `number` accumulates the deltas.
+// Returns false at the payload marker or the end of `data`.
+bool CoapNextOption(const uint8_t *data, size_t size, size_t &offset, uint16_t &number, const uint8_t *&value, size_t &length);
+
+// Appends an option after one numbered `previous` (0 for the first), options must be written in
+// order. Returns false if it doesn't fit in `capacity`.
+bool CoapWriteOption(uint8_t *buffer, size_t capacity, size_t &offset, uint16_t &previous, uint16_t number, const uint8_t *value, size_t length);
+
+// Decodes a CoAP uint option value (network byte order, leading zeros stripped)
+uint32_t CoapDecodeUInt(const uint8_t *value, size_t length);
+
+#endif // _INTERFACES_COAPPACKET_H_
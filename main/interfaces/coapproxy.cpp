@@ -0,0 +1,641 @@
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_PROXY
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "lwip/ip_addr.h"
+
+#include "coapproxy.h"
+
+extern "C" {
+    #include "interface/network/net_Endpoint.h"
+}
+
+static const char *kTag = "CoAP-Proxy";
+
+static const uint16_t kCoapDefaultPort = 5683;
+// Max-Age of a response without one (RFC 7252 section 5.10.5)
+static const uint32_t kCoapDefaultMaxAge = 60;
+// Bodies larger than a block are handed out in 1024 byte blocks
+static const uint8_t kCoapProxyBlockSzx = 6;
+static const uint32_t kCoapProxyNoBlock = UINT32_MAX;
+// Per cached response, on top of key and message
+static const size_t kCoapProxyEntryOverhead = 64;
+// EXCHANGE_LIFETIME (RFC 7252 section 4.8.2), how long a client may retransmit a request
+static const int64_t kCoapProxyExchangeLifetimeUs = 247 * 1000 * 1000LL;
+
+static const char *kCoapScheme = "coap://";
+
+static bool _IsHopByHop(uint16_t number)
+{
+    // Consumed by the proxy, or only meaningful between it and the downstream client
+    switch (number)
+    {
+        case CoapOptionValue::UriHost:
+        case CoapOptionValue::UriPort:
+        case CoapOptionValue::UriPath:
+        case CoapOptionValue::UriQuery:
+        case CoapOptionValue::ProxyUri:
+        case CoapOptionValue::ProxyScheme:
+        case CoapOptionValue::Observe:
+        case CoapOptionValue::Oscore:
+        case CoapOptionValue::Block1:
+        case CoapOptionValue::Block2:
+        case CoapOptionValue::Size1:
+        case CoapOptionValue::Size2:
+        case CoapOptionValue::NoResponse:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static int _HexValue(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+// Undoes percent-encoding (RFC 3986 section 2.1), false on a malformed escape
+static bool _PercentDecode(std::string const &value, std::string &decoded)
+{
+    decoded.clear();
+    for (size_t i = 0; i < value.length(); i++)
+    {
+        if (value[i] != '%')
+        {
+            decoded.push_back(value[i]);
+            continue;
+        }
+        if (i + 2 >= value.length())
+            return false;
+        auto high = _HexValue(value[i + 1]);
+        auto low = _HexValue(value[i + 2]);
+        if (high < 0 || low < 0)
+            return false;
+        decoded.push_back(static_cast<char>(high << 4 | low));
+        i += 2;
+    }
+    return true;
+}
+
+// Percent-encodes everything but unreserved characters, sub-delims and `allowed` (RFC 7252 section 6.5)
+static std::string _PercentEncode(std::string const &value, const char *allowed)
+{
+    static const char *kHex = "0123456789ABCDEF";
+    std::string encoded;
+    for (auto c : value)
+    {
+        if (isalnum(static_cast<unsigned char>(c)) || strchr("-._~!$'()*+,;=", c) != nullptr || (c != '\0' && strchr(allowed, c) != nullptr))
+            encoded.push_back(c);
+        else
+            encoded.append({'%', kHex[static_cast<uint8_t>(c) >> 4], kHex[c & 0x0F]});
+    }
+    return encoded;
+}
+
+// Adds one option per segment of `value`, percent-decoded (RFC 7252 section 6.4)
+static bool _AppendSplit(BufferedCoapMessage &message, uint16_t number, std::string const &value, char separator)
+{
+    size_t start = 0;
+    while (start < value.length())
+    {
+        auto end = value.find(separator, start);
+        if (end == std::string::npos)
+            end = value.length();
+        if (end > start)
+        {
+            std::string segment;
+            if (!_PercentDecode(value.substr(start, end - start), segment))
+                return false;
+            message.AddRawOption(number, reinterpret_cast<const uint8_t *>(segment.data()), segment.length());
+        }
+        start = end + 1;
+    }
+    return true;
+}
+
+CoapProxy::CoapProxy()
+    : _cacheSize(0), _client(nullptr), _transmit(nullptr), _context(nullptr), _messageId(0),
+      _hits(0), _misses(0), _coalesced(0)
+{
+}
+
+CoapProxy::~CoapProxy()
+{
+    for (auto pending : _pending)
+        delete pending;
+}
+
+void CoapProxy::Setup(CoapClient *client, Transmit transmit, void *context)
+{
+    _client = client;
+    _transmit = transmit;
+    _context = context;
+    _messageId = esp_random() & 0xFFFF;
+}
+
+bool CoapProxy::Receive(NetEp_t const &remote, CoapPacket const &packet, int64_t now)
+{
+    if (!packet.IsRequest())
+        return false;
+
+    const uint8_t *value;
+    size_t length;
+    CoapResult proxyUri, proxyScheme;
+    packet.GetOption(CoapOptionValue::ProxyUri, value, length, proxyUri);
+    packet.GetOption(CoapOptionValue::ProxyScheme, value, length, proxyScheme);
+    if (proxyUri != CoapResult::OK && proxyScheme != CoapResult::OK)
+        return false;
+
+    auto confirmable = packet.GetType() == CoapMessageType::Confirmable;
+    auto immediate = confirmable ? CoapMessageType::Acknowledgement : CoapMessageType::NonConfirmable;
+
+    Waiter waiter;
+    waiter.Remote = remote;
+    waiter.MessageId = packet.GetMessageId();
+    waiter.TokenLength = packet.GetTokenLength();
+    memcpy(waiter.Token, packet.GetToken(), waiter.TokenLength);
+
+    CoapResult result;
+    packet.GetOption(CoapOptionValue::Block2, value, length, result);
+    waiter.Block2 = result == CoapResult::OK ? CoapDecodeUInt(value, length) : kCoapProxyNoBlock;
+
+    // A retransmission of a request that is still waiting upstream only needs another ACK
+    for (auto pending : _pending)
+    {
+        for (auto &other : pending->Waiters)
+        {
+            if (other.MessageId == waiter.MessageId && EpAreEqual(&other.Remote, &remote))
+            {
+                if (confirmable)
+                {
+                    uint8_t ack[kCoapHeaderSize];
+                    _transmit(_context, remote, ack, CoapPacket::WriteEmpty(ack, CoapMessageType::Acknowledgement, waiter.MessageId));
+                }
+                return true;
+            }
+        }
+    }
+    if (Retransmit(remote, waiter.MessageId, confirmable, now))
+        return true;
+
+    // Request bodies are forwarded whole, reassembling them is left to the server
+    packet.GetOption(CoapOptionValue::Block1, value, length, result);
+    if (result == CoapResult::OK)
+    {
+        Reject(waiter, immediate, CoapMessageCode::NotImplemented);
+        return true;
+    }
+
+    BufferedCoapMessage upstream;
+    NetEp_t server;
+    std::string uri;
+    CoapMessageCode error;
+    if (!ParseUri(packet, upstream, server, uri, error))
+    {
+        Reject(waiter, immediate, error);
+        return true;
+    }
+
+    // Only GETs are cached and shared, keyed by the target and the format asked for
+    std::string key;
+    if (packet.GetCode() == CoapMessageCode::Get)
+    {
+        key = uri;
+        packet.GetOption(CoapOptionValue::Accept, value, length, result);
+        if (result == CoapResult::OK)
+            key.append("#").append(std::to_string(CoapDecodeUInt(value, length)));
+
+        auto entry = Lookup(key, now);
+        if (entry != nullptr)
+        {
+            _hits++;
+            Respond(waiter, immediate, entry->Response, (entry->Expires - now) / (1000 * 1000));
+            return true;
+        }
+        _misses++;
+
+        for (auto pending : _pending)
+        {
+            if (pending->Key != key)
+                continue;
+
+            if (pending->Waiters.size() == kCoapProxyMaxWaiters)
+            {
+                Reject(waiter, immediate, CoapMessageCode::ServiceUnavailable);
+                return true;
+            }
+
+            _coalesced++;
+            pending->Waiters.push_back(waiter);
+            if (confirmable)
+            {
+                uint8_t ack[kCoapHeaderSize];
+                _transmit(_context, remote, ack, CoapPacket::WriteEmpty(ack, CoapMessageType::Acknowledgement, waiter.MessageId));
+            }
+            return true;
+        }
+    }
+
+    auto pending = new Pending();
+    pending->Proxy = this;
+    pending->Key = key;
+    pending->Uri = uri;
+    pending->Waiters.push_back(waiter);
+
+    _client->Submit(server, upstream, &CoapProxy::UpstreamResponse, pending, result);
+    if (result != CoapResult::OK)
+    {
+        delete pending;
+        Reject(waiter, immediate, CoapMessageCode::ServiceUnavailable);
+        return true;
+    }
+    _pending.push_back(pending);
+
+    // The answer follows as a separate response
+    if (confirmable)
+    {
+        uint8_t ack[kCoapHeaderSize];
+        _transmit(_context, remote, ack, CoapPacket::WriteEmpty(ack, CoapMessageType::Acknowledgement, waiter.MessageId));
+    }
+    return true;
+}
+
+bool CoapProxy::ParseUri(CoapPacket const &packet, BufferedCoapMessage &upstream, NetEp_t &server, std::string &uri, CoapMessageCode &error) const
+{
+    std::string target, scheme, host, path, query;
+    uint32_t port = kCoapDefaultPort;
+    auto hasPort = false;
+
+    CoapResult result;
+    upstream.SetCode(static_cast<CoapMessageCode>(packet.GetCode()), result);
+    upstream.SetType(CoapMessageType::Confirmable, result);
+
+    size_t offset = packet.GetOptionsOffset();
+    uint16_t number = 0;
+    const uint8_t *value;
+    size_t length;
+    while (CoapNextOption(packet.GetData(), packet.GetSize(), offset, number, value, length))
+    {
+        std::string text(reinterpret_cast<const char *>(value), length);
+        if (number == CoapOptionValue::ProxyUri)
+            target = text;
+        else if (number == CoapOptionValue::ProxyScheme)
+            scheme = text;
+        else if (number == CoapOptionValue::UriHost)
+            host = text;
+        else if (number == CoapOptionValue::UriPort)
+        {
+            port = CoapDecodeUInt(value, length);
+            hasPort = true;
+        }
+        else if (number == CoapOptionValue::UriPath)
+            path.append("/").append(_PercentEncode(text, ":@"));
+        else if (number == CoapOptionValue::UriQuery)
+            query.append(query.empty() ? "" : "&").append(_PercentEncode(text, ":@/?"));
+        else if (!_IsHopByHop(number))
+            upstream.AddRawOption(number, value, length);
+    }
+
+    // Proxy-Scheme and the Uri-* options make up the same URI (RFC 7252 section 6.5)
+    if (target.empty())
+    {
+        if (host.empty())
+        {
+            error = CoapMessageCode::BadRequest;
+            return false;
+        }
+        target = scheme + "://" + (host.find(':') != std::string::npos ? "[" + host + "]" : host);
+        if (hasPort)
+            target.append(":").append(std::to_string(port));
+        target.append(path.empty() ? "/" : path);
+        if (!query.empty())
+            target.append("?").append(query);
+    }
+
+    if (target.compare(0, strlen(kCoapScheme), kCoapScheme) != 0)
+    {
+        error = CoapMessageCode::ProxyingNotSupported;
+        return false;
+    }
+
+    // Authority, then path and query
+    auto start = strlen(kCoapScheme);
+    auto authorityEnd = target.find_first_of("/?", start);
+    if (authorityEnd == std::string::npos)
+        authorityEnd = target.length();
+    auto authority = target.substr(start, authorityEnd - start);
+
+    std::string address;
+    std::string portText;
+    if (!authority.empty() && authority[0] == '[')
+    {
+        auto close = authority.find(']');
+        if (close == std::string::npos)
+        {
+            error = CoapMessageCode::BadOption;
+            return false;
+        }
+        address = authority.substr(1, close - 1);
+        if (close + 1 < authority.length() && authority[close + 1] == ':')
+            portText = authority.substr(close + 2);
+    }
+    else
+    {
+        auto colon = authority.find(':');
+        address = authority.substr(0, colon);
+        if (colon != std::string::npos)
+            portText = authority.substr(colon + 1);
+    }
+
+    if (!portText.empty())
+    {
+        char *end;
+        port = strtoul(portText.c_str(), &end, 10);
+        if (*end != '\0' || port == 0 || port > 0xFFFF)
+        {
+            error = CoapMessageCode::BadOption;
+            return false;
+        }
+    }
+
+    // No resolver on the network task, servers behind the proxy are addressed by IP
+    ip_addr_t ip;
+    if (ipaddr_aton(address.c_str(), &ip) == 0)
+    {
+        ESP_LOGW(kTag, "Not proxying to %s, only IP literals are supported", address.c_str());
+        error = CoapMessageCode::ProxyingNotSupported;
+        return false;
+    }
+
+    memset(&server, 0, sizeof(server));
+    server.NetPort = port;
+    if (ip.type == IPADDR_TYPE_V6)
+    {
+        server.NetType = IPV6;
+        for (int i = 0; i < 4; i++)
+            server.NetAddr.IPv6.u32[i] = ip_2_ip6(&ip)->addr[i];
+    }
+    else
+    {
+        server.NetType = IPV4;
+        server.NetAddr.IPv4.u32[0] = ip_addr_get_ip4_u32(&ip);
+    }
+
+    auto queryStart = target.find('?', authorityEnd);
+    auto pathPart = target.substr(authorityEnd, queryStart == std::string::npos ? std::string::npos : queryStart - authorityEnd);
+    if (!_AppendSplit(upstream, CoapOptionValue::UriPath, pathPart, '/') ||
+        (queryStart != std::string::npos && !_AppendSplit(upstream, CoapOptionValue::UriQuery, target.substr(queryStart + 1), '&')))
+    {
+        error = CoapMessageCode::BadOption;
+        return false;
+    }
+
+    Payload payload(packet.GetData() + packet.GetPayloadOffset(), packet.GetSize() - packet.GetPayloadOffset());
+    if (!payload.empty())
+        upstream.SetPayload(payload, result);
+
+    // Default port and brackets normalised, so equivalent URIs share a cache entry
+    uri = address + ":" + std::to_string(port) + target.substr(authorityEnd);
+    return true;
+}
+
+CoapProxy::CacheEntry *CoapProxy::Lookup(std::string const &key, int64_t now)
+{
+    for (auto it = _cache.begin(); it != _cache.end(); it++)
+    {
+        if (it->Key != key)
+            continue;
+
+        if (it->Expires <= now)
+        {
+            _cacheSize -= it->Size;
+            _cache.erase(it);
+            return nullptr;
+        }
+
+        _cache.splice(_cache.begin(), _cache, it);
+        return &_cache.front();
+    }
+    return nullptr;
+}
+
+void CoapProxy::Store(std::string const &key, std::string const &uri, BufferedCoapMessage const &response, int64_t now)
+{
+    uint32_t maxAge = kCoapDefaultMaxAge;
+    for (auto &option : response.GetOptions())
+    {
+        if (option.Number == CoapOptionValue::MaxAge)
+            maxAge = CoapDecodeUInt(option.Value.data(), option.Value.length());
+    }
+    if (maxAge == 0)
+        return;
+
+    auto size = kCoapProxyEntryOverhead + key.length() + uri.length() + response.GetPayload().length();
+    for (auto &option : response.GetOptions())
+        size += sizeof(option) + option.Value.length();
+    if (size > kCoapProxyCacheSize)
+        return;
+
+    for (auto it = _cache.begin(); it != _cache.end(); it++)
+    {
+        if (it->Key == key)
+        {
+            _cacheSize -= it->Size;
+            _cache.erase(it);
+            break;
+        }
+    }
+
+    while (_cacheSize + size > kCoapProxyCacheSize)
+    {
+        _cacheSize -= _cache.back().Size;
+        _cache.pop_back();
+    }
+
+    _cache.emplace_front();
+    auto &entry = _cache.front();
+    entry.Key = key;
+    entry.Uri = uri;
+    entry.Response = response;
+    entry.Expires = now + static_cast<int64_t>(maxAge) * 1000 * 1000;
+    entry.Size = size;
+    _cacheSize += size;
+}
+
+void CoapProxy::Invalidate(std::string const &uri)
+{
+    // A successful unsafe request makes what's cached for its target stale (RFC 7252 section 5.9)
+    for (auto it = _cache.begin(); it != _cache.end(); )
+    {
+        if (it->Uri != uri)
+        {
+            it++;
+            continue;
+        }
+        _cacheSize -= it->Size;
+        it = _cache.erase(it);
+    }
+}
+
+void CoapProxy::UpstreamResponse(void *context, CoapResult result, BufferedCoapMessage const *response)
+{
+    // Runs on the network task, called by the CoapClient
+    auto pending = static_cast<Pending *>(context);
+    auto proxy = pending->Proxy;
+    auto &queue = proxy->_pending;
+    queue.erase(std::remove(queue.begin(), queue.end(), pending), queue.end());
+
+    if (result != CoapResult::OK || response == nullptr)
+    {
+        for (auto &waiter : pending->Waiters)
+            proxy->Reject(waiter, CoapMessageType::NonConfirmable, CoapMessageCode::GatewayTimeout);
+        delete pending;
+        return;
+    }
+
+    int64_t maxAge = kCoapDefaultMaxAge;
+    for (auto &option : response->GetOptions())
+    {
+        if (option.Number == CoapOptionValue::MaxAge)
+            maxAge = CoapDecodeUInt(option.Value.data(), option.Value.length());
+    }
+
+    if (!pending->Key.empty() && response->GetCode() == CoapMessageCode::Content)
+        proxy->Store(pending->Key, pending->Uri, *response, esp_timer_get_time());
+    else if (pending->Key.empty() && (response->GetCode() >> 5) == 2)
+        proxy->Invalidate(pending->Uri);
+
+    for (auto &waiter : pending->Waiters)
+        proxy->Respond(waiter, CoapMessageType::NonConfirmable, *response, maxAge);
+
+    ESP_LOGD(kTag, "%u hits, %u misses, %u coalesced, %d bytes cached in %d entries",
+        proxy->_hits, proxy->_misses, proxy->_coalesced, static_cast<int>(proxy->_cacheSize), static_cast<int>(proxy->_cache.size()));
+    delete pending;
+}
+
+void CoapProxy::Respond(Waiter const &waiter, CoapMessageType type, BufferedCoapMessage const &response, int64_t maxAge)
+{
+    BufferedCoapMessage message;
+    CoapResult result;
+    message.SetCode(response.GetCode(), result);
+    message.SetType(type, result);
+    for (auto &option : response.GetOptions())
+    {
+        if (option.Number != CoapOptionValue::MaxAge && !_IsHopByHop(option.Number))
+            message.AddRawOption(option.Number, option.Value.data(), option.Value.length());
+    }
+    message.AddOption(CoapUIntOption(CoapOptionValue::MaxAge, static_cast<uint32_t>(std::max<int64_t>(maxAge, 0))), result);
+
+    // Large bodies go out block by block, later blocks are usually served from the cache
+    auto &body = response.GetPayload();
+    auto block = waiter.Block2;
+    if (block == kCoapProxyNoBlock && body.length() > (16u << kCoapProxyBlockSzx))
+        block = kCoapProxyBlockSzx;
+
+    if (block != kCoapProxyNoBlock)
+    {
+        auto szx = std::min<uint32_t>(block & 0x07, kCoapProxyBlockSzx);
+        auto size = 16u << szx;
+        auto num = block >> 4;
+        if (num * size >= body.length() && !(num == 0 && body.empty()))
+        {
+            Reject(waiter, type, CoapMessageCode::BadOption);
+            return;
+        }
+        auto more = (num + 1) * size < body.length();
+        message.AddOption(CoapUIntOption(CoapOptionValue::Block2, num << 4 | (more ? 0x08 : 0) | szx), result);
+        if (num == 0)
+            message.AddOption(CoapUIntOption(CoapOptionValue::Size2, body.length()), result);
+        message.SetPayload(body.substr(num * size, size), result);
+    }
+    else if (response.HasPayload())
+        message.SetPayload(body, result);
+
+    uint8_t buffer[kCoapClientMaxMessageSize];
+    size_t size;
+    auto messageId = type == CoapMessageType::Acknowledgement ? waiter.MessageId : _messageId++;
+    if (!message.Serialize(buffer, sizeof(buffer), messageId, waiter.Token, waiter.TokenLength, size))
+    {
+        Reject(waiter, type, CoapMessageCode::BadGateway);
+        return;
+    }
+    Complete(waiter, buffer, size);
+    _transmit(_context, waiter.Remote, buffer, size);
+}
+
+void CoapProxy::Reject(Waiter const &waiter, CoapMessageType type, CoapMessageCode code)
+{
+    BufferedCoapMessage message;
+    CoapResult result;
+    message.SetCode(code, result);
+    message.SetType(type, result);
+
+    uint8_t buffer[kCoapHeaderSize + kCoapMaxTokenLength];
+    size_t size;
+    auto messageId = type == CoapMessageType::Acknowledgement ? waiter.MessageId : _messageId++;
+    if (!message.Serialize(buffer, sizeof(buffer), messageId, waiter.Token, waiter.TokenLength, size))
+        return;
+    Complete(waiter, buffer, size);
+    _transmit(_context, waiter.Remote, buffer, size);
+}
+
+bool CoapProxy::Retransmit(NetEp_t const &remote, uint16_t messageId, bool confirmable, int64_t now)
+{
+    // A request that was already answered gets the same answer again (RFC 7252 section 4.5)
+    for (auto it = _completed.begin(); it != _completed.end(); )
+    {
+        if (it->Expires <= now)
+        {
+            it = _completed.erase(it);
+            continue;
+        }
+        if (it->MessageId != messageId || !EpAreEqual(&it->Remote, &remote))
+        {
+            it++;
+            continue;
+        }
+
+        if (confirmable)
+        {
+            // A separate response needs the ACK that may have been lost along with it
+            auto type = static_cast<CoapMessageType>((it->Datagram[0] >> 4) & 0x03);
+            if (type != CoapMessageType::Acknowledgement)
+            {
+                uint8_t ack[kCoapHeaderSize];
+                _transmit(_context, remote, ack, CoapPacket::WriteEmpty(ack, CoapMessageType::Acknowledgement, messageId));
+            }
+            _transmit(_context, remote, it->Datagram.data(), it->Datagram.size());
+        }
+        return true;
+    }
+    return false;
+}
+
+void CoapProxy::Complete(Waiter const &waiter, const uint8_t *datagram, size_t size)
+{
+    if (_completed.size() == kCoapProxyMaxCompleted)
+        _completed.pop_back();
+
+    _completed.emplace_front();
+    auto &completed = _completed.front();
+    completed.Remote = waiter.Remote;
+    completed.MessageId = waiter.MessageId;
+    completed.Expires = esp_timer_get_time() + kCoapProxyExchangeLifetimeUs;
+    completed.Datagram.assign(datagram, datagram + size);
+}
+
+#endif // CONFIG_IOTNODE_COAP_PROXY
@@ -0,0 +1,116 @@
+#ifndef _INTERFACES_COAPPROXY_H_
+#define _INTERFACES_COAPPROXY_H_
+
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_PROXY
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "coap.h"
+#include "bufferedmessage.h"
+#include "coapclient.h"
+#include "coappacket.h"
+
+extern "C" {
+    #include "liblobaro_coap.h"
+}
+
+static const size_t kCoapProxyCacheSize = CONFIG_IOTNODE_COAP_PROXY_CACHE_SIZE;
+static const int kCoapProxyMaxWaiters = 8;
+static const size_t kCoapProxyMaxCompleted = 8;
+
+// Forward proxy (RFC 7252 section 5.7) for coap:// servers behind this node. Requests with a
+// Proxy-Uri or Proxy-Scheme option are taken off the socket before lobaro sees them and either
+// answered from the cache or sent upstream with the CoapClient, with the answer coming back as a
+// separate response. Successful GET responses are cached until their Max-Age runs out, with the
+// least recently used ones evicted to stay within kCoapProxyCacheSize. A GET for something
+// already on its way upstream waits for that response instead of asking again. The last
+// kCoapProxyMaxCompleted answers are kept for EXCHANGE_LIFETIME, a retransmitted request gets
+// the same answer again instead of being forwarded twice.
+//
+// Only to be used from the network task.
+class CoapProxy
+{
+public:
+    typedef bool (*Transmit)(void *context, NetEp_t const &remote, const uint8_t *data, size_t length);
+
+    CoapProxy();
+    ~CoapProxy();
+
+    void Setup(CoapClient *client, Transmit transmit, void *context);
+
+    // True when `packet` was a proxy request, lobaro mustn't see it then
+    bool Receive(NetEp_t const &remote, CoapPacket const &packet, int64_t now);
+private:
+    // A downstream request waiting for an upstream response
+    struct Waiter
+    {
+        NetEp_t Remote;
+        uint16_t MessageId;
+        uint8_t TokenLength;
+        uint8_t Token[kCoapMaxTokenLength];
+        // Block of the response asked for, the whole body is fetched upstream either way
+        uint32_t Block2;
+    };
+
+    struct Pending
+    {
+        CoapProxy *Proxy;
+        // Empty for requests that aren't cached or shared
+        std::string Key;
+        std::string Uri;
+        std::vector<Waiter> Waiters;
+    };
+    std::vector<Pending*> _pending;
+
+    // What a downstream request was answered with
+    struct Completed
+    {
+        NetEp_t Remote;
+        uint16_t MessageId;
+        int64_t Expires;
+        std::vector<uint8_t> Datagram;
+    };
+    // Most recent first
+    std::list<Completed> _completed;
+
+    struct CacheEntry
+    {
+        std::string Key;
+        std::string Uri;
+        BufferedCoapMessage Response;
+        int64_t Expires;
+        size_t Size;
+    };
+    // Most recently used first
+    std::list<CacheEntry> _cache;
+    size_t _cacheSize;
+
+    CoapClient *_client;
+    Transmit _transmit;
+    void *_context;
+    uint16_t _messageId;
+
+    uint32_t _hits;
+    uint32_t _misses;
+    uint32_t _coalesced;
+
+    bool ParseUri(CoapPacket const &packet, BufferedCoapMessage &upstream, NetEp_t &server, std::string &uri, CoapMessageCode &error) const;
+    void Store(std::string const &key, std::string const &uri, BufferedCoapMessage const &response, int64_t now);
+    void Invalidate(std::string const &uri);
+    CacheEntry *Lookup(std::string const &key, int64_t now);
+
+    bool Retransmit(NetEp_t const &remote, uint16_t messageId, bool confirmable, int64_t now);
+    void Complete(Waiter const &waiter, const uint8_t *datagram, size_t size);
+    void Respond(Waiter const &waiter, CoapMessageType type, BufferedCoapMessage const &response, int64_t maxAge);
+    void Reject(Waiter const &waiter, CoapMessageType type, CoapMessageCode code);
+    static void UpstreamResponse(void *context, CoapResult result, BufferedCoapMessage const *response);
+};
+
+#endif // CONFIG_IOTNODE_COAP_PROXY
+
+#endif // _INTERFACES_COAPPROXY_H_
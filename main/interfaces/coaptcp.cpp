@@ -0,0 +1,875 @@
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_TCP
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "lwip/pbuf.h"
+
+#include "coaptcp.h"
+#include "taskconfig.h"
+
+static const char *kTag = "CoAP-TCP";
+static const char *kCoapTcpThreadName = "coap-tcp";
+
+static const uint16_t kCoapTcpPort = 5683;
+static const int kCoapTcpThreadStackSize = 8192;
+// Below the UDP task, a bulk transfer mustn't hold up notifications and small requests
+static const int kCoapTcpThreadPriority = 7;
+static const int kCoapTcpReadBudget = 4;
+static const int64_t kCoapTcpIdleTimeoutUs = 10 * 60 * 1000 * 1000LL;
+
+// Signaling codes and options (RFC 8323 section 5)
+static const uint8_t kCoapSignalCsm = MESSAGE_CODE_FROM_CLASS_CODE(7, 1);
+static const uint8_t kCoapSignalPing = MESSAGE_CODE_FROM_CLASS_CODE(7, 2);
+static const uint8_t kCoapSignalPong = MESSAGE_CODE_FROM_CLASS_CODE(7, 3);
+static const uint8_t kCoapSignalRelease = MESSAGE_CODE_FROM_CLASS_CODE(7, 4);
+static const uint8_t kCoapSignalAbort = MESSAGE_CODE_FROM_CLASS_CODE(7, 5);
+static const uint16_t kCoapCsmMaxMessageSize = 2;
+static const uint16_t kCoapCsmBlockWiseTransfer = 4;
+
+// What a peer can receive until its CSM says otherwise (RFC 8323 section 5.3.1)
+static const size_t kCoapTcpDefaultMessageSize = 1152;
+// Options and payload marker of a response aren't known when its body is split into blocks
+static const size_t kCoapTcpBlockOverhead = 64;
+static const uint32_t kCoapBlockSzxBert = 7;
+static const uint32_t kCoapBlockSzxMax = 6;
+static const size_t kCoapBertUnit = 1024;
+
+// Woken by the sockets' receive callbacks
+static xTaskHandle _tcpTask = nullptr;
+
+static uint32_t _GetUInt(BufferedCoapMessage const &message, uint16_t number, bool &present)
+{
+    for (auto &option : message.GetOptions())
+    {
+        if (option.Number == number)
+        {
+            present = true;
+            return CoapDecodeUInt(option.Value.data(), option.Value.length());
+        }
+    }
+    present = false;
+    return 0;
+}
+
+// Header (length nibble, extended length, code, token) and body length of the frame at `data`.
+// False until enough of it has arrived to tell.
+static bool _ParseFrameHeader(const uint8_t *data, size_t size, size_t &headerLength, size_t &bodyLength)
+{
+    if (size < 1)
+        return false;
+
+    size_t length = data[0] >> 4;
+    size_t tokenLength = data[0] & 0x0F;
+    size_t extended = length == 13 ? 1 : length == 14 ? 2 : length == 15 ? 4 : 0;
+    if (size < 1 + extended + 1 + std::min<size_t>(tokenLength, kCoapMaxTokenLength))
+        return false;
+
+    if (extended == 1)
+        length = data[1] + 13;
+    else if (extended == 2)
+        length = ((data[1] << 8) | data[2]) + 269;
+    else if (extended == 4)
+        length = ((uint32_t)data[1] << 24 | data[2] << 16 | data[3] << 8 | data[4]) + 65805;
+
+    headerLength = 1 + extended + 1 + tokenLength;
+    bodyLength = length;
+    return true;
+}
+
+CoapTcp::CoapTcp()
+    : _task(nullptr), _listener(nullptr), _networkReady(false)
+{
+    for (auto &connection : _connections)
+        connection.Socket = nullptr;
+}
+
+void CoapTcp::Start(CoapResult &result)
+{
+    int ret = xTaskCreatePinnedToCore(
+        &CoapTcp::TaskHandle,
+        kCoapTcpThreadName,
+        kCoapTcpThreadStackSize,
+        this,
+        kCoapTcpThreadPriority,
+        &this->_task,
+        kNetworkCore
+    );
+
+    result = ret ? CoapResult::OK : CoapResult::Error;
+
+    if (ret != true)
+        ESP_LOGE( kTag, "Failed to create thread %s", kCoapTcpThreadName );
+}
+
+void CoapTcp::SetNetworkReady(bool ready)
+{
+    this->_networkReady = ready;
+    if (_task != nullptr)
+        xTaskNotifyGive(_task);
+}
+
+void CoapTcp::CreateResource(CoapResource &resource, IApplicationResource * const applicationResource, const char* uri, CoapResult &result)
+{
+    assert(sizeof(CoapTcpResource) <= CoapConstraints::MaxResourceSize);
+    _resources.push_back(new (resource.get()) CoapTcpResource(this, applicationResource, uri));
+    result = CoapResult::OK;
+}
+
+void CoapTcp::QueueResourceNotification(ICoapResource *resource, CoapResult &result)
+{
+    if (!_notifyQueue.Push(static_cast<CoapTcpResource *>(resource)))
+    {
+        ESP_LOGW(kTag, "CoapTcp: _notifyQueue is full");
+        result = CoapResult::Error;
+        return;
+    }
+
+    if (_task != nullptr)
+        xTaskNotifyGive(_task);
+    result = CoapResult::OK;
+}
+
+void CoapTcp::SocketEvent(struct netconn *socket, enum netconn_evt event, uint16_t length)
+{
+    // Runs on the lwIP thread, for the listener as well as every accepted connection
+    if (event == NETCONN_EVT_RCVPLUS && _tcpTask != nullptr)
+        xTaskNotifyGive(_tcpTask);
+}
+
+bool CoapTcp::Listen()
+{
+#if CONFIG_IOTNODE_COAP_IPV6
+    // Bound to the IPv6 wildcard lwIP accepts IPv4 connections as well
+    _listener = netconn_new_with_callback(NETCONN_TCP_IPV6, &CoapTcp::SocketEvent);
+#else
+    _listener = netconn_new_with_callback(NETCONN_TCP, &CoapTcp::SocketEvent);
+#endif
+    if (_listener == nullptr)
+    {
+        ESP_LOGE( kTag, "netconn_new(): Failed to get new socket" );
+        return false;
+    }
+
+#if CONFIG_IOTNODE_COAP_IPV6
+    err_t err = netconn_bind(_listener, IP6_ADDR_ANY, kCoapTcpPort);
+#else
+    err_t err = netconn_bind(_listener, IP4_ADDR_ANY, kCoapTcpPort);
+#endif
+    if (err == ERR_OK)
+        err = netconn_listen(_listener);
+    if (err != ERR_OK)
+    {
+        ESP_LOGE(kTag, "netconn_bind/listen( ... ): Failed with %d", err);
+        netconn_delete(_listener);
+        _listener = nullptr;
+        return false;
+    }
+
+    netconn_set_nonblocking(_listener, 1);
+    ESP_LOGD( kTag, "Listening: Port: %hu (TCP)", kCoapTcpPort);
+    return true;
+}
+
+void CoapTcp::Accept(int64_t now)
+{
+    struct netconn *socket = nullptr;
+    while (netconn_accept(_listener, &socket) == ERR_OK)
+    {
+        Connection *connection = nullptr;
+        for (auto &candidate : _connections)
+        {
+            if (candidate.Socket == nullptr)
+            {
+                connection = &candidate;
+                break;
+            }
+        }
+
+        // Unlike a DTLS peer an established connection can't just be dropped, turn the new one away
+        if (connection == nullptr)
+        {
+            ESP_LOGW(kTag, "All %d connections in use, refusing another", kCoapTcpConnections);
+            netconn_close(socket);
+            netconn_delete(socket);
+            continue;
+        }
+
+        connection->Socket = socket;
+        connection->Opened = now;
+        connection->LastActive = now;
+        connection->BytesIn = 0;
+        connection->BytesOut = 0;
+        connection->PeerMaxMessageSize = kCoapTcpDefaultMessageSize;
+        connection->PeerBert = false;
+        connection->Received = 0;
+        connection->Discard = 0;
+        connection->Body.clear();
+        connection->Observations.clear();
+
+        // Data is only read once SocketEvent says there is some
+        netconn_set_nonblocking(socket, 1);
+
+        ESP_LOGI(kTag, "Accepted connection %d", static_cast<int>(connection - _connections));
+        SendCapabilities(*connection);
+    }
+}
+
+void CoapTcp::Close(Connection &connection)
+{
+    if (connection.Socket == nullptr)
+        return;
+
+    auto duration = esp_timer_get_time() - connection.Opened;
+    ESP_LOGI(kTag, "Closed connection %d after %d ms, %u bytes in, %u bytes out", static_cast<int>(&connection - _connections),
+        static_cast<int>(duration / 1000), connection.BytesIn, connection.BytesOut);
+
+    netconn_close(connection.Socket);
+    netconn_delete(connection.Socket);
+    connection.Socket = nullptr;
+    connection.Received = 0;
+    connection.Discard = 0;
+    // Observations are bound to the connection (RFC 8323 section 7.2)
+    connection.Observations.clear();
+    connection.Body.clear();
+    connection.Body.shrink_to_fit();
+}
+
+void CoapTcp::CloseAll()
+{
+    for (auto &connection : _connections)
+        Close(connection);
+}
+
+bool CoapTcp::Read(Connection &connection, int64_t now)
+{
+    struct pbuf *buffer = nullptr;
+    err_t err = netconn_recv_tcp_pbuf(connection.Socket, &buffer);
+    if (err == ERR_WOULDBLOCK)
+        return false;
+    if (err != ERR_OK)
+    {
+        // Closed or reset by the peer
+        Close(connection);
+        return false;
+    }
+
+    connection.LastActive = now;
+    connection.BytesIn += buffer->tot_len;
+
+    size_t offset = 0;
+    auto open = true;
+    while (open && offset < buffer->tot_len)
+    {
+        size_t remaining = buffer->tot_len - offset;
+        if (connection.Discard > 0)
+        {
+            auto skipped = std::min(connection.Discard, remaining);
+            connection.Discard -= skipped;
+            offset += skipped;
+            continue;
+        }
+
+        auto chunk = std::min(sizeof(connection.Buffer) - connection.Received, remaining);
+        pbuf_copy_partial(buffer, connection.Buffer + connection.Received, chunk, offset);
+        connection.Received += chunk;
+        offset += chunk;
+        open = Process(connection);
+    }
+
+    pbuf_free(buffer);
+    if (!open)
+        Close(connection);
+    return open;
+}
+
+bool CoapTcp::Process(Connection &connection)
+{
+    while (connection.Received > 0)
+    {
+        size_t headerLength, bodyLength;
+        if (!_ParseFrameHeader(connection.Buffer, connection.Received, headerLength, bodyLength))
+            return true;
+
+        if ((connection.Buffer[0] & 0x0F) > kCoapMaxTokenLength)
+        {
+            ESP_LOGW(kTag, "Message format error, aborting connection");
+            BufferedCoapMessage abort;
+            CoapResult result;
+            abort.SetCode(static_cast<CoapMessageCode>(kCoapSignalAbort), result);
+            Send(connection, abort, nullptr, 0);
+            return false;
+        }
+
+        auto tokenLength = connection.Buffer[0] & 0x0F;
+        auto token = connection.Buffer + headerLength - tokenLength;
+        size_t frameLength = headerLength + bodyLength;
+
+        if (frameLength > sizeof(connection.Buffer))
+        {
+            // More than our CSM allowed. Skip it and tell the client how much fits.
+            ESP_LOGW(kTag, "Skipping %d byte message", static_cast<int>(frameLength));
+            auto code = connection.Buffer[headerLength - tokenLength - 1];
+            if ((code >> 5) == 0 && code != 0)
+            {
+                BufferedCoapMessage response;
+                CoapResult result;
+                response.SetCode(CoapMessageCode::RequestEntityTooLarge, result);
+                response.SetOption(CoapUIntOption(CoapOptionValue::Size1, kCoapTcpMaxMessageSize), result);
+                Send(connection, response, token, tokenLength);
+            }
+            connection.Discard = frameLength - connection.Received;
+            connection.Received = 0;
+            return true;
+        }
+
+        if (connection.Received < frameLength)
+            return true;
+
+        if (!Dispatch(connection, connection.Buffer, frameLength))
+            return false;
+
+        connection.Received -= frameLength;
+        memmove(connection.Buffer, connection.Buffer + frameLength, connection.Received);
+    }
+    return true;
+}
+
+bool CoapTcp::Dispatch(Connection &connection, const uint8_t *frame, size_t size)
+{
+    size_t headerLength, bodyLength;
+    _ParseFrameHeader(frame, size, headerLength, bodyLength);
+    size_t tokenLength = frame[0] & 0x0F;
+    const uint8_t *token = frame + headerLength - tokenLength;
+    uint8_t code = frame[headerLength - tokenLength - 1];
+
+    // Empty messages are allowed and ignored (RFC 8323 section 3.4)
+    if (code == 0)
+        return true;
+
+    BufferedCoapMessage message;
+    CoapResult result;
+    message.SetCode(static_cast<CoapMessageCode>(code), result);
+
+    size_t offset = headerLength;
+    uint16_t number = 0;
+    const uint8_t *value;
+    size_t length;
+    while (CoapNextOption(frame, size, offset, number, value, length))
+        message.AddRawOption(number, value, length);
+
+    if (offset < size)
+    {
+        // Anything but a payload marker followed by a payload is malformed
+        if (frame[offset] != 0xFF || offset + 1 == size)
+        {
+            ESP_LOGW(kTag, "Malformed message, aborting connection");
+            BufferedCoapMessage abort;
+            abort.SetCode(static_cast<CoapMessageCode>(kCoapSignalAbort), result);
+            Send(connection, abort, nullptr, 0);
+            return false;
+        }
+        message.SetPayload(Payload(frame + offset + 1, size - offset - 1), result);
+    }
+
+    if ((code >> 5) == 7)
+        return HandleSignal(connection, message, token, tokenLength);
+
+    if ((code >> 5) == 0)
+        HandleRequest(connection, message, token, tokenLength);
+
+    // The node never sends requests, responses from the peer have nothing to match
+    return connection.Socket != nullptr;
+}
+
+bool CoapTcp::HandleSignal(Connection &connection, BufferedCoapMessage const &message, const uint8_t *token, size_t tokenLength)
+{
+    auto code = static_cast<uint8_t>(message.GetCode());
+    if (code == kCoapSignalCsm)
+    {
+        bool present;
+        auto maxMessageSize = _GetUInt(message, kCoapCsmMaxMessageSize, present);
+        if (present)
+            connection.PeerMaxMessageSize = maxMessageSize;
+        _GetUInt(message, kCoapCsmBlockWiseTransfer, connection.PeerBert);
+        ESP_LOGD(kTag, "Peer accepts %d byte messages%s", static_cast<int>(connection.PeerMaxMessageSize), connection.PeerBert ? " and BERT" : "");
+        return true;
+    }
+
+    if (code == kCoapSignalPing)
+    {
+        BufferedCoapMessage pong;
+        CoapResult result;
+        pong.SetCode(static_cast<CoapMessageCode>(kCoapSignalPong), result);
+        return Send(connection, pong, token, tokenLength);
+    }
+
+    // Release and Abort both end the connection, anything else unknown is ignored
+    return code != kCoapSignalRelease && code != kCoapSignalAbort;
+}
+
+void CoapTcp::HandleRequest(Connection &connection, BufferedCoapMessage &request, const uint8_t *token, size_t tokenLength)
+{
+    BufferedCoapMessage response;
+    CoapResult result;
+
+    std::vector<std::string> path;
+    request.GetOptions(path, CoapOptionValue::UriPath, result);
+    if (path.size() == 2 && path[0] == ".well-known" && path[1] == "core")
+    {
+        if (request.GetCode() == CoapMessageCode::Get)
+            ServeWellKnown(response);
+        else
+            response.SetCode(CoapMessageCode::MethodNotAllowed, result);
+        SplitBody(connection, request, response);
+        Send(connection, response, token, tokenLength);
+        return;
+    }
+
+    auto resource = FindResource(request);
+    if (resource == nullptr)
+    {
+        response.SetCode(CoapMessageCode::NotFound, result);
+        Send(connection, response, token, tokenLength);
+        return;
+    }
+
+    if ((resource->_methods & (1 << request.GetCode())) == 0)
+    {
+        response.SetCode(CoapMessageCode::MethodNotAllowed, result);
+        Send(connection, response, token, tokenLength);
+        return;
+    }
+
+    bool complete;
+    if (!ReassembleBody(connection, request, response, complete) || !complete)
+    {
+        Send(connection, response, token, tokenLength);
+        return;
+    }
+
+    // Observe registration and deregistration (RFC 7641 section 2), only for a whole GET
+    bool observe;
+    auto registration = _GetUInt(request, CoapOptionValue::Observe, observe);
+    Observation *observation = nullptr;
+    if (observe && request.GetCode() == CoapMessageCode::Get)
+    {
+        auto &observations = connection.Observations;
+        observations.erase(std::remove_if(observations.begin(), observations.end(), [&](Observation const &o) {
+            return o.TokenLength == tokenLength && memcmp(o.Token, token, tokenLength) == 0;
+        }), observations.end());
+
+        if (registration == 0 && resource->_observable && observations.size() < kCoapTcpMaxObservations)
+        {
+            observations.emplace_back();
+            observation = &observations.back();
+            observation->Resource = resource;
+            observation->Request = request;
+            observation->TokenLength = tokenLength;
+            memcpy(observation->Token, token, tokenLength);
+            observation->Sequence = 2;
+        }
+    }
+
+    resource->applicationResource->HandleRequest(&request, &response, result);
+    if (result != CoapResult::OK && response.GetCode() == CoapMessageCode::None)
+        response.SetCode(CoapMessageCode::InternalServerError, result);
+
+    if (observation != nullptr)
+    {
+        // Only a success response establishes the observation
+        if ((response.GetCode() >> 5) == 2)
+            response.SetOption(CoapUIntOption(CoapOptionValue::Observe, 1), result);
+        else
+            connection.Observations.pop_back();
+    }
+
+    SplitBody(connection, request, response);
+    Send(connection, response, token, tokenLength);
+}
+
+bool CoapTcp::ReassembleBody(Connection &connection, BufferedCoapMessage &request, BufferedCoapMessage &response, bool &complete)
+{
+    complete = true;
+
+    bool present;
+    auto block = _GetUInt(request, CoapOptionValue::Block1, present);
+    if (!present)
+        return true;
+
+    // Block1 (RFC 7959 section 2.5), with SZX 7 a BERT block of any multiple of 1024 bytes
+    auto num = block >> 4;
+    auto more = (block & 0x08) != 0;
+    auto szx = block & 0x07;
+    size_t unit = szx == kCoapBlockSzxBert ? kCoapBertUnit : 16u << szx;
+    size_t offset = num * unit;
+
+    Payload payload;
+    CoapResult result;
+    request.GetPayload(payload, result);
+
+    if (num == 0)
+        connection.Body.clear();
+
+    if (offset != connection.Body.length())
+    {
+        response.SetCode(CoapMessageCode::RequestEntityIncomplete, result);
+        connection.Body.clear();
+        return false;
+    }
+
+    if (connection.Body.length() + payload.length() > kCoapTcpMaxBodySize)
+    {
+        response.SetCode(CoapMessageCode::RequestEntityTooLarge, result);
+        response.SetOption(CoapUIntOption(CoapOptionValue::Size1, kCoapTcpMaxBodySize), result);
+        connection.Body.clear();
+        return false;
+    }
+
+    connection.Body.append(payload);
+    response.SetOption(CoapUIntOption(CoapOptionValue::Block1, block), result);
+
+    if (more)
+    {
+        complete = false;
+        response.SetCode(CoapMessageCode::Continue, result);
+        return true;
+    }
+
+    request.SetPayload(connection.Body, result);
+    connection.Body.clear();
+    return true;
+}
+
+void CoapTcp::SplitBody(Connection &connection, BufferedCoapMessage const &request, BufferedCoapMessage &response)
+{
+    if (!response.HasPayload())
+        return;
+
+    auto const &body = response.GetPayload();
+    size_t messageSize = std::min(connection.PeerMaxMessageSize, kCoapTcpMaxMessageSize);
+    size_t limit = messageSize > 2 * kCoapTcpBlockOverhead ? messageSize - kCoapTcpBlockOverhead : kCoapTcpBlockOverhead;
+
+    bool requested;
+    auto block = _GetUInt(request, CoapOptionValue::Block2, requested);
+    if (!requested && body.length() <= limit)
+        return;
+
+    // BERT if the peer announced it and didn't ask for a smaller size, 1024 byte blocks otherwise
+    uint32_t szx = requested ? block & 0x07 : kCoapBlockSzxBert;
+    if (szx == kCoapBlockSzxBert && (!connection.PeerBert || limit < 2 * kCoapBertUnit))
+        szx = kCoapBlockSzxMax;
+    while (szx > 0 && szx != kCoapBlockSzxBert && (16u << szx) > limit)
+        szx--;
+    uint32_t num = requested ? block >> 4 : 0;
+    size_t unit = szx == kCoapBlockSzxBert ? kCoapBertUnit : 16u << szx;
+    size_t chunk = szx == kCoapBlockSzxBert ? limit / kCoapBertUnit * kCoapBertUnit : unit;
+    size_t offset = num * unit;
+
+    CoapResult result;
+    if (offset > 0 && offset >= body.length())
+    {
+        BufferedCoapMessage error;
+        error.SetCode(CoapMessageCode::BadOption, result);
+        response = error;
+        return;
+    }
+
+    auto more = offset + chunk < body.length();
+    response.SetOption(CoapUIntOption(CoapOptionValue::Block2, (num << 4) | (more ? 0x08 : 0) | szx), result);
+    if (num == 0)
+        response.SetOption(CoapUIntOption(CoapOptionValue::Size2, body.length()), result);
+    response.SetPayload(body.substr(offset, chunk), result);
+}
+
+void CoapTcp::ServeWellKnown(BufferedCoapMessage &response)
+{
+    std::string links;
+    for (auto resource : _resources)
+    {
+        if (!links.empty())
+            links += ',';
+        links.append("</").append(resource->_uri).append(">");
+        if (resource->_resourceType != nullptr)
+            links.append(";rt=\"").append(resource->_resourceType).append("\"");
+        if (resource->_interface != nullptr)
+            links.append(";if=\"").append(resource->_interface).append("\"");
+        if (resource->_contentFormat >= 0)
+            links.append(";ct=").append(std::to_string(resource->_contentFormat));
+        if (resource->_observable)
+            links.append(";obs");
+    }
+
+    CoapResult result;
+    response.SetOption(CoapUIntOption(CoapOptionValue::ContentFormat, CoapContentType::LinkFormat), result);
+    response.SetPayload(links, result);
+    response.SetCode(CoapMessageCode::Content, result);
+}
+
+void CoapTcp::Notify(CoapTcpResource *resource)
+{
+    for (auto &connection : _connections)
+    {
+        for (size_t i = 0; connection.Socket != nullptr && i < connection.Observations.size(); )
+        {
+            auto &observation = connection.Observations[i];
+            if (observation.Resource != resource)
+            {
+                i++;
+                continue;
+            }
+
+            BufferedCoapMessage response;
+            CoapResult result;
+            CoapTcpObserver observer(observation.Request);
+            resource->applicationResource->HandleNotify(&observer, &response, result);
+            if (result != CoapResult::OK && response.GetCode() == CoapMessageCode::None)
+                response.SetCode(CoapMessageCode::InternalServerError, result);
+
+            // Sequence numbers wrap at 24 bits, a reliable transport needs no reordering guard
+            auto success = (response.GetCode() >> 5) == 2;
+            if (success)
+                response.SetOption(CoapUIntOption(CoapOptionValue::Observe, observation.Sequence++ & 0xFFFFFF), result);
+
+            SplitBody(connection, observation.Request, response);
+            if (!Send(connection, response, observation.Token, observation.TokenLength))
+                break;
+
+            // An error response ends the observation
+            if (success)
+                i++;
+            else
+                connection.Observations.erase(connection.Observations.begin() + i);
+        }
+    }
+}
+
+bool CoapTcp::Send(Connection &connection, BufferedCoapMessage const &message, const uint8_t *token, size_t tokenLength)
+{
+    // Options and payload go in first, the header is put in front once their length is known
+    size_t offset = kCoapTcpMaxHeaderSize;
+    uint16_t previous = 0;
+    for (auto &option : message.GetOptions())
+    {
+        if (!CoapWriteOption(_frame, sizeof(_frame), offset, previous, option.Number, option.Value.data(), option.Value.length()))
+        {
+            ESP_LOGE(kTag, "CoapTcp::Send: options don't fit");
+            return false;
+        }
+    }
+
+    if (message.HasPayload() && !message.GetPayload().empty())
+    {
+        auto const &payload = message.GetPayload();
+        if (offset + 1 + payload.length() > sizeof(_frame))
+        {
+            ESP_LOGE(kTag, "CoapTcp::Send: %d byte payload doesn't fit", static_cast<int>(payload.length()));
+            return false;
+        }
+        _frame[offset++] = 0xFF;
+        memcpy(_frame + offset, payload.data(), payload.length());
+        offset += payload.length();
+    }
+
+    size_t length = offset - kCoapTcpMaxHeaderSize;
+    uint8_t nibble;
+    size_t extended;
+    if (length < 13)
+        nibble = length, extended = 0;
+    else if (length < 269)
+        nibble = 13, extended = 1;
+    else if (length < 65805)
+        nibble = 14, extended = 2;
+    else
+        nibble = 15, extended = 4;
+
+    size_t start = kCoapTcpMaxHeaderSize - (1 + extended + 1 + tokenLength);
+    auto header = _frame + start;
+    *header++ = (nibble << 4) | tokenLength;
+    if (extended == 1)
+        *header++ = length - 13;
+    else if (extended == 2)
+    {
+        *header++ = (length - 269) >> 8;
+        *header++ = (length - 269) & 0xFF;
+    }
+    else if (extended == 4)
+    {
+        for (int shift = 24; shift >= 0; shift -= 8)
+            *header++ = ((length - 65805) >> shift) & 0xFF;
+    }
+    *header++ = static_cast<uint8_t>(message.GetCode());
+    if (tokenLength > 0)
+        memcpy(header, token, tokenLength);
+
+    // netconn_write can't report a partial write on a non-blocking connection, write this one
+    // out blocking. A stalled peer only holds up this task, not the UDP one.
+    netconn_set_nonblocking(connection.Socket, 0);
+    err_t err = netconn_write(connection.Socket, _frame + start, offset - start, NETCONN_COPY);
+    netconn_set_nonblocking(connection.Socket, 1);
+    if (err != ERR_OK)
+    {
+        ESP_LOGW(kTag, "netconn_write returned %d, closing connection", err);
+        Close(connection);
+        return false;
+    }
+
+    connection.BytesOut += offset - start;
+    return true;
+}
+
+void CoapTcp::SendCapabilities(Connection &connection)
+{
+    // Must be the first message on a connection (RFC 8323 section 5.3)
+    BufferedCoapMessage csm;
+    CoapResult result;
+    csm.SetCode(static_cast<CoapMessageCode>(kCoapSignalCsm), result);
+    csm.AddOption(CoapUIntOption(kCoapCsmMaxMessageSize, kCoapTcpMaxMessageSize), result);
+    csm.AddOption(CoapEmptyOption(kCoapCsmBlockWiseTransfer), result);
+    Send(connection, csm, nullptr, 0);
+}
+
+CoapTcpResource *CoapTcp::FindResource(BufferedCoapMessage const &request) const
+{
+    std::string path;
+    for (auto &option : request.GetOptions())
+    {
+        if (option.Number != CoapOptionValue::UriPath)
+            continue;
+        if (!path.empty())
+            path += '/';
+        path.append(reinterpret_cast<const char *>(option.Value.data()), option.Value.length());
+    }
+
+    for (auto resource : _resources)
+    {
+        if (resource->_uri == path)
+            return resource;
+    }
+    return nullptr;
+}
+
+bool CoapTcp::Poll(int64_t now)
+{
+    if (!_networkReady)
+    {
+        // The connections won't survive the outage, their observations go with them
+        CloseAll();
+        CoapTcpResource *queuedResource = nullptr;
+        while (_notifyQueue.Pop(queuedResource))
+            ;
+        return false;
+    }
+
+    if (_listener == nullptr && !Listen())
+        return false;
+
+    Accept(now);
+
+    auto backlog = false;
+    for (auto &connection : _connections)
+    {
+        int reads = 0;
+        while (connection.Socket != nullptr && reads < kCoapTcpReadBudget && Read(connection, now))
+            reads++;
+        backlog |= reads == kCoapTcpReadBudget;
+
+        if (connection.Socket != nullptr && now - connection.LastActive > kCoapTcpIdleTimeoutUs)
+            Close(connection);
+    }
+
+    CoapTcpResource *queuedResource = nullptr;
+    while (_notifyQueue.Pop(queuedResource))
+        Notify(queuedResource);
+    return backlog;
+}
+
+void CoapTcp::TaskHandle(void *pvParameters)
+{
+    auto instance = static_cast<CoapTcp *>(pvParameters);
+    _tcpTask = xTaskGetCurrentTaskHandle();
+
+    auto backlog = false;
+    while (true)
+    {
+        // Woken by socket events and notifications, the timeout only drives the idle check
+        ulTaskNotifyTake(pdTRUE, backlog ? 0 : 1000 / portTICK_PERIOD_MS);
+        backlog = instance->Poll(esp_timer_get_time());
+    }
+}
+
+CoapTcpResource::CoapTcpResource(CoapTcp * const coap, IApplicationResource * const applicationResource, const char* uri)
+    : ICoapResource(applicationResource), _coap(coap), _uri(uri), _methods(0), _observable(false), _composite(nullptr),
+      _resourceType(nullptr), _interface(nullptr), _contentFormat(-1)
+{
+}
+
+CoapTcpResource::~CoapTcpResource()
+{
+    auto &resources = _coap->_resources;
+    resources.erase(std::remove(resources.begin(), resources.end(), this), resources.end());
+    for (auto resource : resources)
+    {
+        if (resource->_composite == this)
+            resource->_composite = nullptr;
+    }
+}
+
+void CoapTcpResource::RegisterHandler(CoapMessageCode requestType, CoapResult &result)
+{
+    if (requestType < CoapMessageCode::Get || requestType > CoapMessageCode::Delete)
+    {
+        result = CoapResult::Error;
+        return;
+    }
+    _methods |= 1 << requestType;
+    result = CoapResult::OK;
+}
+
+void CoapTcpResource::RegisterAsObservable(CoapResult &result)
+{
+    _observable = true;
+    result = CoapResult::OK;
+}
+
+void CoapTcpResource::SetAttributes(const char *resourceType, const char *interface, std::initializer_list<CoapContentType> contentFormats, CoapResult &result)
+{
+    _resourceType = resourceType;
+    _interface = interface;
+    _contentFormat = contentFormats.size() > 0 ? *contentFormats.begin() : -1;
+    result = CoapResult::OK;
+}
+
+void CoapTcpResource::AddMember(IApplicationResource const *member, CoapResult &result)
+{
+    for (auto resource : _coap->_resources)
+    {
+        if (resource->applicationResource == member)
+        {
+            resource->_composite = this;
+            result = CoapResult::OK;
+            return;
+        }
+    }
+
+    ESP_LOGE(kTag, "CoapTcpResource::AddMember: member has no resource");
+    result = CoapResult::Error;
+}
+
+void CoapTcpResource::NotifyObservers(LatencyTrace const &trace, CoapResult &result)
+{
+    _coap->QueueResourceNotification(this, result);
+
+    if (_composite != nullptr)
+    {
+        CoapResult compositeResult;
+        _composite->NotifyObservers(trace, compositeResult);
+    }
+}
+
+#endif // CONFIG_IOTNODE_COAP_TCP
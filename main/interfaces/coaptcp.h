@@ -0,0 +1,153 @@
+#ifndef _INTERFACES_COAPTCP_H_
+#define _INTERFACES_COAPTCP_H_
+
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_TCP
+
+#include <atomic>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/api.h"
+
+#include "coap.h"
+#include "bufferedmessage.h"
+#include "coappacket.h"
+#include "lockfreequeue.h"
+
+static const int kCoapTcpConnections = CONFIG_IOTNODE_COAP_TCP_CONNECTIONS;
+static const size_t kCoapTcpMaxMessageSize = CONFIG_IOTNODE_COAP_TCP_MAX_MESSAGE;
+static const size_t kCoapTcpMaxBodySize = CONFIG_IOTNODE_COAP_TCP_MAX_BODY;
+static const int kCoapTcpMaxObservations = 8;
+static const int kCoapTcpNotifyQueueSize = 16;
+// Length nibble, up to 4 bytes of extended length, code and token
+static const size_t kCoapTcpMaxHeaderSize = 1 + 4 + 1 + kCoapMaxTokenLength;
+
+class CoapTcpResource;
+
+// CoAP over TCP (RFC 8323) for bulk transfers and clients behind NAT. Messages are length
+// prefixed on a reliable stream, so there are no message IDs, ACKs or retransmission timers and
+// a connection's NAT binding stays open as long as the connection does. Bodies larger than a
+// message are moved in BERT blocks (several 1024 byte blocks per message) when the peer's
+// Capabilities and Settings Message allows it, and in plain 1024 byte blocks otherwise.
+//
+// Runs on its own task. Usually attached to the UDP transport with LobaroCoap::AddTransport so
+// the same resources and handlers are served over both.
+class CoapTcp : public ICoapInterface
+{
+    friend class CoapTcpResource;
+private:
+    struct Observation
+    {
+        CoapTcpResource *Resource;
+        BufferedCoapMessage Request;
+        uint8_t TokenLength;
+        uint8_t Token[kCoapMaxTokenLength];
+        uint32_t Sequence;
+    };
+
+    struct Connection
+    {
+        struct netconn *Socket;
+        int64_t Opened;
+        int64_t LastActive;
+        uint32_t BytesIn;
+        uint32_t BytesOut;
+        // From the peer's CSM (RFC 8323 section 5.3)
+        size_t PeerMaxMessageSize;
+        bool PeerBert;
+        // Receive buffer, holds at most one message and the start of the next. The rest of a
+        // message too large for it is skipped.
+        uint8_t Buffer[kCoapTcpMaxHeaderSize + kCoapTcpMaxMessageSize];
+        size_t Received;
+        size_t Discard;
+        // Request body being reassembled from Block1 blocks
+        Payload Body;
+        std::vector<Observation> Observations;
+    };
+    Connection _connections[kCoapTcpConnections];
+
+    xTaskHandle _task;
+    struct netconn *_listener;
+    std::atomic<bool> _networkReady;
+    LockFreeQueue<CoapTcpResource*, kCoapTcpNotifyQueueSize> _notifyQueue;
+    std::vector<CoapTcpResource*> _resources;
+    uint8_t _frame[kCoapTcpMaxHeaderSize + kCoapTcpMaxMessageSize];
+
+    static void TaskHandle(void *pvParameters);
+    static void SocketEvent(struct netconn *socket, enum netconn_evt event, uint16_t length);
+
+    bool Listen();
+    void Accept(int64_t now);
+    void Close(Connection &connection);
+    void CloseAll();
+    bool Read(Connection &connection, int64_t now);
+    bool Process(Connection &connection);
+    bool Dispatch(Connection &connection, const uint8_t *frame, size_t size);
+    bool HandleSignal(Connection &connection, BufferedCoapMessage const &message, const uint8_t *token, size_t tokenLength);
+    void HandleRequest(Connection &connection, BufferedCoapMessage &request, const uint8_t *token, size_t tokenLength);
+    bool ReassembleBody(Connection &connection, BufferedCoapMessage &request, BufferedCoapMessage &response, bool &complete);
+    void SplitBody(Connection &connection, BufferedCoapMessage const &request, BufferedCoapMessage &response);
+    void ServeWellKnown(BufferedCoapMessage &response);
+    void Notify(CoapTcpResource *resource);
+    bool Send(Connection &connection, BufferedCoapMessage const &message, const uint8_t *token, size_t tokenLength);
+    void SendCapabilities(Connection &connection);
+    CoapTcpResource *FindResource(BufferedCoapMessage const &request) const;
+public:
+    CoapTcp();
+    virtual ~CoapTcp() {}
+
+    void Start(CoapResult &result);
+    void CreateResource(CoapResource &resource, IApplicationResource * const applicationResource, const char* uri, CoapResult &result);
+    void QueueResourceNotification(ICoapResource *resource, CoapResult &result);
+
+    void SetNetworkReady(bool ready);
+
+    // One pass of the task: accepts, reads every connection and sends queued notifications.
+    // True when a connection used up its read budget and may have more waiting.
+    bool Poll(int64_t now);
+};
+
+class CoapTcpResource : public ICoapResource
+{
+    friend class CoapTcp;
+    CoapTcp * const _coap;
+    std::string const _uri;
+    uint8_t _methods;
+    bool _observable;
+    CoapTcpResource *_composite;
+    const char *_resourceType;
+    const char *_interface;
+    int _contentFormat;
+public:
+    CoapTcpResource(CoapTcp * const coap, IApplicationResource * const applicationResource, const char* uri);
+    virtual ~CoapTcpResource();
+
+    void RegisterHandler(CoapMessageCode requestType, CoapResult &result);
+    void RegisterAsObservable(CoapResult &result);
+    void SetAttributes(const char *resourceType, const char *interface, std::initializer_list<CoapContentType> contentFormats, CoapResult &result);
+    void AddMember(IApplicationResource const *member, CoapResult &result);
+    void NotifyObservers(LatencyTrace const &trace, CoapResult &result);
+};
+
+// The registering request of an observation, notifications are built from its options
+class CoapTcpObserver : public ICoapObserver
+{
+    BufferedCoapMessage &_request;
+public:
+    CoapTcpObserver(BufferedCoapMessage &request)
+        : _request(request) {}
+
+    void GetOption(CoapOption &option,const uint16_t number, CoapResult &result) const { _request.GetOption(option, number, result); }
+    void GetOptions(std::vector<std::string> &values, const uint16_t number, CoapResult &result) const { _request.GetOptions(values, number, result); }
+    void AddOption(ICoapOption const *option, CoapResult &result) { _request.AddOption(option, result); }
+
+    // Delivery is reliable, a notification that can't be written closes the connection instead
+    int GetFailCount() const { return 0; }
+};
+
+#endif // CONFIG_IOTNODE_COAP_TCP
+
+#endif // _INTERFACES_COAPTCP_H_
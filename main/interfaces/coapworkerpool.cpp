@@ -0,0 +1,136 @@
+#include "coapworkerpool.h"
+
+#if CONFIG_IOTNODE_COAP_WORKER_POOL
+
+#include <cstring>
+
+#include "esp_log.h"
+#include "taskconfig.h"
+
+static const char* kTag = "CoAP Worker";
+static const char* kThreadName = "coap-worker";
+
+static const int kThreadStackSize = CONFIG_IOTNODE_COAP_WORKER_STACK_SIZE;
+static const int kThreadPriority = 7; // Just below the network task
+
+CoapWorkerPool::CoapWorkerPool()
+    : _networkTask(nullptr)
+{
+    for (auto &job : _jobs)
+        job.State.store(JobState::Free);
+
+    for (auto &worker : _workers)
+    {
+        worker.Pool = this;
+        worker.Task = nullptr;
+    }
+}
+
+void CoapWorkerPool::Start(CoapResult &result)
+{
+    result = CoapResult::OK;
+    for (auto &worker : _workers)
+    {
+        int ret = xTaskCreatePinnedToCore(
+            &CoapWorkerPool::TaskHandle,
+            kThreadName,
+            kThreadStackSize,
+            &worker,
+            kThreadPriority,
+            &worker.Task,
+            kWorkerCore
+        );
+
+        if (ret != pdPASS)
+        {
+            ESP_LOGE(kTag, "Failed to create thread %s", kThreadName);
+            result = CoapResult::Error;
+        }
+    }
+}
+
+CoapWorkerPool::Job *CoapWorkerPool::Find(IApplicationResource *resource, uint16_t messageId, const uint8_t *token, size_t tokenLength, int64_t now)
+{
+    for (auto &job : _jobs)
+    {
+        if (job.State.load() == JobState::Free || job.Resource != resource || job.MessageId != messageId
+            || job.TokenLength != tokenLength || memcmp(job.Token, token, tokenLength) != 0)
+            continue;
+
+        job.Touched = now;
+        return &job;
+    }
+    return nullptr;
+}
+
+CoapWorkerPool::Job *CoapWorkerPool::Acquire(IApplicationResource *resource, uint16_t messageId, const uint8_t *token, size_t tokenLength, int64_t now)
+{
+    if (tokenLength > kCoapMaxTokenLength)
+        return nullptr;
+
+    for (auto &job : _jobs)
+    {
+        // Still queued or running, a worker owns it until it's done
+        if (job.State.load(std::memory_order_acquire) == JobState::Done && now - job.Touched > kCoapWorkerJobExpiryUs)
+        {
+            ESP_LOGW(kTag, "Dropping the response to request %u, lobaro no longer asks for it", job.MessageId);
+            Release(&job);
+        }
+
+        if (job.State.load() != JobState::Free)
+            continue;
+
+        job.Resource = resource;
+        job.MessageId = messageId;
+        job.TokenLength = tokenLength;
+        memcpy(job.Token, token, tokenLength);
+        job.Touched = now;
+        job.Request.Clear();
+        job.Response.Clear();
+        job.Result = CoapResult::Error;
+        return &job;
+    }
+    return nullptr;
+}
+
+void CoapWorkerPool::Dispatch(Job *job, unsigned affinity)
+{
+    auto &worker = _workers[affinity % kCoapWorkerCount];
+    _networkTask = xTaskGetCurrentTaskHandle();
+
+    job->State.store(JobState::Queued, std::memory_order_release);
+
+    // Can't overflow, there are never more jobs than queue slots
+    worker.Queue.Push(static_cast<uint8_t>(job - _jobs));
+    xTaskNotifyGive(worker.Task);
+}
+
+void CoapWorkerPool::Release(Job *job)
+{
+    job->Resource = nullptr;
+    job->State.store(JobState::Free, std::memory_order_release);
+}
+
+void CoapWorkerPool::TaskHandle(void* pvParameters)
+{
+    auto worker = static_cast<Worker*>(pvParameters);
+    auto pool = worker->Pool;
+    uint8_t index;
+
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        while (worker->Queue.Pop(index))
+        {
+            auto &job = pool->_jobs[index];
+            job.Resource->HandleRequest(&job.Request, &job.Response, job.Result);
+            job.State.store(JobState::Done, std::memory_order_release);
+
+            // Wake the network task so it picks up the response straight away
+            xTaskNotifyGive(pool->_networkTask);
+        }
+    }
+}
+
+#endif // CONFIG_IOTNODE_COAP_WORKER_POOL
@@ -0,0 +1,83 @@
+#ifndef _INTERFACES_COAPWORKERPOOL_H_
+#define _INTERFACES_COAPWORKERPOOL_H_
+
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_WORKER_POOL
+
+#include <atomic>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "coap.h"
+#include "coappacket.h"
+#include "lockfreequeue.h"
+#include "bufferedmessage.h"
+
+static const int kCoapWorkerCount = CONFIG_IOTNODE_COAP_WORKER_COUNT;
+static const int kCoapWorkerJobs = CONFIG_IOTNODE_COAP_WORKER_JOBS;
+// Lobaro calls a postponed handler again on every pass, far more often than this
+static const int64_t kCoapWorkerJobExpiryUs = 30 * 1000 * 1000LL;
+
+// Runs IApplicationResource::HandleRequest on a small pool of worker tasks so that slow handlers
+// don't hold up the transport's network task. Requests are copied into BufferedCoapMessages
+// and handed over through lock-free queues; the network task polls for completion.
+//
+// Jobs are looked up by resource, message ID and token of their request. A job that finished
+// but wasn't collected within kCoapWorkerJobExpiryUs belongs to an interaction lobaro gave up
+// on, its slot is reclaimed.
+//
+// Acquire, Find, Dispatch and Release must only be called from the network task.
+class CoapWorkerPool
+{
+public:
+    enum class JobState : uint8_t
+    {
+        Free,
+        Queued,
+        Done,
+    };
+
+    struct Job
+    {
+        std::atomic<JobState> State;
+        IApplicationResource *Resource;
+        uint16_t MessageId;
+        uint8_t TokenLength;
+        uint8_t Token[kCoapMaxTokenLength];
+        // Last time lobaro asked for the job
+        int64_t Touched;
+        BufferedCoapMessage Request;
+        BufferedCoapMessage Response;
+        CoapResult Result;
+    };
+private:
+    // Jobs are always routed to the same worker for a given affinity, so a resource's handler
+    // never runs concurrently with itself
+    struct Worker
+    {
+        CoapWorkerPool *Pool;
+        xTaskHandle Task;
+        LockFreeQueue<uint8_t, 32> Queue;
+    };
+    static_assert(kCoapWorkerJobs <= 32, "CoapWorkerPool queues hold at most 32 jobs");
+
+    Job _jobs[kCoapWorkerJobs];
+    Worker _workers[kCoapWorkerCount];
+    xTaskHandle _networkTask;
+
+    static void TaskHandle(void* pvParameters);
+public:
+    CoapWorkerPool();
+    void Start(CoapResult &result);
+
+    Job *Find(IApplicationResource *resource, uint16_t messageId, const uint8_t *token, size_t tokenLength, int64_t now);
+    Job *Acquire(IApplicationResource *resource, uint16_t messageId, const uint8_t *token, size_t tokenLength, int64_t now);
+    void Dispatch(Job *job, unsigned affinity);
+    void Release(Job *job);
+};
+
+#endif // CONFIG_IOTNODE_COAP_WORKER_POOL
+
+#endif // _INTERFACES_COAPWORKERPOOL_H_
@@ -0,0 +1,503 @@
+#include "dtlsserver.h"
+
+#if CONFIG_IOTNODE_COAP_DTLS
+
+#include <cstring>
+#include "esp_timer.h"
+#include "esp_log.h"
+
+extern "C" {
+    #include "interface/network/net_Endpoint.h"
+}
+
+static const char* kTag = "DTLS";
+
+static const int64_t kDtlsIdleTimeoutUs = CONFIG_IOTNODE_COAP_DTLS_IDLE_TIMEOUT * 1000000LL;
+static const int kDtlsSessionTimeoutSec = CONFIG_IOTNODE_COAP_DTLS_SESSION_TIMEOUT;
+static const uint32_t kDtlsHandshakeTimeoutMinMs = 1000;
+static const uint32_t kDtlsHandshakeTimeoutMaxMs = 16000;
+
+// Record and handshake header fields used to recognise a ClientHello without parsing it
+static const size_t kDtlsRecordHeaderSize = 13;
+static const uint8_t kDtlsContentTypeHandshake = 22;
+static const uint8_t kDtlsHandshakeClientHello = 1;
+static const size_t kDtlsHandshakeHeaderSize = 12;
+static const size_t kDtlsClientHelloSessionIdOffset = kDtlsRecordHeaderSize + kDtlsHandshakeHeaderSize + 2 + 32;
+static const size_t kDtlsMaxTransportIdLength = sizeof(NetAddr_IPv6_t) + sizeof(uint16_t);
+
+static bool _IsClientHello(const uint8_t *datagram, size_t size)
+{
+    // Epoch 0 handshake record starting with a ClientHello
+    return size > kDtlsRecordHeaderSize && datagram[0] == kDtlsContentTypeHandshake
+        && datagram[3] == 0 && datagram[4] == 0 && datagram[kDtlsRecordHeaderSize] == kDtlsHandshakeClientHello;
+}
+
+// The cookie field of a ClientHello, false if it's empty or doesn't fit in the datagram
+static bool _GetCookie(const uint8_t *datagram, size_t size, const uint8_t *&cookie, size_t &cookieLength)
+{
+    if (size <= kDtlsClientHelloSessionIdOffset)
+        return false;
+    size_t cookieOffset = kDtlsClientHelloSessionIdOffset + 1 + datagram[kDtlsClientHelloSessionIdOffset];
+    if (cookieOffset >= size || datagram[cookieOffset] == 0 || cookieOffset + 1 + datagram[cookieOffset] > size)
+        return false;
+
+    cookie = datagram + cookieOffset + 1;
+    cookieLength = datagram[cookieOffset];
+    return true;
+}
+
+// Address and port, what cookies are bound to
+static size_t _TransportId(NetEp_t const &remote, uint8_t *transportId)
+{
+    size_t addressLength = remote.NetType == IPV4 ? sizeof(remote.NetAddr.IPv4.u8) : sizeof(remote.NetAddr.IPv6.u8);
+    memcpy(transportId, remote.NetAddr.IPv6.u8, addressLength);
+    memcpy(transportId + addressLength, &remote.NetPort, sizeof(remote.NetPort));
+    return addressLength + sizeof(remote.NetPort);
+}
+
+DtlsServer::DtlsServer()
+    : _handshakePeer(nullptr), _ready(false), _transmit(nullptr), _context(nullptr),
+      _fullHandshakes(0), _resumedHandshakes(0), _records(0), _recordTime(0)
+{
+    for (auto &peer : _peers)
+    {
+        peer.Server = this;
+        peer.State = PeerState::Free;
+    }
+    _verifier.Server = this;
+    _verifier.State = PeerState::Free;
+
+    mbedtls_entropy_init(&_entropy);
+    mbedtls_ctr_drbg_init(&_drbg);
+    mbedtls_x509_crt_init(&_cert);
+    mbedtls_pk_init(&_key);
+    mbedtls_ssl_cookie_init(&_cookie);
+    mbedtls_ssl_cache_init(&_cache);
+    mbedtls_ssl_config_init(&_config);
+}
+
+DtlsServer::~DtlsServer()
+{
+    for (auto &peer : _peers)
+    {
+        if (peer.State != PeerState::Free)
+            ClosePeer(peer, false);
+    }
+    if (_verifier.State != PeerState::Free)
+        ClosePeer(_verifier, false);
+
+    mbedtls_ssl_config_free(&_config);
+    mbedtls_ssl_cache_free(&_cache);
+    mbedtls_ssl_cookie_free(&_cookie);
+    mbedtls_pk_free(&_key);
+    mbedtls_x509_crt_free(&_cert);
+    mbedtls_ctr_drbg_free(&_drbg);
+    mbedtls_entropy_free(&_entropy);
+}
+
+void DtlsServer::Setup(CoapDtlsOptions const &options, Transmit transmit, void *context, CoapResult &result)
+{
+    result = CoapResult::Error;
+    _transmit = transmit;
+    _context = context;
+
+    if (options.cert_ptr == nullptr || options.cert_key_ptr == nullptr)
+    {
+        ESP_LOGE(kTag, "No certificate or key");
+        return;
+    }
+
+    int ret;
+    if ((ret = mbedtls_ctr_drbg_seed(&_drbg, mbedtls_entropy_func, &_entropy, reinterpret_cast<const unsigned char *>(kTag), strlen(kTag))) != 0)
+    {
+        ESP_LOGE(kTag, "mbedtls_ctr_drbg_seed( ... ): Failed with -0x%x", -ret);
+        return;
+    }
+
+    // PEM input must include the terminating null in its length
+    if ((ret = mbedtls_x509_crt_parse(&_cert, options.cert_ptr, options.cert_len)) != 0)
+    {
+        ESP_LOGE(kTag, "mbedtls_x509_crt_parse( ... ): Failed with -0x%x", -ret);
+        return;
+    }
+
+    if ((ret = mbedtls_pk_parse_key(&_key, options.cert_key_ptr, options.cert_key_len, nullptr, 0)) != 0)
+    {
+        ESP_LOGE(kTag, "mbedtls_pk_parse_key( ... ): Failed with -0x%x", -ret);
+        return;
+    }
+
+    if ((ret = mbedtls_ssl_config_defaults(&_config, MBEDTLS_SSL_IS_SERVER, MBEDTLS_SSL_TRANSPORT_DATAGRAM, MBEDTLS_SSL_PRESET_DEFAULT)) != 0)
+    {
+        ESP_LOGE(kTag, "mbedtls_ssl_config_defaults( ... ): Failed with -0x%x", -ret);
+        return;
+    }
+
+    mbedtls_ssl_conf_rng(&_config, mbedtls_ctr_drbg_random, &_drbg);
+
+    if ((ret = mbedtls_ssl_conf_own_cert(&_config, &_cert, &_key)) != 0)
+    {
+        ESP_LOGE(kTag, "mbedtls_ssl_conf_own_cert( ... ): Failed with -0x%x", -ret);
+        return;
+    }
+
+    // HelloVerifyRequest cookies, a peer slot is only kept once the client has proven its address
+    if ((ret = mbedtls_ssl_cookie_setup(&_cookie, mbedtls_ctr_drbg_random, &_drbg)) != 0)
+    {
+        ESP_LOGE(kTag, "mbedtls_ssl_cookie_setup( ... ): Failed with -0x%x", -ret);
+        return;
+    }
+    mbedtls_ssl_conf_dtls_cookies(&_config, mbedtls_ssl_cookie_write, mbedtls_ssl_cookie_check, &_cookie);
+
+    mbedtls_ssl_cache_set_max_entries(&_cache, kDtlsSessionCacheSize);
+    mbedtls_ssl_cache_set_timeout(&_cache, kDtlsSessionTimeoutSec);
+    mbedtls_ssl_conf_session_cache(&_config, this, &DtlsServer::GetCachedSession, &DtlsServer::SetCachedSession);
+
+    mbedtls_ssl_conf_handshake_timeout(&_config, kDtlsHandshakeTimeoutMinMs, kDtlsHandshakeTimeoutMaxMs);
+
+    // Answers every ClientHello without a cookie, set up once and reset for each one
+    if (!InitPeer(_verifier))
+        return;
+
+    _ready = true;
+    result = CoapResult::OK;
+}
+
+DtlsServer::Peer *DtlsServer::FindPeer(NetEp_t const &remote)
+{
+    for (auto &peer : _peers)
+    {
+        if (peer.State != PeerState::Free && EpAreEqual(&peer.Ep, &remote))
+            return &peer;
+    }
+    return nullptr;
+}
+
+DtlsServer::Peer *DtlsServer::OpenPeer(NetEp_t const &remote, int64_t now)
+{
+    // Take a free slot, or the one that's been quiet the longest. Its session stays cached,
+    // so if that client comes back it only pays for an abbreviated handshake.
+    Peer *slot = nullptr;
+    for (auto &peer : _peers)
+    {
+        if (peer.State == PeerState::Free)
+        {
+            slot = &peer;
+            break;
+        }
+        if (slot == nullptr || peer.LastActive < slot->LastActive)
+            slot = &peer;
+    }
+
+    if (slot->State != PeerState::Free)
+    {
+        ESP_LOGI(kTag, "All %d connections in use, closing the least recently used", kDtlsMaxPeers);
+        ClosePeer(*slot, true);
+    }
+
+    if (!InitPeer(*slot))
+        return nullptr;
+
+    BindPeer(*slot, remote, now);
+    return slot;
+}
+
+bool DtlsServer::InitPeer(Peer &peer)
+{
+    mbedtls_ssl_init(&peer.Ssl);
+    int ret = mbedtls_ssl_setup(&peer.Ssl, &_config);
+    if (ret != 0)
+    {
+        ESP_LOGE(kTag, "mbedtls_ssl_setup( ... ): Failed with -0x%x", -ret);
+        mbedtls_ssl_free(&peer.Ssl);
+        return false;
+    }
+
+    mbedtls_ssl_set_bio(&peer.Ssl, &peer, &DtlsServer::SendRecord, &DtlsServer::ReceiveRecord, nullptr);
+    mbedtls_ssl_set_timer_cb(&peer.Ssl, &peer, &DtlsServer::SetTimer, &DtlsServer::GetTimer);
+    peer.State = PeerState::Handshake;
+    return true;
+}
+
+void DtlsServer::BindPeer(Peer &peer, NetEp_t const &remote, int64_t now)
+{
+    // The cookie is bound to the client's address and port
+    uint8_t transportId[kDtlsMaxTransportIdLength];
+    mbedtls_ssl_set_client_transport_id(&peer.Ssl, transportId, _TransportId(remote, transportId));
+
+    peer.Resumed = false;
+    peer.Ep = remote;
+    peer.LastActive = now;
+    peer.HandshakeStart = now;
+    peer.IntermediateAt = 0;
+    peer.FinalAt = 0;
+    peer.In = nullptr;
+    peer.InLength = 0;
+}
+
+void DtlsServer::Verify(NetEp_t const &remote, const uint8_t *datagram, size_t size, int64_t now)
+{
+    // Costs a HelloVerifyRequest and no peer slot, so spoofed ClientHellos can't push out
+    // established connections
+    mbedtls_ssl_session_reset(&_verifier.Ssl);
+    BindPeer(_verifier, remote, now);
+    _verifier.In = datagram;
+    _verifier.InLength = size;
+
+    int ret = mbedtls_ssl_handshake(&_verifier.Ssl);
+    if (ret != MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED && ret != MBEDTLS_ERR_SSL_WANT_READ)
+        ESP_LOGD(kTag, "Cookie exchange with port %hu returned -0x%x", remote.NetPort, -ret);
+
+    _verifier.In = nullptr;
+    _verifier.InLength = 0;
+}
+
+bool DtlsServer::CheckCookie(NetEp_t const &remote, const uint8_t *datagram, size_t size)
+{
+    const uint8_t *cookie;
+    size_t cookieLength;
+    if (!_GetCookie(datagram, size, cookie, cookieLength))
+        return false;
+
+    uint8_t transportId[kDtlsMaxTransportIdLength];
+    return mbedtls_ssl_cookie_check(&_cookie, cookie, cookieLength, transportId, _TransportId(remote, transportId)) == 0;
+}
+
+void DtlsServer::ClosePeer(Peer &peer, bool notify)
+{
+    if (notify && peer.State == PeerState::Established)
+        mbedtls_ssl_close_notify(&peer.Ssl);
+
+    mbedtls_ssl_free(&peer.Ssl);
+    peer.State = PeerState::Free;
+}
+
+void DtlsServer::Handshake(Peer &peer, int64_t now)
+{
+    _handshakePeer = &peer;
+    int ret = mbedtls_ssl_handshake(&peer.Ssl);
+    _handshakePeer = nullptr;
+
+    if (ret == MBEDTLS_ERR_SSL_WANT_READ || ret == MBEDTLS_ERR_SSL_WANT_WRITE)
+        return;
+
+    if (ret == MBEDTLS_ERR_SSL_HELLO_VERIFY_REQUIRED)
+    {
+        // The cookie didn't check out, a new one has been sent
+        ClosePeer(peer, false);
+        return;
+    }
+
+    if (ret != 0)
+    {
+        ESP_LOGW(kTag, "Handshake with port %hu failed with -0x%x", peer.Ep.NetPort, -ret);
+        ClosePeer(peer, false);
+        return;
+    }
+
+    peer.State = PeerState::Established;
+    if (peer.Resumed)
+        _resumedHandshakes++;
+    else
+        _fullHandshakes++;
+
+    ESP_LOGI(kTag, "%s handshake with port %hu done in %d ms using %s (%u full, %u resumed)",
+        peer.Resumed ? "Abbreviated" : "Full", peer.Ep.NetPort, static_cast<int>((now - peer.HandshakeStart) / 1000),
+        mbedtls_ssl_get_ciphersuite(&peer.Ssl), _fullHandshakes, _resumedHandshakes);
+}
+
+void DtlsServer::Receive(NetEp_t const &remote, const uint8_t *datagram, size_t size, uint8_t *plaintext, size_t capacity, size_t &length, CoapResult &result)
+{
+    length = 0;
+    result = CoapResult::Error;
+    if (!_ready)
+        return;
+
+    auto now = esp_timer_get_time();
+    auto peer = FindPeer(remote);
+    if (peer == nullptr)
+    {
+        // Only a ClientHello returning a valid cookie may take a peer slot, and with it possibly
+        // the slot of an established connection. Anything else is answered by the verifier.
+        if (!_IsClientHello(datagram, size))
+            return;
+
+        result = CoapResult::OK;
+        if (!CheckCookie(remote, datagram, size))
+        {
+            Verify(remote, datagram, size, now);
+            return;
+        }
+
+        if ((peer = OpenPeer(remote, now)) == nullptr)
+            return;
+    }
+
+    peer->In = datagram;
+    peer->InLength = size;
+    peer->LastActive = now;
+    result = CoapResult::OK;
+
+    if (peer->State == PeerState::Handshake)
+    {
+        Handshake(*peer, now);
+    }
+    else
+    {
+        int ret = mbedtls_ssl_read(&peer->Ssl, plaintext, capacity);
+        if (ret > 0)
+        {
+            length = ret;
+            _records++;
+            _recordTime += esp_timer_get_time() - now;
+        }
+        else if (ret == MBEDTLS_ERR_SSL_CLIENT_RECONNECT)
+        {
+            // Same address and port started over, mbedtls has already reset the context
+            peer->State = PeerState::Handshake;
+            peer->Resumed = false;
+            peer->HandshakeStart = now;
+            Handshake(*peer, now);
+        }
+        else if (ret == MBEDTLS_ERR_SSL_PEER_CLOSE_NOTIFY)
+        {
+            ClosePeer(*peer, false);
+        }
+        else if (ret != MBEDTLS_ERR_SSL_WANT_READ && ret != MBEDTLS_ERR_SSL_WANT_WRITE)
+        {
+            ESP_LOGW(kTag, "mbedtls_ssl_read( ... ): Failed with -0x%x", -ret);
+            ClosePeer(*peer, false);
+            result = CoapResult::Error;
+        }
+    }
+
+    // The slot may have been closed above, the datagram is only valid during this call either way
+    peer->In = nullptr;
+    peer->InLength = 0;
+}
+
+void DtlsServer::Send(NetEp_t const &remote, const uint8_t *data, size_t length, CoapResult &result)
+{
+    auto peer = FindPeer(remote);
+    if (peer == nullptr || peer->State != PeerState::Established)
+    {
+        ESP_LOGW(kTag, "No connection to port %hu", remote.NetPort);
+        result = CoapResult::Error;
+        return;
+    }
+
+    auto start = esp_timer_get_time();
+    int ret = mbedtls_ssl_write(&peer->Ssl, data, length);
+    if (ret < 0)
+    {
+        ESP_LOGW(kTag, "mbedtls_ssl_write( ... ): Failed with -0x%x", -ret);
+        result = CoapResult::Error;
+        return;
+    }
+
+    auto end = esp_timer_get_time();
+    peer->LastActive = end;
+    _records++;
+    _recordTime += end - start;
+    ESP_LOGD(kTag, "Wrote %d bytes in %d us, %d us per record on average",
+        static_cast<int>(length), static_cast<int>(end - start), static_cast<int>(_recordTime / _records));
+    result = CoapResult::OK;
+}
+
+void DtlsServer::Poll(int64_t now)
+{
+    for (auto &peer : _peers)
+    {
+        if (peer.State == PeerState::Free)
+            continue;
+
+        if (peer.State == PeerState::Handshake)
+        {
+            // mbedtls resends the last flight (or gives up) when it finds the timer expired
+            if (peer.FinalAt != 0 && now >= peer.FinalAt)
+                Handshake(peer, now);
+        }
+        else if (now - peer.LastActive > kDtlsIdleTimeoutUs)
+        {
+            ESP_LOGI(kTag, "Closing idle connection to port %hu", peer.Ep.NetPort);
+            ClosePeer(peer, true);
+        }
+    }
+}
+
+int DtlsServer::SendRecord(void *context, const unsigned char *data, size_t length)
+{
+    auto peer = static_cast<Peer *>(context);
+    auto server = peer->Server;
+    if (!server->_transmit(server->_context, peer->Ep, data, length))
+        return MBEDTLS_ERR_SSL_WANT_WRITE;
+    return static_cast<int>(length);
+}
+
+int DtlsServer::ReceiveRecord(void *context, unsigned char *data, size_t length)
+{
+    auto peer = static_cast<Peer *>(context);
+    if (peer->In == nullptr)
+        return MBEDTLS_ERR_SSL_WANT_READ;
+
+    // One datagram per call, truncating would corrupt it anyway
+    if (peer->InLength > length)
+    {
+        peer->In = nullptr;
+        return MBEDTLS_ERR_SSL_WANT_READ;
+    }
+
+    size_t size = peer->InLength;
+    memcpy(data, peer->In, size);
+    peer->In = nullptr;
+    peer->InLength = 0;
+    return static_cast<int>(size);
+}
+
+void DtlsServer::SetTimer(void *context, uint32_t intermediateMs, uint32_t finalMs)
+{
+    auto peer = static_cast<Peer *>(context);
+    if (finalMs == 0)
+    {
+        peer->IntermediateAt = 0;
+        peer->FinalAt = 0;
+        return;
+    }
+
+    auto now = esp_timer_get_time();
+    peer->IntermediateAt = now + intermediateMs * 1000LL;
+    peer->FinalAt = now + finalMs * 1000LL;
+}
+
+int DtlsServer::GetTimer(void *context)
+{
+    auto peer = static_cast<Peer *>(context);
+    if (peer->FinalAt == 0)
+        return -1;
+
+    auto now = esp_timer_get_time();
+    if (now >= peer->FinalAt)
+        return 2;
+    if (now >= peer->IntermediateAt)
+        return 1;
+    return 0;
+}
+
+int DtlsServer::GetCachedSession(void *context, mbedtls_ssl_session *session)
+{
+    auto server = static_cast<DtlsServer *>(context);
+    int ret = mbedtls_ssl_cache_get(&server->_cache, session);
+
+    // Only asked during a ClientHello carrying a session id, a hit means the abbreviated handshake
+    if (ret == 0 && server->_handshakePeer != nullptr)
+        server->_handshakePeer->Resumed = true;
+    return ret;
+}
+
+int DtlsServer::SetCachedSession(void *context, const mbedtls_ssl_session *session)
+{
+    auto server = static_cast<DtlsServer *>(context);
+    return mbedtls_ssl_cache_set(&server->_cache, session);
+}
+
+#endif // CONFIG_IOTNODE_COAP_DTLS
@@ -0,0 +1,117 @@
+#ifndef _INTERFACES_DTLSSERVER_H_
+#define _INTERFACES_DTLSSERVER_H_
+
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_DTLS
+
+#include <cstdint>
+
+#include "mbedtls/ssl.h"
+#include "mbedtls/ssl_cache.h"
+#include "mbedtls/ssl_cookie.h"
+#include "mbedtls/entropy.h"
+#include "mbedtls/ctr_drbg.h"
+#include "mbedtls/x509_crt.h"
+#include "mbedtls/pk.h"
+
+#include "coap.h"
+
+extern "C" {
+    #include "liblobaro_coap.h"
+}
+
+static const int kDtlsMaxPeers = CONFIG_IOTNODE_COAP_DTLS_MAX_PEERS;
+static const int kDtlsSessionCacheSize = CONFIG_IOTNODE_COAP_DTLS_SESSION_CACHE;
+
+// Server side of DTLS for the secure CoAP socket. The owner hands in every datagram received
+// on the socket and gets the decrypted CoAP message back; records going out are handed to the
+// Transmit callback. Connections are kept in a fixed number of peer slots, negotiated sessions
+// in a separate, larger cache so a returning client can resume with an abbreviated handshake
+// even after its slot was reused.
+//
+// Only to be used from the network task.
+class DtlsServer
+{
+public:
+    typedef bool (*Transmit)(void *context, NetEp_t const &remote, const uint8_t *data, size_t length);
+
+    DtlsServer();
+    ~DtlsServer();
+
+    void Setup(CoapDtlsOptions const &options, Transmit transmit, void *context, CoapResult &result);
+
+    // `length` is set to the size of the application data decrypted into `plaintext`, 0 when the
+    // datagram only carried handshake records
+    void Receive(NetEp_t const &remote, const uint8_t *datagram, size_t size, uint8_t *plaintext, size_t capacity, size_t &length, CoapResult &result);
+    void Send(NetEp_t const &remote, const uint8_t *data, size_t length, CoapResult &result);
+
+    // Retransmits handshake flights and closes idle connections
+    void Poll(int64_t now);
+
+    void *GetContext() const { return _context; }
+private:
+    enum class PeerState : uint8_t
+    {
+        Free,
+        Handshake,
+        Established,
+    };
+
+    struct Peer
+    {
+        DtlsServer *Server;
+        PeerState State;
+        bool Resumed;
+        NetEp_t Ep;
+        mbedtls_ssl_context Ssl;
+        int64_t LastActive;
+        int64_t HandshakeStart;
+        // Handshake retransmission timer, 0 when cancelled
+        int64_t IntermediateAt;
+        int64_t FinalAt;
+        // Datagram currently being fed to mbedtls
+        const uint8_t *In;
+        size_t InLength;
+    };
+    Peer _peers[kDtlsMaxPeers];
+    Peer _verifier;
+    Peer *_handshakePeer;
+
+    mbedtls_entropy_context _entropy;
+    mbedtls_ctr_drbg_context _drbg;
+    mbedtls_x509_crt _cert;
+    mbedtls_pk_context _key;
+    mbedtls_ssl_cookie_ctx _cookie;
+    mbedtls_ssl_cache_context _cache;
+    mbedtls_ssl_config _config;
+    bool _ready;
+
+    Transmit _transmit;
+    void *_context;
+
+    uint32_t _fullHandshakes;
+    uint32_t _resumedHandshakes;
+    uint32_t _records;
+    int64_t _recordTime;
+
+    Peer *FindPeer(NetEp_t const &remote);
+    Peer *OpenPeer(NetEp_t const &remote, int64_t now);
+    bool InitPeer(Peer &peer);
+    void BindPeer(Peer &peer, NetEp_t const &remote, int64_t now);
+    void Verify(NetEp_t const &remote, const uint8_t *datagram, size_t size, int64_t now);
+    bool CheckCookie(NetEp_t const &remote, const uint8_t *datagram, size_t size);
+    void ClosePeer(Peer &peer, bool notify);
+    void Handshake(Peer &peer, int64_t now);
+
+    static int SendRecord(void *context, const unsigned char *data, size_t length);
+    static int ReceiveRecord(void *context, unsigned char *data, size_t length);
+    static void SetTimer(void *context, uint32_t intermediateMs, uint32_t finalMs);
+    static int GetTimer(void *context);
+    static int GetCachedSession(void *context, mbedtls_ssl_session *session);
+    static int SetCachedSession(void *context, const mbedtls_ssl_session *session);
+};
+
+#endif // CONFIG_IOTNODE_COAP_DTLS
+
+#endif // _INTERFACES_DTLSSERVER_H_
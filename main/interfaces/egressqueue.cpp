@@ -0,0 +1,107 @@
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_EGRESS_QUEUE
+
+#include <cstring>
+
+#include "esp_log.h"
+
+#include "egressqueue.h"
+
+static const char *kTag = "CoAP-Egress";
+
+static const char *kClassNames[] = {
+    "queue.response",
+    "queue.notification",
+    "queue.multicast",
+};
+static_assert(sizeof(kClassNames) / sizeof(kClassNames[0]) == static_cast<int>(EgressClass::Count), "Every EgressClass needs a name");
+
+static LatencyHistogram _histograms[static_cast<int>(EgressClass::Count)];
+
+const char *EgressClassName(EgressClass egressClass)
+{
+    return kClassNames[static_cast<int>(egressClass)];
+}
+
+LatencyHistogram &EgressHistogram(EgressClass egressClass)
+{
+    return _histograms[static_cast<int>(egressClass)];
+}
+
+EgressQueue::EgressQueue()
+    : _lastMulticast(0)
+{
+    for (auto &ring : _rings)
+    {
+        ring.Head = 0;
+        ring.Count = 0;
+        ring.Sent = 0;
+        ring.Overflowed = 0;
+    }
+}
+
+bool EgressQueue::Push(EgressClass egressClass, NetEp_t const &remote, const uint8_t *data, size_t size, LatencyTrace const &trace, int64_t now)
+{
+    auto &ring = _rings[static_cast<int>(egressClass)];
+    if (size > kCoapEgressSlotSize || ring.Count == kCoapEgressDepth)
+    {
+        ring.Overflowed++;
+        ESP_LOGD(kTag, "No room for %d bytes in %s (%u sent, %u overflowed)",
+            static_cast<int>(size), EgressClassName(egressClass), ring.Sent, ring.Overflowed);
+        return false;
+    }
+
+    auto &datagram = ring.Slots[(ring.Head + ring.Count) % kCoapEgressDepth];
+    datagram.Ep = remote;
+    datagram.Queued = now;
+    datagram.Trace = trace;
+    datagram.Size = size;
+    memcpy(datagram.Data, data, size);
+    ring.Count++;
+    return true;
+}
+
+EgressQueue::Datagram *EgressQueue::Front(int64_t now, EgressClass &egressClass)
+{
+    // Most urgent class first, a class only goes once everything before it is out
+    for (int i = 0; i < static_cast<int>(EgressClass::Count); i++)
+    {
+        auto &ring = _rings[i];
+        if (ring.Count == 0)
+            continue;
+
+        if (static_cast<EgressClass>(i) == EgressClass::Multicast && now - _lastMulticast < kCoapEgressMulticastGapUs)
+            return nullptr;
+
+        egressClass = static_cast<EgressClass>(i);
+        return &ring.Slots[ring.Head];
+    }
+    return nullptr;
+}
+
+void EgressQueue::Pop(EgressClass egressClass, int64_t now)
+{
+    auto &ring = _rings[static_cast<int>(egressClass)];
+    auto &datagram = ring.Slots[ring.Head];
+    EgressHistogram(egressClass).Record(static_cast<uint32_t>(now - datagram.Queued));
+
+    ring.Head = (ring.Head + 1) % kCoapEgressDepth;
+    ring.Count--;
+    ring.Sent++;
+
+    if (egressClass == EgressClass::Multicast)
+        _lastMulticast = now;
+}
+
+bool EgressQueue::IsEmpty() const
+{
+    for (auto &ring : _rings)
+    {
+        if (ring.Count > 0)
+            return false;
+    }
+    return true;
+}
+
+#endif // CONFIG_IOTNODE_COAP_EGRESS_QUEUE
@@ -0,0 +1,82 @@
+#ifndef _INTERFACES_EGRESSQUEUE_H_
+#define _INTERFACES_EGRESSQUEUE_H_
+
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_EGRESS_QUEUE
+
+#include <cstddef>
+#include <cstdint>
+
+#include "latencytrace.h"
+
+extern "C" {
+    #include "liblobaro_coap.h"
+}
+
+static const int kCoapEgressDepth = CONFIG_IOTNODE_COAP_EGRESS_DEPTH;
+static const int kCoapEgressBurst = CONFIG_IOTNODE_COAP_EGRESS_BURST;
+static const int64_t kCoapEgressMulticastGapUs = CONFIG_IOTNODE_COAP_EGRESS_MULTICAST_GAP_MS * 1000;
+// Fits a 256 byte discovery block with its header and options, anything larger isn't queued
+static const size_t kCoapEgressSlotSize = 320;
+
+// Priority classes of the egress queue, most latency sensitive first
+enum class EgressClass : uint8_t
+{
+    Response,       // ACKs, resets and responses to unicast requests
+    Notification,   // Observe notifications
+    Multicast,      // Responses to multicast requests and discovery (link-format)
+    Count,
+};
+
+const char *EgressClassName(EgressClass egressClass);
+// Time datagrams of a class spent queued, served by the /latency resource
+LatencyHistogram &EgressHistogram(EgressClass egressClass);
+
+// Outgoing datagrams, one bounded FIFO per EgressClass. The network task queues what lobaro
+// sends during a pass and flushes it most latency sensitive class first, so a burst of
+// discovery responses can't hold up a switch notification. Multicast and discovery datagrams
+// are additionally paced kCoapEgressMulticastGapUs apart. The time every datagram spent queued
+// is recorded in its class' EgressHistogram.
+//
+// Only to be used from the network task.
+class EgressQueue
+{
+public:
+    struct Datagram
+    {
+        NetEp_t Ep;
+        int64_t Queued;
+        // Carries the notification's trace past the queue, see LatencyTrace
+        LatencyTrace Trace;
+        uint16_t Size;
+        uint8_t Data[kCoapEgressSlotSize];
+    };
+
+    EgressQueue();
+
+    // False if the datagram is too large for a slot or its class is full
+    bool Push(EgressClass egressClass, NetEp_t const &remote, const uint8_t *data, size_t size, LatencyTrace const &trace, int64_t now);
+
+    // The next datagram to send, or null if there is none or multicast is being paced
+    Datagram *Front(int64_t now, EgressClass &egressClass);
+    // Removes what Front returned once it was sent
+    void Pop(EgressClass egressClass, int64_t now);
+
+    bool IsEmpty() const;
+private:
+    struct Ring
+    {
+        Datagram Slots[kCoapEgressDepth];
+        int Head;
+        int Count;
+        uint32_t Sent;
+        uint32_t Overflowed;
+    };
+    Ring _rings[static_cast<int>(EgressClass::Count)];
+    int64_t _lastMulticast;
+};
+
+#endif // CONFIG_IOTNODE_COAP_EGRESS_QUEUE
+
+#endif // _INTERFACES_EGRESSQUEUE_H_
@@ -1,9 +1,12 @@
+#include <cstring>
 #include <iterator>
 #include <string>
 #include <new>
 #include "assert.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/timers.h"
+#include "esp_system.h"
+#include "esp_timer.h"
 
 #include "lwip/api.h"
 #include "lwip/netif.h"
@@ -17,6 +20,7 @@ extern "C" {
 }
 
 #include "lobarocoap.h"
+#include "taskconfig.h"
 
 #ifdef LOG_LOCAL_LEVEL
     #undef LOG_LOCAL_LEVEL
@@ -33,15 +37,29 @@ static const char* kCoapThreadName = "libcoap";
 
 static const uint16_t kCoapPort = 5683;
 static const uint16_t kCoapPortDtls = 5684;
-static const int kCoapDefaultTimeUSec = 0;
-static const int kCoapDefaultTimeSec = 5;
 static const int kCoapThreadStackSize = 10240;
 static const int kCoapThreadPriority = 8;
-static const int kNotifyQueueSize = 20;
+static const int kCoapMaxObserversPerResource = 32;
+static const uint32_t kCoapDiscoveryBlockSzx = 4; // 256 byte blocks
+static const uint16_t kNoContentFormat = 0xFFFF;
+static const int64_t kCoapExchangeLifetimeUs = 10 * 1000 * 1000;
+static const uint32_t kCoapMulticastLeisureUs = CONFIG_IOTNODE_COAP_MULTICAST_LEISURE_MS * 1000;
+static const int kCoapEndpointReadBudget = 4;
+
+#if CONFIG_IOTNODE_COAP_NOTIFY_NON
+static const int kCoapNotifyConfirmableEvery = CONFIG_IOTNODE_COAP_NOTIFY_CON_EVERY;
+static const uint32_t kCoapNotifyConfirmableIntervalMs = CONFIG_IOTNODE_COAP_NOTIFY_CON_INTERVAL * 1000;
+static const int kCoapNotifyMaxFailCount = CONFIG_IOTNODE_COAP_NOTIFY_MAX_FAILS;
+// MAX_TRANSMIT_WAIT (RFC 7252 section 4.8.2), lobaro is done with any notification sent before then
+static const uint32_t kCoapNotifyMaxTransmitWaitMs = 93 * 1000;
+#endif
 
 static uint8_t _coap_memory[kCoapMemorySize];
 static CoAP_Config_t _coap_config = {_coap_memory, kCoapMemorySize};
 
+// Woken by the sockets' receive callbacks
+static xTaskHandle _networkTask = nullptr;
+
 static uint32_t hal_rtc_1Hz_Cnt( void );
 static void hal_uart_puts( char *s );
 CoAP_API_t _coap_api = {&hal_rtc_1Hz_Cnt, &hal_uart_puts};
@@ -52,59 +70,476 @@ std::tuple<CoapOptionValue, CoapOptionType> const CoapOptiontypeMap[] =
     std::make_tuple(CoapOptionValue::UriHost,       CoapOptionType::String),
     std::make_tuple(CoapOptionValue::ETag,          CoapOptionType::Opaque),
     std::make_tuple(CoapOptionValue::IfNoneMatch,   CoapOptionType::Empty),
+    std::make_tuple(CoapOptionValue::Observe,       CoapOptionType::UInt),
     std::make_tuple(CoapOptionValue::UriPort,       CoapOptionType::UInt),
     std::make_tuple(CoapOptionValue::LocationPath,  CoapOptionType::String),
+    std::make_tuple(CoapOptionValue::Oscore,        CoapOptionType::Opaque),
     std::make_tuple(CoapOptionValue::UriPath,       CoapOptionType::String),
     std::make_tuple(CoapOptionValue::ContentFormat, CoapOptionType::UInt),
     std::make_tuple(CoapOptionValue::MaxAge,        CoapOptionType::UInt),
     std::make_tuple(CoapOptionValue::UriQuery,      CoapOptionType::String),
     std::make_tuple(CoapOptionValue::Accept,        CoapOptionType::UInt),
     std::make_tuple(CoapOptionValue::LocationQuery, CoapOptionType::String),
+    std::make_tuple(CoapOptionValue::Block2,        CoapOptionType::UInt),
+    std::make_tuple(CoapOptionValue::Block1,        CoapOptionType::UInt),
+    std::make_tuple(CoapOptionValue::Size2,         CoapOptionType::UInt),
     std::make_tuple(CoapOptionValue::ProxyUri,      CoapOptionType::String),
     std::make_tuple(CoapOptionValue::ProxyScheme,   CoapOptionType::String),
     std::make_tuple(CoapOptionValue::Size1,         CoapOptionType::UInt),
+    std::make_tuple(CoapOptionValue::Echo,          CoapOptionType::Opaque),
+    std::make_tuple(CoapOptionValue::NoResponse,    CoapOptionType::UInt),
 };
 
 std::vector<LobaroCoapResource*> LobaroCoapResource::_resources;
+std::string LobaroCoapResource::_linkFormat;
+std::atomic<bool> LobaroCoapResource::_linkFormatStale(true);
+LobaroCoap *LobaroCoapResource::_wellKnownCoap = nullptr;
 
 LobaroCoap::LobaroCoap()
+    : _task(nullptr), _context(nullptr), _networkReady(false), _networkLostTime(0), _networkReadyTime(0), _endpointCount(0), _transportCount(0)
 {
     CoAP_Init(_coap_api, _coap_config);
+    LobaroCoapResource::InstallWellKnownHandler(this);
+
+#if CONFIG_IOTNODE_COAP_OBSERVE_ATTRIBUTES
+    for (auto &state : _observers)
+        state.Observer = nullptr;
+    _observerPass = 0;
+#endif
+
+    for (auto &exchange : _exchanges)
+        exchange.Expires = 0;
+    for (auto &deferred : _deferred)
+        deferred.Size = 0;
+    _suppressedCount = 0;
+    _suppressedBytes = 0;
+
+#if CONFIG_IOTNODE_COAP_DTLS
+    _secure = false;
+    _secureContext = nullptr;
+#endif
+
+    AddEndpoint(EndpointKind::Plain, IPV4, kCoapPort);
+#if CONFIG_IOTNODE_COAP_IPV6
+    AddEndpoint(EndpointKind::Plain, IPV6, kCoapPort);
+#endif
+}
+
+void LobaroCoap::AddEndpoint(EndpointKind kind, NetInterfaceType_t netType, uint16_t port)
+{
+    assert(_endpointCount < kCoapMaxEndpoints);
+    auto &endpoint = _endpoints[_endpointCount++];
+    endpoint.Socket = nullptr;
+    endpoint.Kind = kind;
+    endpoint.NetType = netType;
+    endpoint.Port = port;
+}
+
+LobaroCoap::Endpoint *LobaroCoap::FindEndpoint(EndpointKind kind, NetInterfaceType_t netType)
+{
+    for (int i = 0; i < _endpointCount; i++)
+    {
+        auto &endpoint = _endpoints[i];
+        if (endpoint.Kind == kind && endpoint.NetType == netType && endpoint.Socket != nullptr)
+            return &endpoint;
+    }
+    return nullptr;
+}
+
+void LobaroCoap::Start(CoapOptions const &options, CoapResult &result)
+{
+    if (options.flags.useDTLS)
+    {
+#if CONFIG_IOTNODE_COAP_DTLS
+        // Parsing the key and seeding the DRBG is slow, get it done before the network task runs
+        _dtls.Setup(options.DTLS, &LobaroCoap::TransmitRecord, this, result);
+        if (result != CoapResult::OK)
+            return;
+        _secure = true;
+        AddEndpoint(EndpointKind::Secure, IPV4, kCoapPortDtls);
+#if CONFIG_IOTNODE_COAP_IPV6
+        AddEndpoint(EndpointKind::Secure, IPV6, kCoapPortDtls);
+#endif
+#else
+        ESP_LOGE(kTag, "DTLS requested but CONFIG_IOTNODE_COAP_DTLS is not enabled");
+        result = CoapResult::Error;
+        return;
+#endif
+    }
+
+    Start(result);
+}
+
+void LobaroCoap::AddTransport(ICoapInterface *transport, CoapResult &result)
+{
+    if (_transportCount == kCoapMaxTransports || !LobaroCoapResource::_resources.empty())
+    {
+        ESP_LOGE(kTag, "LobaroCoap::AddTransport: too many transports, or resources already created");
+        result = CoapResult::Error;
+        return;
+    }
 
-    _notifyQueue = xQueueCreate(kNotifyQueueSize, sizeof(ICoapResource*));
+    _transports[_transportCount++] = transport;
+    result = CoapResult::OK;
 }
 
 void LobaroCoap::Start(CoapResult &result)
 {
-    int ret = xTaskCreate(
+#if CONFIG_IOTNODE_COAP_CLIENT
+    _client.Setup(&LobaroCoap::TransmitRequest, this);
+#endif
+
+#if CONFIG_IOTNODE_COAP_PROXY
+    _proxy.Setup(&_client, &LobaroCoap::TransmitRequest, this);
+#endif
+
+#if CONFIG_IOTNODE_COAP_RD
+    // Without a usable directory address the server still runs, just unregistered
+    CoapResult directoryResult;
+    _directory.Setup(&_client, &LobaroCoap::CurrentLinkFormat, directoryResult);
+#endif
+
+#if CONFIG_IOTNODE_COAP_WORKER_POOL
+    _workerPool.Start(result);
+    if (result != CoapResult::OK)
+        return;
+#endif
+
+    int ret = xTaskCreatePinnedToCore(
         &LobaroCoap::TaskHandle,
         kCoapThreadName,
         kCoapThreadStackSize,
         this,
         kCoapThreadPriority,
-        &this->_task
+        &this->_task,
+        kNetworkCore
     );
 
     result = ret ? CoapResult::OK : CoapResult::Error;
 
     if (ret != true)
+    {
         ESP_LOGE( kTag, "Failed to create thread %s", kCoapThreadName );
+        return;
+    }
+
+    for (int i = 0; i < _transportCount && result == CoapResult::OK; i++)
+        _transports[i]->Start(result);
 }
 
 void LobaroCoap::SetNetworkReady(bool ready)
 {
-    // TODO: Do we notify our task?
+    if (ready == this->_networkReady)
+        return;
+
+    if (ready)
+        this->_networkReadyTime = esp_timer_get_time();
+    else if (this->_networkLostTime == 0)
+        this->_networkLostTime = esp_timer_get_time();
+
     this->_networkReady = ready;
+
+    if (_task != nullptr)
+        xTaskNotifyGive(_task);
+
+    for (int i = 0; i < _transportCount; i++)
+        _transports[i]->SetNetworkReady(ready);
+}
+
+bool LobaroCoap::TrackExchange(CoapPacket const &request, NetEp_t const &remote, bool multicast)
+{
+    auto suppress = CoapDefaultNoResponse(multicast);
+
+#if CONFIG_IOTNODE_COAP_NO_RESPONSE
+    CoapResult result;
+    const uint8_t *value;
+    size_t length;
+    request.GetOption(CoapOptionValue::NoResponse, value, length, result);
+    // An explicit No-Response wins over the multicast defaults, empty means every response is wanted
+    if (result == CoapResult::OK)
+        suppress = static_cast<uint8_t>(CoapDecodeUInt(value, length));
+#endif
+
+    if (suppress == 0 && !multicast)
+        return false;
+
+    // Reuse an expired slot, or give up on the exchange that expires first
+    auto now = esp_timer_get_time();
+    auto slot = &_exchanges[0];
+    for (auto &exchange : _exchanges)
+    {
+        if (exchange.Expires < slot->Expires)
+            slot = &exchange;
+        if (exchange.Expires <= now)
+            break;
+    }
+
+    slot->Ep = remote;
+    slot->MessageId = request.GetMessageId();
+    slot->Suppress = suppress;
+    slot->Multicast = multicast;
+    slot->TokenLength = request.GetTokenLength();
+    memcpy(slot->Token, request.GetToken(), slot->TokenLength);
+    // Long enough to catch a separate response and its retransmissions
+    slot->Expires = now + kCoapExchangeLifetimeUs;
+    return true;
+}
+
+LobaroCoap::TrackedExchange *LobaroCoap::MatchExchange(CoAP_Message_t const *request)
+{
+    // Lobaro doesn't tell handlers where a request came from, so the exchange is matched on
+    // message ID and token. Should requests from two endpoints match, the handler can't know
+    // which one it has and treats it as unicast. FilterResponse still matches the response
+    // with its endpoint before anything is suppressed.
+    auto now = esp_timer_get_time();
+    TrackedExchange *match = nullptr;
+    for (auto &exchange : _exchanges)
+    {
+        if (exchange.Expires <= now || exchange.MessageId != request->MessageID
+            || exchange.TokenLength != request->Token.Length || memcmp(exchange.Token, request->Token.Token, exchange.TokenLength) != 0)
+            continue;
+
+        if (match != nullptr && !EpAreEqual(&match->Ep, &exchange.Ep))
+            return nullptr;
+        match = &exchange;
+    }
+    return match;
+}
+
+bool LobaroCoap::IsMulticastExchange(CoAP_Message_t const *request)
+{
+    auto exchange = MatchExchange(request);
+    return exchange != nullptr && exchange->Multicast;
+}
+
+bool LobaroCoap::SuppressMulticastResponse(CoAP_Message_t const *request)
+{
+    // FilterResponse drops whatever lobaro sends for it, as if the client had asked so with No-Response
+    auto exchange = MatchExchange(request);
+    if (exchange == nullptr || !exchange->Multicast)
+        return false;
+    exchange->Suppress = SuppressSuccess | SuppressClientError | SuppressServerError;
+    return true;
+}
+
+bool LobaroCoap::FilterResponse(NetPacket_t *packet)
+{
+    CoapResult result;
+    CoapPacket response(packet->pData, packet->size);
+    response.Parse(result);
+    if (result != CoapResult::OK || !response.IsResponse())
+        return false;
+
+    auto exchange = FindExchange(response, packet->remoteEp, esp_timer_get_time());
+    if (exchange == nullptr)
+        return false;
+
+    // A piggybacked response ends the exchange
+    auto piggybacked = response.GetType() == CoapMessageType::Acknowledgement;
+    if (piggybacked)
+        exchange->Expires = 0;
+
+    if (!IsNoResponseSuppressed(exchange->Suppress, response.GetCodeClass()))
+        return !piggybacked && exchange->Multicast && DeferResponse(packet);
+
+    auto saved = packet->size;
+    // The request still has to be acknowledged, shrink the response to an empty ACK in place
+    if (piggybacked)
+        packet->size = CoapPacket::WriteEmpty(packet->pData, CoapMessageType::Acknowledgement, exchange->MessageId);
+    saved -= packet->size;
+
+    _suppressedCount++;
+    _suppressedBytes += saved;
+    ESP_LOGD(kTag, "Suppressed %d.%02d response, saved %d bytes (%u responses, %u bytes total)",
+        response.GetCodeClass(), response.GetCode() & 0x1F, saved, _suppressedCount, _suppressedBytes);
+
+    return !piggybacked;
+}
+
+LobaroCoap::TrackedExchange *LobaroCoap::FindExchange(CoapPacket const &response, NetEp_t const &remote, int64_t now)
+{
+    for (auto &exchange : _exchanges)
+    {
+        if (exchange.Expires <= now || !EpAreEqual(&exchange.Ep, &remote))
+            continue;
+
+        auto piggybacked = response.GetType() == CoapMessageType::Acknowledgement;
+        if (piggybacked
+            ? response.GetMessageId() != exchange.MessageId
+            : response.GetTokenLength() != exchange.TokenLength || memcmp(response.GetToken(), exchange.Token, exchange.TokenLength) != 0)
+            continue;
+
+        return &exchange;
+    }
+    return nullptr;
+}
+
+bool LobaroCoap::DeferResponse(NetPacket_t *packet)
+{
+    if (kCoapMulticastLeisureUs == 0 || packet->size > kCoapDeferredSize)
+        return false;
+
+    for (auto &deferred : _deferred)
+    {
+        if (deferred.Size != 0)
+            continue;
+
+        // Spread the replies of every node in the group over the leisure period (RFC 7252 section 8.2)
+        deferred.Ep = packet->remoteEp;
+        deferred.SendAt = esp_timer_get_time() + esp_random() % (kCoapMulticastLeisureUs + 1);
+        deferred.Size = packet->size;
+        memcpy(deferred.Data, packet->pData, packet->size);
+        ESP_LOGD(kTag, "Deferring multicast response by %d ms", static_cast<int>((deferred.SendAt - esp_timer_get_time()) / 1000));
+        return true;
+    }
+
+    // No room to hold it back, send it right away
+    return false;
+}
+
+void LobaroCoap::SendDeferred(int64_t now)
+{
+    for (auto &deferred : _deferred)
+    {
+        if (deferred.Size == 0 || deferred.SendAt > now)
+            continue;
+
+        NetPacket_t packet;
+        packet.pData = deferred.Data;
+        packet.size = deferred.Size;
+        packet.remoteEp = deferred.Ep;
+        packet.metaInfo.Type = META_INFO_NONE;
+#if CONFIG_IOTNODE_COAP_EGRESS_QUEUE
+        if (!Enqueue(EgressClass::Multicast, &packet))
+#endif
+        Transmit(&packet);
+        deferred.Size = 0;
+    }
 }
 
 bool LobaroCoap::SendDatagram(NetPacket_t *packet)
+{
+    // Pretend a suppressed or deferred response went out. Lobaro keeps retransmitting a separate
+    // CON response until the exchange is forgotten, those get dropped here too.
+#if CONFIG_IOTNODE_COAP_EGRESS_QUEUE
+    // Before FilterResponse, which ends the exchange of a piggybacked response
+    auto egressClass = Classify(packet);
+#endif
+
+    if (FilterResponse(packet))
+        return true;
+
+#if CONFIG_IOTNODE_COAP_EGRESS_QUEUE
+    if (Enqueue(egressClass, packet))
+        return true;
+#endif
+
+    return Transmit(packet);
+}
+
+#if CONFIG_IOTNODE_COAP_EGRESS_QUEUE
+EgressClass LobaroCoap::Classify(NetPacket_t const *packet)
+{
+    CoapResult result;
+    CoapPacket message(packet->pData, packet->size);
+    message.Parse(result);
+    // Empty ACKs and resets are as urgent as it gets
+    if (result != CoapResult::OK || !message.IsResponse())
+        return EgressClass::Response;
+
+    auto exchange = FindExchange(message, packet->remoteEp, esp_timer_get_time());
+    if (exchange != nullptr && exchange->Multicast)
+        return EgressClass::Multicast;
+
+    const uint8_t *value;
+    size_t length;
+    message.GetOption(CoapOptionValue::ContentFormat, value, length, result);
+    if (result == CoapResult::OK && CoapDecodeUInt(value, length) == CoapContentType::LinkFormat)
+        return EgressClass::Multicast;
+
+    // The response to the registration is piggybacked, every later notification is sent on its own
+    message.GetOption(CoapOptionValue::Observe, value, length, result);
+    if (result == CoapResult::OK && message.GetType() != CoapMessageType::Acknowledgement)
+        return EgressClass::Notification;
+
+    return EgressClass::Response;
+}
+
+bool LobaroCoap::Enqueue(EgressClass egressClass, NetPacket_t *packet)
+{
+    if (_egress.Push(egressClass, packet->remoteEp, packet->pData, packet->size, _sendTrace, esp_timer_get_time()))
+    {
+        _sendTrace = LatencyTrace();
+        return true;
+    }
+
+    // Multicast answers are best effort (RFC 7252 section 8.2), rather lose one than send it
+    // ahead of its pacing. Anything else goes out right away instead.
+    return egressClass == EgressClass::Multicast;
+}
+
+bool LobaroCoap::FlushEgress(int64_t now)
+{
+    // Hand the stack a bounded burst per pass, the Wi-Fi driver only buffers so many frames
+    for (int sent = 0; sent < kCoapEgressBurst; sent++)
+    {
+        EgressClass egressClass;
+        auto datagram = _egress.Front(now, egressClass);
+        if (datagram == nullptr)
+            return false;
+
+        NetPacket_t packet;
+        packet.pData = datagram->Data;
+        packet.size = datagram->Size;
+        packet.remoteEp = datagram->Ep;
+        packet.metaInfo.Type = META_INFO_NONE;
+        _sendTrace = datagram->Trace;
+        Transmit(&packet);
+        _sendTrace = LatencyTrace();
+
+        _egress.Pop(egressClass, now);
+    }
+    EgressClass egressClass;
+    return _egress.Front(now, egressClass) != nullptr;
+}
+#endif
+
+bool LobaroCoap::Transmit(NetPacket_t *packet)
+{
+    if (this->_context == nullptr)
+    {
+        ESP_LOGE( kTag, "send_datagram( ... ): InterfaceID not found");
+        return false;
+    }
+
+    uint8_t *data = packet->pData;
+    size_t size = packet->size;
+#if CONFIG_IOTNODE_COAP_OSCORE
+    // Responses to protected requests, including deferred ones, are protected on the way out
+    CoapResult result;
+    _oscore.Protect(packet->remoteEp, data, size, result);
+    if (result != CoapResult::OK)
+        return false;
+#endif
+
+    if (!SendTo(EndpointKind::Plain, packet->remoteEp, data, size))
+        return false;
+
+    this->_sendTrace.Mark(TraceStage::Send);
+    this->_sendTrace = LatencyTrace();
+    return true;
+}
+
+bool LobaroCoap::SendTo(EndpointKind kind, NetEp_t const &remote, const uint8_t *data, size_t length)
 {
     auto success = false;
     ip_addr_t client_address = IPADDR4_INIT(0);
 
-    if (NETCONNTYPE_GROUP(this->_socket->type) != NETCONN_UDP)
+    // Replies leave through the endpoint of the same kind and address family they came in on
+    auto endpoint = FindEndpoint(kind, remote.NetType);
+    if (endpoint == nullptr)
     {
-        ESP_LOGE( kTag, "Socket handle is not a datagram type" );
+        ESP_LOGE( kTag, "send_datagram( ... ): No endpoint for NetType %d", static_cast<int>(remote.NetType));
         return false;
     }
 
@@ -112,28 +547,19 @@ bool LobaroCoap::SendDatagram(NetPacket_t *packet)
 
     do
     {
-        ESP_LOGD(kTag, "LobaroCoap::SendDatagram: Attempting to send %d bytes", packet->size);
-        if( netbuf_ref( buffer, packet->pData, packet->size ) != ERR_OK)
+        ESP_LOGD(kTag, "LobaroCoap::SendDatagram: Attempting to send %d bytes", static_cast<int>(length));
+        if( netbuf_ref( buffer, data, length ) != ERR_OK)
         {
             ESP_LOGE( kTag, "netbuf_ref( ... ): failed");
             break;
         }
 
-        if (packet->remoteEp.NetType != IPV4)
-        {
-            ESP_LOGE( kTag, "send_datagram( ... ): Wrong NetType");
-            break;
-        }
-
-        if (this->_context == nullptr)
-        {
-            ESP_LOGE( kTag, "send_datagram( ... ): InterfaceID not found");
-            break;
-        }
-
-        ip_2_ip4(&client_address)->addr = packet->remoteEp.NetAddr.IPv4.u32[0];
+        if (remote.NetType == IPV6)
+            IP_ADDR6(&client_address, remote.NetAddr.IPv6.u32[0], remote.NetAddr.IPv6.u32[1], remote.NetAddr.IPv6.u32[2], remote.NetAddr.IPv6.u32[3]);
+        else
+            ip_2_ip4(&client_address)->addr = remote.NetAddr.IPv4.u32[0];
 
-        err_t send_result = netconn_sendto(this->_socket, buffer, &client_address, packet->remoteEp.NetPort);
+        err_t send_result = netconn_sendto(endpoint->Socket, buffer, &client_address, remote.NetPort);
         if (send_result != ERR_OK)
         {
             ESP_LOGE(kTag, "netconn_sendto returned %d; Internal Socket Error", send_result);
@@ -147,51 +573,148 @@ bool LobaroCoap::SendDatagram(NetPacket_t *packet)
     return success;
 }
 
-void LobaroCoap::ReadDatagram()
+#if CONFIG_IOTNODE_COAP_RATE_LIMIT
+bool LobaroCoap::AdmitRequest(EndpointKind kind, CoapPacket const &request, NetEp_t const &remote, bool multicast)
 {
-    NetPacket_t  packet;
-    struct netbuf *buffer = nullptr;
+    uint32_t retryAfter;
+    auto verdict = _rateLimiter.Admit(remote, esp_timer_get_time(), retryAfter);
+    if (verdict == RateLimiter::Verdict::Admit)
+        return true;
+
+#if CONFIG_IOTNODE_COAP_RATE_LIMIT_REPLY
+    // Only confirmable requests are answered, the client would otherwise keep retransmitting.
+    // Never answer a multicast request with an error (RFC 7252 section 8.2).
+    if (verdict == RateLimiter::Verdict::Reject && !multicast && request.GetType() == CoapMessageType::Confirmable)
+    {
+        uint8_t reply[kCoapHeaderSize + kCoapMaxTokenLength + 8];
+        auto size = RateLimiter::WriteRejection(reply, sizeof(reply), request, retryAfter);
+        if (size == 0)
+            return false;
 
-    if (netconn_recv(this->_socket,  &buffer) != ERR_OK)
-        return;
+#if CONFIG_IOTNODE_COAP_DTLS
+        if (kind == EndpointKind::Secure)
+        {
+            CoapResult result;
+            _dtls.Send(remote, reply, size, result);
+            return false;
+        }
+#endif
+        SendTo(kind, remote, reply, size);
+    }
+#endif
+    return false;
+}
+#endif
+
+#if CONFIG_IOTNODE_COAP_CLIENT
+void LobaroCoap::SendRequest(NetEp_t const &remote, BufferedCoapMessage const &request, CoapResponseHandler handler, void *context, CoapResult &result)
+{
+    _client.Submit(remote, request, handler, context, result);
+    if (result == CoapResult::OK && _task != nullptr)
+        xTaskNotifyGive(_task);
+}
+
+bool LobaroCoap::TransmitRequest(void *context, NetEp_t const &remote, const uint8_t *data, size_t length)
+{
+    auto instance = static_cast<LobaroCoap *>(context);
+    return instance->SendTo(EndpointKind::Plain, remote, data, length);
+}
+#endif
+
+#if CONFIG_IOTNODE_COAP_RD
+std::string const &LobaroCoap::CurrentLinkFormat()
+{
+    if (LobaroCoapResource::_linkFormatStale)
+        LobaroCoapResource::BuildLinkFormat();
+    return LobaroCoapResource::_linkFormat;
+}
+#endif
+
+void LobaroCoap::GetRemoteEp(struct netbuf const *buffer, NetEp_t &remote)
+{
+    remote.NetPort = buffer->port;
 
-    if (NETCONNTYPE_GROUP( this->_socket->type ) != NETCONN_UDP)
+    if( buffer->addr.type == IPADDR_TYPE_V6 )
     {
-        ESP_LOGE( kTag, "Socket handle is not a datagram type" );
-        return;
+        remote.NetType = IPV6;
+        remote.NetAddr.IPv6.u32[0] = ip_2_ip6( &buffer->addr )->addr[0];
+        remote.NetAddr.IPv6.u32[1] = ip_2_ip6( &buffer->addr )->addr[1];
+        remote.NetAddr.IPv6.u32[2] = ip_2_ip6( &buffer->addr )->addr[2];
+        remote.NetAddr.IPv6.u32[3] = ip_2_ip6( &buffer->addr )->addr[3];
+    }
+    else
+    {
+        remote.NetType = IPV4;
+        remote.NetAddr.IPv4.u32[0] = ip_addr_get_ip4_u32( &buffer->addr );
+    }
+}
+
+void LobaroCoap::SocketEvent(struct netconn *socket, enum netconn_evt event, uint16_t length)
+{
+    // Runs on the lwIP thread. Every endpoint shares the network task's notification, so a
+    // datagram on any of them wakes it without polling the others.
+    if (event == NETCONN_EVT_RCVPLUS && _networkTask != nullptr)
+        xTaskNotifyGive(_networkTask);
+}
+
+bool LobaroCoap::ReadEndpoints()
+{
+    // Reads never block and each endpoint gets a bounded share of a pass, so a busy socket
+    // delays neither the others nor lobaro's timers. Anything left over is read on the next pass.
+    auto backlog = false;
+    for (int i = 0; i < _endpointCount; i++)
+    {
+        auto &endpoint = _endpoints[i];
+        if (endpoint.Socket == nullptr)
+            continue;
+
+        int reads = 0;
+        while (reads < kCoapEndpointReadBudget && ReadEndpoint(endpoint))
+            reads++;
+        backlog |= reads == kCoapEndpointReadBudget;
+    }
+    return backlog;
+}
+
+bool LobaroCoap::ReadEndpoint(Endpoint &endpoint)
+{
+    struct netbuf *buffer = nullptr;
+    if (netconn_recv(endpoint.Socket, &buffer) != ERR_OK)
+        return false;
+
+#if CONFIG_IOTNODE_COAP_DTLS
+    if (endpoint.Kind == EndpointKind::Secure)
+    {
+        ReadSecureDatagram(buffer);
+        return true;
     }
+#endif
+    ReadDatagram(endpoint, buffer);
+    return true;
+}
+
+void LobaroCoap::ReadDatagram(Endpoint const &endpoint, struct netbuf *buffer)
+{
+    NetPacket_t  packet;
 
     if(this->_context == NULL){
         ESP_LOGE( kTag, "Socket handle not associated with any Lobaro CoAP interfaces" );
+        netbuf_delete(buffer);
         return;
     }
 
     netbuf_data( buffer, (void**) &packet.pData, &packet.size );
-    packet.remoteEp.NetPort = buffer->port;
+    GetRemoteEp(buffer, packet.remoteEp);
     packet.metaInfo.Type = META_INFO_NONE;
 
-    if( buffer->addr.type == IPADDR_TYPE_V4 )
-    {
-        packet.remoteEp.NetType = IPV4;
-        packet.remoteEp.NetAddr.IPv4.u32[0] = ip_addr_get_ip4_u32( &buffer->addr );
-
+    if( packet.remoteEp.NetType == IPV4 )
         ESP_LOGI( kTag, "Received %d Bytes from %s:%hu", packet.size, ipaddr_ntoa( &buffer->addr ), buffer->port );
-    }
-    else if( buffer->addr.type == IPADDR_TYPE_V6 )
-    {
-        packet.remoteEp.NetType = IPV6;
-        packet.remoteEp.NetAddr.IPv6.u32[0] = ip_2_ip6( &buffer->addr )->addr[0];
-        packet.remoteEp.NetAddr.IPv6.u32[1] = ip_2_ip6( &buffer->addr )->addr[1];
-        packet.remoteEp.NetAddr.IPv6.u32[2] = ip_2_ip6( &buffer->addr )->addr[2];
-        packet.remoteEp.NetAddr.IPv6.u32[3] = ip_2_ip6( &buffer->addr )->addr[3];
-
+    else
         ESP_LOGI( kTag, "Received %d Bytes from [%s]:%hu", packet.size, ipaddr_ntoa( &buffer->addr ), buffer->port );
-    }
 
 #if LWIP_NETBUF_RECVINFO
     NetEp_t Sender;
-    ip_addr_t local_addr; // Don't really care about this address. just wanting the port number
-    netconn_getaddr(this->_socket, &local_addr, &Sender.NetPort, 1);
+    Sender.NetPort = endpoint.Port;
 
     if( buffer->toaddr.type == IPADDR_TYPE_V4 )
     {
@@ -200,7 +723,7 @@ void LobaroCoap::ReadDatagram()
 
         ESP_LOGI( kTag, "Packet sent to %s:%hu", ipaddr_ntoa( &buffer->toaddr ), Sender.NetPort );
     }
-    else if( buffer->addr.type == IPADDR_TYPE_V6 )
+    else if( buffer->toaddr.type == IPADDR_TYPE_V6 )
     {
         Sender.NetType = IPV6;
         Sender.NetAddr.IPv6.u32[0] = ip_2_ip6( &buffer->toaddr )->addr[0];
@@ -219,11 +742,78 @@ void LobaroCoap::ReadDatagram()
 #endif /* LWIP_NETBUF_RECVINFO */
 
 
+#if CONFIG_IOTNODE_COAP_RATE_LIMIT
+    // Ahead of OSCORE, so a flood doesn't cost a decryption per datagram
+    {
+        CoapResult result;
+        CoapPacket request(packet.pData, packet.size);
+        request.Parse(result);
+        if (result == CoapResult::OK && request.IsRequest()
+            && !AdmitRequest(endpoint.Kind, request, packet.remoteEp, packet.metaInfo.Type == META_INFO_MULTICAST))
+        {
+            netbuf_delete(buffer);
+            return;
+        }
+    }
+#endif
+
+#if CONFIG_IOTNODE_COAP_OSCORE
+    // Protected requests are verified and decrypted before anything else looks at them
+    {
+        uint8_t *data = packet.pData;
+        size_t size = packet.size;
+        bool reply;
+        CoapResult result;
+        _oscore.Unprotect(packet.remoteEp, data, size, reply, result);
+        packet.pData = data;
+        packet.size = size;
+
+        if (result != CoapResult::OK || reply)
+        {
+            if (reply)
+                Transmit(&packet);
+            netbuf_delete(buffer);
+            return;
+        }
+    }
+#endif
+
     //call the consumer of this socket
     //the packet is only valid during runtime of consuming function!
     //-> so it has to copy relevant data if needed
     // or parse it to a higher level and store this result!
+    CoapResult parseResult;
+    CoapPacket request(packet.pData, packet.size);
+    request.Parse(parseResult);
+
+#if CONFIG_IOTNODE_COAP_CLIENT
+    // Replies to our own requests are consumed by the client, lobaro would reset them
+    if (parseResult == CoapResult::OK && !request.IsRequest() && _client.Receive(packet.remoteEp, request, esp_timer_get_time()))
+    {
+        netbuf_delete(buffer);
+        return;
+    }
+#endif
+
+#if CONFIG_IOTNODE_COAP_PROXY
+    // Proxy requests never reach lobaro, they are answered from the cache or forwarded
+    if (parseResult == CoapResult::OK && request.IsRequest() && packet.metaInfo.Type != META_INFO_MULTICAST
+        && _proxy.Receive(packet.remoteEp, request, esp_timer_get_time()))
+    {
+        netbuf_delete(buffer);
+        return;
+    }
+#endif
+
+    auto tracked = parseResult == CoapResult::OK && request.IsRequest()
+        && TrackExchange(request, packet.remoteEp, packet.metaInfo.Type == META_INFO_MULTICAST);
+    auto handleStart = esp_timer_get_time();
+
     CoAP_HandleIncomingPacket(this->_context->Handle, &packet);
+
+    if (tracked)
+        ESP_LOGD(kTag, "Tracked request handled in %d us", static_cast<int>(esp_timer_get_time() - handleStart));
+
     netbuf_delete(buffer);
 
     return;
@@ -274,8 +864,21 @@ CoAP_HandlerResult_t LobaroCoapResource::ResourceNotifier(CoAP_Observer_t *obser
     LobaroCoapObserver wrappedObserver(observer);
     LobaroCoapMessage wrappedResponse(response);
     resource->applicationResource->HandleNotify(&wrappedObserver, &wrappedResponse, result);// TODO: pass along these parameters (request, response);
-    return result == CoapResult::OK       ? HANDLER_OK :
-	       result == CoapResult::Postpone ? HANDLER_POSTPONE :
+
+#if CONFIG_IOTNODE_COAP_OBSERVE_ATTRIBUTES
+    response->Type = resource->_coap->GetNotificationType(observer);
+#endif
+
+    // Lobaro sends the notification right after building it, hand the trace over to SendDatagram.
+    // Only the first observer's notification is traced, the others didn't wait on the change.
+    if (resource->_trace.IsActive())
+    {
+        resource->_coap->_sendTrace = resource->_trace;
+        resource->_coap->_sendTrace.Mark(TraceStage::Serialize);
+        resource->_trace = LatencyTrace();
+    }
+    return result == CoapResult::OK       ? HANDLER_OK :
+	       result == CoapResult::Postpone ? HANDLER_POSTPONE :
 	                                        HANDLER_ERROR;
 }
 
@@ -304,20 +907,115 @@ CoAP_HandlerResult_t LobaroCoapResource::ResourceHandler(CoAP_Message_t *request
         return HANDLER_ERROR;
     }
 
+#if CONFIG_IOTNODE_COAP_WORKER_POOL
+    return resource->_coap->DispatchToWorker(resource, request, response);
+#else
     CoapResult result;
-    LobaroCoapMessage wrappedRequest(request), wrappedResponse(response);
-    resource->applicationResource->HandleRequest(&wrappedRequest, &wrappedResponse, result);// TODO: pass along these parameters (request, response);
+#if CONFIG_IOTNODE_COAP_STATIC_DISPATCH
+    if (resource->_dispatch != nullptr)
+        result = resource->_dispatch(resource->applicationResource, request, response, resource->_coap->IsMulticastExchange(request));
+    else
+#endif
+    {
+        LobaroCoapMessage wrappedRequest(request, resource->_coap->IsMulticastExchange(request)), wrappedResponse(response);
+        resource->applicationResource->HandleRequest(&wrappedRequest, &wrappedResponse, result);// TODO: pass along these parameters (request, response);
+    }
     return result == CoapResult::OK       ? HANDLER_OK :
 	       result == CoapResult::Postpone ? HANDLER_POSTPONE :
 	                                        HANDLER_ERROR;
+#endif
+}
+
+#if CONFIG_IOTNODE_COAP_WORKER_POOL
+CoAP_HandlerResult_t LobaroCoap::DispatchToWorker(LobaroCoapResource *resource, CoAP_Message_t *request, CoAP_Message_t *response)
+{
+    CoapResult result;
+    // Lobaro calls a postponed handler again with the same request until it stops returning
+    // HANDLER_POSTPONE. Its address says nothing, lobaro reuses it once the interaction is gone.
+    auto now = esp_timer_get_time();
+    auto job = _workerPool.Find(resource->applicationResource, request->MessageID, request->Token.Token, request->Token.Length, now);
+    if (job == nullptr)
+    {
+        job = _workerPool.Acquire(resource->applicationResource, request->MessageID, request->Token.Token, request->Token.Length, now);
+        if (job == nullptr)
+        {
+            ESP_LOGW(kTag, "LobaroCoap::DispatchToWorker: all workers are busy");
+            LobaroCoapMessage wrappedResponse(response);
+            CoapUIntOption maxAge(CoapOptionValue::MaxAge, 1);
+            wrappedResponse.SetOption(&maxAge, result);
+            wrappedResponse.SetCode(CoapMessageCode::ServiceUnavailable, result);
+            return HANDLER_OK;
+        }
+
+        job->Request.SetCode(static_cast<CoapMessageCode>(request->Code), result);
+        job->Request.SetType(static_cast<CoapMessageType>(request->Type), result);
+        job->Request.SetMulticast(IsMulticastExchange(request));
+        for (auto opt = request->pOptionsList; opt != nullptr; opt = opt->next)
+            job->Request.AddRawOption(opt->Number, opt->Value, opt->Length);
+        if (request->Payload != nullptr)
+            job->Request.SetPayload(Payload(request->Payload, request->PayloadLength), result);
+
+        _workerPool.Dispatch(job, resource->_index);
+        return HANDLER_POSTPONE;
+    }
+
+    if (job->State.load(std::memory_order_acquire) != CoapWorkerPool::JobState::Done)
+        return HANDLER_POSTPONE;
+
+    if (job->Result == CoapResult::Postpone)
+    {
+        // The handler wants to be called again, give it another turn on its worker
+        job->Response.Clear();
+        _workerPool.Dispatch(job, resource->_index);
+        return HANDLER_POSTPONE;
+    }
+
+    response->Code = static_cast<CoAP_MessageCode_t>(job->Response.GetCode());
+    for (auto &option : job->Response.GetOptions())
+    {
+        CoAP_option_t opt;
+        opt.Number = option.Number;
+        opt.Length = option.Value.length();
+        opt.Value = (uint8_t*)option.Value.data();
+        CoAP_CopyOptionToList(&response->pOptionsList, &opt);
+    }
+    if (job->Response.HasPayload())
+        CoAP_SetPayload(response, (uint8_t *)job->Response.GetPayload().data(), (uint16_t)job->Response.GetPayload().length(), true);
+
+    result = job->Result;
+    _workerPool.Release(job);
+    return result == CoapResult::OK ? HANDLER_OK : HANDLER_ERROR;
 }
+#endif
+
 void LobaroCoap::CreateResource(CoapResource &resource, IApplicationResource * const applicationResource, const char* uri, CoapResult &result)
 {
-    new (resource.get()) LobaroCoapResource(this, applicationResource, uri, result);
+    // The network task and the transports' tasks walk the resource lists without a lock
+    if (_task != nullptr)
+    {
+        ESP_LOGE(kTag, "LobaroCoap::CreateResource: resources must be created before Start");
+        result = CoapResult::Error;
+        return;
+    }
+
+    auto created = new (resource.get()) LobaroCoapResource(this, applicationResource, uri, result);
 
     if (result != CoapResult::OK)
     {
         ESP_LOGE(kTag, "LobaroCoap::CreateResource resource creation failed");
+        return;
+    }
+
+    // Mirrors are created once at startup and live as long as the resource
+    for (int i = 0; i < _transportCount; i++)
+    {
+        CoapResult mirrorResult;
+        auto mirror = new CoapResource;
+        _transports[i]->CreateResource(*mirror, applicationResource, uri, mirrorResult);
+        if (mirrorResult == CoapResult::OK)
+            created->_mirrors[i] = mirror;
+        else
+            delete mirror;
     }
 }
 
@@ -326,81 +1024,604 @@ LobaroCoapResource::LobaroCoapResource(LobaroCoap * const coap, IApplicationReso
 {
     assert(sizeof(*this) <= CoapConstraints::MaxResourceSize);
 
-    CoAP_ResOpts_t resourceOptions =
-    {
-        (int)CoapContentType::TextPlain,
-	    RES_OPT_GET | RES_OPT_PUT | RES_OPT_POST | RES_OPT_DELETE,
-        0,
-    };
+    CoAP_ResOpts_t resourceOptions =
+    {
+        (int)CoapContentType::TextPlain,
+	    RES_OPT_GET | RES_OPT_PUT | RES_OPT_POST | RES_OPT_DELETE,
+        0,
+    };
+
+    this->_resource = CoAP_CreateResource((char *)uri, "", resourceOptions, &LobaroCoapResource::ResourceHandler, nullptr);
+
+    if (this->_resource == nullptr)
+    {
+        ESP_LOGE(kTag, "CoAP_CreateResource returned null");
+        result = CoapResult::Error;
+        return;
+    }
+
+    // CoAP_CreateResource errors when AllowedMethods is 0, but 🤷‍
+    this->_resource->Options.AllowedMethods = 0;
+
+    _index = _resources.size();
+    _changed = false;
+    _composite = nullptr;
+    for (auto &mirror : _mirrors)
+        mirror = nullptr;
+    _resourceType = nullptr;
+    _interface = nullptr;
+#if CONFIG_IOTNODE_COAP_STATIC_DISPATCH
+    _dispatch = nullptr;
+#endif
+    for (auto &format : _contentFormats)
+        format = kNoContentFormat;
+    _resources.push_back(this);
+    _linkFormatStale = true;
+
+    result = CoapResult::OK;
+}
+
+void LobaroCoapResource::SetAttributes(const char *resourceType, const char *interface, std::initializer_list<CoapContentType> contentFormats, CoapResult &result)
+{
+    if (contentFormats.size() > kMaxContentFormats)
+    {
+        ESP_LOGE(kTag, "LobaroCoapResource::SetAttributes: too many content formats");
+        result = CoapResult::Error;
+        return;
+    }
+
+    _resourceType = resourceType;
+    _interface = interface;
+
+    int i = 0;
+    for (auto format : contentFormats)
+        _contentFormats[i++] = format;
+    for (; i < kMaxContentFormats; i++)
+        _contentFormats[i] = kNoContentFormat;
+
+    if (contentFormats.size() > 0)
+        _resource->Options.Cf = *contentFormats.begin();
+
+    for (auto mirror : _mirrors)
+    {
+        CoapResult mirrorResult;
+        if (mirror != nullptr)
+            (*mirror)->SetAttributes(resourceType, interface, contentFormats, mirrorResult);
+    }
+
+    _linkFormatStale = true;
+    result = CoapResult::OK;
+}
+
+void LobaroCoapResource::BuildLinkFormat()
+{
+    _linkFormatStale = false;
+    _linkFormat.clear();
+
+    for (auto resource : _resources)
+        resource->AppendLink(_linkFormat);
+
+    ESP_LOGD(kTag, "Rebuilt /.well-known/core: %d bytes", static_cast<int>(_linkFormat.length()));
+}
+
+void LobaroCoapResource::AppendLink(std::string &document) const
+{
+    if (_resource == nullptr)
+        return;
+
+    if (!document.empty())
+        document += ',';
+
+    document += '<';
+    for (auto segment = _resource->pUri; segment != nullptr; segment = segment->next)
+    {
+        document += '/';
+        document.append(reinterpret_cast<const char *>(segment->Value), segment->Length);
+    }
+    document += '>';
+
+    if (_resourceType != nullptr)
+        document.append(";rt=\"").append(_resourceType).append("\"");
+    if (_interface != nullptr)
+        document.append(";if=\"").append(_interface).append("\"");
+
+    // A list of content formats has to be quoted, a single one doesn't
+    int formats = 0;
+    while (formats < kMaxContentFormats && _contentFormats[formats] != kNoContentFormat)
+        formats++;
+    for (int i = 0; i < formats; i++)
+    {
+        char format[12];
+        snprintf(format, sizeof(format), "%u", _contentFormats[i]);
+        document.append(i > 0 ? " " : formats > 1 ? ";ct=\"" : ";ct=").append(format);
+    }
+    if (formats > 1)
+        document += '"';
+
+    if (_resource->Notifier != nullptr)
+        document.append(";obs");
+}
+
+// A query filter's value matches exactly, or as a prefix when it ends in '*' (RFC 6690 section 4.1)
+static bool _MatchesFilterValue(const char *value, size_t length, std::string const &filter)
+{
+    if (!filter.empty() && filter.back() == '*')
+        return length >= filter.length() - 1 && memcmp(value, filter.data(), filter.length() - 1) == 0;
+    return length == filter.length() && memcmp(value, filter.data(), length) == 0;
+}
+
+// Any entry of a space separated list, like rt and if values
+static bool _MatchesFilterList(const char *list, std::string const &filter)
+{
+    while (list != nullptr && *list != '\0')
+    {
+        auto length = strcspn(list, " ");
+        if (length > 0 && _MatchesFilterValue(list, length, filter))
+            return true;
+        list += length;
+        list += strspn(list, " ");
+    }
+    return false;
+}
+
+bool LobaroCoapResource::MatchesFilter(std::string const &name, std::string const &value) const
+{
+    if (name == "href")
+    {
+        std::string path;
+        for (auto segment = _resource->pUri; segment != nullptr; segment = segment->next)
+            path.append("/").append(reinterpret_cast<const char *>(segment->Value), segment->Length);
+        return _MatchesFilterValue(path.data(), path.length(), value);
+    }
+    if (name == "rt")
+        return _MatchesFilterList(_resourceType, value);
+    if (name == "if")
+        return _MatchesFilterList(_interface, value);
+    if (name == "ct")
+    {
+        for (int i = 0; i < kMaxContentFormats && _contentFormats[i] != kNoContentFormat; i++)
+        {
+            char format[12];
+            auto length = snprintf(format, sizeof(format), "%u", _contentFormats[i]);
+            if (_MatchesFilterValue(format, length, value))
+                return true;
+        }
+        return false;
+    }
+    if (name == "obs")
+        return _resource->Notifier != nullptr;
+
+    // Attributes the links don't have aren't filtered on
+    return true;
+}
+
+void LobaroCoapResource::InstallWellKnownHandler(LobaroCoap *coap)
+{
+    _wellKnownCoap = coap;
+
+    // Lobaro creates /.well-known/core itself and walks the resource list on every request,
+    // take the resource over and answer from the cached document instead
+    CoAP_option_t core = { nullptr, CoapOptionValue::UriPath, 4, (uint8_t *)"core" };
+    CoAP_option_t wellKnown = { &core, CoapOptionValue::UriPath, 11, (uint8_t *)".well-known" };
+
+    auto resource = CoAP_FindResourceByUri(nullptr, &wellKnown);
+    if (resource == nullptr)
+        resource = CoAP_CreateResource((char *)".well-known/core", "", { CoapContentType::LinkFormat, RES_OPT_GET, 0 }, &LobaroCoapResource::WellKnownHandler, nullptr);
+
+    if (resource == nullptr)
+    {
+        ESP_LOGE(kTag, "Failed to set up /.well-known/core");
+        return;
+    }
+
+    resource->Handler = &LobaroCoapResource::WellKnownHandler;
+    resource->Options.Cf = CoapContentType::LinkFormat;
+}
+
+CoAP_HandlerResult_t LobaroCoapResource::WellKnownHandler(CoAP_Message_t *request, CoAP_Message_t *response)
+{
+    if (_linkFormatStale)
+        BuildLinkFormat();
+
+    // Filtered on the first query parameter (RFC 6690 section 4.1), e.g. ?rt=iotnode.led or ?href=/sw*
+    auto document = &_linkFormat;
+    std::string filtered;
+    for (auto option = request->pOptionsList; option != nullptr; option = option->next)
+    {
+        if (option->Number != CoapOptionValue::UriQuery)
+            continue;
+
+        std::string query(reinterpret_cast<const char *>(option->Value), option->Length);
+        auto separator = query.find('=');
+        auto name = query.substr(0, separator);
+        auto value = separator != std::string::npos ? query.substr(separator + 1) : std::string();
+        for (auto resource : _resources)
+        {
+            if (resource->_resource != nullptr && resource->MatchesFilter(name, value))
+                resource->AppendLink(filtered);
+        }
+        document = &filtered;
+        break;
+    }
+
+    // Nothing matched, a multicast request goes unanswered. A unicast one gets the empty document.
+    if (document->empty() && _wellKnownCoap != nullptr && _wellKnownCoap->SuppressMulticastResponse(request))
+    {
+        response->Code = static_cast<CoAP_MessageCode_t>(CoapMessageCode::Content);
+        return HANDLER_OK;
+    }
+
+    uint32_t szx = kCoapDiscoveryBlockSzx;
+    uint32_t block = 0;
+    auto blockOption = CoAP_FindOptionByNumber(request, CoapOptionValue::Block2);
+    uint32_t blockValue;
+    if (blockOption != nullptr && CoAP_GetUintFromOption(blockOption, &blockValue) == COAP_OK)
+    {
+        uint32_t clientSzx = blockValue & 0x07;
+        block = blockValue >> 4;
+        // 7 is reserved, and BERT only exists on reliable transports (RFC 8323 section 6)
+        if (clientSzx == 7)
+        {
+            response->Code = static_cast<CoAP_MessageCode_t>(CoapMessageCode::BadOption);
+            return HANDLER_OK;
+        }
+
+        // Go with the client's block size if it's smaller than ours, otherwise with ours and the
+        // block number scaled to it (RFC 7959 section 2.4)
+        if (clientSzx < szx)
+            szx = clientSzx;
+        else
+            block <<= clientSzx - szx;
+    }
+
+    size_t blockSize = 16 << szx;
+    size_t offset = block * blockSize;
+    size_t length = document->length();
+
+    if (offset > 0 && offset >= length)
+    {
+        response->Code = static_cast<CoAP_MessageCode_t>(CoapMessageCode::BadOption);
+        return HANDLER_OK;
+    }
+
+    CoAP_AppendUintOptionToList(&response->pOptionsList, CoapOptionValue::ContentFormat, CoapContentType::LinkFormat);
+
+    if (blockOption != nullptr || length > blockSize)
+    {
+        auto more = offset + blockSize < length;
+        CoAP_AppendUintOptionToList(&response->pOptionsList, CoapOptionValue::Block2, (block << 4) | (more ? 0x08 : 0) | szx);
+        if (block == 0)
+            CoAP_AppendUintOptionToList(&response->pOptionsList, CoapOptionValue::Size2, length);
+        length = more ? blockSize : length - offset;
+    }
+
+    response->Code = static_cast<CoAP_MessageCode_t>(CoapMessageCode::Content);
+    CoAP_SetPayload(response, (uint8_t *)document->data() + offset, length, true);
+    return HANDLER_OK;
+}
+
+void LobaroCoapResource::RegisterHandler(CoapMessageCode requestType, CoapResult &result)
+{
+    if(this->_resource == nullptr)
+    {
+        ESP_LOGE(kTag, "this->_resource is null");
+        result = CoapResult::Error;
+        return;
+    }
+
+    switch(requestType)
+    {
+        case CoapMessageCode::Get:
+            this->_resource->Options.AllowedMethods |= RES_OPT_GET;
+            break;
+        case CoapMessageCode::Post:
+            this->_resource->Options.AllowedMethods |= RES_OPT_POST;
+            break;
+        case CoapMessageCode::Put:
+            this->_resource->Options.AllowedMethods |= RES_OPT_PUT;
+            break;
+        case CoapMessageCode::Delete:
+            this->_resource->Options.AllowedMethods |= RES_OPT_DELETE;
+            break;
+        default:
+            result = CoapResult::Error;
+            return;
+    }
+
+    for (auto mirror : _mirrors)
+    {
+        if (mirror != nullptr)
+            (*mirror)->RegisterHandler(requestType, result);
+    }
+    result = CoapResult::OK;
+}
+
+void LobaroCoapResource::RegisterAsObservable(CoapResult &result)
+{
+    _resource->Notifier = &LobaroCoapResource::ResourceNotifier;
+    for (auto mirror : _mirrors)
+    {
+        if (mirror != nullptr)
+            (*mirror)->RegisterAsObservable(result);
+    }
+    _linkFormatStale = true;
+    result = CoapResult::OK;
+}
+
+void LobaroCoap::QueueResourceNotification(ICoapResource *resource, CoapResult &result)
+{
+    QueueResourceNotification(resource, LatencyTrace(), result);
+}
+
+void LobaroCoap::QueueResourceNotification(ICoapResource *resource, LatencyTrace const &trace, CoapResult &result)
+{
+    if(resource == nullptr)
+    {
+        result = CoapResult::Error;
+        return;
+    }
+
+    ESP_LOGD(kTag, "LobaroCoap: pushing resource to _notifyQueue");
+    QueuedNotification notification;
+    notification.Resource = resource;
+    notification.Trace = trace;
+    notification.Trace.Mark(TraceStage::Notify);
+    if (!_notifyQueue.Push(notification))
+    {
+        ESP_LOGW(kTag, "LobaroCoap: _notifyQueue is full");
+        result = CoapResult::Error;
+        return;
+    }
+
+    // Wake the network task so the notification doesn't wait for the poll timeout
+    if (_task != nullptr)
+        xTaskNotifyGive(_task);
+    result = CoapResult::OK;
+}
+
+#if CONFIG_IOTNODE_COAP_OBSERVE_ATTRIBUTES
+LobaroCoap::ObserverState *LobaroCoap::GetObserverState(CoAP_Observer_t *observer, uint32_t now, float value)
+{
+    ObserverState *freeState = nullptr;
+    for (auto &state : _observers)
+    {
+        if (state.Observer == observer)
+        {
+            state.Pass = _observerPass;
+            return &state;
+        }
+        if (state.Observer == nullptr && freeState == nullptr)
+            freeState = &state;
+    }
+
+    if (freeState == nullptr)
+        return nullptr;
+
+    // First time we've seen this observer, the registration response counts as its last notification
+    LobaroCoapObserver wrappedObserver(observer);
+    freeState->Observer = observer;
+    freeState->Attributes = ObserveAttributes();
+    freeState->Attributes.Parse(&wrappedObserver);
+    freeState->LastNotifyMs = now;
+    freeState->LastConfirmableMs = now;
+    freeState->NonConfirmableCount = 0;
+    freeState->LastValue = value;
+    freeState->Pending = false;
+    freeState->Pass = _observerPass;
+
+    if (!freeState->Attributes.IsDefault())
+        ESP_LOGD(kTag, "Observer %p: pmin %ums, pmax %ums", observer, freeState->Attributes.MinPeriodMs, freeState->Attributes.MaxPeriodMs);
+    return freeState;
+}
+
+LobaroCoap::ObserverState *LobaroCoap::FindObserverState(CoAP_Observer_t *observer)
+{
+    for (auto &state : _observers)
+    {
+        if (state.Observer == observer)
+            return &state;
+    }
+    return nullptr;
+}
+
+CoAP_MessageType_t LobaroCoap::GetNotificationType(CoAP_Observer_t *observer)
+{
+#if CONFIG_IOTNODE_COAP_NOTIFY_NON
+    // RFC 7641 4.5: notifications may be NON, but a CON has to go out every now and then
+    // to find out whether the observer is still interested (or still there)
+    auto state = FindObserverState(observer);
+    if (state == nullptr)
+        return CON;
+
+    uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    if (state->NonConfirmableCount + 1 >= kCoapNotifyConfirmableEvery || now - state->LastConfirmableMs >= kCoapNotifyConfirmableIntervalMs)
+    {
+        state->NonConfirmableCount = 0;
+        state->LastConfirmableMs = now;
+        return CON;
+    }
+
+    state->NonConfirmableCount++;
+    return NON;
+#else
+    return CON;
+#endif
+}
+
+static bool _IsNotificationDue(ObserveAttributes const &attributes, uint32_t lastNotifyMs, float lastValue, bool &pending, uint32_t now, bool hasValue, float value)
+{
+    uint32_t elapsed = now - lastNotifyMs;
+
+    if (pending && elapsed >= attributes.MinPeriodMs)
+    {
+        // Changes are held back until pmin has passed, then only sent if they still matter
+        pending = false;
+        if (!hasValue || attributes.IsNotable(lastValue, value))
+            return true;
+    }
+
+    return attributes.MaxPeriodMs != 0 && elapsed >= attributes.MaxPeriodMs;
+}
+
+void LobaroCoap::ProcessObservers(uint32_t now)
+{
+    CoAP_Observer_t *observers[kCoapMaxObserversPerResource];
+    ObserverState *states[kCoapMaxObserversPerResource];
+    bool due[kCoapMaxObserversPerResource];
+
+    _observerPass++;
+    for (auto resource : LobaroCoapResource::_resources)
+    {
+        bool changed = resource->_changed;
+        resource->_changed = false;
+
+        if (resource->_resource == nullptr || resource->_resource->pListObservers == nullptr)
+            continue;
+
+        float value = 0;
+        bool hasValue = resource->applicationResource->GetObservedValue(value);
+
+#if CONFIG_IOTNODE_COAP_NOTIFY_NON
+        // Prune observers that stopped acknowledging our confirmable notifications. They aren't
+        // notified any more, but lobaro's interaction for the last notification may still point
+        // at them, so they're only freed once that is over. Observers without a state are left
+        // to lobaro, there's no telling when they were last notified.
+        for (auto observer = resource->_resource->pListObservers; observer != nullptr; )
+        {
+            auto next = observer->next;
+            auto state = FindObserverState(observer);
+            if (observer->FailCount >= kCoapNotifyMaxFailCount && state != nullptr && now - state->LastNotifyMs >= kCoapNotifyMaxTransmitWaitMs)
+            {
+                ESP_LOGI(kTag, "Removing observer %p after %u failed notifications", observer, observer->FailCount);
+                state->Observer = nullptr;
+                CoAP_UnlinkObserverFromList(&resource->_resource->pListObservers, observer, true);
+            }
+            observer = next;
+        }
+        if (resource->_resource->pListObservers == nullptr)
+            continue;
+#endif
+
+        size_t count = 0, dueCount = 0;
+        bool overflow = false;
+        for (auto observer = resource->_resource->pListObservers; observer != nullptr; observer = observer->next)
+        {
+            if (count == kCoapMaxObserversPerResource)
+            {
+                overflow = true;
+                break;
+            }
+
+            // Observers that don't fit in the table are notified of every change
+            auto state = GetObserverState(observer, now, value);
+            bool isDue = changed;
+            if (state != nullptr)
+            {
+                state->Pending |= changed;
+                isDue = _IsNotificationDue(state->Attributes, state->LastNotifyMs, state->LastValue, state->Pending, now, hasValue, value);
+#if CONFIG_IOTNODE_COAP_NOTIFY_NON
+                // Given up on, waiting to be pruned
+                if (observer->FailCount >= kCoapNotifyMaxFailCount)
+                    isDue = false;
+#endif
+            }
 
-    this->_resource = CoAP_CreateResource((char *)uri, "", resourceOptions, &LobaroCoapResource::ResourceHandler, nullptr);
+            observers[count] = observer;
+            states[count] = state;
+            due[count] = isDue;
+            count++;
+            if (isDue)
+                dueCount++;
+        }
 
-    if (this->_resource == nullptr)
-    {
-        ESP_LOGE(kTag, "CoAP_CreateResource returned null");
-        result = CoapResult::Error;
-        return;
-    }
+        if (overflow && changed)
+        {
+            // Too many observers to filter, fall back to notifying everyone
+            CoAP_NotifyResourceObservers(resource->_resource);
+            dueCount = count;
+            for (size_t i = 0; i < count; i++)
+                due[i] = true;
+        }
+        else if (dueCount == 0 || overflow)
+            continue;
+        else if (dueCount == count)
+            CoAP_NotifyResourceObservers(resource->_resource);
+        else
+        {
+            // Lobaro notifies every observer in the resource's list, so temporarily unlink the
+            // observers that aren't due. The list is restored before anything else can walk it.
+            CoAP_Observer_t *head = nullptr, **tail = &head;
+            for (size_t i = 0; i < count; i++)
+            {
+                if (!due[i])
+                    continue;
+                *tail = observers[i];
+                tail = &observers[i]->next;
+            }
+            *tail = nullptr;
 
-    // CoAP_CreateResource errors when AllowedMethods is 0, but 🤷‍
-    this->_resource->Options.AllowedMethods = 0;
+            resource->_resource->pListObservers = head;
+            CoAP_NotifyResourceObservers(resource->_resource);
 
-    _resources.push_back(this);
-    result = CoapResult::OK;
-}
+            for (size_t i = 0; i < count; i++)
+                observers[i]->next = i + 1 < count ? observers[i + 1] : nullptr;
+            resource->_resource->pListObservers = observers[0];
+        }
 
-void LobaroCoapResource::RegisterHandler(CoapMessageCode requestType, CoapResult &result)
-{
-    if(this->_resource == nullptr)
-    {
-        ESP_LOGE(kTag, "this->_resource is null");
-        result = CoapResult::Error;
-        return;
+        for (size_t i = 0; i < count; i++)
+        {
+            if (!due[i] || states[i] == nullptr)
+                continue;
+            states[i]->LastNotifyMs = now;
+            states[i]->LastValue = value;
+            states[i]->Pending = false;
+        }
     }
 
-    switch(requestType)
+    // Forget observers that lobaro has removed since the last pass
+    for (auto &state : _observers)
     {
-        case CoapMessageCode::Get:
-            this->_resource->Options.AllowedMethods |= RES_OPT_GET;
-            break;
-        case CoapMessageCode::Post:
-            this->_resource->Options.AllowedMethods |= RES_OPT_POST;
-            break;
-        case CoapMessageCode::Put:
-            this->_resource->Options.AllowedMethods |= RES_OPT_PUT;
-            break;
-        case CoapMessageCode::Delete:
-            this->_resource->Options.AllowedMethods |= RES_OPT_DELETE;
-            break;
-        default:
-            result = CoapResult::Error;
-            return;
+        if (state.Observer != nullptr && state.Pass != _observerPass)
+            state.Observer = nullptr;
     }
-    result = CoapResult::OK;
 }
+#endif
 
-void LobaroCoapResource::RegisterAsObservable(CoapResult &result)
+void LobaroCoapResource::NotifyObservers(LatencyTrace const &trace, CoapResult &result)
 {
-    _resource->Notifier = &LobaroCoapResource::ResourceNotifier;
-    result = CoapResult::OK;
-}
+    ESP_LOGD(kTag, "LobaroCoapResource: Queuing resource notification");
+    _coap->QueueResourceNotification(this, trace, result);
 
-void LobaroCoap::QueueResourceNotification(ICoapResource *resource, CoapResult &result)
-{
-    if(_notifyQueue == nullptr || resource == nullptr)
+    // Composites aren't mirrored, the composite below passes the change on to its own mirrors
+    for (auto mirror : _mirrors)
     {
-        result = CoapResult::Error;
-        return;
+        CoapResult mirrorResult;
+        if (mirror != nullptr)
+            (*mirror)->NotifyObservers(trace, mirrorResult);
     }
 
-    ESP_LOGD(kTag, "LobaroCoap: pushing resource to _notifyQueue");
-    xQueueSend(_notifyQueue, &resource, 0);
+    // Changes to several members that are dequeued together end up in one notification
+    if (_composite != nullptr)
+    {
+        CoapResult compositeResult;
+        _composite->NotifyObservers(trace, compositeResult);
+    }
 }
 
-void LobaroCoapResource::NotifyObservers(CoapResult &result)
+void LobaroCoapResource::AddMember(IApplicationResource const *member, CoapResult &result)
 {
-    ESP_LOGD(kTag, "LobaroCoapResource: Queuing resource notification");
-    _coap->QueueResourceNotification(this, result);
+    for (auto resource : _resources)
+    {
+        if (resource->applicationResource == member)
+        {
+            resource->_composite = this;
+            result = CoapResult::OK;
+            return;
+        }
+    }
+
+    ESP_LOGE(kTag, "LobaroCoapResource::AddMember: member has no resource");
+    result = CoapResult::Error;
 }
 
 // static CoapResult_t coap_resource_set_contnet_type( CoapResource_t resource, uint16_t content_type )
@@ -455,27 +1676,11 @@ void LobaroCoapResource::NotifyObservers(CoapResult &result)
 //     return CoAP_GetUintFromOption( pOpt, value ) == COAP_OK ? kCoapOK : kCoapError;
 // }
 
-static void _GetOption(CoAP_option_t *optionsList, CoapOption &option, const uint16_t number, CoapResult &result)
+void CoapOptionFromBytes(CoapOption &option, const uint16_t number, const uint8_t *optionValue, size_t length, CoapResult &result)
 {
-
     CoapOptionType type = CoapOptionType::Empty;
     uint32_t value = 0;
 
-
-    CoAP_option_t *opt;
-	for (opt = optionsList; opt != nullptr; opt = opt->next)
-    {
-		if (opt->Number == number)
-			break;
-	}
-
-    if (opt == nullptr)
-    {
-        ESP_LOGD(kTag, "LobaroCoapMessage::GetOption: option (%u) not present in coap message", number);
-        result = CoapResult::Error;
-        return;
-    }
-
     for(auto it = std::begin(CoapOptiontypeMap); it != std::end(CoapOptiontypeMap); it++)
     {
         if (std::get<0>(*it) == number)
@@ -496,20 +1701,22 @@ static void _GetOption(CoAP_option_t *optionsList, CoapOption &option, const uin
         case CoapOptionType::Opaque:
             ESP_LOGD(kTag, "LobaroCoapMessage::GetOption: initalising CoapOpaqueOption");
             new (option.get()) CoapOpaqueOption(number);
-            option.get<CoapOpaqueOption>()->Data.assign(opt->Value, opt->Length);
+            option.get<CoapOpaqueOption>()->Data.assign(optionValue, length);
             result = CoapResult::OK;
             break;
         case CoapOptionType::String:
             ESP_LOGD(kTag, "LobaroCoapMessage::GetOption: initalising CoapStringOption");
             new (option.get()) CoapStringOption(number);
-            option.get<CoapStringOption>()->Data.assign((char*)opt->Value, opt->Length);
+            option.get<CoapStringOption>()->Data.assign((char*)optionValue, length);
             result = CoapResult::OK;
             break;
         case CoapOptionType::UInt:
             ESP_LOGD(kTag, "LobaroCoapMessage::GetOption: initalising CoapUIntOption");
             new (option.get()) CoapUIntOption(number);
-            CoAP_GetUintFromOption(opt, &value);
-            ESP_LOGD(kTag, "CoAP_GetUintFromOption return %u", value);
+            // Options are a variable length network order uint
+            for (size_t i = 0; i < length && i < sizeof(value); i++)
+                value = (value << 8) | optionValue[i];
+            ESP_LOGD(kTag, "CoapOptionFromBytes decoded %u", value);
             option.get<CoapUIntOption>()->Value = value;
             result = CoapResult::OK;
             break;
@@ -522,6 +1729,46 @@ static void _GetOption(CoAP_option_t *optionsList, CoapOption &option, const uin
     return;
 }
 
+static void _GetOption(CoAP_option_t *optionsList, CoapOption &option, const uint16_t number, CoapResult &result)
+{
+    CoAP_option_t *opt;
+	for (opt = optionsList; opt != nullptr; opt = opt->next)
+    {
+		if (opt->Number == number)
+			break;
+	}
+
+    if (opt == nullptr)
+    {
+        ESP_LOGD(kTag, "LobaroCoapMessage::GetOption: option (%u) not present in coap message", number);
+        result = CoapResult::Error;
+        return;
+    }
+
+    CoapOptionFromBytes(option, number, opt->Value, opt->Length, result);
+}
+
+static void _GetOptions(CoAP_option_t *optionsList, std::vector<std::string> &values, const uint16_t number, CoapResult &result)
+{
+    values.clear();
+    for (auto opt = optionsList; opt != nullptr; opt = opt->next)
+    {
+        if (opt->Number == number)
+            values.emplace_back((char*)opt->Value, opt->Length);
+    }
+    result = values.empty() ? CoapResult::Error : CoapResult::OK;
+}
+
+void LobaroCoapMessage::GetOptions(std::vector<std::string> &values, const uint16_t number, CoapResult &result) const
+{
+    _GetOptions(this->_message->pOptionsList, values, number, result);
+}
+
+void LobaroCoapObserver::GetOptions(std::vector<std::string> &values, const uint16_t number, CoapResult &result) const
+{
+    _GetOptions(this->_observer->pOptList, values, number, result);
+}
+
 void LobaroCoapMessage::GetOption(CoapOption &option, const uint16_t number, CoapResult &result) const
 {
     _GetOption(this->_message->pOptionsList, option, number, result);
@@ -598,17 +1845,6 @@ void LobaroCoapObserver::AddOption(ICoapOption const *option, CoapResult &result
 }
 
 
-CoapMessageCode LobaroCoapMessage::GetCode() const
-{
-    return static_cast<CoapMessageCode>(this->_message->Code);
-}
-
-void LobaroCoapMessage::SetCode(CoapMessageCode code, CoapResult &result)
-{
-    this->_message->Code = static_cast<CoAP_MessageCode_t>(code);
-    result = CoapResult::OK;
-}
-
 // CoapResult_t coap_message_add_option_uint( CoapMessage_t message, uint16_t option, uint32_t code )
 // {
 //     CoAP_AppendUintOptionToList( &(((CoAP_Message_t*)message)->pOptionsList), option, code );
@@ -633,80 +1869,314 @@ void LobaroCoapMessage::SetPayload(const Payload &payload, CoapResult &result)
     result = res == COAP_OK ? CoapResult::OK : CoapResult::Error;
 }
 
-void LobaroCoap::TaskHandle(void *pvParameters)
+bool LobaroCoap::OpenSockets()
 {
-    auto instance = static_cast<LobaroCoap *>(pvParameters);
-    err_t err;
-    while(true)
+    // Allocate a socket in Lobaro CoAP's memory, shared by all plain endpoints
+    if (_context == nullptr)
     {
-        if(!instance->_networkReady)
+        if ((_context = CoAP_NewSocket(this)) == nullptr)
+        {
+            ESP_LOGE(kTag, "CoAP_NewSocket(): failed socket allocation");
+            return false;
+        }
+
+        //user callback registration
+        _context->Tx = &LobaroCoap::SendDatagram;
+        _context->Alive = true;
+    }
+
+#if CONFIG_IOTNODE_COAP_DTLS
+    // Lobaro passes the handle back on every transmit, the DtlsServer finds the connection
+    if (_secure && _secureContext == nullptr)
+    {
+        if ((_secureContext = CoAP_NewSocket(&_dtls)) != nullptr)
         {
-            vTaskDelay(100 / portTICK_PERIOD_MS);
+            _secureContext->Tx = &LobaroCoap::SendSecureDatagram;
+            _secureContext->Alive = true;
+        }
+        else
+            ESP_LOGE(kTag, "CoAP_NewSocket(): failed socket allocation");
+    }
+#endif
+
+    // Endpoints that fail to open are retried on the next reconnect, only plain IPv4 is essential
+    for (int i = 0; i < _endpointCount; i++)
+    {
+        auto &endpoint = _endpoints[i];
+#if CONFIG_IOTNODE_COAP_DTLS
+        if (endpoint.Kind == EndpointKind::Secure && _secureContext == nullptr)
+            continue;
+#endif
+        if (endpoint.Socket == nullptr)
+            OpenEndpoint(endpoint);
+    }
+
+    if (FindEndpoint(EndpointKind::Plain, IPV4) == nullptr)
+        return false;
+
+    ESP_LOGI( kTag, "Coap library now listening" );
+    return true;
+}
+
+bool LobaroCoap::OpenEndpoint(Endpoint &endpoint)
+{
+    auto ipv6 = endpoint.NetType == IPV6;
+    endpoint.Socket = netconn_new_with_callback(ipv6 ? NETCONN_UDP_IPV6 : NETCONN_UDP, &LobaroCoap::SocketEvent);
+
+    if (endpoint.Socket == nullptr)
+    {
+        ESP_LOGE( kTag, "netconn_new(): Failed to get new socket" );
+        return false;
+    }
+
+    // lwIP turns a bind to the IPv6 wildcard into a dual stack bind, which would collide with the
+    // IPv4 endpoint on the same port
+    if (ipv6)
+        netconn_set_ipv6only(endpoint.Socket, 1);
+
+    err_t err = netconn_bind(endpoint.Socket, ipv6 ? IP6_ADDR_ANY : IP4_ADDR_ANY, endpoint.Port);
+    if (err != ERR_OK)
+    {
+        ESP_LOGE(kTag, "netconn_bind( ... ): Failed with %d", err);
+        netconn_delete(endpoint.Socket);
+        endpoint.Socket = nullptr;
+        return false;
+    }
+
+    // SocketEvent says when there's something to read, a read must never wait
+    netconn_set_nonblocking(endpoint.Socket, 1);
+
+    ESP_LOGD( kTag, "Listening: Port: %hu (%s%s)", endpoint.Port, ipv6 ? "IPv6" : "IPv4",
+        endpoint.Kind == EndpointKind::Secure ? ", DTLS" : "");
+    return true;
+}
+
+#if CONFIG_IOTNODE_COAP_DTLS
+void LobaroCoap::ReadSecureDatagram(struct netbuf *buffer)
+{
+    uint8_t *data;
+    uint16_t size;
+    netbuf_data(buffer, (void**) &data, &size);
+
+    NetPacket_t packet;
+    GetRemoteEp(buffer, packet.remoteEp);
+    packet.metaInfo.Type = META_INFO_NONE;
+
+    CoapResult result;
+    size_t length;
+    this->_dtls.Receive(packet.remoteEp, data, size, this->_securePlaintext, sizeof(this->_securePlaintext), length, result);
+    netbuf_delete(buffer);
+
+    if (result != CoapResult::OK || length == 0)
+        return;
+
+    ESP_LOGI( kTag, "Received %d Bytes over DTLS from port %hu", static_cast<int>(length), packet.remoteEp.NetPort );
+
+    packet.pData = this->_securePlaintext;
+    packet.size = length;
+
+    CoapResult parseResult;
+    CoapPacket request(packet.pData, packet.size);
+    request.Parse(parseResult);
+#if CONFIG_IOTNODE_COAP_RATE_LIMIT
+    if (parseResult == CoapResult::OK && request.IsRequest() && !AdmitRequest(EndpointKind::Secure, request, packet.remoteEp, false))
+        return;
+#endif
+
+    if (parseResult == CoapResult::OK && request.IsRequest())
+        TrackExchange(request, packet.remoteEp, false);
+
+    CoAP_HandleIncomingPacket(this->_secureContext->Handle, &packet);
+}
+
+bool LobaroCoap::SendSecureDatagram(SocketHandle_t socketHandle, NetPacket_t *packet)
+{
+    auto instance = static_cast<LobaroCoap *>(static_cast<DtlsServer *>(socketHandle)->GetContext());
+    if (instance->FilterResponse(packet))
+        return true;
+
+    CoapResult result;
+    instance->_dtls.Send(packet->remoteEp, packet->pData, packet->size, result);
+    if (result != CoapResult::OK)
+        return false;
+
+    instance->_sendTrace.Mark(TraceStage::Send);
+    instance->_sendTrace = LatencyTrace();
+    return true;
+}
+
+bool LobaroCoap::TransmitRecord(void *context, NetEp_t const &remote, const uint8_t *data, size_t length)
+{
+    auto instance = static_cast<LobaroCoap *>(context);
+    return instance->SendTo(EndpointKind::Secure, remote, data, length);
+}
+#endif
+
+void LobaroCoap::Resume()
+{
+    // Group membership doesn't reliably survive the interface going down, join it again. The
+    // All CoAP Nodes groups are joined on the plain endpoints, lwIP hands a datagram to one socket
+    // only so a separate socket on the same port would never see them.
+    for (int i = 0; i < _endpointCount; i++)
+    {
+        auto &endpoint = _endpoints[i];
+        if (endpoint.Kind != EndpointKind::Plain || endpoint.Socket == nullptr)
             continue;
+
+        ip_addr_t multicast_addr;
+        if (endpoint.NetType == IPV6)
+            IP_ADDR6_HOST( &multicast_addr, 0xFF020000, 0, 0, 0xFD );
+        else
+        {
+            IP4_ADDR( ip_2_ip4(&multicast_addr) , 224, 0, 1, 187 );
+            IP_SET_TYPE( &multicast_addr, IPADDR_TYPE_V4 );
         }
+        netconn_join_leave_group(endpoint.Socket, &multicast_addr, nullptr, NETCONN_LEAVE );
+        if (netconn_join_leave_group(endpoint.Socket, &multicast_addr, nullptr, NETCONN_JOIN ) != ERR_OK)
+            ESP_LOGE( kTag, "netconn_join_leave_group( ... ): Failed" );
+    }
 
-        instance->_socket = netconn_new(NETCONN_UDP);
+    if (_networkLostTime == 0)
+        return;
 
+    // Observers were kept while we were offline. Anything that failed during the outage wasn't
+    // their fault, and they may have missed changes, so send everyone the current state.
+#if CONFIG_IOTNODE_COAP_OBSERVE_ATTRIBUTES
+    uint32_t now = xTaskGetTickCount() * portTICK_PERIOD_MS;
+#endif
+    int observerCount = 0;
+    for (auto resource : LobaroCoapResource::_resources)
+    {
+        if (resource->_resource == nullptr || resource->_resource->Notifier == nullptr || resource->_resource->pListObservers == nullptr)
+            continue;
 
-        if (instance->_socket == nullptr)
+        for (auto observer = resource->_resource->pListObservers; observer != nullptr; observer = observer->next)
         {
-            ESP_LOGE( kTag, "netconn_new(): Failed to get new socket" );
-            vTaskDelete(nullptr);
-            return;
+            observer->FailCount = 0;
+            observerCount++;
+#if CONFIG_IOTNODE_COAP_OBSERVE_ATTRIBUTES
+            float value = 0;
+            resource->applicationResource->GetObservedValue(value);
+            auto state = GetObserverState(observer, now, value);
+            if (state != nullptr)
+            {
+                state->LastNotifyMs = now;
+                state->LastValue = value;
+                state->Pending = false;
+            }
+#endif
         }
 
-        // Allocate a socket in Lobaro CoAP's memory and return the address
-        if ((instance->_context = CoAP_NewSocket(instance)) == nullptr)
+        resource->_changed = false;
+        CoAP_NotifyResourceObservers(resource->_resource);
+    }
+
+    int64_t resumed = esp_timer_get_time();
+    ESP_LOGI(kTag, "Resumed %d observers after %d ms offline, %d ms after the network came back",
+        observerCount, static_cast<int>((resumed - _networkLostTime) / 1000), static_cast<int>((resumed - _networkReadyTime) / 1000));
+    _networkLostTime = 0;
+}
+
+void LobaroCoap::TaskHandle(void *pvParameters)
+{
+    auto instance = static_cast<LobaroCoap *>(pvParameters);
+    _networkTask = xTaskGetCurrentTaskHandle();
+    while(true)
+    {
+        if(!instance->_networkReady)
         {
-            ESP_LOGE(kTag, "CoAP_NewSocket(): failed socket allocation");
-            netconn_delete(instance->_socket);
-            vTaskDelete(nullptr);
-            return;
+            // The catch-up notification on resume covers anything that changed in the meantime
+            QueuedNotification notification;
+            while (instance->_notifyQueue.Pop(notification))
+                ;
+
+            ulTaskNotifyTake(pdTRUE, 100 / portTICK_PERIOD_MS);
+            continue;
         }
 
-        err = netconn_bind(instance->_socket, nullptr, kCoapPort);
-        if (err != ERR_OK)
+        // The sockets and lobaro's socket contexts (and with them every observe relationship) are
+        // created once and kept across Wi-Fi reconnects
+        if (!instance->OpenSockets())
         {
-            ESP_LOGE(kTag, "netconn_bind( ... ): Failed with %d", err);
-            netconn_delete(instance->_socket);
             vTaskDelete(nullptr);
             return;
         }
 
-        ip_addr_t multicast_addr;
-        IP4_ADDR( ip_2_ip4(&multicast_addr) , 224, 0, 1, 187 );
-        if (netconn_join_leave_group(instance->_socket, &multicast_addr, nullptr, NETCONN_JOIN ) != ERR_OK)
-            ESP_LOGE( kTag, "netconn_join_leave_group( ... ): Failed" );
-
-        ESP_LOGI( kTag, "Coap library now listening" );
-
-        //user callback registration
-        instance->_context->Tx = &LobaroCoap::SendDatagram;
-        instance->_context->Alive = true;
+        instance->Resume();
 
-        ESP_LOGD( kTag, "Listening: Port: %hu", kCoapPort);
+#if CONFIG_IOTNODE_COAP_RD
+        instance->_directory.Resume(esp_timer_get_time());
+#endif
 
+        auto backlog = false;
         while(instance->_networkReady) {
-            // TODO: Loop through all interfaces, and perform interface specific polling stuff
-            // For now, work with UDP sockets and call Lobaro-coap stuff
-
             if (instance->_context == nullptr)
                 break;
 
-            LobaroCoapResource *resourceToNotify = nullptr;
-            if(xQueueReceive(instance->_notifyQueue, &resourceToNotify, 10 / portTICK_PERIOD_MS) && resourceToNotify != nullptr && resourceToNotify->_resource != nullptr)
+            // Sleep until a socket has data, another task hands us work or the poll timeout for
+            // lobaro's retransmissions expires. Don't sleep while datagrams are still queued.
+            ulTaskNotifyTake(pdTRUE, backlog ? 0 : 10 / portTICK_PERIOD_MS);
+
+            QueuedNotification notification;
+            while (instance->_notifyQueue.Pop(notification))
             {
+                auto resourceToNotify = static_cast<LobaroCoapResource *>(notification.Resource);
+                if (resourceToNotify == nullptr || resourceToNotify->_resource == nullptr)
+                    continue;
+
                 ESP_LOGD(kTag, "Dequeing resource notification %p->%p", resourceToNotify, resourceToNotify->_resource);
-                CoAP_NotifyResourceObservers(resourceToNotify->_resource);
+                // Only statistics, a change that overtakes an earlier one simply replaces its trace
+                if (notification.Trace.IsActive())
+                {
+                    resourceToNotify->_trace = notification.Trace;
+                    resourceToNotify->_trace.Mark(TraceStage::Dequeue);
+                }
+                resourceToNotify->_changed = true;
             }
 
-            netconn_set_recvtimeout(instance->_socket, 1);
+#if CONFIG_IOTNODE_COAP_OBSERVE_ATTRIBUTES
+            instance->ProcessObservers(xTaskGetTickCount() * portTICK_PERIOD_MS);
+#else
+            // A resource queued several times since the last pass is notified once
+            for (auto resource : LobaroCoapResource::_resources)
+            {
+                if (!resource->_changed || resource->_resource == nullptr)
+                    continue;
+                resource->_changed = false;
+                CoAP_NotifyResourceObservers(resource->_resource);
+            }
+#endif
+
+#if CONFIG_IOTNODE_COAP_EGRESS_QUEUE
+            // Notifications leave before more requests are read
+            instance->FlushEgress(esp_timer_get_time());
+#endif
+
+            instance->SendDeferred(esp_timer_get_time());
+
+            backlog = instance->ReadEndpoints();
 
-            instance->ReadDatagram();
+#if CONFIG_IOTNODE_COAP_RD
+            instance->_directory.Poll(esp_timer_get_time());
+#endif
+
+#if CONFIG_IOTNODE_COAP_CLIENT
+            instance->_client.Poll(esp_timer_get_time());
+#endif
+
+#if CONFIG_IOTNODE_COAP_DTLS
+            if (instance->_secureContext != nullptr)
+                instance->_dtls.Poll(esp_timer_get_time());
+#endif
 
             CoAP_doWork();
+
+#if CONFIG_IOTNODE_COAP_EGRESS_QUEUE
+            backlog |= instance->FlushEgress(esp_timer_get_time());
+#endif
         }
-        netconn_delete(instance->_socket);
+
+        ESP_LOGI(kTag, "Network lost, holding on to the CoAP sockets and observers");
     }
     vTaskDelete(nullptr);
 }
@@ -1,37 +1,250 @@
 #ifndef _INTERFACES_LOBAROCOAP_H_
 #define _INTERFACES_LOBAROCOAP_H_
 
+#include <algorithm>
+#include <atomic>
+#include <string>
 #include <vector>
+#include "sdkconfig.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "lwip/api.h"
 #include "coap.h"
+#include "coappacket.h"
+#include "coapclient.h"
+#include "coapproxy.h"
+#include "egressqueue.h"
+#include "ratelimiter.h"
+#include "resourcedirectory.h"
+#include "coapworkerpool.h"
+#include "dtlsserver.h"
+#include "oscore.h"
+#include "lockfreequeue.h"
+#include "observeattributes.h"
 
 extern "C" {
     #include "liblobaro_coap.h"
 }
 
 static const int kCoapMemorySize = 4096;
+static const int kCoapNotifyQueueSize = 32;
+static const int kCoapMaxEndpoints = 4;
+static const int kCoapMaxTransports = 2;
+
+class LobaroCoapResource;
 
 class LobaroCoap : public ICoapInterface
 {
+    friend class LobaroCoapResource;
 private:
     xTaskHandle _task;
-    xQueueHandle _notifyQueue;
+    // A resource's trace travels with its notification, resources only touch it on their own task
+    struct QueuedNotification
+    {
+        ICoapResource *Resource;
+        LatencyTrace Trace;
+    };
+    LockFreeQueue<QueuedNotification, kCoapNotifyQueueSize> _notifyQueue;
     static void TaskHandle(void* pvParameters);
     CoAP_Socket_t *_context;
-    struct netconn *_socket;
-    bool _networkReady;
+    std::atomic<bool> _networkReady;
+    int64_t _networkLostTime;
+    int64_t _networkReadyTime;
+    LatencyTrace _sendTrace;
     static bool SendDatagram(SocketHandle_t socketHandle, NetPacket_t* packet);
 
     bool SendDatagram(NetPacket_t* packet);
-    void ReadDatagram();
+
+    enum class EndpointKind : uint8_t
+    {
+        Plain,
+        Secure,
+    };
+
+    // A bound socket the network task waits on. Plain endpoints share lobaro's socket context and
+    // receive the multicast groups, secure ones go through the DtlsServer first.
+    struct Endpoint
+    {
+        struct netconn *Socket;
+        EndpointKind Kind;
+        NetInterfaceType_t NetType;
+        uint16_t Port;
+    };
+    Endpoint _endpoints[kCoapMaxEndpoints];
+    int _endpointCount;
+
+    void AddEndpoint(EndpointKind kind, NetInterfaceType_t netType, uint16_t port);
+    Endpoint *FindEndpoint(EndpointKind kind, NetInterfaceType_t netType);
+    bool OpenEndpoint(Endpoint &endpoint);
+    bool OpenSockets();
+    bool ReadEndpoints();
+    bool ReadEndpoint(Endpoint &endpoint);
+    void ReadDatagram(Endpoint const &endpoint, struct netbuf *buffer);
+    static void GetRemoteEp(struct netbuf const *buffer, NetEp_t &remote);
+    static void SocketEvent(struct netconn *socket, enum netconn_evt event, uint16_t length);
+
+#if CONFIG_IOTNODE_COAP_OBSERVE_ATTRIBUTES
+    static const int kCoapMaxObservers = CONFIG_IOTNODE_COAP_MAX_OBSERVERS;
+
+    // Per observer conditional attribute state, indexed by lobaro's observer
+    struct ObserverState
+    {
+        CoAP_Observer_t *Observer;
+        ObserveAttributes Attributes;
+        uint32_t LastNotifyMs;
+        float LastValue;
+        uint32_t LastConfirmableMs;
+        uint8_t NonConfirmableCount;
+        uint8_t Pass;
+        bool Pending;
+    };
+    ObserverState _observers[kCoapMaxObservers];
+    uint8_t _observerPass;
+
+    ObserverState *GetObserverState(CoAP_Observer_t *observer, uint32_t now, float value);
+    ObserverState *FindObserverState(CoAP_Observer_t *observer);
+    CoAP_MessageType_t GetNotificationType(CoAP_Observer_t *observer);
+    void ProcessObservers(uint32_t now);
+#endif
+
+    static const int kCoapExchangeSlots = 8;
+    static const int kCoapDeferredSlots = 4;
+    static const size_t kCoapDeferredSize = 256;
+
+    // A request whose responses need special treatment (No-Response, multicast), matched
+    // against the responses lobaro sends for it
+    struct TrackedExchange
+    {
+        NetEp_t Ep;
+        int64_t Expires;
+        uint16_t MessageId;
+        uint8_t Suppress;
+        bool Multicast;
+        uint8_t TokenLength;
+        uint8_t Token[kCoapMaxTokenLength];
+    };
+    TrackedExchange _exchanges[kCoapExchangeSlots];
+    uint32_t _suppressedCount;
+    uint32_t _suppressedBytes;
+
+    // Responses to multicast requests held back for a random leisure period
+    struct DeferredDatagram
+    {
+        NetEp_t Ep;
+        int64_t SendAt;
+        uint16_t Size;
+        uint8_t Data[kCoapDeferredSize];
+    };
+    DeferredDatagram _deferred[kCoapDeferredSlots];
+
+    bool TrackExchange(CoapPacket const &request, NetEp_t const &remote, bool multicast);
+    TrackedExchange *FindExchange(CoapPacket const &response, NetEp_t const &remote, int64_t now);
+    TrackedExchange *MatchExchange(CoAP_Message_t const *request);
+    bool IsMulticastExchange(CoAP_Message_t const *request);
+    bool SuppressMulticastResponse(CoAP_Message_t const *request);
+    bool FilterResponse(NetPacket_t *packet);
+    bool DeferResponse(NetPacket_t *packet);
+    void SendDeferred(int64_t now);
+    bool Transmit(NetPacket_t *packet);
+    bool SendTo(EndpointKind kind, NetEp_t const &remote, const uint8_t *data, size_t length);
+
+#if CONFIG_IOTNODE_COAP_EGRESS_QUEUE
+    // What lobaro sends on the plain endpoints, flushed by priority from the network task
+    EgressQueue _egress;
+    EgressClass Classify(NetPacket_t const *packet);
+    // False if the caller has to send the datagram itself
+    bool Enqueue(EgressClass egressClass, NetPacket_t *packet);
+    // True when more is due than a pass may send
+    bool FlushEgress(int64_t now);
+#endif
+
+#if CONFIG_IOTNODE_COAP_RATE_LIMIT
+    RateLimiter _rateLimiter;
+    // False when the client is over its rate, the request is answered (or not) here then
+    bool AdmitRequest(EndpointKind kind, CoapPacket const &request, NetEp_t const &remote, bool multicast);
+#endif
+
+#if CONFIG_IOTNODE_COAP_DTLS
+    // Largest CoAP message accepted over DTLS (RFC 7252 section 4.6)
+    static const size_t kCoapSecureMessageSize = 1152;
+
+    // Second lobaro socket context for the endpoints on port 5684, its handle is the DtlsServer
+    bool _secure;
+    DtlsServer _dtls;
+    CoAP_Socket_t *_secureContext;
+    uint8_t _securePlaintext[kCoapSecureMessageSize];
+
+    void ReadSecureDatagram(struct netbuf *buffer);
+    static bool SendSecureDatagram(SocketHandle_t socketHandle, NetPacket_t *packet);
+    static bool TransmitRecord(void *context, NetEp_t const &remote, const uint8_t *data, size_t length);
+#endif
+
+#if CONFIG_IOTNODE_COAP_OSCORE
+    // Requests on the plain endpoints may be OSCORE protected
+    ObjectSecurity _oscore;
+#endif
+
+#if CONFIG_IOTNODE_COAP_CLIENT
+    // Our own requests, sent from the plain endpoints
+    CoapClient _client;
+    static bool TransmitRequest(void *context, NetEp_t const &remote, const uint8_t *data, size_t length);
+#endif
+
+#if CONFIG_IOTNODE_COAP_PROXY
+    // Forwards Proxy-Uri requests through _client
+    CoapProxy _proxy;
+#endif
+
+#if CONFIG_IOTNODE_COAP_RD
+    ResourceDirectory _directory;
+    static std::string const &CurrentLinkFormat();
+#endif
+
+    // Further transports serving the same resources, see AddTransport
+    ICoapInterface *_transports[kCoapMaxTransports];
+    int _transportCount;
+
+#if CONFIG_IOTNODE_COAP_WORKER_POOL
+    CoapWorkerPool _workerPool;
+    CoAP_HandlerResult_t DispatchToWorker(LobaroCoapResource *resource, CoAP_Message_t *request, CoAP_Message_t *response);
+#endif
 public:
     LobaroCoap();
     void Start(CoapResult &result);
+    // Also listens for DTLS on port 5684 when options.flags.useDTLS is set
+    void Start(CoapOptions const &options, CoapResult &result);
+#if CONFIG_IOTNODE_COAP_OSCORE
+    // Must be called before Start
+    void AddSecurityContext(CoapOscoreOptions const &options, CoapResult &result) { _oscore.AddContext(options, result); }
+#endif
     virtual ~LobaroCoap(){}
 
+    // Serves every resource created after this call over `transport` too, with the same handlers.
+    // The transport is started and told about the network along with this one.
+    void AddTransport(ICoapInterface *transport, CoapResult &result);
+
+#if CONFIG_IOTNODE_COAP_CLIENT
+    // Sends `request` to `remote` from the server's socket. May be called from any task, `handler`
+    // is called on the network task when the exchange completes (see CoapResponseHandler).
+    void SendRequest(NetEp_t const &remote, BufferedCoapMessage const &request, CoapResponseHandler handler, void *context, CoapResult &result);
+#endif
+
+    // Must be called before Start
     void CreateResource(CoapResource &resource, IApplicationResource * const applicationResource, const char* uri, CoapResult &result);
+#if CONFIG_IOTNODE_COAP_STATIC_DISPATCH
+    // Picked over the virtual overload when the resource's type is known, requests are then
+    // handed to Resource::Handle<LobaroCoapMessage> directly
+    template<class Resource>
+    void CreateResource(CoapResource &resource, Resource * const applicationResource, const char* uri, CoapResult &result);
+#endif
     void QueueResourceNotification(ICoapResource *resource, CoapResult &result);
+    void QueueResourceNotification(ICoapResource *resource, LatencyTrace const &trace, CoapResult &result);
 
     void SetNetworkReady(bool ready);
+
+    // What the network task does once the network is (back) up: rejoins the multicast groups
+    // and, after an outage, resets the observers' fail counts and notifies every one of them
+    void Resume();
 };
 
 class LobaroCoapResource : public ICoapResource
@@ -41,42 +254,94 @@ class LobaroCoapResource : public ICoapResource
 
     static std::vector<LobaroCoapResource*> _resources;
     CoAP_Res_t *_resource;
+    unsigned _index;
+    bool _changed;
+    // Trace of the latest queued change, only used on the network task
+    LatencyTrace _trace;
+    LobaroCoapResource *_composite;
+    // The same resource on the transports added with AddTransport
+    CoapResource *_mirrors[kCoapMaxTransports];
+
+    static const int kMaxContentFormats = 3;
+    const char *_resourceType;
+    const char *_interface;
+    uint16_t _contentFormats[kMaxContentFormats];
+
+    // /.well-known/core, rebuilt on the CoAP task the first time it's asked for after a change
+    static std::string _linkFormat;
+    static std::atomic<bool> _linkFormatStale;
+    // Whose exchanges the discovery handler looks up
+    static LobaroCoap *_wellKnownCoap;
+
     static CoAP_HandlerResult_t ResourceHandler(CoAP_Message_t *request, CoAP_Message_t *response);
     static CoAP_HandlerResult_t ResourceNotifier(CoAP_Observer_t *observer, CoAP_Message_t *response);
+    static CoAP_HandlerResult_t WellKnownHandler(CoAP_Message_t *request, CoAP_Message_t *response);
+
+#if CONFIG_IOTNODE_COAP_STATIC_DISPATCH
+    typedef CoapResult (*Dispatcher)(IApplicationResource *applicationResource, CoAP_Message_t *request, CoAP_Message_t *response, bool multicast);
+    Dispatcher _dispatch;
+
+    template<class Resource>
+    static CoapResult Dispatch(IApplicationResource *applicationResource, CoAP_Message_t *request, CoAP_Message_t *response, bool multicast);
+#endif
+    static void InstallWellKnownHandler(LobaroCoap *coap);
+    static void BuildLinkFormat();
+    void AppendLink(std::string &document) const;
+    bool MatchesFilter(std::string const &name, std::string const &value) const;
 public:
     LobaroCoapResource(LobaroCoap * const coap, IApplicationResource * const applicationResource, const char* uri, CoapResult &result);
 
     virtual ~LobaroCoapResource()
     {
-        for(auto it = _resources.begin(); it != _resources.end(); it++)
+        for (auto mirror : _mirrors)
+        {
+            if (mirror == nullptr)
+                continue;
+            (*mirror)->~ICoapResource();
+            delete mirror;
+        }
+
+        _resources.erase(std::remove(_resources.begin(), _resources.end(), this), _resources.end());
+        for (auto resource : _resources)
         {
-            if (*it == this)
-                _resources.erase(it);
+            if (resource->_composite == this)
+                resource->_composite = nullptr;
         }
+        _linkFormatStale = true;
     }
 
     void RegisterHandler(CoapMessageCode requestType, CoapResult &result);
     void RegisterAsObservable(CoapResult &result);
-    void NotifyObservers(CoapResult &result);
+    void SetAttributes(const char *resourceType, const char *interface, std::initializer_list<CoapContentType> contentFormats, CoapResult &result);
+    void AddMember(IApplicationResource const *member, CoapResult &result);
+    void NotifyObservers(LatencyTrace const &trace, CoapResult &result);
 };
 
-class LobaroCoapMessage : public ICoapMessage
+class LobaroCoapMessage final : public ICoapMessage
 {
     CoAP_Message_t * const _message;
+    bool const _multicast;
 public:
     ~LobaroCoapMessage(){}
-    LobaroCoapMessage(CoAP_Message_t *message)
-        : _message(message) {}
+    LobaroCoapMessage(CoAP_Message_t *message, bool multicast = false)
+        : _message(message), _multicast(multicast) {}
 
     void AddOption(ICoapOption const *option, CoapResult &result);
     void GetOption(CoapOption &option,const uint16_t number, CoapResult &result) const;
+    void GetOptions(std::vector<std::string> &values, const uint16_t number, CoapResult &result) const;
     void SetOption(ICoapOption const *option, CoapResult &result);
+    using ICoapMessage::AddOption;
+    using ICoapMessage::SetOption;
 
-    CoapMessageCode GetCode() const;
-    void SetCode(CoapMessageCode code, CoapResult &result);
+    CoapMessageCode GetCode() const { return static_cast<CoapMessageCode>(this->_message->Code); }
+    void SetCode(CoapMessageCode code, CoapResult &result) { this->_message->Code = static_cast<CoAP_MessageCode_t>(code); result = CoapResult::OK; }
+    CoapMessageType GetType() const { return static_cast<CoapMessageType>(this->_message->Type); }
+    void SetType(CoapMessageType type, CoapResult &result) { this->_message->Type = static_cast<CoAP_MessageType_t>(type); result = CoapResult::OK; }
 
     void GetPayload(Payload &payload, CoapResult &result) const;
     void SetPayload(const Payload &payload, CoapResult &result);
+    using ICoapMessage::SetPayload;
+    bool IsMulticast() const { return _multicast; }
 };
 
 class LobaroCoapObserver : public ICoapObserver
@@ -87,9 +352,29 @@ public:
         : _observer(observer) {}
 
     void GetOption(CoapOption &option,const uint16_t number, CoapResult &result) const;
+    void GetOptions(std::vector<std::string> &values, const uint16_t number, CoapResult &result) const;
     void AddOption(ICoapOption const *option, CoapResult &result);
 
     int GetFailCount() const;
 };
 
+#if CONFIG_IOTNODE_COAP_STATIC_DISPATCH
+template<class Resource>
+void LobaroCoap::CreateResource(CoapResource &resource, Resource * const applicationResource, const char* uri, CoapResult &result)
+{
+    CreateResource(resource, static_cast<IApplicationResource *>(applicationResource), uri, result);
+    if (result == CoapResult::OK)
+        static_cast<LobaroCoapResource *>(resource.get())->_dispatch = &LobaroCoapResource::Dispatch<Resource>;
+}
+
+template<class Resource>
+CoapResult LobaroCoapResource::Dispatch(IApplicationResource *applicationResource, CoAP_Message_t *request, CoAP_Message_t *response, bool multicast)
+{
+    CoapResult result;
+    LobaroCoapMessage wrappedRequest(request, multicast), wrappedResponse(response);
+    static_cast<Resource *>(applicationResource)->Handle(&wrappedRequest, &wrappedResponse, result);
+    return result;
+}
+#endif
+
 #endif // _INTERFACES_LOBAROCOAP_H_
@@ -0,0 +1,426 @@
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_MQTT
+
+#include <algorithm>
+#include <new>
+
+#include "esp_log.h"
+
+#include "mqtttransport.h"
+#include "bufferedmessage.h"
+#include "taskconfig.h"
+
+static const char *kTag = "MQTT";
+static const char *kMqttThreadName = "mqtt-publish";
+
+static const int kMqttThreadStackSize = 4096;
+// Same as the TCP transport, below the UDP task
+static const int kMqttThreadPriority = 7;
+
+#define MQTT_TOPIC_BASE CONFIG_IOTNODE_MQTT_TOPIC_PREFIX "/" CONFIG_IOTNODE_HOSTNAME "/"
+static const char *kMqttTopicBase = MQTT_TOPIC_BASE;
+static const char *kMqttCommandSuffix = "/set";
+// Retained "online", replaced by the broker with the will when the connection drops
+static const char *kMqttStatusTopic = MQTT_TOPIC_BASE "status";
+
+static const uint8_t kMqttCommandMethods = (1 << CoapMessageCode::Post) | (1 << CoapMessageCode::Put);
+
+// Stands in for the registering request of an observation, there is only ever the broker
+class MqttObserver : public ICoapObserver
+{
+    BufferedCoapMessage &_request;
+public:
+    MqttObserver(BufferedCoapMessage &request)
+        : _request(request) {}
+
+    void GetOption(CoapOption &option,const uint16_t number, CoapResult &result) const { _request.GetOption(option, number, result); }
+    void GetOptions(std::vector<std::string> &values, const uint16_t number, CoapResult &result) const { _request.GetOptions(values, number, result); }
+    void AddOption(ICoapOption const *option, CoapResult &result) { _request.AddOption(option, result); }
+
+    // Redelivery is up to the broker
+    int GetFailCount() const { return 0; }
+};
+
+MqttTransport::MqttTransport()
+    : _task(nullptr), _client(nullptr), _networkReady(false), _connected(false), _inflight(0),
+      _sessionStarted(false), _published(0), _coalesced(0), _bytes(0)
+{
+}
+
+MqttTransport::~MqttTransport()
+{
+    Command *command;
+    while (_commandQueue.Pop(command))
+        delete command;
+}
+
+void MqttTransport::Start(CoapResult &result)
+{
+    int ret = xTaskCreatePinnedToCore(
+        &MqttTransport::TaskHandle,
+        kMqttThreadName,
+        kMqttThreadStackSize,
+        this,
+        kMqttThreadPriority,
+        &this->_task,
+        kNetworkCore
+    );
+
+    result = ret ? CoapResult::OK : CoapResult::Error;
+
+    if (ret != true)
+        ESP_LOGE( kTag, "Failed to create thread %s", kMqttThreadName );
+}
+
+void MqttTransport::SetNetworkReady(bool ready)
+{
+    // The client reconnects on its own, only the first connect waits for this
+    this->_networkReady = ready;
+    if (_task != nullptr)
+        xTaskNotifyGive(_task);
+}
+
+void MqttTransport::CreateResource(CoapResource &resource, IApplicationResource * const applicationResource, const char* uri, CoapResult &result)
+{
+    assert(sizeof(MqttResource) <= CoapConstraints::MaxResourceSize);
+    _resources.push_back(new (resource.get()) MqttResource(this, applicationResource, uri));
+    result = CoapResult::OK;
+}
+
+void MqttTransport::QueueResourceNotification(ICoapResource *resource, CoapResult &result)
+{
+    Queue(static_cast<MqttResource *>(resource));
+    result = CoapResult::OK;
+}
+
+void MqttTransport::Queue(MqttResource *resource)
+{
+    // A resource is queued once until its state is published, so the queue only overflows with
+    // more resources than slots
+    if (resource->_pending.exchange(true))
+    {
+        _coalesced++;
+        return;
+    }
+
+    if (!_notifyQueue.Push(resource))
+    {
+        ESP_LOGW(kTag, "MqttTransport: _notifyQueue is full");
+        resource->_pending = false;
+        return;
+    }
+
+    if (_task != nullptr)
+        xTaskNotifyGive(_task);
+}
+
+void MqttTransport::Connect()
+{
+    esp_mqtt_client_config_t config = {};
+    config.uri = CONFIG_IOTNODE_MQTT_BROKER_URI;
+    config.event_handle = &MqttTransport::ClientEvent;
+    config.user_context = this;
+    config.lwt_topic = kMqttStatusTopic;
+    config.lwt_msg = "offline";
+    config.lwt_qos = 1;
+    config.lwt_retain = 1;
+
+    _client = esp_mqtt_client_init(&config);
+    if (_client == nullptr)
+    {
+        ESP_LOGE(kTag, "esp_mqtt_client_init failed");
+        return;
+    }
+
+    esp_err_t ret = esp_mqtt_client_start(_client);
+    if (ret != ESP_OK)
+        ESP_LOGE(kTag, "esp_mqtt_client_start failed with %d (0x%X)", ret, ret);
+    else
+        ESP_LOGI(kTag, "Connecting to %s", CONFIG_IOTNODE_MQTT_BROKER_URI);
+}
+
+void MqttTransport::Subscribe()
+{
+    for (auto resource : _resources)
+    {
+        if ((resource->_methods & kMqttCommandMethods) == 0)
+            continue;
+
+        auto topic = kMqttTopicBase + resource->_uri + kMqttCommandSuffix;
+        if (esp_mqtt_client_subscribe(_client, topic.c_str(), 1) < 0)
+            ESP_LOGE(kTag, "Failed to subscribe to %s", topic.c_str());
+    }
+}
+
+void MqttTransport::Publish()
+{
+    // Anything still pending is already in _dirty or in the queue, never in both
+    MqttResource *queuedResource = nullptr;
+    while (_notifyQueue.Pop(queuedResource))
+        _dirty.push_back(queuedResource);
+
+    if (!_connected || _dirty.empty())
+        return;
+
+    auto published = _published;
+    auto bytes = _bytes;
+
+    size_t i = 0;
+    while (i < _dirty.size() && (kMqttQos == 0 || _inflight < kMqttMaxInflight) && Publish(_dirty[i]))
+        i++;
+    _dirty.erase(_dirty.begin(), _dirty.begin() + i);
+
+    ESP_LOGD(kTag, "Published %u resources, %u bytes, %u waiting (%u changes coalesced so far)",
+        _published - published, _bytes - bytes, (unsigned)_dirty.size(), _coalesced.load());
+}
+
+bool MqttTransport::Publish(MqttResource *resource)
+{
+    // Cleared first, a change while the state is built queues the resource again
+    resource->_pending = false;
+
+    BufferedCoapMessage request;
+    BufferedCoapMessage response;
+    CoapResult result;
+    request.SetCode(CoapMessageCode::Get, result);
+    request.AddOption(CoapStringOption(CoapOptionValue::UriPath, resource->_uri), result);
+    if (resource->_contentFormat >= 0)
+        request.AddOption(CoapUIntOption(CoapOptionValue::Accept, resource->_contentFormat), result);
+
+    MqttObserver observer(request);
+    resource->applicationResource->HandleNotify(&observer, &response, result);
+    if (result != CoapResult::OK || (response.GetCode() >> 5) != 2)
+    {
+        ESP_LOGW(kTag, "Not publishing /%s, HandleNotify returned %d.%02d", resource->_uri.c_str(), response.GetCode() >> 5, response.GetCode() & 0x1F);
+        return true;
+    }
+
+    auto topic = kMqttTopicBase + resource->_uri;
+    auto &payload = response.GetPayload();
+    int id = esp_mqtt_client_publish(_client, topic.c_str(), (const char *)payload.data(), payload.length(), kMqttQos, 1);
+    if (id < 0)
+    {
+        // Stays dirty, unless a newer change has queued it again meanwhile
+        ESP_LOGW(kTag, "Failed to publish %s", topic.c_str());
+        return resource->_pending.exchange(true);
+    }
+
+    if (kMqttQos > 0)
+        _inflight++;
+    _published++;
+    _bytes += topic.length() + payload.length();
+    return true;
+}
+
+void MqttTransport::HandleCommands()
+{
+    Command *command;
+    while (_commandQueue.Pop(command))
+    {
+        HandleCommand(*command);
+        delete command;
+    }
+}
+
+void MqttTransport::HandleCommand(Command const &command)
+{
+    for (auto resource : _resources)
+    {
+        if ((resource->_methods & kMqttCommandMethods) == 0)
+            continue;
+
+        if (command.Topic != kMqttTopicBase + resource->_uri + kMqttCommandSuffix)
+            continue;
+
+        BufferedCoapMessage request;
+        BufferedCoapMessage response;
+        CoapResult result;
+        request.SetCode((resource->_methods & (1 << CoapMessageCode::Post)) ? CoapMessageCode::Post : CoapMessageCode::Put, result);
+        request.AddOption(CoapStringOption(CoapOptionValue::UriPath, resource->_uri), result);
+        if (resource->_contentFormat >= 0)
+        {
+            request.AddOption(CoapUIntOption(CoapOptionValue::ContentFormat, resource->_contentFormat), result);
+            request.AddOption(CoapUIntOption(CoapOptionValue::Accept, resource->_contentFormat), result);
+        }
+        request.SetPayload(command.Data, result);
+
+        // A resulting change is published through NotifyObservers like any other
+        resource->applicationResource->HandleRequest(&request, &response, result);
+        if (result != CoapResult::OK || (response.GetCode() >> 5) != 2)
+            ESP_LOGW(kTag, "Command for /%s failed with %d.%02d", resource->_uri.c_str(), response.GetCode() >> 5, response.GetCode() & 0x1F);
+        return;
+    }
+
+    ESP_LOGW(kTag, "Message on unknown topic %s", command.Topic.c_str());
+}
+
+esp_err_t MqttTransport::ClientEvent(esp_mqtt_event_handle_t event)
+{
+    // Runs on the MQTT client's task
+    auto instance = static_cast<MqttTransport *>(event->user_context);
+    switch (event->event_id)
+    {
+        case MQTT_EVENT_CONNECTED:
+            ESP_LOGI(kTag, "Connected to broker");
+            instance->_inflight = 0;
+            instance->_connected = true;
+            esp_mqtt_client_publish(event->client, kMqttStatusTopic, "online", 0, 1, 1);
+            instance->_sessionStarted = true;
+            if (instance->_task != nullptr)
+                xTaskNotifyGive(instance->_task);
+            break;
+        case MQTT_EVENT_DISCONNECTED:
+            // Unacknowledged publishes are dropped with the session
+            instance->_connected = false;
+            instance->_inflight = 0;
+            ESP_LOGW(kTag, "Disconnected from broker, %u states published (%u bytes, %u changes coalesced)",
+                instance->_published, instance->_bytes, instance->_coalesced.load());
+            break;
+        case MQTT_EVENT_PUBLISHED:
+            if (instance->_inflight > 0)
+                instance->_inflight--;
+            if (instance->_task != nullptr)
+                xTaskNotifyGive(instance->_task);
+            break;
+        case MQTT_EVENT_DATA:
+            // Commands are small, larger messages would arrive in pieces
+            if (event->data_len != event->total_data_len)
+            {
+                ESP_LOGW(kTag, "Dropping %d byte message on %.*s", event->total_data_len, event->topic_len, event->topic);
+                break;
+            }
+            {
+                auto command = new Command{std::string(event->topic, event->topic_len), Payload((const uint8_t *)event->data, event->data_len)};
+                if (!instance->_commandQueue.Push(command))
+                {
+                    ESP_LOGW(kTag, "Dropping message on %s, _commandQueue is full", command->Topic.c_str());
+                    delete command;
+                    break;
+                }
+            }
+            if (instance->_task != nullptr)
+                xTaskNotifyGive(instance->_task);
+            break;
+        default:
+            break;
+    }
+    return ESP_OK;
+}
+
+void MqttTransport::TaskHandle(void *pvParameters)
+{
+    auto instance = static_cast<MqttTransport *>(pvParameters);
+
+    while (true)
+    {
+        // Woken by changes, commands, acknowledgements and the network coming up
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Commands don't wait for the batching window, the changes they make join it
+        instance->HandleCommands();
+
+        // Let the rest of a burst arrive, every resource in it is published once
+        if (kMqttBatchMs > 0 && instance->_networkReady)
+            vTaskDelay(kMqttBatchMs / portTICK_PERIOD_MS);
+
+        instance->Poll();
+    }
+}
+
+void MqttTransport::Poll()
+{
+    if (!_networkReady)
+        return;
+
+    if (_client == nullptr)
+        Connect();
+
+    if (_sessionStarted.exchange(false))
+    {
+        Subscribe();
+        // Whatever changed while disconnected is missing from the retained state
+        for (auto resource : _resources)
+        {
+            if (resource->_observable)
+                Queue(resource);
+        }
+    }
+
+    HandleCommands();
+    Publish();
+}
+
+MqttResource::MqttResource(MqttTransport * const mqtt, IApplicationResource * const applicationResource, const char* uri)
+    : ICoapResource(applicationResource), _mqtt(mqtt), _uri(uri), _methods(0), _observable(false), _pending(false),
+      _composite(nullptr), _contentFormat(-1)
+{
+}
+
+MqttResource::~MqttResource()
+{
+    auto &resources = _mqtt->_resources;
+    resources.erase(std::remove(resources.begin(), resources.end(), this), resources.end());
+    for (auto resource : resources)
+    {
+        if (resource->_composite == this)
+            resource->_composite = nullptr;
+    }
+}
+
+void MqttResource::RegisterHandler(CoapMessageCode requestType, CoapResult &result)
+{
+    if (requestType < CoapMessageCode::Get || requestType > CoapMessageCode::Delete)
+    {
+        result = CoapResult::Error;
+        return;
+    }
+    _methods |= 1 << requestType;
+    result = CoapResult::OK;
+}
+
+void MqttResource::RegisterAsObservable(CoapResult &result)
+{
+    _observable = true;
+    result = CoapResult::OK;
+}
+
+void MqttResource::SetAttributes(const char *resourceType, const char *interface, std::initializer_list<CoapContentType> contentFormats, CoapResult &result)
+{
+    // Topics carry no metadata, only the preferred format is kept for payloads both ways
+    _contentFormat = contentFormats.size() > 0 ? *contentFormats.begin() : -1;
+    result = CoapResult::OK;
+}
+
+void MqttResource::AddMember(IApplicationResource const *member, CoapResult &result)
+{
+    for (auto resource : _mqtt->_resources)
+    {
+        if (resource->applicationResource == member)
+        {
+            resource->_composite = this;
+            result = CoapResult::OK;
+            return;
+        }
+    }
+
+    ESP_LOGE(kTag, "MqttResource::AddMember: member has no resource");
+    result = CoapResult::Error;
+}
+
+void MqttResource::NotifyObservers(LatencyTrace const &trace, CoapResult &result)
+{
+    // Not observable means nobody asked to follow it, same as on CoAP
+    if (_observable)
+        _mqtt->QueueResourceNotification(this, result);
+    else
+        result = CoapResult::OK;
+
+    if (_composite != nullptr)
+    {
+        CoapResult compositeResult;
+        _composite->NotifyObservers(trace, compositeResult);
+    }
+}
+
+#endif // CONFIG_IOTNODE_MQTT
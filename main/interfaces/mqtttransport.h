@@ -0,0 +1,112 @@
+#ifndef _INTERFACES_MQTTTRANSPORT_H_
+#define _INTERFACES_MQTTTRANSPORT_H_
+
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_MQTT
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "mqtt_client.h"
+
+#include "coap.h"
+#include "lockfreequeue.h"
+
+static const int kMqttQos = CONFIG_IOTNODE_MQTT_QOS;
+static const int kMqttBatchMs = CONFIG_IOTNODE_MQTT_BATCH_MS;
+static const int kMqttMaxInflight = CONFIG_IOTNODE_MQTT_MAX_INFLIGHT;
+static const int kMqttNotifyQueueSize = 16;
+static const int kMqttCommandQueueSize = 8;
+
+class MqttResource;
+
+// Publishes resources over one persistent broker connection instead of serving them. Where CoAP
+// keeps an observation per client, the node here only knows the broker: NotifyObservers turns
+// into a single retained publish of what HandleNotify returns, and the broker fans it out.
+// Messages on a resource's command topic are handed to HandleRequest as a POST (or PUT).
+//
+// Publishes run on their own task, changes are coalesced per resource over the batching window
+// and while QoS 1 publishes are waiting for their acknowledgement. Commands are queued by the MQTT
+// client's task and run on ours too, which is the only one walking the resource list. Usually
+// attached to the UDP transport with LobaroCoap::AddTransport.
+class MqttTransport : public ICoapInterface
+{
+    friend class MqttResource;
+private:
+    xTaskHandle _task;
+    esp_mqtt_client_handle_t _client;
+    std::atomic<bool> _networkReady;
+    std::atomic<bool> _connected;
+    std::atomic<int> _inflight;
+    LockFreeQueue<MqttResource*, kMqttNotifyQueueSize> _notifyQueue;
+    // A message on a command topic, from the MQTT client's task to ours
+    struct Command
+    {
+        std::string Topic;
+        Payload Data;
+    };
+    LockFreeQueue<Command*, kMqttCommandQueueSize> _commandQueue;
+    // Set on every (re)connect, subscribing and republishing is left to our task
+    std::atomic<bool> _sessionStarted;
+    std::vector<MqttResource*> _resources;
+    // Changed resources not published yet, only used by the publishing task
+    std::vector<MqttResource*> _dirty;
+
+    uint32_t _published;
+    std::atomic<uint32_t> _coalesced;
+    uint32_t _bytes;
+
+    static void TaskHandle(void *pvParameters);
+    static esp_err_t ClientEvent(esp_mqtt_event_handle_t event);
+
+    void Connect();
+    void Subscribe();
+    void Publish();
+    bool Publish(MqttResource *resource);
+    void HandleCommands();
+    void HandleCommand(Command const &command);
+    void Queue(MqttResource *resource);
+public:
+    MqttTransport();
+    virtual ~MqttTransport();
+
+    void Start(CoapResult &result);
+    void CreateResource(CoapResource &resource, IApplicationResource * const applicationResource, const char* uri, CoapResult &result);
+    void QueueResourceNotification(ICoapResource *resource, CoapResult &result);
+
+    void SetNetworkReady(bool ready);
+
+    // One pass of the task without the batching delay: connects, subscribes after a (re)connect,
+    // runs the commands received and publishes what changed
+    void Poll();
+};
+
+class MqttResource : public ICoapResource
+{
+    friend class MqttTransport;
+    MqttTransport * const _mqtt;
+    std::string const _uri;
+    uint8_t _methods;
+    bool _observable;
+    // Set from a change until its publish is built, later changes ride along with that one
+    std::atomic<bool> _pending;
+    MqttResource *_composite;
+    int _contentFormat;
+public:
+    MqttResource(MqttTransport * const mqtt, IApplicationResource * const applicationResource, const char* uri);
+    virtual ~MqttResource();
+
+    void RegisterHandler(CoapMessageCode requestType, CoapResult &result);
+    void RegisterAsObservable(CoapResult &result);
+    void SetAttributes(const char *resourceType, const char *interface, std::initializer_list<CoapContentType> contentFormats, CoapResult &result);
+    void AddMember(IApplicationResource const *member, CoapResult &result);
+    void NotifyObservers(LatencyTrace const &trace, CoapResult &result);
+};
+
+#endif // CONFIG_IOTNODE_MQTT
+
+#endif // _INTERFACES_MQTTTRANSPORT_H_
@@ -0,0 +1,74 @@
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+#include "observeattributes.h"
+
+static uint32_t _ParsePeriod(const char *value)
+{
+    float seconds = std::strtof(value, nullptr);
+    return seconds > 0 ? static_cast<uint32_t>(seconds * 1000) : 0;
+}
+
+void ObserveAttributes::Parse(std::vector<std::string> const &queries)
+{
+    for (auto &query : queries)
+    {
+        auto separator = query.find('=');
+        if (separator == std::string::npos)
+            continue;
+
+        auto name = query.substr(0, separator);
+        auto value = query.c_str() + separator + 1;
+
+        if (name == "pmin")
+            MinPeriodMs = _ParsePeriod(value);
+        else if (name == "pmax")
+            MaxPeriodMs = _ParsePeriod(value);
+        else if (name == "gt")
+        {
+            GreaterThan = std::strtof(value, nullptr);
+            Flags |= HasGreaterThan;
+        }
+        else if (name == "lt")
+        {
+            LessThan = std::strtof(value, nullptr);
+            Flags |= HasLessThan;
+        }
+        else if (name == "st")
+        {
+            Step = std::fabs(std::strtof(value, nullptr));
+            Flags |= HasStep;
+        }
+    }
+
+    // pmax must not be shorter than pmin
+    if (MaxPeriodMs != 0 && MaxPeriodMs < MinPeriodMs)
+        MaxPeriodMs = MinPeriodMs;
+}
+
+void ObserveAttributes::Parse(ICoapObserver const *observer)
+{
+    CoapResult result;
+    std::vector<std::string> queries;
+    observer->GetOptions(queries, CoapOptionValue::UriQuery, result);
+    if (result == CoapResult::OK)
+        Parse(queries);
+}
+
+bool ObserveAttributes::IsNotable(float previous, float current) const
+{
+    if ((Flags & HasValueCondition) == 0)
+        return previous != current;
+
+    if ((Flags & HasGreaterThan) && (previous > GreaterThan) != (current > GreaterThan))
+        return true;
+
+    if ((Flags & HasLessThan) && (previous < LessThan) != (current < LessThan))
+        return true;
+
+    if ((Flags & HasStep) && std::fabs(current - previous) >= Step)
+        return true;
+
+    return false;
+}
@@ -0,0 +1,38 @@
+#ifndef _INTERFACES_OBSERVEATTRIBUTES_H_
+#define _INTERFACES_OBSERVEATTRIBUTES_H_
+
+#include <string>
+#include <vector>
+
+#include "coap.h"
+
+// Conditional observe attributes an observer can request through Uri-Query when it registers,
+// e.g. coap://node/switch?pmin=1&pmax=60 or coap://node/temp?st=0.5
+struct ObserveAttributes
+{
+    enum Flags : uint8_t
+    {
+        HasGreaterThan = (1 << 0),
+        HasLessThan    = (1 << 1),
+        HasStep        = (1 << 2),
+        HasValueCondition = HasGreaterThan | HasLessThan | HasStep,
+    };
+
+    uint32_t MinPeriodMs = 0; // pmin: never notify more often than this
+    uint32_t MaxPeriodMs = 0; // pmax: notify at least this often (0 = never)
+    float GreaterThan = 0;    // gt: notify when the value crosses above or back below this threshold
+    float LessThan = 0;       // lt: notify when the value crosses below or back above this threshold
+    float Step = 0;           // st: notify when the value moved at least this far since the last notification
+    uint8_t Flags = 0;
+
+    // Parses pmin, pmax, gt, lt and st out of Uri-Query values. Unknown queries are ignored.
+    void Parse(std::vector<std::string> const &queries);
+    void Parse(ICoapObserver const *observer);
+
+    // Whether a change from `previous` to `current` is worth notifying about
+    bool IsNotable(float previous, float current) const;
+
+    bool IsDefault() const { return MinPeriodMs == 0 && MaxPeriodMs == 0 && Flags == 0; }
+};
+
+#endif // _INTERFACES_OBSERVEATTRIBUTES_H_
@@ -0,0 +1,797 @@
+#include "oscore.h"
+
+#if CONFIG_IOTNODE_COAP_OSCORE
+
+#include <cstdio>
+#include <cstring>
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+#include "nvs.h"
+#include "mbedtls/md.h"
+
+extern "C" {
+    #include "interface/network/net_Endpoint.h"
+}
+
+static const char* kTag = "OSCORE";
+static const char* kNvsNamespace = "oscore";
+
+static const uint8_t kOscoreVersion = 1;
+static const uint8_t kOscoreAlgorithm = 10; // AES-CCM-16-64-128
+static const uint64_t kOscoreMaxSequence = (1ULL << 40) - 1;
+static const uint64_t kOscoreSequenceStep = 256;
+static const int64_t kOscoreExchangeLifetimeUs = 60 * 1000 * 1000LL;
+static const size_t kOscoreMaxInfoLength = 48;
+static const size_t kOscoreMaxAadLength = 48;
+static const int kOscoreReplayWindow = 32;
+
+// OSCORE option flags (RFC 8613 section 6.1)
+static const uint8_t kOscoreFlagPivMask = 0x07;
+static const uint8_t kOscoreFlagKid = 0x08;
+static const uint8_t kOscoreFlagKidContext = 0x10;
+static const uint8_t kOscoreFlagReserved = 0xE0;
+
+// Class U options stay in the outer message, everything else is encrypted
+static bool _IsOuterOption(uint16_t number)
+{
+    return number == CoapOptionValue::UriHost || number == CoapOptionValue::Observe || number == CoapOptionValue::UriPort
+        || number == CoapOptionValue::Oscore || number == CoapOptionValue::ProxyUri || number == CoapOptionValue::ProxyScheme;
+}
+
+// Byte (major type 2) or text (3) string, everything here is shorter than 256 bytes
+static void _CborString(uint8_t *buffer, size_t &offset, const uint8_t *data, size_t length, uint8_t major = 2)
+{
+    if (length < 24)
+        buffer[offset++] = (major << 5) | length;
+    else
+    {
+        buffer[offset++] = (major << 5) | 24;
+        buffer[offset++] = length;
+    }
+    if (length > 0)
+        memcpy(buffer + offset, data, length);
+    offset += length;
+}
+
+// HKDF-SHA-256 with info = [id, id_context, alg_aead, type, L] (RFC 8613 section 3.2.1)
+static bool _Derive(CoapOscoreOptions const &options, const uint8_t *id, size_t idLength, const char *type, uint8_t *output, size_t length)
+{
+    uint8_t info[kOscoreMaxInfoLength];
+    size_t infoLength = 0;
+    info[infoLength++] = 0x85;
+    _CborString(info, infoLength, id, idLength);
+    if (options.id_context_len > 0)
+        _CborString(info, infoLength, options.id_context_ptr, options.id_context_len);
+    else
+        info[infoLength++] = 0xF6; // nil
+    info[infoLength++] = kOscoreAlgorithm;
+    _CborString(info, infoLength, reinterpret_cast<const uint8_t *>(type), strlen(type), 3);
+    info[infoLength++] = length;
+    // Keys and the IV are shorter than one SHA-256 block, T(1) is all the expand step needs
+    info[infoLength++] = 0x01;
+
+    auto md = mbedtls_md_info_from_type(MBEDTLS_MD_SHA256);
+    uint8_t prk[32];
+    uint8_t okm[32];
+    if (mbedtls_md_hmac(md, options.master_salt_ptr, options.master_salt_len, options.master_secret_ptr, options.master_secret_len, prk) != 0
+        || mbedtls_md_hmac(md, prk, sizeof(prk), info, infoLength, okm) != 0)
+        return false;
+
+    memcpy(output, okm, length);
+    memset(prk, 0, sizeof(prk));
+    memset(okm, 0, sizeof(okm));
+    return true;
+}
+
+// Sender ID of whoever chose the Partial IV and the Partial IV, padded and mixed with the common IV (RFC 8613 section 5.2)
+static void _Nonce(const uint8_t *commonIv, const uint8_t *id, size_t idLength, const uint8_t *piv, size_t pivLength, uint8_t *nonce)
+{
+    memset(nonce, 0, kOscoreNonceLength);
+    nonce[0] = idLength;
+    memcpy(nonce + 1 + kOscoreMaxIdLength - idLength, id, idLength);
+    memcpy(nonce + kOscoreNonceLength - pivLength, piv, pivLength);
+    for (size_t i = 0; i < kOscoreNonceLength; i++)
+        nonce[i] ^= commonIv[i];
+}
+
+// Enc_structure with the external AAD of the request (RFC 8613 section 5.4), no class I options
+static size_t _Aad(const uint8_t *kid, size_t kidLength, const uint8_t *piv, size_t pivLength, uint8_t *aad)
+{
+    uint8_t external[kOscoreMaxAadLength];
+    size_t externalLength = 0;
+    external[externalLength++] = 0x85;
+    external[externalLength++] = kOscoreVersion;
+    external[externalLength++] = 0x81;
+    external[externalLength++] = kOscoreAlgorithm;
+    _CborString(external, externalLength, kid, kidLength);
+    _CborString(external, externalLength, piv, pivLength);
+    external[externalLength++] = 0x40;
+
+    size_t length = 0;
+    aad[length++] = 0x83;
+    _CborString(aad, length, reinterpret_cast<const uint8_t *>("Encrypt0"), 8, 3);
+    aad[length++] = 0x40;
+    _CborString(aad, length, external, externalLength);
+    return length;
+}
+
+static bool _IsFresh(uint64_t highest, uint32_t bitmap, uint64_t sequence)
+{
+    if (sequence > highest)
+        return true;
+    auto age = highest - sequence;
+    return age < kOscoreReplayWindow && (bitmap & (1u << age)) == 0;
+}
+
+ObjectSecurity::ObjectSecurity()
+{
+    for (auto &context : _contexts)
+    {
+        context.Active = false;
+        mbedtls_ccm_init(&context.SenderCcm);
+        mbedtls_ccm_init(&context.RecipientCcm);
+    }
+
+    for (auto &exchange : _exchanges)
+        exchange.Active = false;
+    for (auto &retired : _retired)
+        retired.Expires = 0;
+    for (auto &response : _responses)
+        response.Expires = 0;
+}
+
+ObjectSecurity::~ObjectSecurity()
+{
+    for (auto &context : _contexts)
+    {
+        mbedtls_ccm_free(&context.SenderCcm);
+        mbedtls_ccm_free(&context.RecipientCcm);
+    }
+}
+
+void ObjectSecurity::AddContext(CoapOscoreOptions const &options, CoapResult &result)
+{
+    result = CoapResult::Error;
+
+    if (options.master_secret_ptr == nullptr || options.master_secret_len == 0
+        || options.sender_id_len > kOscoreMaxIdLength || options.recipient_id_len > kOscoreMaxIdLength
+        || options.id_context_len > kOscoreMaxIdContextLength)
+    {
+        ESP_LOGE(kTag, "Invalid security context");
+        return;
+    }
+
+    int index = 0;
+    while (index < kOscoreMaxContexts && _contexts[index].Active)
+        index++;
+    if (index == kOscoreMaxContexts)
+    {
+        ESP_LOGE(kTag, "No room for another security context, see CONFIG_IOTNODE_COAP_OSCORE_CONTEXTS");
+        return;
+    }
+    auto &context = _contexts[index];
+
+    uint8_t senderKey[kOscoreKeyLength];
+    uint8_t recipientKey[kOscoreKeyLength];
+    auto derived = _Derive(options, options.sender_id_ptr, options.sender_id_len, "Key", senderKey, sizeof(senderKey))
+        && _Derive(options, options.recipient_id_ptr, options.recipient_id_len, "Key", recipientKey, sizeof(recipientKey))
+        && _Derive(options, nullptr, 0, "IV", context.CommonIv, sizeof(context.CommonIv))
+        && mbedtls_ccm_setkey(&context.SenderCcm, MBEDTLS_CIPHER_ID_AES, senderKey, kOscoreKeyLength * 8) == 0
+        && mbedtls_ccm_setkey(&context.RecipientCcm, MBEDTLS_CIPHER_ID_AES, recipientKey, kOscoreKeyLength * 8) == 0;
+
+    // Only the key schedules are kept
+    memset(senderKey, 0, sizeof(senderKey));
+    memset(recipientKey, 0, sizeof(recipientKey));
+
+    if (!derived)
+    {
+        ESP_LOGE(kTag, "Failed to derive keys for security context %d", index);
+        return;
+    }
+
+    // Empty IDs are valid and may come without a pointer
+    context.SenderIdLength = options.sender_id_len;
+    if (options.sender_id_len > 0)
+        memcpy(context.SenderId, options.sender_id_ptr, options.sender_id_len);
+    context.RecipientIdLength = options.recipient_id_len;
+    if (options.recipient_id_len > 0)
+        memcpy(context.RecipientId, options.recipient_id_ptr, options.recipient_id_len);
+    context.IdContextLength = options.id_context_len;
+    if (options.id_context_len > 0)
+        memcpy(context.IdContext, options.id_context_ptr, options.id_context_len);
+
+    // Sequence numbers belong to the sender key, stored under a hash of what it's derived from
+    // besides the secret (NVS keys are at most 15 characters)
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < context.SenderIdLength; i++)
+        hash = (hash ^ context.SenderId[i]) * 16777619u;
+    for (size_t i = 0; i < context.IdContextLength; i++)
+        hash = (hash ^ context.IdContext[i]) * 16777619u;
+    snprintf(context.SequenceKey, sizeof(context.SequenceKey), "seq%08x", hash);
+
+    uint64_t stored = 0;
+    nvs_handle handle;
+    if (nvs_open(kNvsNamespace, NVS_READONLY, &handle) == ESP_OK)
+    {
+        nvs_get_u64(handle, context.SequenceKey, &stored);
+        nvs_close(handle);
+    }
+
+    context.SenderSequence = stored;
+    context.SenderSequenceLimit = stored;
+    if (!PersistSequence(context, stored + kOscoreSequenceStep))
+        return;
+
+    context.ReplaySynced = false;
+    context.ReplayHighest = 0;
+    context.ReplayBitmap = 0;
+
+    if (index == 0)
+    {
+        for (size_t i = 0; i < kOscoreEchoLength; i += sizeof(uint32_t))
+        {
+            uint32_t random = esp_random();
+            memcpy(_echo + i, &random, sizeof(random));
+        }
+    }
+
+    context.Active = true;
+    result = CoapResult::OK;
+    ESP_LOGI(kTag, "Security context %d ready, sender sequence number %u", index, static_cast<unsigned>(stored));
+}
+
+bool ObjectSecurity::PersistSequence(Context &context, uint64_t limit)
+{
+    nvs_handle handle;
+    esp_err_t err = nvs_open(kNvsNamespace, NVS_READWRITE, &handle);
+    if (err == ESP_OK)
+    {
+        err = nvs_set_u64(handle, context.SequenceKey, limit);
+        if (err == ESP_OK)
+            err = nvs_commit(handle);
+        nvs_close(handle);
+    }
+
+    if (err != ESP_OK)
+    {
+        ESP_LOGE(kTag, "Failed to persist sender sequence number: %d", err);
+        return false;
+    }
+
+    context.SenderSequenceLimit = limit;
+    return true;
+}
+
+bool ObjectSecurity::NextSequence(Context &context, uint8_t *piv, size_t &pivLength)
+{
+    if (context.SenderSequence > kOscoreMaxSequence)
+    {
+        ESP_LOGE(kTag, "Sender sequence numbers exhausted, the security context needs renewing");
+        return false;
+    }
+
+    // A number past the persisted limit could be used again after a reboot
+    if (context.SenderSequence >= context.SenderSequenceLimit
+        && !PersistSequence(context, context.SenderSequenceLimit + kOscoreSequenceStep))
+        return false;
+
+    auto sequence = context.SenderSequence++;
+
+    // Shortest big-endian encoding, at least one byte
+    pivLength = 1;
+    while (pivLength < kOscoreMaxPivLength && (sequence >> (8 * pivLength)) != 0)
+        pivLength++;
+    for (size_t i = 0; i < pivLength; i++)
+        piv[i] = sequence >> (8 * (pivLength - 1 - i));
+    return true;
+}
+
+ObjectSecurity::Context *ObjectSecurity::FindContext(const uint8_t *kid, size_t kidLength, const uint8_t *idContext, size_t idContextLength)
+{
+    for (auto &context : _contexts)
+    {
+        if (!context.Active || context.RecipientIdLength != kidLength || memcmp(context.RecipientId, kid, kidLength) != 0)
+            continue;
+
+        // The ID context is optional in requests
+        if (idContext != nullptr
+            && (context.IdContextLength != idContextLength || memcmp(context.IdContext, idContext, idContextLength) != 0))
+            continue;
+
+        return &context;
+    }
+    return nullptr;
+}
+
+ObjectSecurity::Exchange *ObjectSecurity::FindExchange(NetEp_t const &remote, CoapPacket const &packet)
+{
+    auto now = esp_timer_get_time();
+    for (auto &exchange : _exchanges)
+    {
+        if (!exchange.Active)
+            continue;
+
+        if (!exchange.Observe && now - exchange.LastUsed > kOscoreExchangeLifetimeUs)
+        {
+            Retire(exchange, now);
+            continue;
+        }
+
+        if (EpAreEqual(&exchange.Ep, &remote) && exchange.TokenLength == packet.GetTokenLength()
+            && memcmp(exchange.Token, packet.GetToken(), exchange.TokenLength) == 0)
+            return &exchange;
+    }
+    return nullptr;
+}
+
+void ObjectSecurity::TrackExchange(NetEp_t const &remote, CoapPacket const &request, uint8_t context, const uint8_t *piv, size_t pivLength, bool observe)
+{
+    // Reuse the slot of an earlier request with the same token (e.g. a re-registration), a free
+    // one, or failing that the one used least recently
+    auto slot = FindExchange(remote, request);
+    if (slot == nullptr)
+    {
+        for (auto &exchange : _exchanges)
+        {
+            if (!exchange.Active)
+            {
+                slot = &exchange;
+                break;
+            }
+            if (slot == nullptr || exchange.LastUsed < slot->LastUsed)
+                slot = &exchange;
+        }
+
+        if (slot->Active)
+        {
+            ESP_LOGW(kTag, "Out of exchange slots, replacing the least recently used");
+            Retire(*slot, esp_timer_get_time());
+        }
+    }
+
+    slot->Active = true;
+    slot->Ep = remote;
+    slot->LastUsed = esp_timer_get_time();
+    slot->Observe = observe;
+    slot->MessageId = request.GetMessageId();
+    slot->Context = context;
+    slot->TokenLength = request.GetTokenLength();
+    memcpy(slot->Token, request.GetToken(), slot->TokenLength);
+    slot->PivLength = pivLength;
+    memcpy(slot->Piv, piv, pivLength);
+}
+
+void ObjectSecurity::Retire(Exchange &exchange, int64_t now)
+{
+    // An expired slot, or failing that the one that expires first
+    auto slot = &_retired[0];
+    for (auto &retired : _retired)
+    {
+        if (retired.Expires < slot->Expires)
+            slot = &retired;
+        if (retired.Expires <= now)
+            break;
+    }
+
+    // Lobaro answers a request within its lifetime, but keeps notifying an observer until it
+    // gives up on it
+    slot->Ep = exchange.Ep;
+    slot->Expires = exchange.Observe ? INT64_MAX : now + kOscoreExchangeLifetimeUs;
+    slot->TokenLength = exchange.TokenLength;
+    memcpy(slot->Token, exchange.Token, exchange.TokenLength);
+
+    exchange.Active = false;
+}
+
+ObjectSecurity::Retired *ObjectSecurity::FindRetired(NetEp_t const &remote, CoapPacket const &packet, int64_t now)
+{
+    for (auto &retired : _retired)
+    {
+        if (retired.Expires > now && EpAreEqual(&retired.Ep, &remote) && retired.TokenLength == packet.GetTokenLength()
+            && memcmp(retired.Token, packet.GetToken(), retired.TokenLength) == 0)
+            return &retired;
+    }
+    return nullptr;
+}
+
+void ObjectSecurity::CacheResponse(NetEp_t const &remote, uint16_t messageId, const uint8_t *data, size_t size, int64_t now)
+{
+    auto slot = &_responses[0];
+    for (auto &response : _responses)
+    {
+        if (response.Expires < slot->Expires)
+            slot = &response;
+    }
+
+    // Covers the client's retransmissions (MAX_TRANSMIT_SPAN, RFC 7252 section 4.8.2)
+    slot->Ep = remote;
+    slot->Expires = now + kOscoreExchangeLifetimeUs;
+    slot->MessageId = messageId;
+    slot->Size = size;
+    memcpy(slot->Data, data, size);
+}
+
+bool ObjectSecurity::IsDuplicate(NetEp_t const &remote, CoapPacket const &request, const uint8_t *piv, size_t pivLength, uint8_t *&message, size_t &size, bool &reply)
+{
+    if (request.GetType() != CoapMessageType::Confirmable)
+        return false;
+
+    auto now = esp_timer_get_time();
+    for (auto &response : _responses)
+    {
+        if (response.Expires > now && response.MessageId == request.GetMessageId() && EpAreEqual(&response.Ep, &remote))
+        {
+            ESP_LOGD(kTag, "Retransmitted request %u, sending the response again", request.GetMessageId());
+            message = response.Data;
+            size = response.Size;
+            reply = true;
+            return true;
+        }
+    }
+
+    // Not answered yet, or answered separately. Lobaro has seen the original, nothing to do.
+    for (auto &exchange : _exchanges)
+    {
+        if (exchange.Active && exchange.MessageId == request.GetMessageId() && EpAreEqual(&exchange.Ep, &remote)
+            && exchange.PivLength == pivLength && memcmp(exchange.Piv, piv, pivLength) == 0)
+        {
+            ESP_LOGD(kTag, "Retransmitted request %u without a response to repeat, dropped", request.GetMessageId());
+            return true;
+        }
+    }
+    return false;
+}
+
+void ObjectSecurity::Reject(CoapPacket const &request, CoapMessageCode code, const char *diagnostic, uint8_t *&message, size_t &size, bool &reply)
+{
+    // Errors in OSCORE processing itself go back unprotected (RFC 8613 section 8.2)
+    ESP_LOGW(kTag, "Rejecting request: %s", diagnostic);
+
+    auto confirmable = request.GetType() == CoapMessageType::Confirmable;
+    size_t offset = CoapPacket::WriteEmpty(_protected,
+        confirmable ? CoapMessageType::Acknowledgement : CoapMessageType::NonConfirmable,
+        confirmable ? request.GetMessageId() : static_cast<uint16_t>(esp_random()));
+    _protected[0] |= request.GetTokenLength();
+    _protected[1] = code;
+    memcpy(_protected + offset, request.GetToken(), request.GetTokenLength());
+    offset += request.GetTokenLength();
+
+    // Max-Age 0, not to be cached
+    uint16_t previous = 0;
+    CoapWriteOption(_protected, sizeof(_protected), offset, previous, CoapOptionValue::MaxAge, nullptr, 0);
+
+    size_t length = strlen(diagnostic);
+    _protected[offset++] = 0xFF;
+    memcpy(_protected + offset, diagnostic, length);
+    offset += length;
+
+    message = _protected;
+    size = offset;
+    reply = true;
+}
+
+void ObjectSecurity::Challenge(CoapPacket const &request, uint8_t *&message, size_t &size, bool &reply)
+{
+    // 4.01 with an Echo option the client has to repeat in its next request. It's a response to
+    // a tracked exchange, so it gets protected on its way out like any other.
+    auto confirmable = request.GetType() == CoapMessageType::Confirmable;
+    size_t offset = CoapPacket::WriteEmpty(_message,
+        confirmable ? CoapMessageType::Acknowledgement : CoapMessageType::NonConfirmable,
+        confirmable ? request.GetMessageId() : static_cast<uint16_t>(esp_random()));
+    _message[0] |= request.GetTokenLength();
+    _message[1] = CoapMessageCode::Unauthorized;
+    memcpy(_message + offset, request.GetToken(), request.GetTokenLength());
+    offset += request.GetTokenLength();
+
+    uint16_t previous = 0;
+    CoapWriteOption(_message, sizeof(_message), offset, previous, CoapOptionValue::Echo, _echo, sizeof(_echo));
+
+    message = _message;
+    size = offset;
+    reply = true;
+}
+
+void ObjectSecurity::Unprotect(NetEp_t const &remote, uint8_t *&message, size_t &size, bool &reply, CoapResult &result)
+{
+    reply = false;
+
+    CoapPacket request(message, size);
+    request.Parse(result);
+    if (result != CoapResult::OK || !request.IsRequest())
+    {
+        result = CoapResult::OK;
+        return;
+    }
+
+    const uint8_t *option;
+    size_t optionLength;
+    request.GetOption(CoapOptionValue::Oscore, option, optionLength, result);
+    if (result != CoapResult::OK)
+    {
+        // A plain request reusing the token of a retired protected one starts a plain exchange
+        auto retired = FindRetired(remote, request, esp_timer_get_time());
+        if (retired != nullptr)
+            retired->Expires = 0;
+        result = CoapResult::OK;
+        return;
+    }
+
+    // Requests always carry a Partial IV and a kid
+    uint8_t flags = optionLength > 0 ? option[0] : 0;
+    size_t pivLength = flags & kOscoreFlagPivMask;
+    size_t offset = 1 + pivLength;
+    if ((flags & kOscoreFlagReserved) != 0 || (flags & kOscoreFlagKid) == 0
+        || pivLength == 0 || pivLength > kOscoreMaxPivLength || offset > optionLength)
+        return Reject(request, CoapMessageCode::BadOption, "Malformed OSCORE option", message, size, reply);
+    const uint8_t *piv = option + 1;
+
+    // A retransmission repeats the Partial IV, it must not be taken for a replay
+    if (IsDuplicate(remote, request, piv, pivLength, message, size, reply))
+    {
+        result = reply ? CoapResult::OK : CoapResult::Error;
+        return;
+    }
+
+    const uint8_t *idContext = nullptr;
+    size_t idContextLength = 0;
+    if ((flags & kOscoreFlagKidContext) != 0)
+    {
+        if (offset >= optionLength || offset + 1 + option[offset] > optionLength)
+            return Reject(request, CoapMessageCode::BadOption, "Malformed OSCORE option", message, size, reply);
+        idContextLength = option[offset];
+        idContext = option + offset + 1;
+        offset += 1 + idContextLength;
+    }
+    const uint8_t *kid = option + offset;
+    size_t kidLength = optionLength - offset;
+
+    auto context = FindContext(kid, kidLength, idContext, idContextLength);
+    if (context == nullptr)
+        return Reject(request, CoapMessageCode::Unauthorized, "Security context not found", message, size, reply);
+
+    uint64_t sequence = 0;
+    for (size_t i = 0; i < pivLength; i++)
+        sequence = (sequence << 8) | piv[i];
+
+    // Cheap enough to check before spending an AEAD pass on it
+    if (context->ReplaySynced && !_IsFresh(context->ReplayHighest, context->ReplayBitmap, sequence))
+        return Reject(request, CoapMessageCode::Unauthorized, "Replay detected", message, size, reply);
+
+    auto payloadOffset = request.GetPayloadOffset();
+    if (payloadOffset >= size || size - payloadOffset <= kOscoreTagLength)
+        return Reject(request, CoapMessageCode::BadRequest, "Decryption failed", message, size, reply);
+
+    uint8_t nonce[kOscoreNonceLength];
+    _Nonce(context->CommonIv, kid, kidLength, piv, pivLength, nonce);
+    uint8_t aad[kOscoreMaxAadLength];
+    size_t aadLength = _Aad(kid, kidLength, piv, pivLength, aad);
+
+    // Decrypted where it is, in the received datagram
+    uint8_t *plaintext = message + payloadOffset;
+    size_t length = size - payloadOffset - kOscoreTagLength;
+    if (mbedtls_ccm_auth_decrypt(&context->RecipientCcm, length, nonce, sizeof(nonce), aad, aadLength,
+            plaintext, plaintext, plaintext + length, kOscoreTagLength) != 0)
+        return Reject(request, CoapMessageCode::BadRequest, "Decryption failed", message, size, reply);
+
+    // Rebuild a plain request for lobaro: original header and token, the inner code, inner
+    // options merged in order with the outer class U ones, and the inner payload
+    size_t tokenEnd = kCoapHeaderSize + request.GetTokenLength();
+    memcpy(_message, message, tokenEnd);
+    _message[1] = plaintext[0];
+
+    offset = tokenEnd;
+    uint16_t previous = 0;
+    uint16_t lastInner = 0;
+    size_t innerOffset = 1;
+    size_t outerOffset = request.GetOptionsOffset();
+    uint16_t innerNumber = 0;
+    uint16_t outerNumber = 0;
+    const uint8_t *innerValue;
+    const uint8_t *outerValue;
+    size_t innerLength;
+    size_t outerLength;
+    bool inner = CoapNextOption(plaintext, length, innerOffset, innerNumber, innerValue, innerLength);
+    bool outer = CoapNextOption(message, size, outerOffset, outerNumber, outerValue, outerLength);
+    bool fits = true;
+    while (fits && (inner || outer))
+    {
+        if (inner && (!outer || innerNumber <= outerNumber))
+        {
+            fits = CoapWriteOption(_message, sizeof(_message), offset, previous, innerNumber, innerValue, innerLength);
+            lastInner = innerNumber;
+            inner = CoapNextOption(plaintext, length, innerOffset, innerNumber, innerValue, innerLength);
+        }
+        else
+        {
+            // An inner option wins over an outer one with the same number
+            if (_IsOuterOption(outerNumber) && outerNumber != CoapOptionValue::Oscore && outerNumber != lastInner)
+                fits = CoapWriteOption(_message, sizeof(_message), offset, previous, outerNumber, outerValue, outerLength);
+            outer = CoapNextOption(message, size, outerOffset, outerNumber, outerValue, outerLength);
+        }
+    }
+
+    if (!fits || (innerOffset < length && plaintext[innerOffset] != 0xFF))
+        return Reject(request, CoapMessageCode::BadOption, "Malformed inner options", message, size, reply);
+
+    if (innerOffset < length)
+    {
+        if (offset + length - innerOffset > sizeof(_message))
+            return Reject(request, CoapMessageCode::RequestEntityTooLarge, "Request too large", message, size, reply);
+        memcpy(_message + offset, plaintext + innerOffset, length - innerOffset);
+        offset += length - innerOffset;
+    }
+
+    CoapPacket unprotected(_message, offset);
+    unprotected.Parse(result);
+    if (result != CoapResult::OK)
+        return Reject(request, CoapMessageCode::BadRequest, "Malformed request", message, size, reply);
+
+    const uint8_t *value;
+    size_t valueLength;
+    CoapResult optionResult;
+    unprotected.GetOption(CoapOptionValue::Observe, value, valueLength, optionResult);
+    bool observe = optionResult == CoapResult::OK && CoapDecodeUInt(value, valueLength) == 0;
+
+    TrackExchange(remote, request, context - _contexts, piv, pivLength, observe);
+
+    // After a reboot the replay window is unknown. The first request is answered with an Echo
+    // challenge and the window starts at the one that returns it (RFC 8613 appendix B.1.2).
+    if (!context->ReplaySynced)
+    {
+        unprotected.GetOption(CoapOptionValue::Echo, value, valueLength, optionResult);
+        if (optionResult != CoapResult::OK || valueLength != sizeof(_echo) || memcmp(value, _echo, sizeof(_echo)) != 0)
+        {
+            Challenge(request, message, size, reply);
+            result = CoapResult::OK;
+            return;
+        }
+
+        context->ReplaySynced = true;
+        context->ReplayHighest = sequence;
+        context->ReplayBitmap = 1;
+    }
+    else if (sequence > context->ReplayHighest)
+    {
+        auto shift = sequence - context->ReplayHighest;
+        context->ReplayBitmap = shift >= kOscoreReplayWindow ? 1 : (context->ReplayBitmap << shift) | 1;
+        context->ReplayHighest = sequence;
+    }
+    else
+        context->ReplayBitmap |= 1u << (context->ReplayHighest - sequence);
+
+    message = _message;
+    size = offset;
+    result = CoapResult::OK;
+}
+
+void ObjectSecurity::Protect(NetEp_t const &remote, uint8_t *&message, size_t &size, CoapResult &result)
+{
+    result = CoapResult::OK;
+
+    CoapPacket response(message, size);
+    CoapResult parseResult;
+    response.Parse(parseResult);
+    if (parseResult != CoapResult::OK || response.GetCode() == CoapMessageCode::None || response.IsRequest())
+        return;
+
+    // A cached response sent again is protected already
+    const uint8_t *value;
+    size_t length;
+    response.GetOption(CoapOptionValue::Oscore, value, length, parseResult);
+    if (parseResult == CoapResult::OK)
+        return;
+
+    auto now = esp_timer_get_time();
+    auto exchange = FindExchange(remote, response);
+    if (exchange == nullptr)
+    {
+        // Fail closed, a response to a protected request never goes out in the clear
+        if (FindRetired(remote, response, now) != nullptr)
+        {
+            ESP_LOGW(kTag, "Dropped a %d.%02d response to a protected request no longer tracked",
+                response.GetCodeClass(), response.GetCode() & 0x1F);
+            result = CoapResult::Error;
+        }
+        return;
+    }
+
+    auto &context = _contexts[exchange->Context];
+    result = CoapResult::Error;
+
+    const uint8_t *observe;
+    size_t observeLength;
+    response.GetOption(CoapOptionValue::Observe, observe, observeLength, parseResult);
+    bool notification = parseResult == CoapResult::OK;
+    if (!notification)
+        exchange->Observe = false;
+
+    // Notifications carry a Partial IV of their own, other responses reuse the request's nonce
+    uint8_t piv[kOscoreMaxPivLength];
+    size_t pivLength = 0;
+    uint8_t nonce[kOscoreNonceLength];
+    if (notification)
+    {
+        if (!NextSequence(context, piv, pivLength))
+            return;
+        _Nonce(context.CommonIv, context.SenderId, context.SenderIdLength, piv, pivLength, nonce);
+    }
+    else
+        _Nonce(context.CommonIv, context.RecipientId, context.RecipientIdLength, exchange->Piv, exchange->PivLength, nonce);
+
+    uint8_t aad[kOscoreMaxAadLength];
+    size_t aadLength = _Aad(context.RecipientId, context.RecipientIdLength, exchange->Piv, exchange->PivLength, aad);
+
+    // Outer message: original header and token, a code that gives nothing away, Observe for
+    // any proxy in between, and the OSCORE option
+    size_t tokenEnd = kCoapHeaderSize + response.GetTokenLength();
+    memcpy(_protected, message, tokenEnd);
+    _protected[1] = notification ? CoapMessageCode::Content : CoapMessageCode::Changed;
+
+    size_t offset = tokenEnd;
+    uint16_t previous = 0;
+    if (notification)
+        CoapWriteOption(_protected, sizeof(_protected), offset, previous, CoapOptionValue::Observe, observe, observeLength);
+
+    uint8_t option[1 + kOscoreMaxPivLength];
+    size_t optionLength = 0;
+    if (pivLength > 0)
+    {
+        option[0] = pivLength;
+        memcpy(option + 1, piv, pivLength);
+        optionLength = 1 + pivLength;
+    }
+    CoapWriteOption(_protected, sizeof(_protected), offset, previous, CoapOptionValue::Oscore, option, optionLength);
+    _protected[offset++] = 0xFF;
+
+    // The plaintext is laid out after the payload marker and encrypted in place
+    size_t plaintext = offset;
+    _protected[offset++] = response.GetCode();
+
+    previous = 0;
+    size_t optionOffset = response.GetOptionsOffset();
+    uint16_t number = 0;
+    while (CoapNextOption(message, size, optionOffset, number, value, length))
+    {
+        if (_IsOuterOption(number))
+            continue;
+
+        if (!CoapWriteOption(_protected, sizeof(_protected) - kOscoreTagLength, offset, previous, number, value, length))
+        {
+            ESP_LOGE(kTag, "Response too large to protect");
+            return;
+        }
+    }
+
+    auto payloadOffset = response.GetPayloadOffset();
+    if (payloadOffset < size)
+    {
+        // Payload with its marker
+        length = size - payloadOffset + 1;
+        if (offset + length + kOscoreTagLength > sizeof(_protected))
+        {
+            ESP_LOGE(kTag, "Response too large to protect");
+            return;
+        }
+        memcpy(_protected + offset, message + payloadOffset - 1, length);
+        offset += length;
+    }
+
+    if (mbedtls_ccm_encrypt_and_tag(&context.SenderCcm, offset - plaintext, nonce, sizeof(nonce), aad, aadLength,
+            _protected + plaintext, _protected + plaintext, _protected + offset, kOscoreTagLength) != 0)
+    {
+        ESP_LOGE(kTag, "mbedtls_ccm_encrypt_and_tag( ... ): Failed");
+        return;
+    }
+    offset += kOscoreTagLength;
+
+    if (response.GetType() == CoapMessageType::Acknowledgement)
+        CacheResponse(remote, response.GetMessageId(), _protected, offset, now);
+
+    exchange->LastUsed = now;
+    message = _protected;
+    size = offset;
+    result = CoapResult::OK;
+}
+
+#endif // CONFIG_IOTNODE_COAP_OSCORE
@@ -0,0 +1,151 @@
+#ifndef _INTERFACES_OSCORE_H_
+#define _INTERFACES_OSCORE_H_
+
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_OSCORE
+
+#include <cstddef>
+#include <cstdint>
+
+#include "mbedtls/ccm.h"
+
+#include "coap.h"
+#include "coappacket.h"
+
+extern "C" {
+    #include "liblobaro_coap.h"
+}
+
+static const int kOscoreMaxContexts = CONFIG_IOTNODE_COAP_OSCORE_CONTEXTS;
+static const int kOscoreExchangeSlots = 8;
+static const int kOscoreRetiredSlots = 2 * kOscoreExchangeSlots;
+static const int kOscoreResponseSlots = 2;
+
+// AES-CCM-16-64-128, the mandatory to implement algorithm
+static const size_t kOscoreKeyLength = 16;
+static const size_t kOscoreNonceLength = 13;
+static const size_t kOscoreTagLength = 8;
+static const size_t kOscoreMaxIdLength = kOscoreNonceLength - 6;
+static const size_t kOscoreMaxIdContextLength = 8;
+static const size_t kOscoreMaxPivLength = 5;
+static const size_t kOscoreEchoLength = 8;
+static const size_t kOscoreMaxMessageSize = 1152;
+static const size_t kOscoreMaxProtectedSize = kOscoreMaxMessageSize + kOscoreTagLength + 16;
+
+// Object security for CoAP (RFC 8613), server side. Sits between the socket and lobaro:
+// protected requests are verified and decrypted back into plain CoAP before lobaro sees them,
+// and the responses to them are encrypted on their way out. No handshake and no per-client
+// session, a message costs one AEAD pass and a few bytes of option.
+//
+// Keys, the common IV and the AES key schedules are derived once when a context is added.
+// Contexts must be added before the transport starts, everything else is only to be used from
+// the network task.
+class ObjectSecurity
+{
+public:
+    ObjectSecurity();
+    ~ObjectSecurity();
+
+    void AddContext(CoapOscoreOptions const &options, CoapResult &result);
+
+    // Turns a protected request into plain CoAP. On return `message` and `size` describe the
+    // request to hand to lobaro, or when `reply` is set, a response to send back instead.
+    // Requests without an OSCORE option are left alone.
+    void Unprotect(NetEp_t const &remote, uint8_t *&message, size_t &size, bool &reply, CoapResult &result);
+
+    // Protects a response to a request that came in protected, anything else is left alone.
+    // Result is Error if the response must not be sent, e.g. one to a protected request that
+    // is no longer tracked.
+    void Protect(NetEp_t const &remote, uint8_t *&message, size_t &size, CoapResult &result);
+private:
+    struct Context
+    {
+        bool Active;
+        uint8_t SenderIdLength;
+        uint8_t SenderId[kOscoreMaxIdLength];
+        uint8_t RecipientIdLength;
+        uint8_t RecipientId[kOscoreMaxIdLength];
+        uint8_t IdContextLength;
+        uint8_t IdContext[kOscoreMaxIdContextLength];
+        uint8_t CommonIv[kOscoreNonceLength];
+        mbedtls_ccm_context SenderCcm;
+        mbedtls_ccm_context RecipientCcm;
+
+        // Sequence numbers up to the limit may have been used before a reboot, the limit is kept
+        // in NVS and moved ahead in steps so it's rarely written
+        uint64_t SenderSequence;
+        uint64_t SenderSequenceLimit;
+        char SequenceKey[16];
+
+        // Highest accepted sequence number and a bitmap of the 32 below it (RFC 8613 section
+        // 7.4). Not kept across reboots, the window is re-established with an Echo round trip.
+        bool ReplaySynced;
+        uint64_t ReplayHighest;
+        uint32_t ReplayBitmap;
+    };
+    Context _contexts[kOscoreMaxContexts];
+
+    // A protected request whose responses must be protected, kept for the lifetime of the
+    // observation if it registered one
+    struct Exchange
+    {
+        NetEp_t Ep;
+        int64_t LastUsed;
+        bool Active;
+        bool Observe;
+        uint16_t MessageId;
+        uint8_t Context;
+        uint8_t TokenLength;
+        uint8_t Token[kCoapMaxTokenLength];
+        uint8_t PivLength;
+        uint8_t Piv[kOscoreMaxPivLength];
+    };
+    Exchange _exchanges[kOscoreExchangeSlots];
+
+    // Endpoint and token of exchanges that expired or had to make room for another. Lobaro may
+    // still answer or notify them, those responses are dropped instead of going out in the clear.
+    struct Retired
+    {
+        NetEp_t Ep;
+        int64_t Expires;
+        uint8_t TokenLength;
+        uint8_t Token[kCoapMaxTokenLength];
+    };
+    Retired _retired[kOscoreRetiredSlots];
+
+    // Protected piggybacked responses. A retransmitted request gets the same response again
+    // (RFC 7252 section 4.5) instead of being taken for a replay.
+    struct CachedResponse
+    {
+        NetEp_t Ep;
+        int64_t Expires;
+        uint16_t MessageId;
+        uint16_t Size;
+        uint8_t Data[kOscoreMaxProtectedSize];
+    };
+    CachedResponse _responses[kOscoreResponseSlots];
+
+    uint8_t _echo[kOscoreEchoLength];
+
+    // Decrypted requests handed to lobaro and protected responses going out
+    uint8_t _message[kOscoreMaxMessageSize];
+    uint8_t _protected[kOscoreMaxProtectedSize];
+
+    Context *FindContext(const uint8_t *kid, size_t kidLength, const uint8_t *idContext, size_t idContextLength);
+    Exchange *FindExchange(NetEp_t const &remote, CoapPacket const &packet);
+    void TrackExchange(NetEp_t const &remote, CoapPacket const &request, uint8_t context, const uint8_t *piv, size_t pivLength, bool observe);
+    void Retire(Exchange &exchange, int64_t now);
+    Retired *FindRetired(NetEp_t const &remote, CoapPacket const &packet, int64_t now);
+    void CacheResponse(NetEp_t const &remote, uint16_t messageId, const uint8_t *data, size_t size, int64_t now);
+    bool IsDuplicate(NetEp_t const &remote, CoapPacket const &request, const uint8_t *piv, size_t pivLength, uint8_t *&message, size_t &size, bool &reply);
+    bool NextSequence(Context &context, uint8_t *piv, size_t &pivLength);
+    bool PersistSequence(Context &context, uint64_t limit);
+
+    void Reject(CoapPacket const &request, CoapMessageCode code, const char *diagnostic, uint8_t *&message, size_t &size, bool &reply);
+    void Challenge(CoapPacket const &request, uint8_t *&message, size_t &size, bool &reply);
+};
+
+#endif // CONFIG_IOTNODE_COAP_OSCORE
+
+#endif // _INTERFACES_OSCORE_H_
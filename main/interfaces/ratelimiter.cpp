@@ -0,0 +1,105 @@
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_RATE_LIMIT
+
+#include <algorithm>
+#include <cstring>
+
+#include "esp_log.h"
+
+#include "bufferedmessage.h"
+#include "ratelimiter.h"
+
+extern "C" {
+    #include "interface/network/net_Endpoint.h"
+}
+
+static const char *kTag = "CoAP-RateLimit";
+
+static const uint32_t kTokenScale = 1000;
+static const uint32_t kBucketSize = kCoapRateLimitBurst * kTokenScale;
+
+RateLimiter::RateLimiter()
+    : _admitted(0), _limited(0), _evicted(0)
+{
+    memset(_buckets, 0, sizeof(_buckets));
+}
+
+RateLimiter::Bucket &RateLimiter::FindBucket(NetEp_t const &remote, int64_t now)
+{
+    NetEp_t address = remote;
+    address.NetPort = 0;
+
+    auto oldest = &_buckets[0];
+    for (auto &bucket : _buckets)
+    {
+        if (bucket.Updated != 0 && EpAreEqual(&bucket.Remote, &address))
+            return bucket;
+        if (bucket.Updated < oldest->Updated)
+            oldest = &bucket;
+    }
+
+    // The client heard from least recently makes room, if it was quiet long enough to have
+    // refilled it loses nothing by being forgotten
+    if (oldest->Updated != 0)
+        _evicted++;
+
+    memset(oldest, 0, sizeof(*oldest));
+    oldest->Remote = address;
+    oldest->Updated = now;
+    oldest->Tokens = kBucketSize;
+    return *oldest;
+}
+
+RateLimiter::Verdict RateLimiter::Admit(NetEp_t const &remote, int64_t now, uint32_t &retryAfter)
+{
+    auto &bucket = FindBucket(remote, now);
+
+    // Refill for the time since the last request, kCoapRateLimitRate tokens per second
+    auto elapsed = std::max<int64_t>(now - bucket.Updated, 0);
+    auto refill = elapsed * kCoapRateLimitRate * kTokenScale / (1000 * 1000);
+    bucket.Tokens = static_cast<uint32_t>(std::min<int64_t>(bucket.Tokens + refill, kBucketSize));
+    bucket.Updated = now;
+
+    if (bucket.Tokens >= kTokenScale)
+    {
+        bucket.Tokens -= kTokenScale;
+        _admitted++;
+        if (bucket.Limited > 0)
+        {
+            ESP_LOGI(kTag, "Client on port %hu back within its rate after %u requests turned away", remote.NetPort, bucket.Limited);
+            bucket.Limited = 0;
+        }
+        return Verdict::Admit;
+    }
+
+    _limited++;
+    if (bucket.Limited++ == 0)
+        ESP_LOGW(kTag, "Client on port %hu over %u requests/s (%u admitted, %u limited, %u evicted)",
+            remote.NetPort, kCoapRateLimitRate, _admitted, _limited, _evicted);
+
+    // Whole seconds until the next token, Max-Age has no finer resolution
+    auto wait = static_cast<int64_t>(kTokenScale - bucket.Tokens) * 1000 * 1000 / (kCoapRateLimitRate * kTokenScale);
+    retryAfter = std::max<uint32_t>(1, static_cast<uint32_t>((wait + 999999) / (1000 * 1000)));
+
+    if (now < bucket.RejectedUntil)
+        return Verdict::Drop;
+    bucket.RejectedUntil = now + static_cast<int64_t>(retryAfter) * 1000 * 1000;
+    return Verdict::Reject;
+}
+
+size_t RateLimiter::WriteRejection(uint8_t *buffer, size_t capacity, CoapPacket const &request, uint32_t retryAfter)
+{
+    BufferedCoapMessage response;
+    CoapResult result;
+    response.SetType(CoapMessageType::Acknowledgement, result);
+    response.SetCode(CoapMessageCode::ServiceUnavailable, result);
+    response.AddOption(CoapUIntOption(CoapOptionValue::MaxAge, retryAfter), result);
+
+    size_t size;
+    if (!response.Serialize(buffer, capacity, request.GetMessageId(), request.GetToken(), request.GetTokenLength(), size))
+        return 0;
+    return size;
+}
+
+#endif // CONFIG_IOTNODE_COAP_RATE_LIMIT
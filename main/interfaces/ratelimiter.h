@@ -0,0 +1,72 @@
+#ifndef _INTERFACES_RATELIMITER_H_
+#define _INTERFACES_RATELIMITER_H_
+
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_RATE_LIMIT
+
+#include <cstddef>
+#include <cstdint>
+
+#include "coap.h"
+#include "coappacket.h"
+
+extern "C" {
+    #include "liblobaro_coap.h"
+}
+
+static const int kCoapRateLimitClients = CONFIG_IOTNODE_COAP_RATE_LIMIT_CLIENTS;
+static const uint32_t kCoapRateLimitRate = CONFIG_IOTNODE_COAP_RATE_LIMIT_RATE;
+static const uint32_t kCoapRateLimitBurst = CONFIG_IOTNODE_COAP_RATE_LIMIT_BURST;
+
+// Per client token buckets guarding the network task and lobaro's memory pool. Every client
+// address may send kCoapRateLimitBurst requests back to back and kCoapRateLimitRate per second
+// after that, further requests are turned away before lobaro parses them. Clients are told
+// apart by address alone, so changing the source port doesn't buy a fresh bucket. The table holds
+// kCoapRateLimitClients addresses, the one heard from least recently makes room for a new one.
+//
+// Only to be used from the network task.
+class RateLimiter
+{
+public:
+    enum class Verdict
+    {
+        Admit,
+        // Over the limit, answer with 5.03 (RFC 7252 section 5.9.3.4)
+        Reject,
+        // Over the limit and already told so, or not worth an answer
+        Drop,
+    };
+
+    RateLimiter();
+
+    // Takes a token from `remote`'s bucket. When there was none, `retryAfter` is the number of
+    // seconds until there is.
+    Verdict Admit(NetEp_t const &remote, int64_t now, uint32_t &retryAfter);
+
+    // Writes a piggybacked 5.03 with Max-Age `retryAfter` for a confirmable `request`
+    static size_t WriteRejection(uint8_t *buffer, size_t capacity, CoapPacket const &request, uint32_t retryAfter);
+private:
+    struct Bucket
+    {
+        // Port zeroed
+        NetEp_t Remote;
+        int64_t Updated;
+        // In thousandths of a request
+        uint32_t Tokens;
+        // No further 5.03 to this client before then, one per Max-Age is enough
+        int64_t RejectedUntil;
+        uint32_t Limited;
+    };
+    Bucket _buckets[kCoapRateLimitClients];
+
+    uint32_t _admitted;
+    uint32_t _limited;
+    uint32_t _evicted;
+
+    Bucket &FindBucket(NetEp_t const &remote, int64_t now);
+};
+
+#endif // CONFIG_IOTNODE_COAP_RATE_LIMIT
+
+#endif // _INTERFACES_RATELIMITER_H_
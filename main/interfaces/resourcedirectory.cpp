@@ -0,0 +1,214 @@
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_RD
+
+#include <algorithm>
+#include <cstring>
+
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "lwip/ip_addr.h"
+
+#include "resourcedirectory.h"
+
+static const char *kTag = "CoAP-RD";
+
+static const char *kRdPath = CONFIG_IOTNODE_COAP_RD_PATH;
+static const char *kRdEndpointName = CONFIG_IOTNODE_HOSTNAME;
+
+// Refresh once three quarters of the lifetime are gone, the rest is for retries
+static const int64_t kCoapRdRefreshUs = static_cast<int64_t>(kCoapRdLifetime) * 1000 * 1000 * 3 / 4;
+static const int64_t kCoapRdRetryUs = 10 * 1000 * 1000;
+static const int64_t kCoapRdMaxRetryUs = 5 * 60 * 1000 * 1000;
+// Spread registrations of nodes that all came back with the same access point
+static const uint32_t kCoapRdJitterUs = 2 * 1000 * 1000;
+
+ResourceDirectory::ResourceDirectory()
+    : _state(State::Disabled), _client(nullptr), _links(nullptr), _expires(0), _inFlight(false), _next(0),
+      _retryDelay(kCoapRdRetryUs), _registrations(0), _updates(0)
+{
+    memset(&_directory, 0, sizeof(_directory));
+}
+
+void ResourceDirectory::Setup(CoapClient *client, LinkFormat links, CoapResult &result)
+{
+    ip_addr_t address;
+    if (ipaddr_aton(CONFIG_IOTNODE_COAP_RD_ADDRESS, &address) == 0)
+    {
+        ESP_LOGE(kTag, "Resource directory address \"%s\" is not an IP address", CONFIG_IOTNODE_COAP_RD_ADDRESS);
+        result = CoapResult::Error;
+        return;
+    }
+
+    _directory.NetPort = CONFIG_IOTNODE_COAP_RD_PORT;
+    if (address.type == IPADDR_TYPE_V6)
+    {
+        _directory.NetType = IPV6;
+        for (int i = 0; i < 4; i++)
+            _directory.NetAddr.IPv6.u32[i] = ip_2_ip6(&address)->addr[i];
+    }
+    else
+    {
+        _directory.NetType = IPV4;
+        _directory.NetAddr.IPv4.u32[0] = ip_addr_get_ip4_u32(&address);
+    }
+
+    _client = client;
+    _links = links;
+    _state = State::Unregistered;
+    result = CoapResult::OK;
+}
+
+void ResourceDirectory::Resume(int64_t now)
+{
+    if (_state == State::Disabled)
+        return;
+
+    // A registration that's still alive only needs an update, which also moves it to our new address
+    _retryDelay = kCoapRdRetryUs;
+    _next = now + esp_random() % kCoapRdJitterUs;
+}
+
+void ResourceDirectory::Poll(int64_t now)
+{
+    if (_state == State::Disabled || _inFlight || now < _next)
+        return;
+
+    if (_state == State::Registered && now >= _expires)
+    {
+        ESP_LOGW(kTag, "Registration expired");
+        _state = State::Unregistered;
+    }
+
+    // Changed links go out as a new registration, which replaces the old one
+    if (_state == State::Registered && _links() == _registered)
+        Update(now);
+    else
+        Register(now);
+}
+
+void ResourceDirectory::Register(int64_t now)
+{
+    BufferedCoapMessage request;
+    CoapResult result;
+    request.SetCode(CoapMessageCode::Post, result);
+    request.SetType(CoapMessageType::Confirmable, result);
+    std::string path(kRdPath);
+    for (size_t start = 0, end; start < path.length(); start = end + 1)
+    {
+        end = std::min(path.find('/', start), path.length());
+        if (end > start)
+            request.AddOption(CoapStringOption(CoapOptionValue::UriPath, path.substr(start, end - start)), result);
+    }
+    request.AddOption(CoapUIntOption(CoapOptionValue::ContentFormat, CoapContentType::LinkFormat), result);
+    request.AddOption(CoapStringOption(CoapOptionValue::UriQuery, std::string("ep=") + kRdEndpointName), result);
+    request.AddOption(CoapStringOption(CoapOptionValue::UriQuery, "lt=" + std::to_string(kCoapRdLifetime)), result);
+
+    _registered = _links();
+    request.SetPayload(_registered, result);
+
+    _client->Submit(_directory, request, &ResourceDirectory::RegisterResponse, this, result);
+    if (result != CoapResult::OK)
+    {
+        Retry(now);
+        return;
+    }
+    _inFlight = true;
+}
+
+void ResourceDirectory::Update(int64_t now)
+{
+    // No payload and no query, the directory just restarts the lifetime (RFC 9176 section 5.3.1)
+    BufferedCoapMessage request;
+    CoapResult result;
+    request.SetCode(CoapMessageCode::Post, result);
+    request.SetType(CoapMessageType::Confirmable, result);
+    for (auto &segment : _location)
+        request.AddOption(CoapStringOption(CoapOptionValue::UriPath, segment), result);
+
+    _client->Submit(_directory, request, &ResourceDirectory::UpdateResponse, this, result);
+    if (result != CoapResult::OK)
+    {
+        Retry(now);
+        return;
+    }
+    _inFlight = true;
+}
+
+void ResourceDirectory::Retry(int64_t now)
+{
+    _next = now + _retryDelay;
+    _retryDelay = std::min(_retryDelay * 2, kCoapRdMaxRetryUs);
+}
+
+void ResourceDirectory::RegisterResponse(void *context, CoapResult result, BufferedCoapMessage const *response)
+{
+    auto directory = static_cast<ResourceDirectory *>(context);
+    auto now = esp_timer_get_time();
+    directory->_inFlight = false;
+
+    if (response == nullptr || response->GetCode() != CoapMessageCode::Created)
+    {
+        ESP_LOGW(kTag, "Registration failed: %d.%02d", response != nullptr ? response->GetCode() >> 5 : 0, response != nullptr ? response->GetCode() & 0x1F : 0);
+        directory->Retry(now);
+        return;
+    }
+
+    directory->_location.clear();
+    for (auto &option : response->GetOptions())
+    {
+        if (option.Number == CoapOptionValue::LocationPath)
+            directory->_location.emplace_back(reinterpret_cast<const char *>(option.Value.data()), option.Value.length());
+    }
+    if (directory->_location.empty())
+    {
+        ESP_LOGW(kTag, "Registration created without a Location-Path");
+        directory->Retry(now);
+        return;
+    }
+
+    directory->_registrations++;
+    directory->_state = State::Registered;
+    directory->_expires = now + static_cast<int64_t>(kCoapRdLifetime) * 1000 * 1000;
+    directory->_next = now + kCoapRdRefreshUs;
+    directory->_retryDelay = kCoapRdRetryUs;
+    ESP_LOGI(kTag, "Registered %d bytes of links for %u s (%u registrations, %u updates)",
+        static_cast<int>(directory->_registered.length()), kCoapRdLifetime, directory->_registrations, directory->_updates);
+}
+
+void ResourceDirectory::UpdateResponse(void *context, CoapResult result, BufferedCoapMessage const *response)
+{
+    auto directory = static_cast<ResourceDirectory *>(context);
+    auto now = esp_timer_get_time();
+    directory->_inFlight = false;
+
+    if (response == nullptr)
+    {
+        directory->Retry(now);
+        return;
+    }
+
+    if (response->GetCode() == CoapMessageCode::NotFound || response->GetCode() == CoapMessageCode::BadRequest)
+    {
+        // The directory lost or dropped us, start over
+        ESP_LOGW(kTag, "Registration gone, registering again");
+        directory->_state = State::Unregistered;
+        directory->_next = now;
+        return;
+    }
+
+    if (response->GetCode() != CoapMessageCode::Changed)
+    {
+        directory->Retry(now);
+        return;
+    }
+
+    directory->_updates++;
+    directory->_expires = now + static_cast<int64_t>(kCoapRdLifetime) * 1000 * 1000;
+    directory->_next = now + kCoapRdRefreshUs;
+    directory->_retryDelay = kCoapRdRetryUs;
+    ESP_LOGD(kTag, "Registration refreshed (%u updates)", directory->_updates);
+}
+
+#endif // CONFIG_IOTNODE_COAP_RD
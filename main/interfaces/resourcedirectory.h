@@ -0,0 +1,79 @@
+#ifndef _INTERFACES_RESOURCEDIRECTORY_H_
+#define _INTERFACES_RESOURCEDIRECTORY_H_
+
+#include "sdkconfig.h"
+
+#if CONFIG_IOTNODE_COAP_RD
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "coap.h"
+#include "bufferedmessage.h"
+#include "coapclient.h"
+
+extern "C" {
+    #include "liblobaro_coap.h"
+}
+
+static const uint32_t kCoapRdLifetime = CONFIG_IOTNODE_COAP_RD_LIFETIME;
+
+// Registers the node's resources with a resource directory (RFC 9176) so hubs can look them up
+// there instead of multicasting GET /.well-known/core to the whole segment. One registration
+// covers every resource; it is kept alive with an empty POST to its location, which only resets
+// the lifetime, and the links are only sent again when they changed. A registration the directory
+// no longer knows (e.g. after it restarted) is replaced by a new one.
+//
+// Only to be used from the network task.
+class ResourceDirectory
+{
+public:
+    // Current /.well-known/core document
+    typedef std::string const &(*LinkFormat)();
+
+    ResourceDirectory();
+
+    void Setup(CoapClient *client, LinkFormat links, CoapResult &result);
+
+    // The network (re)connected, the address we registered from may have changed
+    void Resume(int64_t now);
+
+    // Registers or updates once due
+    void Poll(int64_t now);
+private:
+    enum class State
+    {
+        Disabled,
+        Unregistered,
+        Registered,
+    };
+    State _state;
+
+    CoapClient *_client;
+    LinkFormat _links;
+    NetEp_t _directory;
+
+    // Location-Path of our registration resource, e.g. {"reg", "4521"}
+    std::vector<std::string> _location;
+    // Links the directory has for us
+    std::string _registered;
+    int64_t _expires;
+
+    bool _inFlight;
+    int64_t _next;
+    int64_t _retryDelay;
+
+    uint32_t _registrations;
+    uint32_t _updates;
+
+    void Register(int64_t now);
+    void Update(int64_t now);
+    void Retry(int64_t now);
+    static void RegisterResponse(void *context, CoapResult result, BufferedCoapMessage const *response);
+    static void UpdateResponse(void *context, CoapResult result, BufferedCoapMessage const *response);
+};
+
+#endif // CONFIG_IOTNODE_COAP_RD
+
+#endif // _INTERFACES_RESOURCEDIRECTORY_H_
@@ -14,10 +14,17 @@
 
 #include "esp_log.h"
 
+#include "taskconfig.h"
+#include "utils.h"
 #include "interfaces/lobarocoap.h"
+#include "interfaces/coaptcp.h"
+#include "interfaces/mqtttransport.h"
 #include "resources/led.h"
 #include "resources/switch.h"
 #include "resources/wifi.h"
+#include "resources/latency.h"
+#include "resources/state.h"
+#include "services/inputdispatcher.h"
 
 static const char* kTag = "IoTNode";
 static bool connected = false;
@@ -41,7 +48,30 @@ static const UBaseType_t kThreadPriority = 8;
     #error WIFI_SSID or WIFI_PASSWORD not set in secrets file. See secrets.example
 #endif
 
+#if CONFIG_IOTNODE_COAP_OSCORE
+#if !defined( OSCORE_MASTER_SECRET ) || !defined( OSCORE_SENDER_ID ) || !defined( OSCORE_RECIPIENT_ID )
+    #error OSCORE_MASTER_SECRET, OSCORE_SENDER_ID or OSCORE_RECIPIENT_ID not set in secrets file. See secrets.example
+#endif
+#ifndef OSCORE_MASTER_SALT
+    #define OSCORE_MASTER_SALT
+#endif
+#endif
+
 LobaroCoap coap_interface;
+#if CONFIG_IOTNODE_COAP_TCP
+CoapTcp coap_tcp_interface;
+#endif
+#if CONFIG_IOTNODE_MQTT
+MqttTransport mqtt_interface;
+#endif
+
+#if CONFIG_IOTNODE_COAP_DTLS
+extern const unsigned char coap_server_crt_start[] asm("_binary_coap_server_crt_start");
+extern const unsigned char coap_server_crt_end[]   asm("_binary_coap_server_crt_end");
+extern const unsigned char coap_server_key_start[] asm("_binary_coap_server_key_start");
+extern const unsigned char coap_server_key_end[]   asm("_binary_coap_server_key_end");
+#endif
+InputDispatcher input_dispatcher;
 
 esp_err_t event_handler(void *ctx, system_event_t *event)
 {
@@ -55,6 +85,11 @@ esp_err_t event_handler(void *ctx, system_event_t *event)
             break;
         case SYSTEM_EVENT_STA_CONNECTED:
             connected = true;
+#if CONFIG_IOTNODE_COAP_IPV6
+            // The IPv6 endpoints and the ff02::fd group only need the link-local address
+            if ( (ret = tcpip_adapter_create_ip6_linklocal( TCPIP_ADAPTER_IF_STA ) ) != ESP_OK )
+                ESP_LOGE( kTag, "tcpip_adapter_create_ip6_linklocal failed with %d (0x%X)", ret, ret );
+#endif
             break;
         case SYSTEM_EVENT_STA_GOT_IP:
             xEventGroupSetBits( wifi_event_group, kCoapConnectedBit );
@@ -101,13 +136,14 @@ void app_main(void)
 
     // Start a new Application task with enough  stack size to hold the resources
     xTaskHandle _task;
-    int ret = xTaskCreate(
+    int ret = xTaskCreatePinnedToCore(
         &TaskHandle,
         kThreadName,
         kThreadStackSize,
         nullptr,
         kThreadPriority,
-        &_task
+        &_task,
+        kApplicationCore
     );
 
     if (ret != true)
@@ -122,15 +158,69 @@ void app_main(void)
 static void TaskHandle(void* pvParameters)
 {
     CoapResult result;
-    coap_interface.Start(result);
+    CoapOptions options = {};
+#if CONFIG_IOTNODE_COAP_DTLS
+    // Embedded text files are null terminated, which mbedtls expects as part of PEM input
+    options.flags.useDTLS = true;
+    options.DTLS.cert_ptr = coap_server_crt_start;
+    options.DTLS.cert_len = coap_server_crt_end - coap_server_crt_start;
+    options.DTLS.cert_key_ptr = coap_server_key_start;
+    options.DTLS.cert_key_len = coap_server_key_end - coap_server_key_start;
+#endif
+#if CONFIG_IOTNODE_COAP_OSCORE
+    {
+        // Only the derived keys are kept, the decoded secrets can go once the context is added
+        uint8_t secret[32], salt[32], senderId[8], recipientId[8];
+        CoapOscoreOptions oscore = {};
+        oscore.master_secret_ptr = secret;
+        oscore.master_secret_len = HexToBytes(STRING(OSCORE_MASTER_SECRET), secret, sizeof(secret));
+        oscore.master_salt_ptr = salt;
+        oscore.master_salt_len = HexToBytes(STRING(OSCORE_MASTER_SALT), salt, sizeof(salt));
+        oscore.sender_id_ptr = senderId;
+        oscore.sender_id_len = HexToBytes(STRING(OSCORE_SENDER_ID), senderId, sizeof(senderId));
+        oscore.recipient_id_ptr = recipientId;
+        oscore.recipient_id_len = HexToBytes(STRING(OSCORE_RECIPIENT_ID), recipientId, sizeof(recipientId));
+
+        coap_interface.AddSecurityContext(oscore, result);
+        assert(result == CoapResult::OK);
+        memset(secret, 0, sizeof(secret));
+    }
+#endif
+#if CONFIG_IOTNODE_COAP_TCP
+    // Every resource below is served over TCP as well
+    coap_interface.AddTransport(&coap_tcp_interface, result);
     assert(result == CoapResult::OK);
+#endif
+#if CONFIG_IOTNODE_MQTT
+    // Observable resources are published to the broker as well, commands come back as POSTs
+    coap_interface.AddTransport(&mqtt_interface, result);
+    assert(result == CoapResult::OK);
+#endif
+    // All GPIO inputs are debounced on a single shared task
+    bool started = input_dispatcher.Start();
+    assert(started);
 
     // Create and register our wifi resource
     WifiResource wifiResource(coap_interface);
 
     // Create and register our LED resource
     LEDResource statusLED(coap_interface, kLEDRedPin, kLEDGreenPin, kLEDBluePin);
-    SwitchResource pushSwitch(coap_interface, kSwitchPin);
+    SwitchResource pushSwitch(coap_interface, input_dispatcher, kSwitchPin);
+
+    // Everything above in one exchange
+    StateResource state(coap_interface, {
+        {"led", &statusLED},
+        {"switch", &pushSwitch},
+        {"wifi", &wifiResource},
+    });
+
+#if CONFIG_IOTNODE_LATENCY_TRACE
+    LatencyResource latencyResource(coap_interface);
+#endif
+
+    // Only once every resource exists, the network task walks the list without a lock
+    coap_interface.Start(options, result);
+    assert(result == CoapResult::OK);
 
     int level = 0;
     bool lastConnectedState = false;
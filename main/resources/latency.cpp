@@ -0,0 +1,101 @@
+#include <nlohmann/json.hpp>
+
+#include <string>
+
+// for convenience
+using json = nlohmann::json;
+
+#include "esp_log.h"
+
+#include "latencytrace.h"
+#include "resources/latency.h"
+#include "../interfaces/egressqueue.h"
+
+static const char *kTag = "Latency Resource";
+
+static void AddHistogram(json &entry, LatencyHistogram const &histogram)
+{
+    // Bucket i counts latencies in [2^i, 2^(i+1)) microseconds
+    json buckets = json::array();
+    for (int i = 0; i < LatencyHistogram::kBuckets; i++)
+        buckets.push_back(histogram.GetBucket(i));
+
+    entry["count"] = histogram.GetCount();
+    entry["max"] = histogram.GetMax();
+    entry["p50"] = histogram.GetPercentile(50);
+    entry["p90"] = histogram.GetPercentile(90);
+    entry["p99"] = histogram.GetPercentile(99);
+    entry["buckets"] = buckets;
+}
+
+template<class Message>
+void LatencyResource::Handle(Message const *request, Message *response, CoapResult &result)
+{
+    if(request->GetCode() == CoapMessageCode::Delete)
+    {
+        for (int stage = 0; stage < static_cast<int>(TraceStage::Count); stage++)
+            TraceHistogram(static_cast<TraceStage>(stage)).Reset();
+#if CONFIG_IOTNODE_COAP_EGRESS_QUEUE
+        for (int egressClass = 0; egressClass < static_cast<int>(EgressClass::Count); egressClass++)
+            EgressHistogram(static_cast<EgressClass>(egressClass)).Reset();
+#endif
+
+        response->SetCode(CoapMessageCode::Deleted, result);
+        return;
+    }
+
+    CoapOption acceptOption;
+    request->GetOption(acceptOption, CoapOptionValue::Accept, result);
+
+    // Default to application/json if the option wasn't present
+    uint32_t accept = result == CoapResult::OK
+        ? static_cast<CoapContentType>(AsUInt(acceptOption)->Value)
+        : CoapContentType::ApplicationJson;
+
+    json output;
+    for (int stage = 0; stage < static_cast<int>(TraceStage::Count); stage++)
+        AddHistogram(output[TraceStageName(static_cast<TraceStage>(stage))], TraceHistogram(static_cast<TraceStage>(stage)));
+#if CONFIG_IOTNODE_COAP_EGRESS_QUEUE
+    for (int egressClass = 0; egressClass < static_cast<int>(EgressClass::Count); egressClass++)
+        AddHistogram(output[EgressClassName(static_cast<EgressClass>(egressClass))], EgressHistogram(static_cast<EgressClass>(egressClass)));
+#endif
+
+    if(accept == CoapContentType::ApplicationJson)
+    {
+        response->AddOption(CoapUIntOption(CoapOptionValue::ContentFormat, CoapContentType::ApplicationJson), result);
+        response->SetPayload(output.dump(), result);
+        response->SetCode(CoapMessageCode::Content, result);
+    }
+    else if(accept == CoapContentType::ApplicationCbor)
+    {
+        response->AddOption(CoapUIntOption(CoapOptionValue::ContentFormat, CoapContentType::ApplicationCbor), result);
+        response->SetPayload(json::to_cbor(output), result);
+        response->SetCode(CoapMessageCode::Content, result);
+    }
+    else
+    {
+        response->SetCode(CoapMessageCode::BadOption, result);
+        result = CoapResult::Error;
+    }
+}
+
+LatencyResource::LatencyResource(CoapTransport& coap)
+    : _coap(coap)
+{
+    CoapResult result;
+    this->_coap.CreateResource(this->_resource, this, "latency", result);
+    if (result != CoapResult::OK || this->_resource == nullptr)
+    {
+        ESP_LOGE( kTag, "CreateResource failed." );
+        return;
+    }
+
+    this->_resource->RegisterHandler(CoapMessageCode::Get, result);
+    this->_resource->RegisterHandler(CoapMessageCode::Delete, result);
+    this->_resource->SetAttributes("iotnode.latency", "core.rp", {CoapContentType::ApplicationJson, CoapContentType::ApplicationCbor}, result);
+}
+
+template void LatencyResource::Handle(ICoapMessage const *request, ICoapMessage *response, CoapResult &result);
+#if CONFIG_IOTNODE_COAP_STATIC_DISPATCH
+template void LatencyResource::Handle(CoapTransportMessage const *request, CoapTransportMessage *response, CoapResult &result);
+#endif
@@ -12,6 +12,7 @@ using json = nlohmann::json;
 #include "esp_log.h"
 #include "tcpip_adapter.h"
 
+#include "statewriter.h"
 #include "utils.h"
 #include "resources/led.h"
 
@@ -28,7 +29,8 @@ static constexpr int kLedcHPoint = (1 << kLedcResolution) - 1;
 
 static const int kFadeTime = 200;
 
-void LEDResource::HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result)
+template<class Message>
+void LEDResource::Handle(Message const *request, Message *response, CoapResult &result)
 {
     CoapOption acceptOption;
     request->GetOption(acceptOption, CoapOptionValue::Accept, result);
@@ -79,20 +81,28 @@ void LEDResource::HandleRequest(ICoapMessage const *request, ICoapMessage *respo
         }
     }
 
-    json output;
-    GetColor(red, green, blue);
-    output["color"] = { red, green, blue };
-    output["mode"] = _mode == Mode::ShowStatus ? "status" : "user";
-
-    if(accept == CoapContentType::ApplicationJson)
+    // The client won't read the response, don't bother building it
+    if(IsResponseSuppressed(request, code))
     {
-        response->AddOption(CoapUIntOption(CoapOptionValue::ContentFormat, CoapContentType::ApplicationJson), result);
-        response->SetPayload(output.dump(), result);
+        response->SetCode(code, result);
+        return;
     }
-    else if(accept == CoapContentType::ApplicationCbor)
+
+    StateWriter::Format format;
+    if(StateWriter::FormatFor(accept, format))
     {
-        response->AddOption(CoapUIntOption(CoapOptionValue::ContentFormat, CoapContentType::ApplicationCbor), result);
-        response->SetPayload(json::to_cbor(output), result);
+        std::vector<std::string> queries;
+        request->GetOptions(queries, CoapOptionValue::UriQuery, result);
+
+        std::string output;
+        StateWriter writer(format, output);
+        writer.Select(queries);
+        writer.BeginMap();
+        WriteState(writer);
+        writer.EndMap();
+
+        response->AddOption(CoapUIntOption(CoapOptionValue::ContentFormat, accept), result);
+        response->SetPayload(output, result);
     }
     else
     {
@@ -103,8 +113,16 @@ void LEDResource::HandleRequest(ICoapMessage const *request, ICoapMessage *respo
     response->SetCode(code, result);
 }
 
-LEDResource::LEDResource(ICoapInterface& coap, gpio_num_t red, gpio_num_t green, gpio_num_t blue)
-    : _coap(coap), _pinLEDRed(red), _pinLEDGreen(green), _pinLEDBlue(blue)
+bool LEDResource::WriteState(StateWriter &writer) const
+{
+    auto state = _state.Load();
+    writer.Field("color", {state.Red, state.Green, state.Blue});
+    writer.Field("mode", state.LEDMode == Mode::ShowStatus ? "status" : "user");
+    return true;
+}
+
+LEDResource::LEDResource(CoapTransport& coap, gpio_num_t red, gpio_num_t green, gpio_num_t blue)
+    : _coap(coap), _pinLEDRed(red), _pinLEDGreen(green), _pinLEDBlue(blue), _ledcLock(xSemaphoreCreateMutex())
 {
     CoapResult result;
     this->_coap.CreateResource(this->_resource, this, "led", result);
@@ -116,6 +134,7 @@ LEDResource::LEDResource(ICoapInterface& coap, gpio_num_t red, gpio_num_t green,
 
     this->_resource->RegisterHandler(CoapMessageCode::Get, result);
     this->_resource->RegisterHandler(CoapMessageCode::Post, result);
+    this->_resource->SetAttributes("iotnode.led", "core.a", {CoapContentType::ApplicationJson, CoapContentType::ApplicationCbor}, result);
 
         /*
      * Prepare and set configuration of timers
@@ -165,52 +184,69 @@ LEDResource::LEDResource(ICoapInterface& coap, gpio_num_t red, gpio_num_t green,
 
 void LEDResource::SetStatusColor(uint8_t red, uint8_t green, uint8_t blue, int fadeTime)
 {
-    if(_mode != Mode::ShowStatus)
-        return;
-
-    ledc_set_fade_time_and_start(_ledcRedChannel.speed_mode, _ledcRedChannel.channel, red << 2, fadeTime, LEDC_FADE_NO_WAIT);
-    ledc_set_fade_time_and_start(_ledcGreenChannel.speed_mode, _ledcGreenChannel.channel, green << 2, fadeTime, LEDC_FADE_NO_WAIT);
-    ledc_set_fade_time_and_start(_ledcBlueChannel.speed_mode, _ledcBlueChannel.channel, blue << 2, fadeTime, LEDC_FADE_NO_WAIT);
+    xSemaphoreTake(_ledcLock, portMAX_DELAY);
+    if(_state.Load().LEDMode == Mode::ShowStatus)
+        Fade(red, green, blue, fadeTime);
+    xSemaphoreGive(_ledcLock);
 }
 
 void LEDResource::SetMode(Mode mode)
 {
-    if(_mode == mode)
-        return;
-
-    _mode = mode;
-
-    if(_mode == Mode::ShowStatus)
+    xSemaphoreTake(_ledcLock, portMAX_DELAY);
+    auto previous = _state.Update([mode](State &state) { state.LEDMode = mode; });
+    if(previous.LEDMode != mode)
     {
-        ledc_set_fade_time_and_start(_ledcRedChannel.speed_mode, _ledcRedChannel.channel, 0, kFadeTime, LEDC_FADE_NO_WAIT);
-        ledc_set_fade_time_and_start(_ledcGreenChannel.speed_mode, _ledcGreenChannel.channel, 0, kFadeTime, LEDC_FADE_NO_WAIT);
-        ledc_set_fade_time_and_start(_ledcBlueChannel.speed_mode, _ledcBlueChannel.channel, 0, kFadeTime, LEDC_FADE_NO_WAIT);
-    }
-    else if(mode == Mode::User)
-    {
-        ledc_set_fade_time_and_start(_ledcRedChannel.speed_mode, _ledcRedChannel.channel, _redValue, kFadeTime, LEDC_FADE_NO_WAIT);
-        ledc_set_fade_time_and_start(_ledcGreenChannel.speed_mode, _ledcGreenChannel.channel, _greenValue, kFadeTime, LEDC_FADE_NO_WAIT);
-        ledc_set_fade_time_and_start(_ledcBlueChannel.speed_mode, _ledcBlueChannel.channel, _blueValue, kFadeTime, LEDC_FADE_NO_WAIT);
+        if(mode == Mode::ShowStatus)
+            Fade(0, 0, 0, kFadeTime);
+        else if(mode == Mode::User)
+            Fade(previous.Red, previous.Green, previous.Blue, kFadeTime);
     }
+    xSemaphoreGive(_ledcLock);
+
+    if(previous.LEDMode != mode)
+        StateChanged();
 }
 
 void LEDResource::SetColor(uint8_t red, uint8_t green, uint8_t blue)
 {
-    _redValue = red << 2;
-    _greenValue = green << 2;
-    _blueValue = blue << 2;
+    xSemaphoreTake(_ledcLock, portMAX_DELAY);
+    auto previous = _state.Update([red, green, blue](State &state) {
+        state.Red = red;
+        state.Green = green;
+        state.Blue = blue;
+    });
+    if(previous.LEDMode == Mode::User)
+        Fade(red, green, blue, kFadeTime);
+    xSemaphoreGive(_ledcLock);
+
+    if(previous.Red != red || previous.Green != green || previous.Blue != blue)
+        StateChanged();
+}
 
-    if(_mode != Mode::User)
-        return;
+// Callers hold _ledcLock
+void LEDResource::Fade(uint8_t red, uint8_t green, uint8_t blue, int fadeTime)
+{
+    ledc_set_fade_time_and_start(_ledcRedChannel.speed_mode, _ledcRedChannel.channel, red << 2, fadeTime, LEDC_FADE_NO_WAIT);
+    ledc_set_fade_time_and_start(_ledcGreenChannel.speed_mode, _ledcGreenChannel.channel, green << 2, fadeTime, LEDC_FADE_NO_WAIT);
+    ledc_set_fade_time_and_start(_ledcBlueChannel.speed_mode, _ledcBlueChannel.channel, blue << 2, fadeTime, LEDC_FADE_NO_WAIT);
+}
 
-    ledc_set_fade_time_and_start(_ledcRedChannel.speed_mode, _ledcRedChannel.channel, _redValue, kFadeTime, LEDC_FADE_NO_WAIT);
-    ledc_set_fade_time_and_start(_ledcGreenChannel.speed_mode, _ledcGreenChannel.channel, _greenValue, kFadeTime, LEDC_FADE_NO_WAIT);
-    ledc_set_fade_time_and_start(_ledcBlueChannel.speed_mode, _ledcBlueChannel.channel, _blueValue, kFadeTime, LEDC_FADE_NO_WAIT);
+void LEDResource::StateChanged()
+{
+    // The LED isn't observable itself, but composites that include it (/state) are
+    CoapResult result;
+    _resource->NotifyObservers(result);
 }
 
 void LEDResource::GetColor(uint8_t &red, uint8_t &green, uint8_t &blue)
 {
-    red = _redValue >> 2;
-    green = _greenValue >> 2;
-    blue = _blueValue >> 2;
+    auto state = _state.Load();
+    red = state.Red;
+    green = state.Green;
+    blue = state.Blue;
 }
+
+template void LEDResource::Handle(ICoapMessage const *request, ICoapMessage *response, CoapResult &result);
+#if CONFIG_IOTNODE_COAP_STATIC_DISPATCH
+template void LEDResource::Handle(CoapTransportMessage const *request, CoapTransportMessage *response, CoapResult &result);
+#endif
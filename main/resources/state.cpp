@@ -0,0 +1,110 @@
+#include <string>
+
+#include "esp_log.h"
+
+#include "statewriter.h"
+#include "resources/state.h"
+
+static const char *kTag = "State Resource";
+
+bool StateResource::WriteState(StateWriter &writer) const
+{
+    for (int i = 0; i < _memberCount; i++)
+    {
+        writer.BeginMap(_members[i].Name);
+        _members[i].Resource->WriteState(writer);
+        writer.EndMap();
+    }
+    return true;
+}
+
+template<class Message>
+void StateResource::Respond(Message *response, CoapContentType contentType, std::vector<std::string> const &queries, CoapResult &result)
+{
+    StateWriter::Format format;
+    if(!StateWriter::FormatFor(contentType, format))
+    {
+        response->SetCode(CoapMessageCode::BadOption, result);
+        result = CoapResult::Error;
+        return;
+    }
+
+    std::string output;
+    StateWriter writer(format, output);
+    writer.Select(queries);
+    writer.BeginMap();
+    WriteState(writer);
+    writer.EndMap();
+
+    response->SetOption(CoapUIntOption(CoapOptionValue::ContentFormat, contentType), result);
+    response->SetPayload(output, result);
+    response->SetCode(CoapMessageCode::Content, result);
+}
+
+template<class Message>
+void StateResource::Handle(Message const *request, Message *response, CoapResult &result)
+{
+    CoapOption acceptOption;
+    request->GetOption(acceptOption, CoapOptionValue::Accept, result);
+
+    // Default to application/cbor if the option wasn't present
+    CoapContentType accept = result == CoapResult::OK
+        ? static_cast<CoapContentType>(AsUInt(acceptOption)->Value)
+        : CoapContentType::ApplicationCbor;
+
+    std::vector<std::string> queries;
+    request->GetOptions(queries, CoapOptionValue::UriQuery, result);
+
+    Respond(response, accept, queries, result);
+}
+
+void StateResource::HandleNotify(ICoapObserver const *observer, ICoapMessage *response, CoapResult &result)
+{
+    CoapOption acceptOption;
+    observer->GetOption(acceptOption, CoapOptionValue::Accept, result);
+
+    CoapContentType accept = result == CoapResult::OK
+        ? static_cast<CoapContentType>(AsUInt(acceptOption)->Value)
+        : CoapContentType::ApplicationCbor;
+
+    std::vector<std::string> queries;
+    observer->GetOptions(queries, CoapOptionValue::UriQuery, result);
+
+    Respond(response, accept, queries, result);
+}
+
+StateResource::StateResource(CoapTransport& coap, std::initializer_list<Member> members)
+    : _coap(coap), _memberCount(0)
+{
+    CoapResult result;
+    this->_coap.CreateResource(this->_resource, this, "state", result);
+    if (result != CoapResult::OK || this->_resource == nullptr)
+    {
+        ESP_LOGE( kTag, "CreateResource failed." );
+        return;
+    }
+
+    this->_resource->RegisterHandler(CoapMessageCode::Get, result);
+    this->_resource->RegisterAsObservable(result);
+    this->_resource->SetAttributes("iotnode.state", "core.b", {CoapContentType::ApplicationCbor, CoapContentType::ApplicationJson}, result);
+
+    for (auto &member : members)
+    {
+        if (_memberCount == kMaxMembers)
+        {
+            ESP_LOGE( kTag, "Too many members, /%s left out", member.Name );
+            continue;
+        }
+
+        this->_resource->AddMember(member.Resource, result);
+        if (result != CoapResult::OK)
+            continue;
+
+        _members[_memberCount++] = member;
+    }
+}
+
+template void StateResource::Handle(ICoapMessage const *request, ICoapMessage *response, CoapResult &result);
+#if CONFIG_IOTNODE_COAP_STATIC_DISPATCH
+template void StateResource::Handle(CoapTransportMessage const *request, CoapTransportMessage *response, CoapResult &result);
+#endif
@@ -1,23 +1,20 @@
-#include <nlohmann/json.hpp>
-
 #include <cstring>
 #include <ostream>
 #include <sstream>
 #include <string>
 
-// for convenience
-using json = nlohmann::json;
-
 #include "esp_log.h"
 #include "tcpip_adapter.h"
 
+#include "statewriter.h"
 #include "utils.h"
 #include "resources/wifi.h"
 
 static const char *kTag = "Wifi Resource";
 
 
-void WifiResource::HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result)
+template<class Message>
+void WifiResource::Handle(Message const *request, Message *response, CoapResult &result)
 {
 	tcpip_adapter_ip_info_t ipinfo;
 	// char payloadTemp[250], ip_address[16], ip_mask[16], ip_gateway[16];
@@ -49,26 +46,20 @@ void WifiResource::HandleRequest(ICoapMessage const *request, ICoapMessage *resp
         response->SetPayload(output.str(), result);
         response->SetCode(CoapMessageCode::Content, result);
     }
-    else if(accept == CoapContentType::ApplicationJson)
-    {
-        json output;
-        output["ip"] = to_string(ipinfo.ip);
-        output["mask"] = to_string(ipinfo.netmask);
-        output["gateway"] = to_string(ipinfo.gw);
-
-        response->AddOption(CoapUIntOption(CoapOptionValue::ContentFormat, CoapContentType::ApplicationJson), result);
-        response->SetPayload(output.dump(), result);
-        response->SetCode(CoapMessageCode::Content, result);
-    }
-    else if(accept == CoapContentType::ApplicationCbor)
+    else if(accept == CoapContentType::ApplicationJson || accept == CoapContentType::ApplicationCbor)
     {
-        json output;
-        output["ip"] = to_string(ipinfo.ip);
-        output["mask"] = to_string(ipinfo.netmask);
-        output["gateway"] = to_string(ipinfo.gw);
-
-        response->AddOption(CoapUIntOption(CoapOptionValue::ContentFormat, CoapContentType::ApplicationCbor), result);
-        response->SetPayload(json::to_cbor(output), result);
+        std::vector<std::string> queries;
+        request->GetOptions(queries, CoapOptionValue::UriQuery, result);
+
+        std::string output;
+        StateWriter writer(accept == CoapContentType::ApplicationCbor ? StateWriter::Format::Cbor : StateWriter::Format::Json, output);
+        writer.Select(queries);
+        writer.BeginMap();
+        WriteState(ipinfo, writer);
+        writer.EndMap();
+
+        response->AddOption(CoapUIntOption(CoapOptionValue::ContentFormat, accept), result);
+        response->SetPayload(output, result);
         response->SetCode(CoapMessageCode::Content, result);
     }
     else
@@ -79,7 +70,28 @@ void WifiResource::HandleRequest(ICoapMessage const *request, ICoapMessage *resp
 
 }
 
-WifiResource::WifiResource(ICoapInterface& coap)
+void WifiResource::WriteState(tcpip_adapter_ip_info_t const &ipinfo, StateWriter &writer) const
+{
+    // Don't format addresses that were filtered out
+    if (writer.Wants("gateway"))
+        writer.Field("gateway", to_string(ipinfo.gw));
+    if (writer.Wants("ip"))
+        writer.Field("ip", to_string(ipinfo.ip));
+    if (writer.Wants("mask"))
+        writer.Field("mask", to_string(ipinfo.netmask));
+}
+
+bool WifiResource::WriteState(StateWriter &writer) const
+{
+    tcpip_adapter_ip_info_t ipinfo;
+    if( tcpip_adapter_get_ip_info( TCPIP_ADAPTER_IF_STA, &ipinfo ) != ESP_OK )
+        return false;
+
+    WriteState(ipinfo, writer);
+    return true;
+}
+
+WifiResource::WifiResource(CoapTransport& coap)
     : _coap(coap)
 {
     CoapResult result;
@@ -91,4 +103,10 @@ WifiResource::WifiResource(ICoapInterface& coap)
     }
 
     this->_resource->RegisterHandler(CoapMessageCode::Get, result);
+    this->_resource->SetAttributes("iotnode.wifi", "core.rp", {CoapContentType::TextPlain, CoapContentType::ApplicationJson, CoapContentType::ApplicationCbor}, result);
 }
+
+template void WifiResource::Handle(ICoapMessage const *request, ICoapMessage *response, CoapResult &result);
+#if CONFIG_IOTNODE_COAP_STATIC_DISPATCH
+template void WifiResource::Handle(CoapTransportMessage const *request, CoapTransportMessage *response, CoapResult &result);
+#endif
@@ -0,0 +1,186 @@
+#include <algorithm>
+#include <cstdint>
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "taskconfig.h"
+#include "services/inputdispatcher.h"
+
+static const char *kTag = "Input Dispatcher";
+
+static const char *kThreadName = "Input Dispatcher";
+static const size_t kThreadStackSize = 2048;
+static const UBaseType_t kThreadPriority = 8;
+static constexpr int64_t kDebouncePeriodUSec = CONFIG_IOTNODE_INPUT_DEBOUNCE_MS * 1000;
+
+InputDispatcher::InputDispatcher()
+    : _inputCount(0), _task(nullptr)
+{
+}
+
+bool InputDispatcher::Start()
+{
+    int ret = xTaskCreatePinnedToCore(
+        &InputDispatcher::TaskHandle,
+        kThreadName,
+        kThreadStackSize,
+        this,
+        kThreadPriority,
+        &this->_task,
+        kApplicationCore
+    );
+
+    if (ret != pdPASS)
+    {
+        ESP_LOGE(kTag, "Failed to create thread %s", kThreadName );
+        return false;
+    }
+
+    //install gpio isr service
+    gpio_install_isr_service(0);
+    return true;
+}
+
+bool InputDispatcher::Register(gpio_num_t pin, uint32_t activeLevel, IInputListener *listener)
+{
+    int index = _inputCount.load();
+    if (index >= kInputDispatcherMaxInputs)
+    {
+        ESP_LOGE(kTag, "Can not register GPIO %d, all %d inputs are in use", pin, kInputDispatcherMaxInputs);
+        return false;
+    }
+
+    auto &input = _inputs[index];
+    input.Dispatcher = this;
+    input.Listener = listener;
+    input.Pin = pin;
+    input.ActiveLevel = activeLevel;
+    input.LockoutUntil = 0;
+    input.Bounced = false;
+
+    gpio_config_t io_conf;
+    io_conf.intr_type = GPIO_INTR_ANYEDGE;
+    io_conf.mode = GPIO_MODE_INPUT;
+    io_conf.pin_bit_mask = (1ULL << pin);
+    io_conf.pull_down_en = GPIO_PULLDOWN_DISABLE;
+    io_conf.pull_up_en = GPIO_PULLUP_ENABLE;
+    gpio_config(&io_conf);
+
+    input.Active.store(gpio_get_level(pin) == static_cast<int>(activeLevel));
+
+    // Publish the input to the task before it can receive edges for it
+    _inputCount.store(index + 1);
+    gpio_isr_handler_add(pin, &InputDispatcher::GPIOHandler, &input);
+    return true;
+}
+
+bool InputDispatcher::IsActive(gpio_num_t pin) const
+{
+    int count = _inputCount.load();
+    for (int i = 0; i < count; i++)
+    {
+        if (_inputs[i].Pin == pin)
+            return _inputs[i].Active;
+    }
+    return false;
+}
+
+void IRAM_ATTR InputDispatcher::GPIOHandler(void* arg)
+{
+    auto input = static_cast<Input*>(arg);
+    auto dispatcher = input->Dispatcher;
+
+    Edge edge;
+    edge.Timestamp = esp_timer_get_time();
+    edge.Input = static_cast<uint8_t>(input - dispatcher->_inputs);
+    edge.Level = static_cast<uint8_t>(gpio_get_level(input->Pin));
+
+    // If the queue is full the edge is dropped, the lockout re-read will still catch the final level
+    dispatcher->_edges.Push(edge);
+
+    if (dispatcher->_task == nullptr)
+        return;
+
+    BaseType_t higherPriorityTaskWoken = pdFALSE;
+    vTaskNotifyGiveFromISR(dispatcher->_task, &higherPriorityTaskWoken);
+    if (higherPriorityTaskWoken)
+        portYIELD_FROM_ISR();
+}
+
+void InputDispatcher::HandleEdge(Edge const &edge)
+{
+    auto &input = _inputs[edge.Input];
+
+    if (edge.Timestamp < input.LockoutUntil)
+    {
+        input.Bounced = true;
+        return;
+    }
+
+    bool active = edge.Level == input.ActiveLevel;
+    if (active == input.Active)
+        return;
+
+    input.Active = active;
+    input.LockoutUntil = edge.Timestamp + kDebouncePeriodUSec;
+    input.Bounced = false;
+    input.Listener->InputChanged(input.Pin, active, edge.Timestamp);
+}
+
+TickType_t InputDispatcher::HandleLockouts(int64_t now)
+{
+    int64_t nextLockout = INT64_MAX;
+    int count = _inputCount.load();
+
+    for (int i = 0; i < count; i++)
+    {
+        auto &input = _inputs[i];
+        if (input.LockoutUntil == 0)
+            continue;
+
+        if (now < input.LockoutUntil)
+        {
+            nextLockout = std::min(nextLockout, input.LockoutUntil);
+            continue;
+        }
+
+        input.LockoutUntil = 0;
+        if (!input.Bounced)
+            continue;
+
+        // Edges were ignored during the lockout, make sure we didn't miss the pin settling elsewhere
+        input.Bounced = false;
+        bool active = gpio_get_level(input.Pin) == static_cast<int>(input.ActiveLevel);
+        if (active == input.Active)
+            continue;
+
+        input.Active = active;
+        input.LockoutUntil = now + kDebouncePeriodUSec;
+        nextLockout = std::min(nextLockout, input.LockoutUntil);
+        input.Listener->InputChanged(input.Pin, active, now);
+    }
+
+    if (nextLockout == INT64_MAX)
+        return portMAX_DELAY;
+
+    // Round up so we never wake before the lockout has expired
+    return static_cast<TickType_t>((nextLockout - now) / 1000 / portTICK_PERIOD_MS) + 1;
+}
+
+void InputDispatcher::TaskHandle(void* pvParameters)
+{
+    auto instance = static_cast<InputDispatcher*>(pvParameters);
+    TickType_t timeout = portMAX_DELAY;
+    Edge edge;
+
+    while(true)
+    {
+        ulTaskNotifyTake(pdTRUE, timeout);
+
+        while (instance->_edges.Pop(edge))
+            instance->HandleEdge(edge);
+
+        timeout = instance->HandleLockouts(esp_timer_get_time());
+    }
+}
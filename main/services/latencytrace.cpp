@@ -0,0 +1,67 @@
+#include "latencytrace.h"
+
+static const char *kStageNames[] = {
+    "wakeup",
+    "notify",
+    "dequeue",
+    "serialize",
+    "send",
+    "total",
+};
+static_assert(sizeof(kStageNames) / sizeof(kStageNames[0]) == static_cast<int>(TraceStage::Count), "Every TraceStage needs a name");
+
+static LatencyHistogram _histograms[static_cast<int>(TraceStage::Count)];
+
+const char *TraceStageName(TraceStage stage)
+{
+    return kStageNames[static_cast<int>(stage)];
+}
+
+LatencyHistogram &TraceHistogram(TraceStage stage)
+{
+    return _histograms[static_cast<int>(stage)];
+}
+
+LatencyHistogram::LatencyHistogram()
+{
+    Reset();
+}
+
+void LatencyHistogram::Record(uint32_t usec)
+{
+    int bucket = usec < 2 ? 0 : 31 - __builtin_clz(usec);
+    if (bucket >= kBuckets)
+        bucket = kBuckets - 1;
+
+    _buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    _count.fetch_add(1, std::memory_order_relaxed);
+
+    uint32_t max = _max.load(std::memory_order_relaxed);
+    while (usec > max && !_max.compare_exchange_weak(max, usec, std::memory_order_relaxed))
+        ;
+}
+
+void LatencyHistogram::Reset()
+{
+    for (auto &bucket : _buckets)
+        bucket.store(0, std::memory_order_relaxed);
+    _count.store(0, std::memory_order_relaxed);
+    _max.store(0, std::memory_order_relaxed);
+}
+
+uint32_t LatencyHistogram::GetPercentile(int percentile) const
+{
+    uint32_t count = GetCount();
+    if (count == 0)
+        return 0;
+
+    uint32_t target = (static_cast<uint64_t>(count) * percentile + 99) / 100;
+    uint32_t seen = 0;
+    for (int i = 0; i < kBuckets; i++)
+    {
+        seen += GetBucket(i);
+        if (seen >= target)
+            return i == kBuckets - 1 ? GetMax() : (2u << i) - 1;
+    }
+    return GetMax();
+}
@@ -0,0 +1,271 @@
+#include <cstdio>
+#include <cstring>
+
+#include "statewriter.h"
+
+// CBOR (RFC 7049) major types
+static const uint8_t kCborUnsigned = 0;
+static const uint8_t kCborNegative = 1;
+static const uint8_t kCborText = 3;
+static const uint8_t kCborArray = 4;
+static const uint8_t kCborMap = 5;
+static const uint8_t kCborFalse = 0xF4;
+static const uint8_t kCborTrue = 0xF5;
+static const uint8_t kCborFloat = 0xFA;
+static const uint8_t kCborIndefiniteMap = 0xBF;
+static const uint8_t kCborBreak = 0xFF;
+
+StateWriter::StateWriter(Format format, std::string &output)
+    : _format(format), _output(output), _depth(0), _skip(0)
+{
+}
+
+void StateWriter::Select(std::vector<std::string> const &queries)
+{
+    for (auto &query : queries)
+    {
+        if (query.compare(0, 2, "f=") == 0)
+        {
+            _fields = query.substr(2);
+            return;
+        }
+    }
+}
+
+bool StateWriter::Wants(const char *name) const
+{
+    // Only the fields of the outermost map are selected
+    if (_fields.empty() || _depth != 1)
+        return true;
+
+    auto length = strlen(name);
+    for (size_t start = 0; start <= _fields.length();)
+    {
+        auto end = _fields.find(',', start);
+        if (end == std::string::npos)
+            end = _fields.length();
+
+        if (end - start == length && _fields.compare(start, length, name) == 0)
+            return true;
+
+        start = end + 1;
+    }
+    return false;
+}
+
+void StateWriter::Head(uint8_t major, uint32_t value)
+{
+    major <<= 5;
+    if (value < 24)
+        _output += static_cast<char>(major | value);
+    else if (value <= 0xFF)
+    {
+        _output += static_cast<char>(major | 24);
+        _output += static_cast<char>(value);
+    }
+    else if (value <= 0xFFFF)
+    {
+        _output += static_cast<char>(major | 25);
+        _output += static_cast<char>(value >> 8);
+        _output += static_cast<char>(value);
+    }
+    else
+    {
+        _output += static_cast<char>(major | 26);
+        _output += static_cast<char>(value >> 24);
+        _output += static_cast<char>(value >> 16);
+        _output += static_cast<char>(value >> 8);
+        _output += static_cast<char>(value);
+    }
+}
+
+template<class T>
+void StateWriter::Number(const char *format, T value)
+{
+    char number[16];
+    snprintf(number, sizeof(number), format, value);
+    _output += number;
+}
+
+void StateWriter::String(const char *value)
+{
+    if (_format == Format::Cbor)
+    {
+        auto length = strlen(value);
+        Head(kCborText, length);
+        _output.append(value, length);
+        return;
+    }
+
+    _output += '"';
+    for (; *value != '\0'; value++)
+    {
+        if (*value == '"' || *value == '\\')
+            _output += '\\';
+        if (static_cast<uint8_t>(*value) < 0x20)
+        {
+            char escaped[8];
+            snprintf(escaped, sizeof(escaped), "\\u%04x", *value);
+            _output += escaped;
+            continue;
+        }
+        _output += *value;
+    }
+    _output += '"';
+}
+
+void StateWriter::Next()
+{
+    if (_depth == 0 || _depth > kMaxDepth)
+        return;
+
+    if (_format == Format::Json && !_first[_depth - 1])
+        _output += ',';
+    _first[_depth - 1] = false;
+}
+
+bool StateWriter::Key(const char *name)
+{
+    if (_skip > 0 || !Wants(name))
+        return false;
+
+    Next();
+    String(name);
+    if (_format == Format::Json)
+        _output += ':';
+    return true;
+}
+
+void StateWriter::Open()
+{
+    // Indefinite length, the number of fields isn't known up front
+    if (_format == Format::Cbor)
+        _output += static_cast<char>(kCborIndefiniteMap);
+    else
+        _output += '{';
+
+    if (_depth < kMaxDepth)
+        _first[_depth] = true;
+    _depth++;
+}
+
+void StateWriter::BeginMap()
+{
+    if (_skip > 0)
+    {
+        _skip++;
+        return;
+    }
+
+    Next();
+    Open();
+}
+
+void StateWriter::BeginMap(const char *name)
+{
+    // Everything up to the matching EndMap is left out along with the map
+    if (!Key(name))
+    {
+        _skip++;
+        return;
+    }
+
+    Open();
+}
+
+void StateWriter::EndMap()
+{
+    if (_skip > 0)
+    {
+        _skip--;
+        return;
+    }
+
+    if (_depth == 0)
+        return;
+
+    _depth--;
+    if (_format == Format::Cbor)
+        _output += static_cast<char>(kCborBreak);
+    else
+        _output += '}';
+}
+
+void StateWriter::Field(const char *name, const char *value)
+{
+    if (!Key(name))
+        return;
+    String(value);
+}
+
+void StateWriter::Field(const char *name, uint32_t value)
+{
+    if (!Key(name))
+        return;
+    if (_format == Format::Cbor)
+        Head(kCborUnsigned, value);
+    else
+        Number("%u", static_cast<unsigned>(value));
+}
+
+void StateWriter::Field(const char *name, int32_t value)
+{
+    if (!Key(name))
+        return;
+    if (_format == Format::Cbor)
+        Head(value < 0 ? kCborNegative : kCborUnsigned, value < 0 ? -1 - value : value);
+    else
+        Number("%d", static_cast<int>(value));
+}
+
+void StateWriter::Field(const char *name, bool value)
+{
+    if (!Key(name))
+        return;
+    if (_format == Format::Cbor)
+        _output += static_cast<char>(value ? kCborTrue : kCborFalse);
+    else
+        _output += value ? "true" : "false";
+}
+
+void StateWriter::Field(const char *name, float value)
+{
+    if (!Key(name))
+        return;
+    if (_format == Format::Cbor)
+    {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof(bits));
+        _output += static_cast<char>(kCborFloat);
+        _output += static_cast<char>(bits >> 24);
+        _output += static_cast<char>(bits >> 16);
+        _output += static_cast<char>(bits >> 8);
+        _output += static_cast<char>(bits);
+    }
+    else
+    {
+        Number("%g", value);
+    }
+}
+
+void StateWriter::Field(const char *name, std::initializer_list<uint32_t> values)
+{
+    if (!Key(name))
+        return;
+    if (_format == Format::Cbor)
+    {
+        Head(kCborArray, values.size());
+        for (auto value : values)
+            Head(kCborUnsigned, value);
+        return;
+    }
+
+    _output += '[';
+    for (auto value = values.begin(); value != values.end(); value++)
+    {
+        if (value != values.begin())
+            _output += ',';
+        Number("%u", static_cast<unsigned>(*value));
+    }
+    _output += ']';
+}
@@ -0,0 +1,143 @@
+#ifndef _TEST_COAPTEST_H_
+#define _TEST_COAPTEST_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "coap.h"
+#include "coappacket.h"
+
+#include "stubs.h"
+#include "test.h"
+
+extern "C" {
+    #include "interface/network/net_Endpoint.h"
+}
+
+// Datagrams for the tests of code that talks CoAP over a Transmit callback
+
+typedef std::vector<std::pair<uint16_t, std::string>> TestOptions;
+
+struct Datagram
+{
+    NetEp_t Remote;
+    std::vector<uint8_t> Data;
+};
+// Everything passed to Transmit, tests clear it themselves
+static std::vector<Datagram> gSent;
+
+inline bool Transmit(void *context, NetEp_t const &remote, const uint8_t *data, size_t length)
+{
+    gSent.push_back({remote, std::vector<uint8_t>(data, data + length)});
+    return true;
+}
+
+inline NetEp_t Endpoint(uint32_t address, uint16_t port)
+{
+    NetEp_t ep = {};
+    ep.NetType = IPV4;
+    ep.NetAddr.IPv4.u32[0] = address;
+    ep.NetPort = port;
+    return ep;
+}
+
+// Options must be in ascending order
+inline std::vector<uint8_t> Message(CoapMessageType type, uint8_t code, uint16_t messageId, std::string const &token,
+    TestOptions const &options, std::string const &payload = "")
+{
+    std::vector<uint8_t> data(kCoapHeaderSize + token.length() + 64 + payload.length());
+    data[0] = 0x40 | static_cast<uint8_t>(type) << 4 | token.length();
+    data[1] = code;
+    data[2] = messageId >> 8;
+    data[3] = messageId & 0xFF;
+    memcpy(&data[kCoapHeaderSize], token.data(), token.length());
+    size_t offset = kCoapHeaderSize + token.length();
+    uint16_t previous = 0;
+    for (auto &option : options)
+        CHECK(CoapWriteOption(data.data(), data.size(), offset, previous, option.first,
+            reinterpret_cast<const uint8_t *>(option.second.data()), option.second.size()));
+    if (!payload.empty())
+    {
+        data[offset++] = 0xFF;
+        memcpy(&data[offset], payload.data(), payload.length());
+        offset += payload.length();
+    }
+    data.resize(offset);
+    return data;
+}
+
+// A response to `request`, piggybacked on its ACK when that was confirmable
+inline std::vector<uint8_t> Reply(Datagram const &request, uint8_t code, TestOptions const &options, std::string const &payload = "")
+{
+    CoapResult result;
+    CoapPacket packet(request.Data.data(), request.Data.size());
+    packet.Parse(result);
+
+    auto type = packet.GetType() == CoapMessageType::Confirmable ? CoapMessageType::Acknowledgement : CoapMessageType::NonConfirmable;
+    std::string token(reinterpret_cast<const char *>(packet.GetToken()), packet.GetTokenLength());
+    return Message(type, code, packet.GetMessageId(), token, options, payload);
+}
+
+// Minimal length network order, as an option value
+inline std::string UInt(uint32_t value)
+{
+    std::string encoded;
+    for (int i = 3; i >= 0; i--)
+    {
+        if ((value >> (i * 8)) != 0 || !encoded.empty())
+            encoded.push_back(static_cast<char>(value >> (i * 8)));
+    }
+    return encoded;
+}
+
+template <typename Receiver>
+inline bool Feed(Receiver &receiver, NetEp_t const &remote, std::vector<uint8_t> const &data)
+{
+    CoapResult result;
+    CoapPacket packet(data.data(), data.size());
+    packet.Parse(result);
+    CHECK(result == CoapResult::OK);
+    return receiver.Receive(remote, packet, gTestNow);
+}
+
+inline CoapMessageType TypeOf(Datagram const &datagram)
+{
+    return static_cast<CoapMessageType>((datagram.Data[0] >> 4) & 0x03);
+}
+
+inline uint8_t CodeOf(Datagram const &datagram)
+{
+    return datagram.Data[1];
+}
+
+inline std::vector<std::string> OptionsOf(Datagram const &datagram, uint16_t wanted)
+{
+    CoapResult result;
+    CoapPacket packet(datagram.Data.data(), datagram.Data.size());
+    packet.Parse(result);
+
+    std::vector<std::string> values;
+    size_t offset = packet.GetOptionsOffset();
+    uint16_t number = 0;
+    const uint8_t *value;
+    size_t length;
+    while (CoapNextOption(datagram.Data.data(), datagram.Data.size(), offset, number, value, length))
+    {
+        if (number == wanted)
+            values.emplace_back(reinterpret_cast<const char *>(value), length);
+    }
+    return values;
+}
+
+inline std::string PayloadOf(Datagram const &datagram)
+{
+    CoapResult result;
+    CoapPacket packet(datagram.Data.data(), datagram.Data.size());
+    packet.Parse(result);
+
+    auto offset = packet.GetPayloadOffset();
+    return std::string(reinterpret_cast<const char *>(datagram.Data.data()) + offset, datagram.Data.size() - offset);
+}
+
+#endif // _TEST_COAPTEST_H_
@@ -0,0 +1,8 @@
+#pragma once
+#include "liblobaro_coap.h"
+
+CoAP_option_t *CoAP_FindOptionByNumber(CoAP_Message_t *message, uint16_t number);
+CoAP_Result_t CoAP_RemoveOptionFromList(CoAP_option_t **list, CoAP_option_t *option);
+CoAP_Result_t CoAP_AppendUintOptionToList(CoAP_option_t **list, uint16_t number, uint32_t value);
+CoAP_Result_t CoAP_CopyOptionToList(CoAP_option_t **list, CoAP_option_t *option);
+CoAP_Result_t CoAP_GetUintFromOption(const CoAP_option_t *option, uint32_t *value);
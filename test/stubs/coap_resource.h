@@ -0,0 +1,4 @@
+#pragma once
+#include "liblobaro_coap.h"
+
+CoAP_Res_t *CoAP_FindResourceByUri(CoAP_Res_t *list, CoAP_option_t *uri);
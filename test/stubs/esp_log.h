@@ -0,0 +1,16 @@
+#pragma once
+#include <stdio.h>
+
+// Only errors, TEST_VERBOSE=1 shows everything. Tests provoke warnings on purpose.
+#define ESP_LOGE(tag, fmt, ...) printf("E %s: " fmt "\n", tag, ##__VA_ARGS__)
+#if TEST_VERBOSE
+#define ESP_LOGW(tag, fmt, ...) printf("W %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGI(tag, fmt, ...) printf("I %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGD(tag, fmt, ...) printf("D %s: " fmt "\n", tag, ##__VA_ARGS__)
+#define ESP_LOGV(tag, fmt, ...) printf("V %s: " fmt "\n", tag, ##__VA_ARGS__)
+#else
+#define ESP_LOGW(tag, fmt, ...) do { if (0) printf("%s: " fmt, tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGI(tag, fmt, ...) do { if (0) printf("%s: " fmt, tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGD(tag, fmt, ...) do { if (0) printf("%s: " fmt, tag, ##__VA_ARGS__); } while (0)
+#define ESP_LOGV(tag, fmt, ...) do { if (0) printf("%s: " fmt, tag, ##__VA_ARGS__); } while (0)
+#endif
@@ -0,0 +1,5 @@
+#pragma once
+#include <stdint.h>
+
+// Returns the fake clock, see stubs.cpp
+int64_t esp_timer_get_time();
@@ -0,0 +1,32 @@
+#pragma once
+// FreeRTOSConfig.h pulls in assert() on the target
+#include <assert.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef int BaseType_t;
+typedef unsigned UBaseType_t;
+typedef uint32_t TickType_t;
+typedef void *TaskHandle_t;
+typedef void *EventGroupHandle_t;
+
+#define portMAX_DELAY 0xffffffff
+#define portTICK_PERIOD_MS 1
+#define tskNO_AFFINITY 0x7FFFFFFF
+#define pdMS_TO_TICKS(x) (x)
+#define pdTRUE 1
+#define pdFALSE 0
+#define IRAM_ATTR
+
+// A real spinlock, test_seqlock runs writers on several threads
+typedef struct { int owner; } portMUX_TYPE;
+#define portMUX_INITIALIZER_UNLOCKED {0}
+static inline void portENTER_CRITICAL(portMUX_TYPE *mux)
+{
+    while (__atomic_exchange_n(&mux->owner, 1, __ATOMIC_ACQUIRE) != 0)
+        ;
+}
+static inline void portEXIT_CRITICAL(portMUX_TYPE *mux)
+{
+    __atomic_store_n(&mux->owner, 0, __ATOMIC_RELEASE);
+}
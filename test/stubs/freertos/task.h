@@ -0,0 +1,15 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+// Tasks are never started on the host, tests drive what they'd run themselves
+typedef void (*TaskFunction_t)(void *);
+typedef TaskHandle_t xTaskHandle;
+
+BaseType_t xTaskCreatePinnedToCore(TaskFunction_t function, const char *name, uint32_t stackDepth, void *parameters,
+    UBaseType_t priority, TaskHandle_t *created, BaseType_t core);
+TaskHandle_t xTaskGetCurrentTaskHandle();
+BaseType_t xTaskNotifyGive(TaskHandle_t task);
+uint32_t ulTaskNotifyTake(BaseType_t clearOnExit, TickType_t ticksToWait);
+void vTaskDelay(TickType_t ticks);
+TickType_t xTaskGetTickCount();
+void vTaskDelete(TaskHandle_t task);
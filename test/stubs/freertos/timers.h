@@ -0,0 +1,11 @@
+#pragma once
+#include "freertos/FreeRTOS.h"
+
+// Timers never fire on the host, tests call what the callback would
+typedef void *TimerHandle_t;
+typedef void (*TimerCallbackFunction_t)(TimerHandle_t timer);
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, BaseType_t autoReload, void *id,
+    TimerCallbackFunction_t callback);
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer);
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticksToWait);
@@ -0,0 +1,7 @@
+#pragma once
+#include "liblobaro_coap.h"
+
+extern const NetEp_t NetEp_IPv4_mulitcast;
+extern const NetEp_t NetEp_IPv6_mulitcast;
+
+bool EpAreEqual(const NetEp_t *ep_A, const NetEp_t *ep_B);
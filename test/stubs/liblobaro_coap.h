@@ -0,0 +1,132 @@
+#pragma once
+// The parts of lobaro's API the tested code uses
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum { EP_NONE, IPV6, IPV4 } NetInterfaceType_t;
+typedef union { uint8_t u8[16]; uint16_t u16[8]; uint32_t u32[4]; } NetAddr_IPv6_t;
+typedef union { uint8_t u8[4]; uint32_t u32[1]; } NetAddr_IPv4_t;
+typedef struct
+{
+    NetInterfaceType_t NetType;
+    union
+    {
+        NetAddr_IPv6_t IPv6;
+        NetAddr_IPv4_t IPv4;
+    } NetAddr;
+    uint16_t NetPort;
+} NetEp_t;
+
+typedef void *SocketHandle_t;
+
+typedef enum { COAP_OK, COAP_ERR } CoAP_Result_t;
+typedef enum { HANDLER_OK, HANDLER_POSTPONE, HANDLER_ERROR } CoAP_HandlerResult_t;
+typedef enum { CON = 0, NON = 1, ACK = 2, RST = 3 } CoAP_MessageType_t;
+typedef enum { EMPTY = 0, RESP_INTERNAL_SERVER_ERROR_5_00 = 160 } CoAP_MessageCode_t;
+
+typedef enum { META_INFO_NONE, META_INFO_MULTICAST } MetaInfoType_t;
+typedef struct { MetaInfoType_t Type; } MetaInfo_t;
+
+typedef struct
+{
+    uint8_t *pData;
+    uint16_t size;
+    NetEp_t remoteEp;
+    MetaInfo_t metaInfo;
+} NetPacket_t;
+
+typedef bool (*NetTransmit_fn)(SocketHandle_t handle, NetPacket_t *packet);
+typedef struct
+{
+    SocketHandle_t Handle;
+    NetEp_t EpLocal;
+    NetTransmit_fn Tx;
+    bool Alive;
+} CoAP_Socket_t;
+
+typedef struct CoAP_option
+{
+    struct CoAP_option *next;
+    uint16_t Number;
+    uint16_t Length;
+    uint8_t *Value;
+} CoAP_option_t;
+
+typedef struct
+{
+    uint8_t Length;
+    uint8_t Token[8];
+} CoAP_Token_t;
+
+typedef struct
+{
+    uint32_t Timestamp;
+    CoAP_MessageType_t Type;
+    CoAP_MessageCode_t Code;
+    uint16_t MessageID;
+    uint16_t PayloadLength;
+    uint16_t PayloadBufSize;
+    CoAP_Token_t Token;
+    CoAP_option_t *pOptionsList;
+    uint8_t *Payload;
+    struct CoAP_Res *pResource;
+} CoAP_Message_t;
+
+typedef struct CoAP_Observer
+{
+    uint8_t FailCount;
+    SocketHandle_t socketHandle;
+    NetEp_t Ep;
+    CoAP_option_t *pOptList;
+    struct CoAP_Observer *next;
+} CoAP_Observer_t;
+
+typedef CoAP_HandlerResult_t (*CoAP_ResourceHandler_fPtr_t)(CoAP_Message_t *request, CoAP_Message_t *response);
+typedef CoAP_HandlerResult_t (*CoAP_ResourceNotifier_fPtr_t)(CoAP_Observer_t *observer, CoAP_Message_t *message);
+
+#define RES_OPT_GET 1
+#define RES_OPT_POST 2
+#define RES_OPT_PUT 4
+#define RES_OPT_DELETE 8
+typedef struct
+{
+    uint16_t Cf;
+    uint16_t AllowedMethods;
+    uint16_t ETag;
+} CoAP_ResOpts_t;
+
+typedef struct CoAP_Res
+{
+    struct CoAP_Res *next;
+    uint32_t ResId;
+    CoAP_option_t *pDescription;
+    CoAP_ResOpts_t Options;
+    CoAP_option_t *pUri;
+    CoAP_Observer_t *pListObservers;
+    CoAP_ResourceHandler_fPtr_t Handler;
+    CoAP_ResourceNotifier_fPtr_t Notifier;
+    uint32_t UpdateCnt;
+} CoAP_Res_t;
+
+typedef struct
+{
+    uint32_t (*rtc1HzCnt)(void);
+    void (*debugPuts)(char *s);
+} CoAP_API_t;
+
+typedef struct
+{
+    uint8_t *Memory;
+    int MemorySize;
+} CoAP_Config_t;
+
+void CoAP_Init(CoAP_API_t api, CoAP_Config_t config);
+CoAP_Socket_t *CoAP_NewSocket(SocketHandle_t handle);
+void CoAP_HandleIncomingPacket(SocketHandle_t handle, NetPacket_t *packet);
+void CoAP_doWork();
+CoAP_Res_t *CoAP_CreateResource(char *uri, char *description, CoAP_ResOpts_t options,
+    CoAP_ResourceHandler_fPtr_t handler, CoAP_ResourceNotifier_fPtr_t notifier);
+CoAP_Result_t CoAP_NotifyResourceObservers(CoAP_Res_t *resource);
+CoAP_Result_t CoAP_SetPayload(CoAP_Message_t *message, uint8_t *payload, uint16_t length, bool copy);
+CoAP_Result_t CoAP_UnlinkObserverFromList(CoAP_Observer_t **list, CoAP_Observer_t *observer, bool free);
@@ -0,0 +1,50 @@
+#pragma once
+// The netconn calls the CoAP transports make, tests that use them provide the fake connections
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lwip/ip_addr.h"
+
+typedef int8_t err_t;
+#define ERR_OK 0
+#define ERR_TIMEOUT -3
+#define ERR_WOULDBLOCK -7
+#define ERR_CLSD -15
+
+#define NETCONN_COPY 0x01
+
+enum netconn_type { NETCONN_TCP = 0x10, NETCONN_TCP_IPV6 = 0x18, NETCONN_UDP = 0x20, NETCONN_UDP_IPV6 = 0x28 };
+enum netconn_evt { NETCONN_EVT_RCVPLUS, NETCONN_EVT_RCVMINUS, NETCONN_EVT_SENDPLUS, NETCONN_EVT_SENDMINUS, NETCONN_EVT_ERROR };
+enum netconn_igmp { NETCONN_JOIN, NETCONN_LEAVE };
+
+struct netconn;
+struct pbuf;
+struct netbuf
+{
+    struct pbuf *p, *ptr;
+    ip_addr_t addr;
+    uint16_t port;
+    ip_addr_t toaddr;
+};
+typedef void (*netconn_callback)(struct netconn *conn, enum netconn_evt event, uint16_t length);
+
+struct netconn *netconn_new_with_callback(enum netconn_type type, netconn_callback callback);
+err_t netconn_delete(struct netconn *conn);
+err_t netconn_bind(struct netconn *conn, const ip_addr_t *addr, uint16_t port);
+err_t netconn_listen(struct netconn *conn);
+err_t netconn_accept(struct netconn *conn, struct netconn **new_conn);
+err_t netconn_recv_tcp_pbuf(struct netconn *conn, struct pbuf **new_buf);
+err_t netconn_write(struct netconn *conn, const void *dataptr, size_t size, uint8_t apiflags);
+err_t netconn_close(struct netconn *conn);
+void netconn_set_nonblocking(struct netconn *conn, int value);
+
+void netconn_set_ipv6only(struct netconn *conn, int value);
+err_t netconn_join_leave_group(struct netconn *conn, const ip_addr_t *multiaddr, const ip_addr_t *netifaddr,
+    enum netconn_igmp joinOrLeave);
+err_t netconn_recv(struct netconn *conn, struct netbuf **new_buf);
+err_t netconn_sendto(struct netconn *conn, struct netbuf *buf, const ip_addr_t *addr, uint16_t port);
+
+struct netbuf *netbuf_new();
+void netbuf_delete(struct netbuf *buf);
+err_t netbuf_ref(struct netbuf *buf, const void *dataptr, uint16_t size);
+err_t netbuf_data(struct netbuf *buf, void **dataptr, uint16_t *len);
@@ -0,0 +1,36 @@
+#pragma once
+#include <arpa/inet.h>
+#include <stdint.h>
+
+typedef struct { uint32_t addr; } ip4_addr_t;
+typedef struct { uint32_t addr[4]; } ip6_addr_t;
+typedef struct
+{
+    union
+    {
+        ip6_addr_t ip6;
+        ip4_addr_t ip4;
+    } u_addr;
+    uint8_t type;
+} ip_addr_t;
+
+#define IPADDR_TYPE_V4 0U
+#define IPADDR_TYPE_V6 6U
+
+#define IPADDR4_INIT(u32val) {{{{u32val, 0, 0, 0}}}, IPADDR_TYPE_V4}
+#define IP_SET_TYPE(ipaddr, iptype) ((ipaddr)->type = (iptype))
+#define IP4_ADDR(ipaddr, a, b, c, d) ((ipaddr)->addr = (uint32_t)(a) | (uint32_t)(b) << 8 | (uint32_t)(c) << 16 | (uint32_t)(d) << 24)
+#define IP_ADDR6(ipaddr, i0, i1, i2, i3) ((ipaddr)->type = IPADDR_TYPE_V6, \
+    (ipaddr)->u_addr.ip6.addr[0] = (i0), (ipaddr)->u_addr.ip6.addr[1] = (i1), \
+    (ipaddr)->u_addr.ip6.addr[2] = (i2), (ipaddr)->u_addr.ip6.addr[3] = (i3))
+#define IP_ADDR6_HOST(ipaddr, i0, i1, i2, i3) IP_ADDR6(ipaddr, htonl(i0), htonl(i1), htonl(i2), htonl(i3))
+
+#define ip_2_ip4(ipaddr) (&((ipaddr)->u_addr.ip4))
+#define ip_2_ip6(ipaddr) (&((ipaddr)->u_addr.ip6))
+#define ip_addr_get_ip4_u32(ipaddr) ((ipaddr)->u_addr.ip4.addr)
+
+#define IP4_ADDR_ANY ((const ip_addr_t *)0)
+#define IP6_ADDR_ANY ((const ip_addr_t *)0)
+
+int ipaddr_aton(const char *cp, ip_addr_t *addr);
+char *ipaddr_ntoa(const ip_addr_t *addr);
@@ -0,0 +1,87 @@
+#include <cstring>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+#include "mbedtls/ccm.h"
+#include "mbedtls/md.h"
+
+// Enough of mbedtls for the tested code, on top of OpenSSL's libcrypto. Errors are reported
+// the mbedtls way, as a non-zero return.
+
+static const int kError = -1;
+
+struct mbedtls_md_info_t
+{
+    const EVP_MD *(*Digest)();
+};
+
+static const mbedtls_md_info_t kSha256 = {EVP_sha256};
+
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t type)
+{
+    return type == MBEDTLS_MD_SHA256 ? &kSha256 : nullptr;
+}
+
+int mbedtls_md_hmac(const mbedtls_md_info_t *md_info, const unsigned char *key, size_t keylen,
+    const unsigned char *input, size_t ilen, unsigned char *output)
+{
+    // An empty key is valid, OpenSSL wants a pointer all the same
+    static const unsigned char kEmpty[1] = {};
+    unsigned int length;
+    if (md_info == nullptr || HMAC(md_info->Digest(), key != nullptr ? key : kEmpty, keylen, input, ilen, output, &length) == nullptr)
+        return kError;
+    return 0;
+}
+
+void mbedtls_ccm_init(mbedtls_ccm_context *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void mbedtls_ccm_free(mbedtls_ccm_context *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+int mbedtls_ccm_setkey(mbedtls_ccm_context *ctx, mbedtls_cipher_id_t cipher, const unsigned char *key, unsigned int keybits)
+{
+    if (cipher != MBEDTLS_CIPHER_ID_AES || (keybits != 128 && keybits != 256))
+        return kError;
+    memcpy(ctx->key, key, keybits / 8);
+    ctx->keybits = keybits;
+    return 0;
+}
+
+// One CCM pass: the total length goes in first, then the additional data, then the text
+static int _Ccm(mbedtls_ccm_context *ctx, bool encrypt, size_t length, const unsigned char *iv, size_t iv_len,
+    const unsigned char *add, size_t add_len, const unsigned char *input, unsigned char *output, unsigned char *tag, size_t tag_len)
+{
+    auto cipher = ctx->keybits == 128 ? EVP_aes_128_ccm() : EVP_aes_256_ccm();
+    auto evp = EVP_CIPHER_CTX_new();
+    int written;
+    bool ok = EVP_CipherInit_ex(evp, cipher, nullptr, nullptr, nullptr, encrypt) == 1
+        && EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_CCM_SET_IVLEN, iv_len, nullptr) == 1
+        && EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_CCM_SET_TAG, tag_len, encrypt ? nullptr : tag) == 1
+        && EVP_CipherInit_ex(evp, nullptr, nullptr, ctx->key, iv, encrypt) == 1
+        && EVP_CipherUpdate(evp, nullptr, &written, nullptr, length) == 1
+        && (add_len == 0 || EVP_CipherUpdate(evp, nullptr, &written, add, add_len) == 1)
+        && EVP_CipherUpdate(evp, output, &written, input, length) == 1;
+    if (ok && encrypt)
+        ok = EVP_CipherFinal_ex(evp, output + written, &written) == 1
+            && EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_CCM_GET_TAG, tag_len, tag) == 1;
+    EVP_CIPHER_CTX_free(evp);
+    return ok ? 0 : kError;
+}
+
+int mbedtls_ccm_encrypt_and_tag(mbedtls_ccm_context *ctx, size_t length, const unsigned char *iv, size_t iv_len,
+    const unsigned char *add, size_t add_len, const unsigned char *input, unsigned char *output, unsigned char *tag, size_t tag_len)
+{
+    return _Ccm(ctx, true, length, iv, iv_len, add, add_len, input, output, tag, tag_len);
+}
+
+int mbedtls_ccm_auth_decrypt(mbedtls_ccm_context *ctx, size_t length, const unsigned char *iv, size_t iv_len,
+    const unsigned char *add, size_t add_len, const unsigned char *input, unsigned char *output, const unsigned char *tag, size_t tag_len)
+{
+    return _Ccm(ctx, false, length, iv, iv_len, add, add_len, input, output, const_cast<unsigned char *>(tag), tag_len);
+}
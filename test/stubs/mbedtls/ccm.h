@@ -0,0 +1,19 @@
+#pragma once
+// mbedtls' CCM API, backed by OpenSSL on the host (stubs/mbedtls.cpp)
+#include <stddef.h>
+
+typedef enum { MBEDTLS_CIPHER_ID_NONE, MBEDTLS_CIPHER_ID_AES = 2 } mbedtls_cipher_id_t;
+
+typedef struct mbedtls_ccm_context
+{
+    unsigned char key[32];
+    unsigned int keybits;
+} mbedtls_ccm_context;
+
+void mbedtls_ccm_init(mbedtls_ccm_context *ctx);
+void mbedtls_ccm_free(mbedtls_ccm_context *ctx);
+int mbedtls_ccm_setkey(mbedtls_ccm_context *ctx, mbedtls_cipher_id_t cipher, const unsigned char *key, unsigned int keybits);
+int mbedtls_ccm_encrypt_and_tag(mbedtls_ccm_context *ctx, size_t length, const unsigned char *iv, size_t iv_len,
+    const unsigned char *add, size_t add_len, const unsigned char *input, unsigned char *output, unsigned char *tag, size_t tag_len);
+int mbedtls_ccm_auth_decrypt(mbedtls_ccm_context *ctx, size_t length, const unsigned char *iv, size_t iv_len,
+    const unsigned char *add, size_t add_len, const unsigned char *input, unsigned char *output, const unsigned char *tag, size_t tag_len);
@@ -0,0 +1,10 @@
+#pragma once
+// mbedtls' message digest API, backed by OpenSSL on the host (stubs/mbedtls.cpp)
+#include <stddef.h>
+
+typedef enum { MBEDTLS_MD_NONE, MBEDTLS_MD_SHA256 = 6 } mbedtls_md_type_t;
+typedef struct mbedtls_md_info_t mbedtls_md_info_t;
+
+const mbedtls_md_info_t *mbedtls_md_info_from_type(mbedtls_md_type_t type);
+int mbedtls_md_hmac(const mbedtls_md_info_t *md_info, const unsigned char *key, size_t keylen,
+    const unsigned char *input, size_t ilen, unsigned char *output);
@@ -0,0 +1,17 @@
+#pragma once
+// NVS as the tested code uses it, test_oscore keeps the values in memory and test_lobarocoap
+// has none
+#include <stdint.h>
+
+#include "esp_err.h"
+
+#define ESP_ERR_NVS_NOT_FOUND 0x1102
+
+typedef uint32_t nvs_handle;
+typedef enum { NVS_READONLY, NVS_READWRITE } nvs_open_mode;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode mode, nvs_handle *handle);
+void nvs_close(nvs_handle handle);
+esp_err_t nvs_get_u64(nvs_handle handle, const char *key, uint64_t *value);
+esp_err_t nvs_set_u64(nvs_handle handle, const char *key, uint64_t value);
+esp_err_t nvs_commit(nvs_handle handle);
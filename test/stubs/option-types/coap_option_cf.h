@@ -0,0 +1,2 @@
+#pragma once
+#include "liblobaro_coap.h"
@@ -0,0 +1,51 @@
+#ifndef _TEST_STUBS_SDKCONFIG_H_
+#define _TEST_STUBS_SDKCONFIG_H_
+
+// The configuration the host tests build against, every feature under test is enabled
+
+#define CONFIG_IOTNODE_HOSTNAME "IoTNode"
+
+#define CONFIG_IOTNODE_COAP_NO_RESPONSE 1
+#define CONFIG_IOTNODE_COAP_MULTICAST_LEISURE_MS 1000
+
+#define CONFIG_IOTNODE_COAP_TCP 1
+#define CONFIG_IOTNODE_COAP_TCP_CONNECTIONS 2
+#define CONFIG_IOTNODE_COAP_TCP_MAX_MESSAGE 4096
+#define CONFIG_IOTNODE_COAP_TCP_MAX_BODY 16384
+
+#define CONFIG_IOTNODE_COAP_CLIENT 1
+#define CONFIG_IOTNODE_COAP_CLIENT_NSTART 4
+#define CONFIG_IOTNODE_COAP_CLIENT_MAX_REQUESTS 8
+#define CONFIG_IOTNODE_COAP_CLIENT_MAX_BODY 4096
+
+#define CONFIG_IOTNODE_COAP_PROXY 1
+#define CONFIG_IOTNODE_COAP_PROXY_CACHE_SIZE 8192
+
+#define CONFIG_IOTNODE_COAP_RD 1
+#define CONFIG_IOTNODE_COAP_RD_ADDRESS "10.0.0.9"
+#define CONFIG_IOTNODE_COAP_RD_PORT 5683
+#define CONFIG_IOTNODE_COAP_RD_PATH "rd"
+#define CONFIG_IOTNODE_COAP_RD_LIFETIME 3600
+
+#define CONFIG_IOTNODE_MQTT 1
+#define CONFIG_IOTNODE_MQTT_BROKER_URI "mqtt://broker.local"
+#define CONFIG_IOTNODE_MQTT_TOPIC_PREFIX "iotnode"
+#define CONFIG_IOTNODE_MQTT_QOS 1
+#define CONFIG_IOTNODE_MQTT_BATCH_MS 50
+#define CONFIG_IOTNODE_MQTT_MAX_INFLIGHT 4
+
+#define CONFIG_IOTNODE_COAP_RATE_LIMIT 1
+#define CONFIG_IOTNODE_COAP_RATE_LIMIT_RATE 10
+#define CONFIG_IOTNODE_COAP_RATE_LIMIT_BURST 20
+#define CONFIG_IOTNODE_COAP_RATE_LIMIT_CLIENTS 16
+#define CONFIG_IOTNODE_COAP_RATE_LIMIT_REPLY 1
+
+#define CONFIG_IOTNODE_COAP_OSCORE 1
+#define CONFIG_IOTNODE_COAP_OSCORE_CONTEXTS 2
+
+#define CONFIG_IOTNODE_COAP_EGRESS_QUEUE 1
+#define CONFIG_IOTNODE_COAP_EGRESS_DEPTH 4
+#define CONFIG_IOTNODE_COAP_EGRESS_BURST 8
+#define CONFIG_IOTNODE_COAP_EGRESS_MULTICAST_GAP_MS 20
+
+#endif // _TEST_STUBS_SDKCONFIG_H_
@@ -0,0 +1,8 @@
+#pragma once
+#include <stdint.h>
+
+#include "esp_timer.h"
+#include "esp_system.h"
+
+// What esp_timer_get_time() returns, tests move it forward themselves
+extern int64_t gTestNow;
@@ -0,0 +1,32 @@
+#ifndef _TEST_TEST_H_
+#define _TEST_TEST_H_
+
+#include <cstdio>
+
+// Minimal assertions for the host tests. A failed CHECK is reported and the test carries on,
+// TEST_RESULT() is what main returns.
+static int gTestFailures = 0;
+
+#define CHECK(condition) \
+    do { \
+        if (!(condition)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+            gTestFailures++; \
+        } \
+    } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+    do { \
+        auto _expected = (expected); \
+        auto _actual = (actual); \
+        if (!(_expected == _actual)) { \
+            printf("%s:%d: CHECK_EQUAL(%s, %s) failed: %lld != %lld\n", __FILE__, __LINE__, #expected, #actual, \
+                static_cast<long long>(_expected), static_cast<long long>(_actual)); \
+            gTestFailures++; \
+        } \
+    } while (0)
+
+#define TEST_RESULT() \
+    (printf("%s: %s\n", __FILE__, gTestFailures == 0 ? "passed" : "FAILED"), gTestFailures == 0 ? 0 : 1)
+
+#endif // _TEST_TEST_H_
@@ -0,0 +1,96 @@
+#include "coapclient.h"
+
+#include "coaptest.h"
+
+static const uint8_t kContent = 0x45;
+
+struct Completion
+{
+    int Calls = 0;
+    CoapResult Result = CoapResult::Error;
+    BufferedCoapMessage Response;
+};
+
+static void OnResponse(void *context, CoapResult result, BufferedCoapMessage const *response)
+{
+    auto completion = static_cast<Completion *>(context);
+    completion->Calls++;
+    completion->Result = result;
+    if (response != nullptr)
+        completion->Response = *response;
+}
+
+static bool HasOption(BufferedCoapMessage const &message, uint16_t number)
+{
+    for (auto &option : message.GetOptions())
+    {
+        if (option.Number == number)
+            return true;
+    }
+    return false;
+}
+
+// A response sent in blocks is handed over whole, without the options that described its blocks
+static void TestBlock2Reassembly()
+{
+    gTestNow = 1;
+    gSent.clear();
+    CoapClient client;
+    client.Setup(Transmit, nullptr);
+    auto server = Endpoint(0x0200000A, 5683);
+
+    BufferedCoapMessage request;
+    CoapResult result;
+    request.SetCode(CoapMessageCode::Get, result);
+    request.AddOption(CoapStringOption(CoapOptionValue::UriPath, "big"), result);
+    Completion completion;
+    client.Submit(server, request, OnResponse, &completion, result);
+    CHECK(result == CoapResult::OK);
+    client.Poll(gTestNow);
+    CHECK_EQUAL(1, gSent.size());
+
+    std::string first(64, 'a'), second(36, 'b');
+    CHECK(Feed(client, server, Reply(gSent.back(), kContent,
+        {{CoapOptionValue::ContentFormat, UInt(0)}, {CoapOptionValue::Block2, UInt(0 << 4 | 0x08 | 2)}, {CoapOptionValue::Size2, UInt(100)}}, first)));
+    CHECK_EQUAL(0, completion.Calls);
+    CHECK_EQUAL(2, gSent.size());
+    CHECK((OptionsOf(gSent.back(), CoapOptionValue::Block2) == std::vector<std::string>{UInt(1 << 4 | 2)}));
+
+    CHECK(Feed(client, server, Reply(gSent.back(), kContent,
+        {{CoapOptionValue::ContentFormat, UInt(0)}, {CoapOptionValue::Block2, UInt(1 << 4 | 2)}}, second)));
+    CHECK_EQUAL(1, completion.Calls);
+    CHECK(completion.Result == CoapResult::OK);
+    CHECK(completion.Response.GetCode() == CoapMessageCode::Content);
+    CHECK(!HasOption(completion.Response, CoapOptionValue::Block2));
+    CHECK(!HasOption(completion.Response, CoapOptionValue::Size2));
+    CHECK(HasOption(completion.Response, CoapOptionValue::ContentFormat));
+    auto &body = completion.Response.GetPayload();
+    CHECK(std::string(body.begin(), body.end()) == first + second);
+}
+
+// RemoveOption drops every instance of the option and leaves the others in order
+static void TestRemoveOption()
+{
+    BufferedCoapMessage message;
+    CoapResult result;
+    message.AddOption(CoapStringOption(CoapOptionValue::UriPath, "a"), result);
+    message.AddOption(CoapUIntOption(CoapOptionValue::Block2, 1), result);
+    message.AddOption(CoapStringOption(CoapOptionValue::UriPath, "b"), result);
+    message.AddOption(CoapUIntOption(CoapOptionValue::Block2, 2), result);
+
+    message.RemoveOption(CoapOptionValue::Block2);
+    auto &options = message.GetOptions();
+    CHECK_EQUAL(2, options.size());
+    CHECK(options[0].Number == CoapOptionValue::UriPath && options[0].Value == Payload(reinterpret_cast<const uint8_t *>("a"), 1));
+    CHECK(options[1].Number == CoapOptionValue::UriPath && options[1].Value == Payload(reinterpret_cast<const uint8_t *>("b"), 1));
+
+    message.RemoveOption(CoapOptionValue::Size2);
+    CHECK_EQUAL(2, message.GetOptions().size());
+}
+
+int main()
+{
+    TestBlock2Reassembly();
+    TestRemoveOption();
+    return TEST_RESULT();
+}
@@ -0,0 +1,495 @@
+#include <deque>
+#include <memory>
+
+#include "lwip/pbuf.h"
+
+#include "coaptcp.h"
+
+#include "coaptest.h"
+
+static const uint8_t kGet = 0x01;
+static const uint8_t kPut = 0x03;
+static const uint8_t kChanged = 0x44;
+static const uint8_t kContent = 0x45;
+static const uint8_t kContinue = 0x5F;
+static const uint8_t kRequestEntityIncomplete = 0x88;
+static const uint8_t kRequestEntityTooLarge = 0x8D;
+static const uint8_t kCsm = 0xE1;
+static const uint8_t kPing = 0xE2;
+static const uint8_t kPong = 0xE3;
+static const uint8_t kRelease = 0xE4;
+static const uint8_t kAbort = 0xE5;
+static const uint16_t kMaxMessageSize = 2;
+static const uint16_t kBlockWiseTransfer = 4;
+
+// One listener and one peer. Whatever the test queues in gInbound is read from the peer, one
+// pbuf per entry, and everything written to it ends up in gOutbound.
+struct netconn
+{
+    bool Closed;
+};
+static netconn gListener, gPeer;
+static bool gConnecting;
+static std::deque<std::vector<uint8_t>> gInbound;
+static std::vector<uint8_t> gOutbound;
+
+struct netconn *netconn_new_with_callback(enum netconn_type type, netconn_callback callback) { return &gListener; }
+err_t netconn_delete(struct netconn *conn) { return ERR_OK; }
+err_t netconn_bind(struct netconn *conn, const ip_addr_t *addr, uint16_t port) { return ERR_OK; }
+err_t netconn_listen(struct netconn *conn) { return ERR_OK; }
+void netconn_set_nonblocking(struct netconn *conn, int value) {}
+
+err_t netconn_accept(struct netconn *conn, struct netconn **new_conn)
+{
+    if (!gConnecting)
+        return ERR_WOULDBLOCK;
+    gConnecting = false;
+    gPeer.Closed = false;
+    *new_conn = &gPeer;
+    return ERR_OK;
+}
+
+err_t netconn_close(struct netconn *conn)
+{
+    conn->Closed = true;
+    return ERR_OK;
+}
+
+err_t netconn_write(struct netconn *conn, const void *dataptr, size_t size, uint8_t apiflags)
+{
+    auto data = static_cast<const uint8_t *>(dataptr);
+    gOutbound.insert(gOutbound.end(), data, data + size);
+    return ERR_OK;
+}
+
+err_t netconn_recv_tcp_pbuf(struct netconn *conn, struct pbuf **new_buf)
+{
+    if (conn->Closed)
+        return ERR_CLSD;
+    if (gInbound.empty())
+        return ERR_WOULDBLOCK;
+
+    auto data = new std::vector<uint8_t>(gInbound.front());
+    gInbound.pop_front();
+    *new_buf = new pbuf{nullptr, data, static_cast<uint16_t>(data->size()), static_cast<uint16_t>(data->size())};
+    return ERR_OK;
+}
+
+uint16_t pbuf_copy_partial(const struct pbuf *buf, void *dataptr, uint16_t len, uint16_t offset)
+{
+    auto data = static_cast<std::vector<uint8_t> *>(buf->payload);
+    memcpy(dataptr, data->data() + offset, len);
+    return len;
+}
+
+uint8_t pbuf_free(struct pbuf *p)
+{
+    delete static_cast<std::vector<uint8_t> *>(p->payload);
+    delete p;
+    return 1;
+}
+
+// A message as framed on the stream (RFC 8323 section 3.2)
+struct TcpMessage
+{
+    uint8_t LengthNibble;
+    uint8_t Code;
+    std::string Token;
+    TestOptions Options;
+    std::string Payload;
+};
+
+static std::vector<uint8_t> Frame(uint8_t code, std::string const &token, TestOptions const &options, std::string const &payload = "")
+{
+    std::vector<uint8_t> body(64 + payload.length());
+    size_t offset = 0;
+    uint16_t previous = 0;
+    for (auto &option : options)
+        CHECK(CoapWriteOption(body.data(), body.size(), offset, previous, option.first,
+            reinterpret_cast<const uint8_t *>(option.second.data()), option.second.size()));
+    body.resize(offset);
+    if (!payload.empty())
+    {
+        body.push_back(0xFF);
+        body.insert(body.end(), payload.begin(), payload.end());
+    }
+
+    std::vector<uint8_t> frame;
+    auto length = body.size();
+    if (length < 13)
+        frame.push_back(length << 4 | token.length());
+    else if (length < 269)
+        frame.insert(frame.end(), {static_cast<uint8_t>(13 << 4 | token.length()), static_cast<uint8_t>(length - 13)});
+    else if (length < 65805)
+        frame.insert(frame.end(), {static_cast<uint8_t>(14 << 4 | token.length()), static_cast<uint8_t>((length - 269) >> 8),
+            static_cast<uint8_t>(length - 269)});
+    else
+    {
+        frame.push_back(15 << 4 | token.length());
+        for (int shift = 24; shift >= 0; shift -= 8)
+            frame.push_back(static_cast<uint8_t>((length - 65805) >> shift));
+    }
+    frame.push_back(code);
+    frame.insert(frame.end(), token.begin(), token.end());
+    frame.insert(frame.end(), body.begin(), body.end());
+    return frame;
+}
+
+// Everything the node wrote since the last call, which must be whole messages
+static std::vector<TcpMessage> Written()
+{
+    std::vector<TcpMessage> messages;
+    size_t position = 0;
+    while (position < gOutbound.size())
+    {
+        auto frame = gOutbound.data() + position;
+        TcpMessage message;
+        message.LengthNibble = frame[0] >> 4;
+        size_t tokenLength = frame[0] & 0x0F;
+        size_t length = message.LengthNibble, extended = 0;
+        if (length == 13)
+            length = frame[1] + 13, extended = 1;
+        else if (length == 14)
+            length = (frame[1] << 8 | frame[2]) + 269, extended = 2;
+        else if (length == 15)
+            length = (static_cast<size_t>(frame[1]) << 24 | frame[2] << 16 | frame[3] << 8 | frame[4]) + 65805, extended = 4;
+
+        size_t headerLength = 1 + extended + 1 + tokenLength;
+        CHECK(position + headerLength + length <= gOutbound.size());
+        if (position + headerLength + length > gOutbound.size())
+            break;
+        message.Code = frame[1 + extended];
+        message.Token.assign(reinterpret_cast<const char *>(frame) + 2 + extended, tokenLength);
+
+        size_t offset = headerLength;
+        uint16_t number = 0;
+        const uint8_t *value;
+        size_t valueLength;
+        while (CoapNextOption(frame, headerLength + length, offset, number, value, valueLength))
+            message.Options.emplace_back(number, std::string(reinterpret_cast<const char *>(value), valueLength));
+        if (offset < headerLength + length)
+        {
+            CHECK_EQUAL(0xFF, frame[offset]);
+            message.Payload.assign(reinterpret_cast<const char *>(frame) + offset + 1, headerLength + length - offset - 1);
+        }
+
+        messages.push_back(message);
+        position += headerLength + length;
+    }
+    gOutbound.clear();
+    return messages;
+}
+
+static std::vector<std::string> Values(TcpMessage const &message, uint16_t number)
+{
+    std::vector<std::string> values;
+    for (auto &option : message.Options)
+    {
+        if (option.first == number)
+            values.push_back(option.second);
+    }
+    return values;
+}
+
+static std::string Body(size_t length)
+{
+    std::string body(length, ' ');
+    for (size_t i = 0; i < length; i++)
+        body[i] = 'a' + i % 26;
+    return body;
+}
+
+// Answers with what it was sent
+class Mirror : public IApplicationResource
+{
+public:
+    void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result)
+    {
+        Payload payload;
+        request->GetPayload(payload, result);
+        response->SetCode(CoapMessageCode::Content, result);
+        response->SetPayload(payload, result);
+    }
+};
+
+// Answers with a body much larger than a message
+class Large : public IApplicationResource
+{
+public:
+    void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result)
+    {
+        response->SetCode(CoapMessageCode::Content, result);
+        response->SetPayload(Body(10000), result);
+    }
+};
+
+// Keeps what it was sent
+class Sink : public IApplicationResource
+{
+public:
+    std::string Received;
+
+    void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result)
+    {
+        Payload payload;
+        request->GetPayload(payload, result);
+        Received.assign(payload.begin(), payload.end());
+        response->SetCode(CoapMessageCode::Changed, result);
+    }
+};
+
+struct Fixture
+{
+    std::unique_ptr<CoapTcp> Tcp;
+    Mirror MirrorResource;
+    Large LargeResource;
+    Sink SinkResource;
+    CoapResource Resources[3];
+
+    // Connects a peer, which first sends a CSM with `options` unless they're empty
+    Fixture(TestOptions const &capabilities = {})
+        : Tcp(new CoapTcp())
+    {
+        gTestNow = 1;
+        gInbound.clear();
+        gOutbound.clear();
+
+        CoapResult result;
+        Tcp->CreateResource(Resources[0], &MirrorResource, "echo", result);
+        Tcp->CreateResource(Resources[1], &LargeResource, "large", result);
+        Tcp->CreateResource(Resources[2], &SinkResource, "sink", result);
+        for (auto &resource : Resources)
+        {
+            resource->RegisterHandler(CoapMessageCode::Get, result);
+            resource->RegisterHandler(CoapMessageCode::Put, result);
+        }
+
+        Tcp->SetNetworkReady(true);
+        gConnecting = true;
+        Tcp->Poll(gTestNow);
+        CHECK_EQUAL(1, Written().size());
+        if (!capabilities.empty())
+            CHECK(Send(Frame(kCsm, "", capabilities)).empty());
+    }
+
+    ~Fixture()
+    {
+        for (auto &resource : Resources)
+            resource->~ICoapResource();
+    }
+
+    // Hands `data` to the node in pbufs of at most `chunk` bytes and returns its answers
+    std::vector<TcpMessage> Send(std::vector<uint8_t> const &data, size_t chunk = 1000)
+    {
+        for (size_t offset = 0; offset < data.size(); offset += chunk)
+            gInbound.emplace_back(data.begin() + offset, data.begin() + std::min(offset + chunk, data.size()));
+        while (!gInbound.empty() && !gPeer.Closed)
+            Tcp->Poll(gTestNow);
+        return Written();
+    }
+};
+
+// The node's CSM is the first thing on a connection (RFC 8323 section 5.3)
+static void TestCapabilities()
+{
+    gTestNow = 1;
+    gOutbound.clear();
+    std::unique_ptr<CoapTcp> tcp(new CoapTcp());
+    tcp->SetNetworkReady(true);
+    gConnecting = true;
+    tcp->Poll(gTestNow);
+
+    auto written = Written();
+    CHECK_EQUAL(1, written.size());
+    CHECK_EQUAL(kCsm, written[0].Code);
+    CHECK((Values(written[0], kMaxMessageSize) == std::vector<std::string>{UInt(kCoapTcpMaxMessageSize)}));
+    CHECK((Values(written[0], kBlockWiseTransfer) == std::vector<std::string>{""}));
+}
+
+// Every length encoding in both directions: 4 bit, 8 bit and 16 bit extended
+static void TestLengths()
+{
+    Fixture fixture({{kMaxMessageSize, UInt(8192)}});
+    struct
+    {
+        size_t Payload;
+        uint8_t Nibble;
+    } cases[] = {{0, 0}, {11, 12}, {12, 13}, {267, 13}, {268, 14}, {3000, 14}};
+
+    uint8_t token = 0;
+    for (auto &c : cases)
+    {
+        auto payload = Body(c.Payload);
+        auto written = fixture.Send(Frame(kPut, std::string(1, token), {{CoapOptionValue::UriPath, "echo"}}, payload));
+        CHECK_EQUAL(1, written.size());
+        if (written.size() != 1)
+            continue;
+        CHECK_EQUAL(kContent, written[0].Code);
+        CHECK(written[0].Token == std::string(1, token));
+        CHECK_EQUAL(c.Nibble, written[0].LengthNibble);
+        CHECK(written[0].Payload == payload);
+        token++;
+    }
+}
+
+// Messages are found wherever the reads split the stream
+static void TestSplitReads()
+{
+    Fixture fixture;
+    auto first = Frame(kGet, "\x01", {{CoapOptionValue::UriPath, "echo"}});
+    auto second = Frame(kPut, "\x02\x03", {{CoapOptionValue::UriPath, "echo"}}, Body(300));
+
+    auto written = fixture.Send(first, 1);
+    CHECK_EQUAL(1, written.size());
+    CHECK(written.size() == 1 && written[0].Token == "\x01");
+
+    auto both = first;
+    both.insert(both.end(), second.begin(), second.end());
+    written = fixture.Send(both, 7);
+    CHECK_EQUAL(2, written.size());
+    if (written.size() == 2)
+    {
+        CHECK(written[0].Token == "\x01");
+        CHECK(written[1].Token == "\x02\x03");
+        CHECK(written[1].Payload == Body(300));
+    }
+}
+
+// A message larger than the CSM allowed is skipped with 4.13, the stream stays in sync
+static void TestTooLarge()
+{
+    Fixture fixture;
+    auto stream = Frame(kPut, "\x01", {{CoapOptionValue::UriPath, "echo"}}, Body(70000));
+    CHECK_EQUAL(15, stream[0] >> 4);
+    auto next = Frame(kGet, "\x02", {{CoapOptionValue::UriPath, "echo"}});
+    stream.insert(stream.end(), next.begin(), next.end());
+
+    auto written = fixture.Send(stream);
+    CHECK_EQUAL(2, written.size());
+    if (written.size() == 2)
+    {
+        CHECK_EQUAL(kRequestEntityTooLarge, written[0].Code);
+        CHECK(written[0].Token == "\x01");
+        CHECK((Values(written[0], CoapOptionValue::Size1) == std::vector<std::string>{UInt(kCoapTcpMaxMessageSize)}));
+        CHECK_EQUAL(kContent, written[1].Code);
+        CHECK(written[1].Token == "\x02");
+    }
+    CHECK(!gPeer.Closed);
+}
+
+// Ping is answered with a Pong carrying its token, Release ends the connection
+static void TestSignals()
+{
+    Fixture fixture;
+    auto written = fixture.Send(Frame(kPing, "\x05\x06", {}));
+    CHECK_EQUAL(1, written.size());
+    CHECK(written.size() == 1 && written[0].Code == kPong && written[0].Token == "\x05\x06");
+
+    CHECK(fixture.Send(Frame(kRelease, "", {})).empty());
+    CHECK(gPeer.Closed);
+}
+
+// A token longer than 8 bytes is a message format error, answered with Abort
+static void TestMalformed()
+{
+    Fixture fixture;
+    auto frame = Frame(kGet, "123456789", {{CoapOptionValue::UriPath, "echo"}});
+    auto written = fixture.Send(frame);
+    CHECK_EQUAL(1, written.size());
+    CHECK(written.size() == 1 && written[0].Code == kAbort);
+    CHECK(gPeer.Closed);
+}
+
+// Fetches all of /large, asking for each block after the first the way the server numbered them
+static std::string FetchLarge(Fixture &fixture, uint32_t expectedSzx, size_t expectedBlock)
+{
+    std::string body;
+    uint32_t num = 0;
+    for (int i = 0; i < 20; i++)
+    {
+        TestOptions options = {{CoapOptionValue::UriPath, "large"}};
+        if (num > 0)
+            options.emplace_back(CoapOptionValue::Block2, UInt(num << 4 | expectedSzx));
+        auto written = fixture.Send(Frame(kGet, "\x07", options));
+        CHECK_EQUAL(1, written.size());
+        if (written.size() != 1)
+            break;
+
+        auto block2 = Values(written[0], CoapOptionValue::Block2);
+        CHECK_EQUAL(1, block2.size());
+        if (block2.size() != 1)
+            break;
+        auto value = CoapDecodeUInt(reinterpret_cast<const uint8_t *>(block2[0].data()), block2[0].length());
+        CHECK_EQUAL(expectedSzx, value & 0x07);
+        CHECK_EQUAL(num, value >> 4);
+        if (num == 0)
+            CHECK((Values(written[0], CoapOptionValue::Size2) == std::vector<std::string>{UInt(10000)}));
+
+        body += written[0].Payload;
+        if ((value & 0x08) == 0)
+            break;
+        CHECK_EQUAL(expectedBlock, written[0].Payload.length());
+        // BERT block numbers count 1024 byte units (RFC 8323 section 6)
+        num += written[0].Payload.length() / (expectedSzx == 7 ? 1024 : 16u << expectedSzx);
+    }
+    return body;
+}
+
+// A peer that announced BERT gets several 1024 byte units per message, others plain blocks
+static void TestBertBlock2()
+{
+    {
+        Fixture fixture({{kMaxMessageSize, UInt(8192)}, {kBlockWiseTransfer, ""}});
+        // As much of the 4096 byte message as whole units fit in next to the header
+        CHECK(FetchLarge(fixture, 7, 3 * 1024) == Body(10000));
+    }
+    {
+        Fixture fixture({{kMaxMessageSize, UInt(8192)}});
+        CHECK(FetchLarge(fixture, 6, 1024) == Body(10000));
+    }
+}
+
+// BERT Block1: a request body in multi-unit blocks, numbered in 1024 byte units
+static void TestBertBlock1()
+{
+    Fixture fixture({{kMaxMessageSize, UInt(8192)}, {kBlockWiseTransfer, ""}});
+    auto body = Body(5000);
+    struct
+    {
+        uint32_t Block1;
+        size_t Offset;
+        size_t Length;
+        uint8_t Code;
+    } blocks[] = {{0 << 4 | 0x08 | 7, 0, 2048, kContinue}, {2 << 4 | 0x08 | 7, 2048, 2048, kContinue}, {4 << 4 | 7, 4096, 904, kChanged}};
+
+    for (auto &block : blocks)
+    {
+        auto written = fixture.Send(Frame(kPut, "\x08", {{CoapOptionValue::UriPath, "sink"}, {CoapOptionValue::Block1, UInt(block.Block1)}},
+            body.substr(block.Offset, block.Length)));
+        CHECK_EQUAL(1, written.size());
+        if (written.size() != 1)
+            return;
+        CHECK_EQUAL(block.Code, written[0].Code);
+        CHECK((Values(written[0], CoapOptionValue::Block1) == std::vector<std::string>{UInt(block.Block1)}));
+    }
+    CHECK(fixture.SinkResource.Received == body);
+
+    // A block that doesn't continue where the body ends
+    fixture.Send(Frame(kPut, "\x09", {{CoapOptionValue::UriPath, "sink"}, {CoapOptionValue::Block1, UInt(0 << 4 | 0x08 | 7)}}, body.substr(0, 1024)));
+    auto written = fixture.Send(Frame(kPut, "\x09", {{CoapOptionValue::UriPath, "sink"}, {CoapOptionValue::Block1, UInt(3 << 4 | 7)}}, body.substr(0, 10)));
+    CHECK_EQUAL(1, written.size());
+    CHECK(written.size() == 1 && written[0].Code == kRequestEntityIncomplete);
+}
+
+int main()
+{
+    TestCapabilities();
+    TestLengths();
+    TestSplitReads();
+    TestTooLarge();
+    TestSignals();
+    TestMalformed();
+    TestBertBlock2();
+    TestBertBlock1();
+    return TEST_RESULT();
+}
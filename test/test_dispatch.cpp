@@ -0,0 +1,136 @@
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "test.h"
+
+// Cost of finding the resource for a request, with the two lookups every request to
+// LobaroCoap goes through: lobaro matching the Uri-Path options against the path of each
+// resource in its list to set pResource, then LobaroCoapResource::ResourceHandler scanning
+// _resources for the wrapper of pResource. Built with -O2 and without sanitizers, see the
+// Makefile.
+
+static const uint16_t kUriPath = 11;
+
+// The parts of lobaro's CoAP_option_t and CoAP_Res_t the lookup touches
+struct Option
+{
+    Option *next;
+    uint16_t Number;
+    uint16_t Length;
+    const uint8_t *Value;
+};
+
+struct Resource
+{
+    Resource *next;
+    Option *pUri;
+};
+
+struct Wrapper
+{
+    Resource *_resource;
+};
+
+// The node's resources and enough made up ones to see the trend
+struct Resources
+{
+    std::vector<std::string> Paths;
+    std::vector<Option> Uris;
+    std::vector<Resource> List;
+    std::vector<Wrapper> Wrappers;
+    std::vector<Wrapper *> _resources;
+
+    explicit Resources(size_t count)
+        : Paths(count), Uris(count), List(count), Wrappers(count)
+    {
+        const char *node[] = {"led", "switch", "wifi", "latency", "state"};
+        for (size_t i = 0; i < count; i++)
+        {
+            Paths[i] = i < 5 ? node[i] : "sensor" + std::to_string(i);
+            Uris[i] = {nullptr, kUriPath, static_cast<uint16_t>(Paths[i].size()), reinterpret_cast<const uint8_t *>(Paths[i].data())};
+            List[i] = {i + 1 < count ? &List[i + 1] : nullptr, &Uris[i]};
+            Wrappers[i] = {&List[i]};
+        }
+        for (auto &wrapper : Wrappers)
+            _resources.push_back(&wrapper);
+    }
+};
+
+// Segment by segment compare of the request's Uri-Path with each resource's, like lobaro's
+// CoAP_FindResourceByUri
+static Resource *FindByUri(Resource *list, Option *options)
+{
+    for (auto resource = list; resource != nullptr; resource = resource->next)
+    {
+        auto path = resource->pUri;
+        auto option = options;
+        for (; option != nullptr && path != nullptr; option = option->next)
+        {
+            if (option->Number != kUriPath)
+                continue;
+            if (option->Length != path->Length || memcmp(option->Value, path->Value, path->Length) != 0)
+                break;
+            path = path->next;
+        }
+        if (option == nullptr && path == nullptr)
+            return resource;
+    }
+    return nullptr;
+}
+
+static Wrapper *FindWrapper(std::vector<Wrapper *> const &resources, Resource *resource)
+{
+    for (auto it = resources.begin(); it != resources.end(); it++)
+    {
+        if ((*it)->_resource == resource)
+            return *it;
+    }
+    return nullptr;
+}
+
+// Keeps the compiler from dropping the lookups
+static void *volatile gSink;
+
+template<typename Lookup>
+static double NanosecondsPerRequest(size_t requests, Lookup lookup)
+{
+    const size_t kLookups = 1000 * 1000;
+    auto start = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < kLookups; i++)
+        gSink = lookup(i % requests);
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / kLookups;
+}
+
+// Requests spread evenly over the resources. The string match grows with the list and the
+// path lengths; the pointer scan stays a small part of the dispatch cost.
+static void TestDispatchCost()
+{
+    printf("%s: ns per request, requests spread over all resources\n", __FILE__);
+    printf("%10s %16s %16s\n", "resources", "uri match", "wrapper scan");
+    for (size_t count : {1, 5, 16, 32, 64})
+    {
+        Resources resources(count);
+        std::vector<Option> requests(resources.Uris);
+
+        for (size_t i = 0; i < count; i++)
+        {
+            auto resource = FindByUri(&resources.List[0], &requests[i]);
+            CHECK(resource == &resources.List[i]);
+            CHECK(FindWrapper(resources._resources, resource) == &resources.Wrappers[i]);
+        }
+
+        auto match = NanosecondsPerRequest(count, [&](size_t i) { return FindByUri(&resources.List[0], &requests[i]); });
+        auto scan = NanosecondsPerRequest(count, [&](size_t i) { return FindWrapper(resources._resources, &resources.List[i]); });
+        printf("%10u %16.1f %16.1f\n", (unsigned)count, match, scan);
+    }
+}
+
+int main()
+{
+    TestDispatchCost();
+    return TEST_RESULT();
+}
@@ -0,0 +1,137 @@
+#include <cstring>
+
+#include "egressqueue.h"
+
+#include "test.h"
+
+static const int64_t kStart = 1000000;
+
+static NetEp_t Remote(uint8_t host)
+{
+    NetEp_t remote = {};
+    remote.NetType = IPV4;
+    remote.NetAddr.IPv4.u8[0] = 10;
+    remote.NetAddr.IPv4.u8[3] = host;
+    remote.NetPort = 5683;
+    return remote;
+}
+
+// Queues a one byte datagram whose payload tells the test which one it was
+static bool Push(EgressQueue &queue, EgressClass egressClass, uint8_t tag, int64_t now)
+{
+    return queue.Push(egressClass, Remote(tag), &tag, 1, LatencyTrace(), now);
+}
+
+// The tag of the next datagram sent at `now`, or -1 if nothing may be sent
+static int Send(EgressQueue &queue, int64_t now)
+{
+    EgressClass egressClass;
+    auto datagram = queue.Front(now, egressClass);
+    if (datagram == nullptr)
+        return -1;
+
+    int tag = datagram->Data[0];
+    CHECK_EQUAL(1, datagram->Size);
+    CHECK_EQUAL(tag, datagram->Ep.NetAddr.IPv4.u8[3]);
+    queue.Pop(egressClass, now);
+    return tag;
+}
+
+static void ResetHistograms()
+{
+    for (int i = 0; i < static_cast<int>(EgressClass::Count); i++)
+        EgressHistogram(static_cast<EgressClass>(i)).Reset();
+}
+
+void TestPriorityOrder()
+{
+    EgressQueue queue;
+    ResetHistograms();
+
+    // Queued least urgent first, sent most urgent first and in order within a class
+    CHECK(Push(queue, EgressClass::Multicast, 1, kStart));
+    CHECK(Push(queue, EgressClass::Notification, 2, kStart));
+    CHECK(Push(queue, EgressClass::Response, 3, kStart));
+    CHECK(Push(queue, EgressClass::Notification, 4, kStart));
+    CHECK(Push(queue, EgressClass::Response, 5, kStart));
+    CHECK(!queue.IsEmpty());
+
+    CHECK_EQUAL(3, Send(queue, kStart + 100));
+    CHECK_EQUAL(5, Send(queue, kStart + 200));
+    CHECK_EQUAL(2, Send(queue, kStart + 300));
+    CHECK_EQUAL(4, Send(queue, kStart + 400));
+    CHECK_EQUAL(1, Send(queue, kStart + 500));
+    CHECK_EQUAL(-1, Send(queue, kStart + 600));
+    CHECK(queue.IsEmpty());
+
+    // The time spent queued is recorded per class
+    CHECK_EQUAL(2, EgressHistogram(EgressClass::Response).GetCount());
+    CHECK_EQUAL(200, EgressHistogram(EgressClass::Response).GetMax());
+    CHECK_EQUAL(2, EgressHistogram(EgressClass::Notification).GetCount());
+    CHECK_EQUAL(400, EgressHistogram(EgressClass::Notification).GetMax());
+    CHECK_EQUAL(1, EgressHistogram(EgressClass::Multicast).GetCount());
+    CHECK_EQUAL(500, EgressHistogram(EgressClass::Multicast).GetMax());
+}
+
+void TestFullClass()
+{
+    EgressQueue queue;
+
+    for (int i = 0; i < kCoapEgressDepth; i++)
+        CHECK(Push(queue, EgressClass::Notification, 10 + i, kStart));
+
+    // A full class turns datagrams away without affecting the others
+    CHECK(!Push(queue, EgressClass::Notification, 99, kStart));
+    CHECK(Push(queue, EgressClass::Response, 1, kStart));
+
+    // So is anything that doesn't fit a slot
+    static uint8_t large[kCoapEgressSlotSize + 1];
+    CHECK(!queue.Push(EgressClass::Response, Remote(2), large, sizeof(large), LatencyTrace(), kStart));
+    CHECK(queue.Push(EgressClass::Response, Remote(2), large, kCoapEgressSlotSize, LatencyTrace(), kStart));
+
+    CHECK_EQUAL(1, Send(queue, kStart));
+    EgressClass egressClass;
+    CHECK(queue.Front(kStart, egressClass)->Size == kCoapEgressSlotSize);
+    queue.Pop(egressClass, kStart);
+
+    // Sending one makes room for one, and the ring wraps around in order
+    CHECK_EQUAL(10, Send(queue, kStart));
+    CHECK(Push(queue, EgressClass::Notification, 20, kStart));
+    CHECK(!Push(queue, EgressClass::Notification, 99, kStart));
+    for (int i = 1; i < kCoapEgressDepth; i++)
+        CHECK_EQUAL(10 + i, Send(queue, kStart));
+    CHECK_EQUAL(20, Send(queue, kStart));
+    CHECK(queue.IsEmpty());
+}
+
+void TestMulticastGap()
+{
+    EgressQueue queue;
+
+    for (int i = 0; i < 3; i++)
+        CHECK(Push(queue, EgressClass::Multicast, 1 + i, kStart));
+
+    // The first goes right away, the next only once the gap has passed
+    CHECK_EQUAL(1, Send(queue, kStart));
+    CHECK_EQUAL(-1, Send(queue, kStart + kCoapEgressMulticastGapUs - 1));
+
+    // Pacing multicast doesn't hold up anything more urgent
+    CHECK(Push(queue, EgressClass::Notification, 10, kStart + 1000));
+    CHECK_EQUAL(10, Send(queue, kStart + 1000));
+    CHECK_EQUAL(-1, Send(queue, kStart + 1000));
+
+    CHECK_EQUAL(2, Send(queue, kStart + kCoapEgressMulticastGapUs));
+    CHECK_EQUAL(-1, Send(queue, kStart + kCoapEgressMulticastGapUs));
+
+    // Measured from when the last one was sent, not when it was due
+    CHECK_EQUAL(3, Send(queue, kStart + 5 * kCoapEgressMulticastGapUs));
+    CHECK(queue.IsEmpty());
+}
+
+int main()
+{
+    TestPriorityOrder();
+    TestFullClass();
+    TestMulticastGap();
+    return TEST_RESULT();
+}
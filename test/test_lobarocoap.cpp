@@ -0,0 +1,220 @@
+#include <algorithm>
+#include <memory>
+#include <vector>
+
+#include "freertos/timers.h"
+#include "nvs.h"
+
+#include "lobarocoap.h"
+
+#include "test.h"
+#include "stubs.h"
+
+extern "C" {
+    #include "coap_options.h"
+    #include "coap_resource.h"
+    #include "interface/network/net_Endpoint.h"
+}
+
+// Stand-in for lobaro. Resources are kept so the test can hang observers off them the way an
+// Observe registration would, and every notification lobaro is asked for is recorded.
+static std::vector<std::unique_ptr<CoAP_Res_t>> gLobaroResources;
+static std::vector<CoAP_Res_t *> gNotified;
+
+const NetEp_t NetEp_IPv4_mulitcast = {IPV4, {{{224, 0, 1, 187}}}, 5683};
+const NetEp_t NetEp_IPv6_mulitcast = {IPV6, {{{0xFF, 0x02, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xFD}}}, 5683};
+
+void CoAP_Init(CoAP_API_t api, CoAP_Config_t config) {}
+CoAP_Socket_t *CoAP_NewSocket(SocketHandle_t handle) { return nullptr; }
+void CoAP_HandleIncomingPacket(SocketHandle_t handle, NetPacket_t *packet) {}
+void CoAP_doWork() {}
+CoAP_Result_t CoAP_SetPayload(CoAP_Message_t *message, uint8_t *payload, uint16_t length, bool copy) { return COAP_OK; }
+CoAP_Result_t CoAP_UnlinkObserverFromList(CoAP_Observer_t **list, CoAP_Observer_t *observer, bool free) { return COAP_OK; }
+CoAP_option_t *CoAP_FindOptionByNumber(CoAP_Message_t *message, uint16_t number) { return nullptr; }
+CoAP_Result_t CoAP_RemoveOptionFromList(CoAP_option_t **list, CoAP_option_t *option) { return COAP_OK; }
+CoAP_Result_t CoAP_AppendUintOptionToList(CoAP_option_t **list, uint16_t number, uint32_t value) { return COAP_OK; }
+CoAP_Result_t CoAP_CopyOptionToList(CoAP_option_t **list, CoAP_option_t *option) { return COAP_OK; }
+CoAP_Result_t CoAP_GetUintFromOption(const CoAP_option_t *option, uint32_t *value) { return COAP_ERR; }
+CoAP_Res_t *CoAP_FindResourceByUri(CoAP_Res_t *list, CoAP_option_t *uri) { return nullptr; }
+
+CoAP_Res_t *CoAP_CreateResource(char *uri, char *description, CoAP_ResOpts_t options,
+    CoAP_ResourceHandler_fPtr_t handler, CoAP_ResourceNotifier_fPtr_t notifier)
+{
+    gLobaroResources.emplace_back(new CoAP_Res_t());
+    auto resource = gLobaroResources.back().get();
+    resource->Options = options;
+    resource->Handler = handler;
+    resource->Notifier = notifier;
+    return resource;
+}
+
+CoAP_Result_t CoAP_NotifyResourceObservers(CoAP_Res_t *resource)
+{
+    gNotified.push_back(resource);
+    return COAP_OK;
+}
+
+// The sockets are never opened, the network task isn't running
+struct netconn *netconn_new_with_callback(enum netconn_type type, netconn_callback callback) { return nullptr; }
+err_t netconn_delete(struct netconn *conn) { return ERR_OK; }
+err_t netconn_bind(struct netconn *conn, const ip_addr_t *addr, uint16_t port) { return ERR_OK; }
+void netconn_set_nonblocking(struct netconn *conn, int value) {}
+void netconn_set_ipv6only(struct netconn *conn, int value) {}
+err_t netconn_join_leave_group(struct netconn *conn, const ip_addr_t *multiaddr, const ip_addr_t *netifaddr,
+    enum netconn_igmp joinOrLeave) { return ERR_OK; }
+err_t netconn_recv(struct netconn *conn, struct netbuf **new_buf) { return ERR_WOULDBLOCK; }
+err_t netconn_sendto(struct netconn *conn, struct netbuf *buf, const ip_addr_t *addr, uint16_t port) { return ERR_OK; }
+struct netbuf *netbuf_new() { return new netbuf(); }
+void netbuf_delete(struct netbuf *buf) { delete buf; }
+err_t netbuf_ref(struct netbuf *buf, const void *dataptr, uint16_t size) { return ERR_OK; }
+err_t netbuf_data(struct netbuf *buf, void **dataptr, uint16_t *len) { return ERR_OK; }
+char *ipaddr_ntoa(const ip_addr_t *addr) { return const_cast<char *>("0.0.0.0"); }
+
+TimerHandle_t xTimerCreate(const char *name, TickType_t period, BaseType_t autoReload, void *id,
+    TimerCallbackFunction_t callback) { return nullptr; }
+BaseType_t xTimerIsTimerActive(TimerHandle_t timer) { return pdTRUE; }
+BaseType_t xTimerStart(TimerHandle_t timer, TickType_t ticksToWait) { return pdTRUE; }
+TickType_t xTaskGetTickCount() { return static_cast<TickType_t>(gTestNow / 1000); }
+void vTaskDelete(TaskHandle_t task) {}
+
+// No security context is added, nothing is ever stored
+esp_err_t nvs_open(const char *name, nvs_open_mode mode, nvs_handle *handle) { return ESP_ERR_NVS_NOT_FOUND; }
+void nvs_close(nvs_handle handle) {}
+esp_err_t nvs_get_u64(nvs_handle handle, const char *key, uint64_t *value) { return ESP_ERR_NVS_NOT_FOUND; }
+esp_err_t nvs_set_u64(nvs_handle handle, const char *key, uint64_t value) { return ESP_ERR_NVS_NOT_FOUND; }
+esp_err_t nvs_commit(nvs_handle handle) { return ESP_ERR_NVS_NOT_FOUND; }
+
+class Value : public IApplicationResource
+{
+};
+
+// A started server with an observed resource, one nobody observes yet and one that can't be
+// observed. The network task isn't running, the test calls what it would.
+struct Node
+{
+    LobaroCoap Coap;
+    Value Values[3];
+    CoapResource Resources[3];
+    CoAP_Res_t *Observed;
+    CoAP_Res_t *Unobserved;
+    CoAP_Res_t *Plain;
+    CoAP_Observer_t Observers[2];
+
+    Node()
+    {
+        CoapResult result;
+        const char *uris[] = {"switch", "led", "info"};
+        CoAP_Res_t *created[3];
+        for (int i = 0; i < 3; i++)
+        {
+            Coap.CreateResource(Resources[i], &Values[i], uris[i], result);
+            CHECK(result == CoapResult::OK);
+            created[i] = gLobaroResources.back().get();
+        }
+        Observed = created[0];
+        Unobserved = created[1];
+        Plain = created[2];
+
+        Resources[0]->RegisterAsObservable(result);
+        Resources[1]->RegisterAsObservable(result);
+
+        // What lobaro links in for two Observe registrations on /switch
+        for (int i = 0; i < 2; i++)
+        {
+            auto &observer = Observers[i];
+            observer = CoAP_Observer_t();
+            observer.socketHandle = &Coap;
+            observer.Ep.NetType = IPV4;
+            observer.Ep.NetAddr.IPv4.u32[0] = 0x0200000A + i;
+            observer.Ep.NetPort = 5683;
+            observer.next = i == 0 ? &Observers[1] : nullptr;
+        }
+        Observed->pListObservers = &Observers[0];
+
+        Coap.Start(result);
+        CHECK(result == CoapResult::OK);
+    }
+
+    // The observers are still linked in, in order and unchanged
+    void CheckObservers()
+    {
+        CHECK(Observed->pListObservers == &Observers[0]);
+        CHECK(Observers[0].next == &Observers[1]);
+        CHECK(Observers[1].next == nullptr);
+        CHECK_EQUAL(0x0200000A, Observers[0].Ep.NetAddr.IPv4.u32[0]);
+        CHECK_EQUAL(0x0200000B, Observers[1].Ep.NetAddr.IPv4.u32[0]);
+        CHECK(Observed->Notifier != nullptr);
+    }
+};
+
+void TestFirstConnect(Node &node)
+{
+    gNotified.clear();
+    node.Coap.SetNetworkReady(true);
+    node.Coap.Resume();
+
+    // Nothing was missed, nobody is notified
+    CHECK_EQUAL(0, gNotified.size());
+    node.CheckObservers();
+}
+
+void TestOutage(Node &node)
+{
+    gNotified.clear();
+    node.Coap.SetNetworkReady(false);
+
+    // Notifications to observers that can't be reached count against them while we're offline
+    node.Observers[0].FailCount = 3;
+    node.Observers[1].FailCount = 1;
+
+    // Repeated reports of the same state change nothing
+    gTestNow += 20 * 1000000;
+    node.Coap.SetNetworkReady(false);
+    gTestNow += 10 * 1000000;
+    node.Coap.SetNetworkReady(true);
+    node.Coap.SetNetworkReady(true);
+    CHECK_EQUAL(0, gNotified.size());
+
+    node.Coap.Resume();
+
+    // Kept, forgiven, and sent a catch-up notification once per observed resource
+    node.CheckObservers();
+    CHECK_EQUAL(0, node.Observers[0].FailCount);
+    CHECK_EQUAL(0, node.Observers[1].FailCount);
+    CHECK_EQUAL(1, gNotified.size());
+    CHECK(std::count(gNotified.begin(), gNotified.end(), node.Observed) == 1);
+    CHECK(std::count(gNotified.begin(), gNotified.end(), node.Unobserved) == 0);
+    CHECK(std::count(gNotified.begin(), gNotified.end(), node.Plain) == 0);
+
+    // Caught up, resuming again without an outage notifies nobody
+    gNotified.clear();
+    node.Coap.Resume();
+    CHECK_EQUAL(0, gNotified.size());
+}
+
+void TestRepeatedOutages(Node &node)
+{
+    // Every outage ends in one catch-up, however short
+    for (int i = 0; i < 3; i++)
+    {
+        gNotified.clear();
+        node.Coap.SetNetworkReady(false);
+        node.Observers[i % 2].FailCount = 2;
+        gTestNow += 1000;
+        node.Coap.SetNetworkReady(true);
+        node.Coap.Resume();
+
+        node.CheckObservers();
+        CHECK_EQUAL(0, node.Observers[i % 2].FailCount);
+        CHECK_EQUAL(1, gNotified.size());
+    }
+}
+
+int main()
+{
+    Node node;
+    TestFirstConnect(node);
+    TestOutage(node);
+    TestRepeatedOutages(node);
+    return TEST_RESULT();
+}
@@ -0,0 +1,374 @@
+#include <map>
+#include <memory>
+
+#include "mqtttransport.h"
+
+#include "coaptest.h"
+
+static const char *kStatusTopic = "iotnode/IoTNode/status";
+static const char *kLedTopic = "iotnode/IoTNode/led";
+static const char *kLedCommandTopic = "iotnode/IoTNode/led/set";
+
+// Stand-in for the esp-mqtt client and the broker behind it. Records what the node subscribed
+// to and published, and hands events to the transport the way the client's task would.
+struct esp_mqtt_client
+{
+    esp_mqtt_client_config_t Config;
+    bool Started;
+};
+
+struct PublishedMessage
+{
+    std::string Topic;
+    std::string Data;
+    int Qos;
+    bool Retain;
+};
+
+struct Broker
+{
+    bool Created;
+    esp_mqtt_client Client;
+    std::vector<std::string> Subscriptions;
+    std::vector<PublishedMessage> Published;
+    std::map<std::string, std::string> Retained;
+    int NextId;
+    std::vector<int> Unacknowledged;
+};
+static Broker gBroker;
+
+esp_mqtt_client_handle_t esp_mqtt_client_init(const esp_mqtt_client_config_t *config)
+{
+    gBroker.Created = true;
+    gBroker.Client.Config = *config;
+    gBroker.Client.Started = false;
+    return &gBroker.Client;
+}
+
+esp_err_t esp_mqtt_client_start(esp_mqtt_client_handle_t client)
+{
+    client->Started = true;
+    return ESP_OK;
+}
+
+int esp_mqtt_client_subscribe(esp_mqtt_client_handle_t client, const char *topic, int qos)
+{
+    gBroker.Subscriptions.push_back(topic);
+    return gBroker.NextId++;
+}
+
+int esp_mqtt_client_publish(esp_mqtt_client_handle_t client, const char *topic, const char *data, int len, int qos, int retain)
+{
+    std::string payload(data, len > 0 ? len : strlen(data));
+    gBroker.Published.push_back({topic, payload, qos, retain != 0});
+    if (retain)
+        gBroker.Retained[topic] = payload;
+    if (qos == 0)
+        return 0;
+    gBroker.Unacknowledged.push_back(gBroker.NextId);
+    return gBroker.NextId++;
+}
+
+static void ResetBroker()
+{
+    gBroker.Created = false;
+    gBroker.Subscriptions.clear();
+    gBroker.Published.clear();
+    gBroker.Retained.clear();
+    gBroker.NextId = 1;
+    gBroker.Unacknowledged.clear();
+}
+
+static void Event(esp_mqtt_event_id_t id, std::string topic = "", std::string data = "", int totalLength = -1, int messageId = 0)
+{
+    esp_mqtt_event_t event = {};
+    event.event_id = id;
+    event.client = &gBroker.Client;
+    event.user_context = gBroker.Client.Config.user_context;
+    event.topic = &topic[0];
+    event.topic_len = topic.length();
+    event.data = &data[0];
+    event.data_len = data.length();
+    event.total_data_len = totalLength < 0 ? data.length() : totalLength;
+    event.msg_id = messageId;
+    gBroker.Client.Config.event_handle(&event);
+}
+
+// PUBACKs for every QoS 1 publish so far
+static void Acknowledge()
+{
+    auto unacknowledged = gBroker.Unacknowledged;
+    gBroker.Unacknowledged.clear();
+    for (auto id : unacknowledged)
+        Event(MQTT_EVENT_PUBLISHED, "", "", -1, id);
+}
+
+// Publishes of resource state since `from`, without the status topic
+static std::vector<PublishedMessage> States(size_t from = 0)
+{
+    std::vector<PublishedMessage> states;
+    for (size_t i = from; i < gBroker.Published.size(); i++)
+    {
+        if (gBroker.Published[i].Topic != kStatusTopic)
+            states.push_back(gBroker.Published[i]);
+    }
+    return states;
+}
+
+// A resource with a string state. Commands replace it, and are recorded with the task they ran on.
+class Value : public IApplicationResource
+{
+public:
+    CoapResource Resource;
+    std::string State;
+    int Requests = 0;
+    CoapMessageCode Method = CoapMessageCode::None;
+    std::vector<std::string> ContentFormat;
+
+    Value(std::string const &state)
+        : State(state) {}
+
+    void Change(std::string const &state)
+    {
+        State = state;
+        CoapResult result;
+        Resource->NotifyObservers(result);
+    }
+
+    void HandleRequest(ICoapMessage const *request, ICoapMessage *response, CoapResult &result)
+    {
+        Requests++;
+        Method = request->GetCode();
+        request->GetOptions(ContentFormat, CoapOptionValue::ContentFormat, result);
+        Payload payload;
+        request->GetPayload(payload, result);
+        response->SetCode(CoapMessageCode::Changed, result);
+        Change(std::string(payload.begin(), payload.end()));
+    }
+
+    void HandleNotify(ICoapObserver const *observer, ICoapMessage *response, CoapResult &result)
+    {
+        response->SetCode(CoapMessageCode::Content, result);
+        response->SetPayload(State, result);
+    }
+};
+
+struct Fixture
+{
+    MqttTransport Mqtt;
+    Value Led{"off"};
+    Value Switch{"idle"};
+    std::vector<std::unique_ptr<Value>> Sensors;
+
+    // /led takes commands, /switch and the sensors are only observable
+    Fixture(int sensors = 0)
+    {
+        ResetBroker();
+        CoapResult result;
+        Mqtt.Start(result);
+        CHECK(result == CoapResult::OK);
+
+        Mqtt.CreateResource(Led.Resource, &Led, "led", result);
+        Led.Resource->RegisterHandler(CoapMessageCode::Get, result);
+        Led.Resource->RegisterHandler(CoapMessageCode::Post, result);
+        Led.Resource->RegisterAsObservable(result);
+        Led.Resource->SetAttributes("iotnode.led", "core.a", {CoapContentType::ApplicationJson}, result);
+
+        Mqtt.CreateResource(Switch.Resource, &Switch, "switch", result);
+        Switch.Resource->RegisterHandler(CoapMessageCode::Get, result);
+        Switch.Resource->RegisterAsObservable(result);
+
+        for (int i = 0; i < sensors; i++)
+        {
+            Sensors.emplace_back(new Value("0"));
+            auto uri = "sensor" + std::to_string(i);
+            Mqtt.CreateResource(Sensors.back()->Resource, Sensors.back().get(), uri.c_str(), result);
+            Sensors.back()->Resource->RegisterAsObservable(result);
+        }
+
+        Mqtt.SetNetworkReady(true);
+        Mqtt.Poll();
+        CHECK(gBroker.Created && gBroker.Client.Started);
+        Event(MQTT_EVENT_CONNECTED);
+        Mqtt.Poll();
+    }
+
+    ~Fixture()
+    {
+        Led.Resource->~ICoapResource();
+        Switch.Resource->~ICoapResource();
+        for (auto &sensor : Sensors)
+            sensor->Resource->~ICoapResource();
+    }
+};
+
+// On connect the node says it's online, subscribes to command topics and publishes every state
+static void TestSession()
+{
+    Fixture fixture;
+    CHECK(std::string(gBroker.Client.Config.lwt_topic) == kStatusTopic);
+    CHECK(std::string(gBroker.Client.Config.lwt_msg) == "offline");
+    CHECK_EQUAL(1, gBroker.Client.Config.lwt_retain);
+    CHECK(gBroker.Retained[kStatusTopic] == "online");
+
+    CHECK((gBroker.Subscriptions == std::vector<std::string>{kLedCommandTopic}));
+    CHECK_EQUAL(2, States().size());
+    CHECK(gBroker.Retained[kLedTopic] == "off");
+    CHECK(gBroker.Retained["iotnode/IoTNode/switch"] == "idle");
+    for (auto &state : States())
+        CHECK(state.Qos == kMqttQos && state.Retain);
+
+    // A new session starts over, the broker may have lost both
+    Acknowledge();
+    auto published = gBroker.Published.size();
+    Event(MQTT_EVENT_DISCONNECTED);
+    fixture.Switch.Change("pushed");
+    fixture.Mqtt.Poll();
+    CHECK_EQUAL(published, gBroker.Published.size());
+
+    Event(MQTT_EVENT_CONNECTED);
+    fixture.Mqtt.Poll();
+    CHECK((gBroker.Subscriptions == std::vector<std::string>{kLedCommandTopic, kLedCommandTopic}));
+    CHECK_EQUAL(2, States(published).size());
+    CHECK(gBroker.Retained["iotnode/IoTNode/switch"] == "pushed");
+}
+
+// Commands are queued by the client's task and run on the transport's
+static void TestCommand()
+{
+    Fixture fixture;
+    Acknowledge();
+    auto published = gBroker.Published.size();
+
+    Event(MQTT_EVENT_DATA, kLedCommandTopic, "on");
+    CHECK_EQUAL(0, fixture.Led.Requests);
+
+    fixture.Mqtt.Poll();
+    CHECK_EQUAL(1, fixture.Led.Requests);
+    CHECK(fixture.Led.Method == CoapMessageCode::Post);
+    CHECK((fixture.Led.ContentFormat == std::vector<std::string>{UInt(CoapContentType::ApplicationJson)}));
+    // The change it made went out in the same pass
+    CHECK_EQUAL(1, States(published).size());
+    CHECK(gBroker.Retained[kLedTopic] == "on");
+
+    // Nothing handles these
+    Event(MQTT_EVENT_DATA, "iotnode/IoTNode/switch/set", "pushed");
+    Event(MQTT_EVENT_DATA, "iotnode/IoTNode/unknown/set", "x");
+    Event(MQTT_EVENT_DATA, kLedCommandTopic, "of", 40);
+    fixture.Mqtt.Poll();
+    CHECK_EQUAL(1, fixture.Led.Requests);
+    CHECK(fixture.Switch.State == "idle");
+}
+
+// A full command queue drops what doesn't fit, whatever is left when the transport goes is freed
+static void TestCommandQueueFull()
+{
+    {
+        Fixture fixture;
+        for (int i = 0; i < kMqttCommandQueueSize + 3; i++)
+            Event(MQTT_EVENT_DATA, kLedCommandTopic, std::to_string(i));
+        fixture.Mqtt.Poll();
+        CHECK_EQUAL(kMqttCommandQueueSize, fixture.Led.Requests);
+        CHECK(fixture.Led.State == std::to_string(kMqttCommandQueueSize - 1));
+    }
+    {
+        Fixture fixture;
+        Event(MQTT_EVENT_DATA, kLedCommandTopic, "on");
+    }
+}
+
+// Changes are coalesced per resource, and no more than kMqttMaxInflight publishes await a PUBACK
+static void TestBatching()
+{
+    Fixture fixture(4);
+    // Six observable resources, four went out on connect
+    CHECK_EQUAL(kMqttMaxInflight, States().size());
+    auto published = gBroker.Published.size();
+    fixture.Mqtt.Poll();
+    CHECK_EQUAL(published, gBroker.Published.size());
+    Acknowledge();
+    fixture.Mqtt.Poll();
+    CHECK_EQUAL(2, States(published).size());
+    Acknowledge();
+
+    published = gBroker.Published.size();
+    for (int i = 0; i < 10; i++)
+        fixture.Led.Change(std::to_string(i));
+    fixture.Switch.Change("pushed");
+    fixture.Mqtt.Poll();
+    auto states = States(published);
+    CHECK_EQUAL(2, states.size());
+    CHECK(gBroker.Retained[kLedTopic] == "9");
+
+    // Changes while the window is full are published once there's room, with the latest state
+    published = gBroker.Published.size();
+    for (auto &sensor : fixture.Sensors)
+        sensor->Change("1");
+    fixture.Mqtt.Poll();
+    CHECK_EQUAL(2, States(published).size());
+    fixture.Sensors[3]->Change("2");
+    fixture.Mqtt.Poll();
+    CHECK_EQUAL(2, States(published).size());
+    Acknowledge();
+    fixture.Mqtt.Poll();
+    CHECK_EQUAL(4, States(published).size());
+    CHECK(gBroker.Retained["iotnode/IoTNode/sensor3"] == "2");
+}
+
+// PUBLISH with a QoS 1 packet ID, the PUBACK is 4 bytes
+static size_t MqttPublishSize(std::string const &topic, std::string const &payload)
+{
+    size_t remaining = 2 + topic.length() + 2 + payload.length();
+    return 1 + (remaining < 128 ? 1 : 2) + remaining;
+}
+
+// What one change of /led costs the node with more and more followers. CoAP observe sends every
+// observer its own notification; the MQTT transport publishes once and the broker fans it out.
+static void TestFanOut()
+{
+    static const size_t kUdpIpv4Overhead = 8 + 20;
+    static const size_t kTcpIpv4Overhead = 20 + 20;
+    static const size_t kPubackSize = 4;
+
+    Fixture fixture;
+    Acknowledge();
+
+    printf("%s: one change, bytes on the node's link (IPv4 headers included)\n", __FILE__);
+    printf("%10s %16s %16s %16s %16s\n", "followers", "coap datagrams", "coap bytes", "mqtt messages", "mqtt bytes");
+    uint16_t messageId = 0x100;
+    for (size_t followers : {1, 2, 4, 16, 64})
+    {
+        auto published = gBroker.Published.size();
+        fixture.Led.Change("on" + std::to_string(followers));
+        fixture.Mqtt.Poll();
+        auto states = States(published);
+        CHECK_EQUAL(1, states.size());
+        auto mqttBytes = kTcpIpv4Overhead + MqttPublishSize(states[0].Topic, states[0].Data) + kTcpIpv4Overhead + kPubackSize;
+        Acknowledge();
+
+        // A NON notification per observer, with a 4 byte token, a 3 byte Observe sequence number
+        // and the Content-Format the state is published in
+        size_t coapBytes = 0;
+        for (size_t i = 0; i < followers; i++)
+        {
+            auto notification = Message(CoapMessageType::NonConfirmable, 0x45, messageId++, "\x01\x02\x03\x04",
+                {{CoapOptionValue::Observe, UInt(0x10000 + i)}, {CoapOptionValue::ContentFormat, UInt(CoapContentType::ApplicationJson)}},
+                states[0].Data);
+            coapBytes += kUdpIpv4Overhead + notification.size();
+        }
+
+        printf("%10u %16u %16u %16u %16u\n", (unsigned)followers, (unsigned)followers, (unsigned)coapBytes, 2u, (unsigned)mqttBytes);
+        if (followers >= 4)
+            CHECK(mqttBytes < coapBytes);
+    }
+}
+
+int main()
+{
+    TestSession();
+    TestCommand();
+    TestCommandQueueFull();
+    TestBatching();
+    TestFanOut();
+    return TEST_RESULT();
+}
@@ -0,0 +1,86 @@
+#include "coap.h"
+
+#include "test.h"
+
+// No-Response values (RFC 7967 section 2.1) and the response classes each of them suppresses
+static void TestNoResponseValues()
+{
+    // 2: not interested in 2.xx
+    CHECK(IsNoResponseSuppressed(2, 2));
+    CHECK(!IsNoResponseSuppressed(2, 4));
+    CHECK(!IsNoResponseSuppressed(2, 5));
+
+    // 8: not interested in 4.xx
+    CHECK(!IsNoResponseSuppressed(8, 2));
+    CHECK(IsNoResponseSuppressed(8, 4));
+    CHECK(!IsNoResponseSuppressed(8, 5));
+
+    // 16: not interested in 5.xx
+    CHECK(!IsNoResponseSuppressed(16, 2));
+    CHECK(!IsNoResponseSuppressed(16, 4));
+    CHECK(IsNoResponseSuppressed(16, 5));
+
+    // 26: not interested in any response
+    CHECK(IsNoResponseSuppressed(26, 2));
+    CHECK(IsNoResponseSuppressed(26, 4));
+    CHECK(IsNoResponseSuppressed(26, 5));
+
+    // 0: interested in everything
+    CHECK(!IsNoResponseSuppressed(0, 2));
+    CHECK(!IsNoResponseSuppressed(0, 4));
+    CHECK(!IsNoResponseSuppressed(0, 5));
+}
+
+// Bits without a meaning don't suppress anything, nor can the classes they'd map to be suppressed
+static void TestUndefinedBits()
+{
+    CHECK(!IsNoResponseSuppressed(0xFF, 0));
+    CHECK(!IsNoResponseSuppressed(0xFF, 1));
+    CHECK(!IsNoResponseSuppressed(0xFF, 3));
+    CHECK(!IsNoResponseSuppressed(0xFF, 6));
+    CHECK(!IsNoResponseSuppressed(0xFF, 7));
+
+    CHECK(!IsNoResponseSuppressed(1 | 4 | 32 | 64 | 128, 2));
+    CHECK(!IsNoResponseSuppressed(1 | 4 | 32 | 64 | 128, 4));
+    CHECK(!IsNoResponseSuppressed(1 | 4 | 32 | 64 | 128, 5));
+}
+
+static void TestCoapNoResponseBits()
+{
+    CHECK_EQUAL(2, CoapNoResponse::SuppressSuccess);
+    CHECK_EQUAL(8, CoapNoResponse::SuppressClientError);
+    CHECK_EQUAL(16, CoapNoResponse::SuppressServerError);
+
+    CHECK(IsNoResponseSuppressed(CoapNoResponse::SuppressSuccess, CoapMessageCode::Content >> 5));
+    CHECK(IsNoResponseSuppressed(CoapNoResponse::SuppressClientError, CoapMessageCode::NotFound >> 5));
+    CHECK(IsNoResponseSuppressed(CoapNoResponse::SuppressServerError, CoapMessageCode::InternalServerError >> 5));
+}
+
+// Without No-Response, unicast requests get every response and multicast requests no errors
+static void TestDefaults()
+{
+    auto unicast = CoapDefaultNoResponse(false);
+    CHECK(!IsNoResponseSuppressed(unicast, CoapMessageCode::Content >> 5));
+    CHECK(!IsNoResponseSuppressed(unicast, CoapMessageCode::NotFound >> 5));
+    CHECK(!IsNoResponseSuppressed(unicast, CoapMessageCode::InternalServerError >> 5));
+
+    auto multicast = CoapDefaultNoResponse(true);
+#if CONFIG_IOTNODE_COAP_MULTICAST_SUPPRESS_SUCCESS
+    CHECK(IsNoResponseSuppressed(multicast, CoapMessageCode::Content >> 5));
+#else
+    CHECK(!IsNoResponseSuppressed(multicast, CoapMessageCode::Content >> 5));
+#endif
+    CHECK(IsNoResponseSuppressed(multicast, CoapMessageCode::BadRequest >> 5));
+    CHECK(IsNoResponseSuppressed(multicast, CoapMessageCode::NotFound >> 5));
+    CHECK(IsNoResponseSuppressed(multicast, CoapMessageCode::InternalServerError >> 5));
+    CHECK(IsNoResponseSuppressed(multicast, CoapMessageCode::ServiceUnavailable >> 5));
+}
+
+int main()
+{
+    TestNoResponseValues();
+    TestUndefinedBits();
+    TestCoapNoResponseBits();
+    TestDefaults();
+    return TEST_RESULT();
+}
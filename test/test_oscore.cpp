@@ -0,0 +1,369 @@
+#include <map>
+
+// Built into this test instead of linked, the derivation, nonce, AAD and replay window helpers
+// are file static
+#include "oscore.cpp"
+
+#include "coaptest.h"
+
+// NVS in memory, AddContext persists the sender sequence number limit here
+static std::map<std::string, uint64_t> gNvs;
+
+esp_err_t nvs_open(const char *name, nvs_open_mode mode, nvs_handle *handle)
+{
+    *handle = 1;
+    return ESP_OK;
+}
+
+void nvs_close(nvs_handle handle)
+{
+}
+
+esp_err_t nvs_get_u64(nvs_handle handle, const char *key, uint64_t *value)
+{
+    auto it = gNvs.find(key);
+    if (it == gNvs.end())
+        return ESP_ERR_NVS_NOT_FOUND;
+    *value = it->second;
+    return ESP_OK;
+}
+
+esp_err_t nvs_set_u64(nvs_handle handle, const char *key, uint64_t value)
+{
+    gNvs[key] = value;
+    return ESP_OK;
+}
+
+esp_err_t nvs_commit(nvs_handle handle)
+{
+    return ESP_OK;
+}
+
+typedef std::vector<uint8_t> Bytes;
+
+static Bytes Hex(const char *hex)
+{
+    Bytes bytes;
+    for (; hex[0] != '\0' && hex[1] != '\0'; hex += 2)
+        bytes.push_back(static_cast<uint8_t>(std::stoul(std::string(hex, 2), nullptr, 16)));
+    return bytes;
+}
+
+// RFC 8613 appendix C.1 to C.3
+static const Bytes kMasterSecret = Hex("0102030405060708090a0b0c0d0e0f10");
+static const Bytes kMasterSalt = Hex("9e7ca92223786340");
+static const Bytes kIdContext = Hex("37cbf3210017a2d3");
+static const Bytes kClientId = Hex("");
+static const Bytes kServerId = Hex("01");
+
+static CoapOscoreOptions Options(Bytes const &sender, Bytes const &recipient, Bytes const *salt, Bytes const *idContext = nullptr)
+{
+    CoapOscoreOptions options = {};
+    options.master_secret_ptr = kMasterSecret.data();
+    options.master_secret_len = kMasterSecret.size();
+    options.master_salt_ptr = salt != nullptr ? salt->data() : nullptr;
+    options.master_salt_len = salt != nullptr ? salt->size() : 0;
+    options.sender_id_ptr = sender.data();
+    options.sender_id_len = sender.size();
+    options.recipient_id_ptr = recipient.data();
+    options.recipient_id_len = recipient.size();
+    options.id_context_ptr = idContext != nullptr ? idContext->data() : nullptr;
+    options.id_context_len = idContext != nullptr ? idContext->size() : 0;
+    return options;
+}
+
+static Bytes Derive(CoapOscoreOptions const &options, Bytes const &id, const char *type, size_t length)
+{
+    Bytes output(length);
+    CHECK(_Derive(options, id.data(), id.size(), type, output.data(), length));
+    return output;
+}
+
+static Bytes Nonce(Bytes const &commonIv, Bytes const &id, Bytes const &piv)
+{
+    // The firmware passes arrays, never a null ID
+    static const uint8_t kEmpty[1] = {};
+    Bytes nonce(kOscoreNonceLength);
+    _Nonce(commonIv.data(), id.empty() ? kEmpty : id.data(), id.size(), piv.data(), piv.size(), nonce.data());
+    return nonce;
+}
+
+// Sender and recipient keys, common IV and nonces (with Partial IV 0) of the client and server
+// contexts in appendix C.1 to C.3
+static void TestKeyDerivation()
+{
+    struct Vector
+    {
+        const char *Name;
+        Bytes ClientId;
+        Bytes ServerId;
+        const Bytes *Salt;
+        const Bytes *IdContext;
+        Bytes ClientKey;
+        Bytes ServerKey;
+        Bytes CommonIv;
+        Bytes ClientNonce;
+        Bytes ServerNonce;
+    };
+    Vector vectors[] = {
+        {"C.1", Hex(""), Hex("01"), &kMasterSalt, nullptr,
+            Hex("f0910ed7295e6ad4b54fc793154302ff"), Hex("ffb14e093c94c9cac9471648b4f98710"),
+            Hex("4622d4dd6d944168eefb54987c"), Hex("4622d4dd6d944168eefb54987c"), Hex("4722d4dd6d944169eefb54987c")},
+        {"C.2", Hex("00"), Hex("01"), nullptr, nullptr,
+            Hex("321b26943253c7ffb6003b0b64d74041"), Hex("e57b5635815177cd679ab4bcec9d7dda"),
+            Hex("be35ae297d2dace910c52e99f9"), Hex("bf35ae297d2dace910c52e99f9"), Hex("bf35ae297d2dace810c52e99f9")},
+        {"C.3", Hex(""), Hex("01"), &kMasterSalt, &kIdContext,
+            Hex("af2a1300a5e95788b356336eeecd2b92"), Hex("e39a0c7c77b43f03b4b39ab9a268699f"),
+            Hex("2ca58fb85ff1b81c0b7181b85e"), Hex("2ca58fb85ff1b81c0b7181b85e"), Hex("2da58fb85ff1b81d0b7181b85e")},
+    };
+
+    for (auto &vector : vectors)
+    {
+        printf("%s: test vector %s\n", __FILE__, vector.Name);
+        auto client = Options(vector.ClientId, vector.ServerId, vector.Salt, vector.IdContext);
+        auto server = Options(vector.ServerId, vector.ClientId, vector.Salt, vector.IdContext);
+
+        CHECK(Derive(client, vector.ClientId, "Key", kOscoreKeyLength) == vector.ClientKey);
+        CHECK(Derive(client, vector.ServerId, "Key", kOscoreKeyLength) == vector.ServerKey);
+        CHECK(Derive(client, Bytes(), "IV", kOscoreNonceLength) == vector.CommonIv);
+        // The server derives the same from its side
+        CHECK(Derive(server, vector.ServerId, "Key", kOscoreKeyLength) == vector.ServerKey);
+        CHECK(Derive(server, vector.ClientId, "Key", kOscoreKeyLength) == vector.ClientKey);
+
+        CHECK(Nonce(vector.CommonIv, vector.ClientId, Hex("00")) == vector.ClientNonce);
+        CHECK(Nonce(vector.CommonIv, vector.ServerId, Hex("00")) == vector.ServerNonce);
+    }
+}
+
+// Nonce and AAD of the requests in appendix C.4 (empty kid) and C.5 (kid 00), Partial IV 20
+static void TestNonceAndAad()
+{
+    CHECK(Nonce(Hex("4622d4dd6d944168eefb54987c"), Hex(""), Hex("14")) == Hex("4622d4dd6d944168eefb549868"));
+    CHECK(Nonce(Hex("be35ae297d2dace910c52e99f9"), Hex("00"), Hex("14")) == Hex("bf35ae297d2dace910c52e99ed"));
+
+    Bytes aad(kOscoreMaxAadLength);
+    auto piv = Hex("14");
+    aad.resize(_Aad(nullptr, 0, piv.data(), piv.size(), aad.data()));
+    CHECK(aad == Hex("8368456e63727970743040488501810a40411440"));
+
+    auto kid = Hex("00");
+    aad.resize(kOscoreMaxAadLength);
+    aad.resize(_Aad(kid.data(), kid.size(), piv.data(), piv.size(), aad.data()));
+    CHECK(aad == Hex("8368456e63727970743040498501810a4100411440"));
+}
+
+// 32 sequence numbers below the highest accepted one, bit n for highest - n
+static void TestIsFresh()
+{
+    // Anything above the highest
+    CHECK(_IsFresh(10, 1, 11));
+    CHECK(_IsFresh(10, 0xFFFFFFFF, 1000));
+    // The highest itself and anything marked below it was seen
+    CHECK(!_IsFresh(10, 1, 10));
+    CHECK(!_IsFresh(10, 1 | 1 << 3, 7));
+    CHECK(_IsFresh(10, 1 | 1 << 3, 8));
+    // The oldest number in the window, and the first one out of it
+    CHECK(_IsFresh(40, 1, 9));
+    CHECK(!_IsFresh(40, 1u << 31, 9));
+    CHECK(!_IsFresh(40, 1, 8));
+    CHECK(!_IsFresh(40, 0, 0));
+}
+
+static const NetEp_t kClient = Endpoint(0x0200000A, 5683);
+static const uint8_t kRequestPost = 0x02;
+static const uint8_t kRequestGet = 0x01;
+static const uint8_t kUnauthorized = 0x81;
+
+// The client side of appendix C.1, protects requests for the server under test
+struct Client
+{
+    CoapOscoreOptions Options = ::Options(kClientId, kServerId, &kMasterSalt);
+    Bytes CommonIv = Derive(Options, Bytes(), "IV", kOscoreNonceLength);
+    mbedtls_ccm_context Ccm;
+
+    Client()
+    {
+        mbedtls_ccm_init(&Ccm);
+        auto key = Derive(Options, Bytes(), "Key", kOscoreKeyLength);
+        CHECK(mbedtls_ccm_setkey(&Ccm, MBEDTLS_CIPHER_ID_AES, key.data(), key.size() * 8) == 0);
+    }
+
+    ~Client()
+    {
+        mbedtls_ccm_free(&Ccm);
+    }
+
+    // GET /tv1 on localhost, like appendix C.4, with the given inner options after Uri-Path
+    Bytes Request(uint8_t sequence, uint16_t messageId, TestOptions const &inner = {})
+    {
+        Bytes plaintext(64);
+        plaintext[0] = kRequestGet;
+        size_t offset = 1;
+        uint16_t previous = 0;
+        TestOptions options = {{CoapOptionValue::UriPath, "tv1"}};
+        options.insert(options.end(), inner.begin(), inner.end());
+        for (auto &option : options)
+            CHECK(CoapWriteOption(plaintext.data(), plaintext.size(), offset, previous, option.first,
+                reinterpret_cast<const uint8_t *>(option.second.data()), option.second.size()));
+        plaintext.resize(offset);
+
+        Bytes piv = {sequence};
+        auto nonce = Nonce(CommonIv, Bytes(), piv);
+        Bytes aad(kOscoreMaxAadLength);
+        aad.resize(_Aad(nullptr, 0, piv.data(), piv.size(), aad.data()));
+        Bytes ciphertext(plaintext.size() + kOscoreTagLength);
+        CHECK(mbedtls_ccm_encrypt_and_tag(&Ccm, plaintext.size(), nonce.data(), nonce.size(), aad.data(), aad.size(),
+            plaintext.data(), ciphertext.data(), ciphertext.data() + plaintext.size(), kOscoreTagLength) == 0);
+
+        std::string option = {static_cast<char>(kOscoreFlagKid | 1), static_cast<char>(sequence)};
+        return Message(CoapMessageType::Confirmable, kRequestPost, messageId, "\x00\x00\x39\x74",
+            {{CoapOptionValue::UriHost, "localhost"}, {CoapOptionValue::Oscore, option}},
+            std::string(ciphertext.begin(), ciphertext.end()));
+    }
+};
+
+// What Unprotect made of a datagram: the request for lobaro, or a reply for the client
+struct Unprotected
+{
+    CoapResult Result;
+    bool Reply;
+    Datagram Message;
+};
+
+static Unprotected Receive(ObjectSecurity &security, Bytes datagram)
+{
+    Unprotected unprotected;
+    uint8_t *message = datagram.data();
+    size_t size = datagram.size();
+    security.Unprotect(kClient, message, size, unprotected.Reply, unprotected.Result);
+    unprotected.Message = {kClient, Bytes(message, message + size)};
+    return unprotected;
+}
+
+static bool IsRejected(Unprotected const &unprotected, const char *diagnostic)
+{
+    return unprotected.Reply && CodeOf(unprotected.Message) == kUnauthorized && PayloadOf(unprotected.Message) == diagnostic;
+}
+
+static bool IsAccepted(Unprotected const &unprotected)
+{
+    return unprotected.Result == CoapResult::OK && !unprotected.Reply && CodeOf(unprotected.Message) == kRequestGet
+        && OptionsOf(unprotected.Message, CoapOptionValue::UriPath) == std::vector<std::string>{"tv1"};
+}
+
+struct Fixture
+{
+    ObjectSecurity Security;
+    Client Peer;
+
+    // The server context of appendix C.1
+    Fixture()
+    {
+        gTestNow = 1;
+        gNvs.clear();
+        auto server = Options(kServerId, kClientId, &kMasterSalt);
+        CoapResult result;
+        Security.AddContext(server, result);
+        CHECK(result == CoapResult::OK);
+    }
+
+    // Answers the Echo challenge to the first request, the replay window starts at `sequence`
+    void Synchronize(uint8_t sequence)
+    {
+        auto challenge = Receive(Security, Peer.Request(sequence - 1, 0x100));
+        CHECK(challenge.Reply && CodeOf(challenge.Message) == kUnauthorized);
+        auto echo = OptionsOf(challenge.Message, CoapOptionValue::Echo);
+        CHECK_EQUAL(1, echo.size());
+
+        auto synced = Receive(Security, Peer.Request(sequence, 0x101, {{CoapOptionValue::Echo, echo[0]}}));
+        CHECK(IsAccepted(synced));
+        CHECK((OptionsOf(synced.Message, CoapOptionValue::Echo) == echo));
+    }
+};
+
+// The protected request of appendix C.4 decrypts, and the response of C.7 protects to the
+// exact bytes of the RFC
+static void TestRequestAndResponseVectors()
+{
+    Fixture fixture;
+
+    // Sender sequence numbers are reserved ahead in NVS
+    CHECK_EQUAL(1, gNvs.size());
+    CHECK_EQUAL(kOscoreSequenceStep, gNvs.begin()->second);
+
+    // The first request after boot is challenged, which needs it decrypted and verified
+    auto request = Hex("44025d1f00003974396c6f63616c686f7374620914ff612f1092f1776f1c1668b3825e");
+    auto challenge = Receive(fixture.Security, request);
+    CHECK(challenge.Result == CoapResult::OK);
+    CHECK(challenge.Reply);
+    CHECK_EQUAL(kUnauthorized, CodeOf(challenge.Message));
+    CHECK_EQUAL(1, OptionsOf(challenge.Message, CoapOptionValue::Echo).size());
+
+    // A tampered copy isn't. With a message ID of its own, the same one is a retransmission.
+    auto tampered = request;
+    tampered[3] ^= 1;
+    tampered.back() ^= 1;
+    auto rejected = Receive(fixture.Security, tampered);
+    CHECK(rejected.Reply && CodeOf(rejected.Message) == 0x80 && PayloadOf(rejected.Message) == "Decryption failed");
+
+    auto response = Hex("64455d1f00003974ff48656c6c6f20576f726c6421");
+    uint8_t *message = response.data();
+    size_t size = response.size();
+    CoapResult result;
+    fixture.Security.Protect(kClient, message, size, result);
+    CHECK(result == CoapResult::OK);
+    CHECK(Bytes(message, message + size) == Hex("64445d1f0000397490ffdbaad1e9a7e7b2a813d3c31524378303cdafae119106"));
+}
+
+// Requests after the Echo round trip: the window moves up with newer sequence numbers and
+// remembers the ones seen below the highest
+static void TestReplayWindow()
+{
+    Fixture fixture;
+    fixture.Synchronize(20);
+    uint16_t messageId = 0x200;
+    auto receive = [&](uint8_t sequence) { return Receive(fixture.Security, fixture.Peer.Request(sequence, messageId++)); };
+
+    CHECK(IsRejected(receive(20), "Replay detected"));
+    // The challenged request never got to lobaro, it may still come
+    CHECK(IsAccepted(receive(19)));
+    CHECK(IsRejected(receive(19), "Replay detected"));
+
+    // Shifted by one, then by eight
+    CHECK(IsAccepted(receive(21)));
+    CHECK(IsAccepted(receive(29)));
+    CHECK(IsRejected(receive(21), "Replay detected"));
+    CHECK(IsRejected(receive(20), "Replay detected"));
+
+    // Out of order below the highest sets its bit, once
+    CHECK(IsAccepted(receive(25)));
+    CHECK(IsRejected(receive(25), "Replay detected"));
+    CHECK(IsAccepted(receive(24)));
+
+    // Shifted by the width of the window less one: only 29 stays in it
+    CHECK(IsAccepted(receive(60)));
+    CHECK(IsRejected(receive(29), "Replay detected"));
+    CHECK(IsAccepted(receive(30)));
+    CHECK(IsRejected(receive(28), "Replay detected"));
+
+    // A jump past the window starts it over
+    CHECK(IsAccepted(receive(200)));
+    CHECK(IsAccepted(receive(169)));
+    CHECK(IsRejected(receive(168), "Replay detected"));
+    CHECK(IsRejected(receive(200), "Replay detected"));
+
+    // So does a jump of exactly the width of the window, nothing of the old one is left
+    CHECK(IsAccepted(receive(232)));
+    CHECK(IsAccepted(receive(201)));
+    CHECK(IsRejected(receive(200), "Replay detected"));
+}
+
+int main()
+{
+    TestKeyDerivation();
+    TestNonceAndAad();
+    TestIsFresh();
+    TestRequestAndResponseVectors();
+    TestReplayWindow();
+    return TEST_RESULT();
+}
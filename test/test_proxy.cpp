@@ -0,0 +1,148 @@
+#include "coapproxy.h"
+
+#include "coaptest.h"
+
+static const uint8_t kGet = 0x01;
+static const uint8_t kContent = 0x45;
+static const uint8_t kBadOption = 0x82;
+
+struct Fixture
+{
+    CoapClient Client;
+    CoapProxy Proxy;
+    NetEp_t Downstream = Endpoint(0x0100000A, 40000);
+    NetEp_t Upstream = Endpoint(0x0200000A, 5683);
+
+    Fixture()
+    {
+        gSent.clear();
+        Client.Setup(Transmit, nullptr);
+        Proxy.Setup(&Client, Transmit, nullptr);
+    }
+
+    // Sends `request` downstream and returns what went upstream for it
+    Datagram Forward(std::vector<uint8_t> const &request)
+    {
+        CHECK(Feed(Proxy, Downstream, request));
+        Client.Poll(gTestNow);
+        CHECK(!gSent.empty());
+        auto upstream = gSent.back();
+        CHECK(EpAreEqual(&upstream.Remote, &Upstream));
+        return upstream;
+    }
+};
+
+// A retransmitted CON answered with a separate response gets the empty ACK and the same response again
+static void TestSeparateResponseRetransmitted()
+{
+    gTestNow = 1;
+    Fixture fixture;
+    auto request = Message(CoapMessageType::Confirmable, kGet, 0x1000, "\xA1", {{CoapOptionValue::ProxyUri, "coap://10.0.0.2/temp"}});
+    auto upstream = fixture.Forward(request);
+    gSent.clear();
+
+    CHECK(Feed(fixture.Client, fixture.Upstream, Reply(upstream, kContent, {}, "x")));
+    CHECK_EQUAL(1, gSent.size());
+    auto response = gSent.back();
+    CHECK(TypeOf(response) == CoapMessageType::NonConfirmable);
+    gSent.clear();
+
+    gTestNow += 5 * 1000 * 1000;
+    CHECK(Feed(fixture.Proxy, fixture.Downstream, request));
+    fixture.Client.Poll(gTestNow);
+    CHECK_EQUAL(2, gSent.size());
+    CHECK(TypeOf(gSent[0]) == CoapMessageType::Acknowledgement);
+    CHECK_EQUAL(0, CodeOf(gSent[0]));
+    CHECK(gSent[1].Data == response.Data);
+}
+
+// A retransmitted CON answered from the cache gets the same piggybacked response, a NON duplicate nothing
+static void TestPiggybackedRetransmitted()
+{
+    gTestNow = 1;
+    Fixture fixture;
+    auto uri = std::make_pair(CoapOptionValue::ProxyUri, std::string("coap://10.0.0.2/temp"));
+    auto upstream = fixture.Forward(Message(CoapMessageType::Confirmable, kGet, 0x2000, "\xB1", {uri}));
+    Feed(fixture.Client, fixture.Upstream, Reply(upstream, kContent, {}, "x"));
+    gSent.clear();
+
+    auto cached = Message(CoapMessageType::Confirmable, kGet, 0x2001, "\xB2", {uri});
+    CHECK(Feed(fixture.Proxy, fixture.Downstream, cached));
+    CHECK_EQUAL(1, gSent.size());
+    auto response = gSent.back();
+    CHECK(TypeOf(response) == CoapMessageType::Acknowledgement);
+    CHECK_EQUAL(kContent, CodeOf(response));
+    gSent.clear();
+
+    // Max-Age went down a second, the retransmission still gets what was sent the first time
+    gTestNow += 1000 * 1000;
+    CHECK(Feed(fixture.Proxy, fixture.Downstream, cached));
+    CHECK_EQUAL(1, gSent.size());
+    CHECK(gSent.back().Data == response.Data);
+    gSent.clear();
+
+    auto non = Message(CoapMessageType::NonConfirmable, kGet, 0x2002, "\xB3", {uri});
+    CHECK(Feed(fixture.Proxy, fixture.Downstream, non));
+    CHECK_EQUAL(1, gSent.size());
+    gSent.clear();
+    CHECK(Feed(fixture.Proxy, fixture.Downstream, non));
+    CHECK_EQUAL(0, gSent.size());
+}
+
+// After EXCHANGE_LIFETIME the same message ID is a new request
+static void TestCompletedExpires()
+{
+    gTestNow = 1;
+    Fixture fixture;
+    auto request = Message(CoapMessageType::Confirmable, kGet, 0x3000, "\xC1", {{CoapOptionValue::ProxyUri, "coap://10.0.0.2/temp"}});
+    auto upstream = fixture.Forward(request);
+    Feed(fixture.Client, fixture.Upstream, Reply(upstream, kContent, {}, "x"));
+    gSent.clear();
+
+    gTestNow += 248 * 1000 * 1000LL;
+    fixture.Forward(request);
+    CHECK(OptionsOf(gSent.back(), CoapOptionValue::UriPath) == std::vector<std::string>{"temp"});
+}
+
+// Uri-Path and Uri-Query options carry percent-decoded segments (RFC 7252 section 6.4)
+static void TestPercentDecoding()
+{
+    gTestNow = 1;
+    Fixture fixture;
+    auto upstream = fixture.Forward(Message(CoapMessageType::Confirmable, kGet, 0x4000, "\xD1",
+        {{CoapOptionValue::ProxyUri, "coap://10.0.0.2/a%20b/c%2Fd?x=%26y&z%3d1"}}));
+    CHECK((OptionsOf(upstream, CoapOptionValue::UriPath) == std::vector<std::string>{"a b", "c/d"}));
+    CHECK((OptionsOf(upstream, CoapOptionValue::UriQuery) == std::vector<std::string>{"x=&y", "z=1"}));
+
+    // Composed from Proxy-Scheme and Uri-* options, the segments arrive upstream unchanged
+    upstream = fixture.Forward(Message(CoapMessageType::Confirmable, kGet, 0x4001, "\xD2",
+        {{CoapOptionValue::UriHost, "10.0.0.2"}, {CoapOptionValue::UriPath, "c/d"}, {CoapOptionValue::UriPath, "50%"},
+         {CoapOptionValue::UriQuery, "q=a&b"}, {CoapOptionValue::ProxyScheme, "coap"}}));
+    CHECK((OptionsOf(upstream, CoapOptionValue::UriPath) == std::vector<std::string>{"c/d", "50%"}));
+    CHECK((OptionsOf(upstream, CoapOptionValue::UriQuery) == std::vector<std::string>{"q=a&b"}));
+}
+
+// A malformed escape is turned away with 4.02
+static void TestMalformedEscape()
+{
+    gTestNow = 1;
+    Fixture fixture;
+    uint16_t messageId = 0x5000;
+    for (auto uri : {"coap://10.0.0.2/a%2", "coap://10.0.0.2/a%zz", "coap://10.0.0.2/a?b=%"})
+    {
+        gSent.clear();
+        CHECK(Feed(fixture.Proxy, fixture.Downstream, Message(CoapMessageType::Confirmable, kGet, messageId++, "\xE1", {{CoapOptionValue::ProxyUri, uri}})));
+        CHECK_EQUAL(1, gSent.size());
+        CHECK_EQUAL(kBadOption, CodeOf(gSent.back()));
+    }
+}
+
+int main()
+{
+    TestSeparateResponseRetransmitted();
+    TestPiggybackedRetransmitted();
+    TestCompletedExpires();
+    TestPercentDecoding();
+    TestMalformedEscape();
+    return TEST_RESULT();
+}
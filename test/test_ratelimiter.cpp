@@ -0,0 +1,179 @@
+#include "ratelimiter.h"
+
+#include "coaptest.h"
+
+static const int64_t kSecondUs = 1000 * 1000;
+
+static NetEp_t Client(uint32_t address, uint16_t port = 40000)
+{
+    return Endpoint(0x0A000000 | address, port);
+}
+
+// Requests admitted until the first one that isn't
+static int Drain(RateLimiter &limiter, NetEp_t const &remote, RateLimiter::Verdict &verdict, uint32_t &retryAfter)
+{
+    int admitted = 0;
+    while ((verdict = limiter.Admit(remote, gTestNow, retryAfter)) == RateLimiter::Verdict::Admit)
+        admitted++;
+    return admitted;
+}
+
+// A new client may send a whole burst back to back, then has to wait for the next token
+static void TestBurst()
+{
+    gTestNow = 1;
+    RateLimiter limiter;
+    RateLimiter::Verdict verdict;
+    uint32_t retryAfter = 0;
+    CHECK_EQUAL(kCoapRateLimitBurst, Drain(limiter, Client(1), verdict, retryAfter));
+    CHECK(verdict == RateLimiter::Verdict::Reject);
+    CHECK_EQUAL(1, retryAfter);
+
+    // Clients are told apart by address, another port is the same bucket
+    CHECK(limiter.Admit(Client(1, 40001), gTestNow, retryAfter) != RateLimiter::Verdict::Admit);
+    CHECK(limiter.Admit(Client(2), gTestNow, retryAfter) == RateLimiter::Verdict::Admit);
+}
+
+// Tokens come back at kCoapRateLimitRate per second, up to the burst size
+static void TestRefill()
+{
+    gTestNow = 1;
+    RateLimiter limiter;
+    RateLimiter::Verdict verdict;
+    uint32_t retryAfter;
+    Drain(limiter, Client(1), verdict, retryAfter);
+
+    gTestNow += kSecondUs / kCoapRateLimitRate;
+    CHECK_EQUAL(1, Drain(limiter, Client(1), verdict, retryAfter));
+
+    gTestNow += kSecondUs;
+    CHECK_EQUAL(kCoapRateLimitRate, Drain(limiter, Client(1), verdict, retryAfter));
+
+    gTestNow += 60 * kSecondUs;
+    CHECK_EQUAL(kCoapRateLimitBurst, Drain(limiter, Client(1), verdict, retryAfter));
+}
+
+// One 5.03 per Max-Age, whatever the client sends before that is dropped
+static void TestRejectThenDrop()
+{
+    gTestNow = 1;
+    RateLimiter limiter;
+    RateLimiter::Verdict verdict;
+    uint32_t retryAfter;
+    auto start = gTestNow;
+    Drain(limiter, Client(1), verdict, retryAfter);
+    CHECK(verdict == RateLimiter::Verdict::Reject);
+    CHECK_EQUAL(1, retryAfter);
+
+    CHECK(limiter.Admit(Client(1), gTestNow, retryAfter) == RateLimiter::Verdict::Drop);
+    gTestNow += kSecondUs / kCoapRateLimitRate / 2;
+    CHECK(limiter.Admit(Client(1), gTestNow, retryAfter) == RateLimiter::Verdict::Drop);
+
+    // A token that came back is still handed out, running dry again within Max-Age is a Drop
+    gTestNow = start + kSecondUs / kCoapRateLimitRate;
+    CHECK_EQUAL(1, Drain(limiter, Client(1), verdict, retryAfter));
+    CHECK(verdict == RateLimiter::Verdict::Drop);
+
+    // Past Max-Age the client is told again
+    gTestNow = start + static_cast<int64_t>(retryAfter) * kSecondUs;
+    Drain(limiter, Client(1), verdict, retryAfter);
+    CHECK(verdict == RateLimiter::Verdict::Reject);
+}
+
+// With the table full, the client heard from least recently is forgotten and starts over
+static void TestEviction()
+{
+    gTestNow = 1;
+    RateLimiter limiter;
+    RateLimiter::Verdict verdict;
+    uint32_t retryAfter;
+    Drain(limiter, Client(1), verdict, retryAfter);
+
+    for (uint32_t i = 0; i < kCoapRateLimitClients - 1; i++)
+    {
+        gTestNow += 1000;
+        CHECK(limiter.Admit(Client(100 + i), gTestNow, retryAfter) == RateLimiter::Verdict::Admit);
+    }
+    // Still tracked, still empty
+    gTestNow += 1000;
+    CHECK(limiter.Admit(Client(1), gTestNow, retryAfter) != RateLimiter::Verdict::Admit);
+
+    // Now the others are older, one more client pushes out the oldest of them instead
+    gTestNow += 1000;
+    CHECK(limiter.Admit(Client(200), gTestNow, retryAfter) == RateLimiter::Verdict::Admit);
+    CHECK(limiter.Admit(Client(1), gTestNow, retryAfter) != RateLimiter::Verdict::Admit);
+
+    // Once everyone else was heard from more recently, client 1 is evicted and gets a fresh burst
+    for (uint32_t i = 0; i < kCoapRateLimitClients; i++)
+    {
+        gTestNow += 1000;
+        limiter.Admit(Client(300 + i), gTestNow, retryAfter);
+    }
+    CHECK_EQUAL(kCoapRateLimitBurst, Drain(limiter, Client(1), verdict, retryAfter));
+}
+
+// A client sending well within its rate gets every request through while others flood, whether
+// the flood comes from one address or from more addresses than the table holds
+static void TestFlood(uint32_t flooders)
+{
+    gTestNow = 1;
+    RateLimiter limiter;
+    uint32_t retryAfter;
+    const int seconds = 10;
+    const int floodPerMs = 2;
+    const int politeEveryMs = 1000 / (kCoapRateLimitRate / 2);
+
+    int polite = 0, politeAdmitted = 0, floodAdmitted = 0;
+    uint32_t next = 0;
+    for (int ms = 0; ms < seconds * 1000; ms++)
+    {
+        gTestNow += 1000;
+        for (int i = 0; i < floodPerMs; i++)
+        {
+            if (limiter.Admit(Client(1000 + next++ % flooders), gTestNow, retryAfter) == RateLimiter::Verdict::Admit)
+                floodAdmitted++;
+        }
+        if (ms % politeEveryMs == 0)
+        {
+            polite++;
+            if (limiter.Admit(Client(1), gTestNow, retryAfter) == RateLimiter::Verdict::Admit)
+                politeAdmitted++;
+        }
+    }
+
+    CHECK_EQUAL(polite, politeAdmitted);
+    if (flooders == 1)
+        CHECK(floodAdmitted <= static_cast<int>(kCoapRateLimitBurst + kCoapRateLimitRate * seconds) + 1);
+}
+
+// The 5.03 is piggybacked on the ACK and carries the wait as Max-Age
+static void TestWriteRejection()
+{
+    auto request = Message(CoapMessageType::Confirmable, 0x01, 0x1234, "\x01\x02", {});
+    CoapResult result;
+    CoapPacket packet(request.data(), request.size());
+    packet.Parse(result);
+
+    uint8_t buffer[64];
+    auto size = RateLimiter::WriteRejection(buffer, sizeof(buffer), packet, 3);
+    CHECK(size > 0);
+    Datagram response{Client(1), std::vector<uint8_t>(buffer, buffer + size)};
+    CHECK(TypeOf(response) == CoapMessageType::Acknowledgement);
+    CHECK_EQUAL(0xA3, CodeOf(response));
+    CHECK_EQUAL(0x12, response.Data[2]);
+    CHECK_EQUAL(0x34, response.Data[3]);
+    CHECK_EQUAL(2, response.Data[0] & 0x0F);
+    CHECK((OptionsOf(response, CoapOptionValue::MaxAge) == std::vector<std::string>{UInt(3)}));
+}
+
+int main()
+{
+    TestBurst();
+    TestRefill();
+    TestRejectThenDrop();
+    TestEviction();
+    TestFlood(1);
+    TestFlood(4 * kCoapRateLimitClients);
+    TestWriteRejection();
+    return TEST_RESULT();
+}
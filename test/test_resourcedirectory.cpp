@@ -0,0 +1,244 @@
+#include <algorithm>
+
+#include "resourcedirectory.h"
+
+#include "coaptest.h"
+
+static const uint8_t kPost = 0x02;
+static const uint8_t kCreated = 0x41;
+static const uint8_t kChanged = 0x44;
+static const uint8_t kNotFound = 0x84;
+static const uint8_t kServiceUnavailable = 0xA3;
+
+static const int64_t kSecond = 1000 * 1000;
+static const int64_t kRefresh = kCoapRdLifetime * kSecond * 3 / 4;
+
+static std::string gLinks;
+
+static std::string const &Links()
+{
+    return gLinks;
+}
+
+// The node's client and directory, talking to a stand-in for the directory at CONFIG_IOTNODE_COAP_RD_ADDRESS
+struct Fixture
+{
+    CoapClient Client;
+    ResourceDirectory Directory;
+    NetEp_t Server = Endpoint(0x0900000A, CONFIG_IOTNODE_COAP_RD_PORT);
+
+    Fixture()
+    {
+        gTestNow = 1;
+        gSent.clear();
+        gLinks = "</temp>;rt=\"temperature\";obs,</led>";
+        Client.Setup(Transmit, nullptr);
+        CoapResult result;
+        Directory.Setup(&Client, Links, result);
+        CHECK(result == CoapResult::OK);
+    }
+
+    // Moves the clock to `now` and returns the request the node sent to the directory then, if any
+    bool Poll(int64_t now, Datagram &request)
+    {
+        gTestNow = now;
+        gSent.clear();
+        Directory.Poll(now);
+        Client.Poll(now);
+        if (gSent.empty())
+            return false;
+        CHECK_EQUAL(1, gSent.size());
+        request = gSent.back();
+        CHECK(EpAreEqual(&request.Remote, &Server));
+        CHECK_EQUAL(kPost, CodeOf(request));
+        return true;
+    }
+
+    void Answer(Datagram const &request, uint8_t code, TestOptions const &options = {})
+    {
+        Feed(Client, Server, Reply(request, code, options));
+    }
+
+    // Registers and returns the time of the registration
+    int64_t Register(int64_t now)
+    {
+        Datagram request;
+        CHECK(Poll(now, request));
+        CHECK(IsRegistration(request));
+        Answer(request, kCreated, {{CoapOptionValue::LocationPath, "reg"}, {CoapOptionValue::LocationPath, "4521"}});
+        return now;
+    }
+
+    static bool IsRegistration(Datagram const &request)
+    {
+        return OptionsOf(request, CoapOptionValue::UriPath) == std::vector<std::string>{"rd"};
+    }
+
+    static bool IsUpdate(Datagram const &request)
+    {
+        return OptionsOf(request, CoapOptionValue::UriPath) == std::vector<std::string>{"reg", "4521"};
+    }
+};
+
+// The registration carries the endpoint name, lifetime and links (RFC 9176 section 5.3)
+static void TestRegister()
+{
+    Fixture fixture;
+    Datagram request;
+    CHECK(fixture.Poll(gTestNow, request));
+    CHECK(Fixture::IsRegistration(request));
+    CHECK(TypeOf(request) == CoapMessageType::Confirmable);
+    CHECK((OptionsOf(request, CoapOptionValue::ContentFormat) == std::vector<std::string>{UInt(CoapContentType::LinkFormat)}));
+    CHECK((OptionsOf(request, CoapOptionValue::UriQuery) == std::vector<std::string>{"ep=" CONFIG_IOTNODE_HOSTNAME, "lt=3600"}));
+    CHECK(PayloadOf(request) == gLinks);
+
+    // Nothing more until the refresh is due
+    fixture.Answer(request, kCreated, {{CoapOptionValue::LocationPath, "reg"}, {CoapOptionValue::LocationPath, "4521"}});
+    CHECK(!fixture.Poll(gTestNow + kSecond, request));
+    CHECK(!fixture.Poll(1 + kRefresh - 1, request));
+}
+
+// Three quarters into the lifetime an empty POST to the registration resets it, again and again
+static void TestUpdate()
+{
+    Fixture fixture;
+    auto registered = fixture.Register(gTestNow);
+
+    Datagram request;
+    for (int i = 1; i <= 3; i++)
+    {
+        auto due = registered + i * kRefresh;
+        CHECK(!fixture.Poll(due - 1, request));
+        CHECK(fixture.Poll(due, request));
+        CHECK(Fixture::IsUpdate(request));
+        CHECK(OptionsOf(request, CoapOptionValue::UriQuery).empty());
+        CHECK(PayloadOf(request).empty());
+        fixture.Answer(request, kChanged);
+    }
+}
+
+// A directory that forgot the registration gets a new one right away
+static void TestReregister()
+{
+    Fixture fixture;
+    fixture.Register(gTestNow);
+
+    Datagram request;
+    CHECK(fixture.Poll(1 + kRefresh, request));
+    CHECK(Fixture::IsUpdate(request));
+    fixture.Answer(request, kNotFound);
+
+    CHECK(fixture.Poll(gTestNow, request));
+    CHECK(Fixture::IsRegistration(request));
+    CHECK(PayloadOf(request) == gLinks);
+}
+
+// Changed links are registered anew instead of updated
+static void TestLinksChanged()
+{
+    Fixture fixture;
+    fixture.Register(gTestNow);
+
+    gLinks += ",</humidity>;obs";
+    Datagram request;
+    CHECK(fixture.Poll(1 + kRefresh, request));
+    CHECK(Fixture::IsRegistration(request));
+    CHECK(PayloadOf(request) == gLinks);
+}
+
+// Failures are retried after 10 s, doubling up to 5 min, and a success starts over at 10 s
+static void TestRetryBackoff()
+{
+    Fixture fixture;
+    Datagram request;
+    CHECK(fixture.Poll(gTestNow, request));
+
+    int64_t delays[] = {10, 20, 40, 80, 160, 300, 300};
+    for (auto delay : delays)
+    {
+        auto failed = gTestNow;
+        fixture.Answer(request, kServiceUnavailable);
+        CHECK(!fixture.Poll(failed + delay * kSecond - 1, request));
+        CHECK(fixture.Poll(failed + delay * kSecond, request));
+        CHECK(Fixture::IsRegistration(request));
+    }
+
+    // A registration without a Location-Path is a failure too, the backoff goes on
+    auto failed = gTestNow;
+    fixture.Answer(request, kCreated);
+    CHECK(!fixture.Poll(failed + 300 * kSecond - 1, request));
+    CHECK(fixture.Poll(failed + 300 * kSecond, request));
+
+    fixture.Answer(request, kCreated, {{CoapOptionValue::LocationPath, "reg"}, {CoapOptionValue::LocationPath, "4521"}});
+    auto registered = gTestNow;
+    CHECK(fixture.Poll(registered + kRefresh, request));
+    CHECK(Fixture::IsUpdate(request));
+    failed = gTestNow;
+    fixture.Answer(request, kServiceUnavailable);
+    CHECK(!fixture.Poll(failed + 10 * kSecond - 1, request));
+    CHECK(fixture.Poll(failed + 10 * kSecond, request));
+    CHECK(Fixture::IsUpdate(request));
+}
+
+// Once updates failed for the whole lifetime the registration is gone, the next attempt registers
+static void TestExpired()
+{
+    Fixture fixture;
+    auto registered = fixture.Register(gTestNow);
+    auto expires = registered + kCoapRdLifetime * kSecond;
+
+    Datagram request;
+    CHECK(fixture.Poll(registered + kRefresh, request));
+    while (gTestNow < expires)
+    {
+        CHECK(Fixture::IsUpdate(request));
+        fixture.Answer(request, kServiceUnavailable);
+        int64_t now = gTestNow;
+        while (!fixture.Poll(now, request))
+            now += kSecond;
+    }
+    CHECK(Fixture::IsRegistration(request));
+}
+
+// After the network came back the node updates within the jitter window, also before the refresh is due
+static void TestResume()
+{
+    Fixture fixture;
+    auto registered = fixture.Register(gTestNow);
+
+    auto resumed = registered + 60 * kSecond;
+    fixture.Directory.Resume(resumed);
+    Datagram request;
+    int64_t now = resumed;
+    while (now <= resumed + 2 * kSecond && !fixture.Poll(now, request))
+        now += 100 * 1000;
+    CHECK(now < resumed + 2 * kSecond);
+    CHECK(Fixture::IsUpdate(request));
+
+    // Every Resume draws its own delay
+    std::vector<int64_t> delays;
+    for (int i = 0; i < 4; i++)
+    {
+        fixture.Answer(request, kChanged);
+        resumed = gTestNow + 60 * kSecond;
+        fixture.Directory.Resume(resumed);
+        now = resumed;
+        while (now <= resumed + 2 * kSecond && !fixture.Poll(now, request))
+            now += 1000;
+        CHECK(now < resumed + 2 * kSecond);
+        delays.push_back(now - resumed);
+    }
+    CHECK(std::count(delays.begin(), delays.end(), delays[0]) < 4);
+}
+
+int main()
+{
+    TestRegister();
+    TestUpdate();
+    TestReregister();
+    TestLinksChanged();
+    TestRetryBackoff();
+    TestExpired();
+    TestResume();
+    return TEST_RESULT();
+}
@@ -0,0 +1,147 @@
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "seqlock.h"
+
+#include "test.h"
+
+// Wider than any single store, every field is written from the same counter so a snapshot
+// mixing two writes shows up as fields that disagree
+struct Snapshot
+{
+    uint32_t Sequence;
+    uint8_t Bytes[243];
+    uint32_t Check;
+    uint64_t Wide;
+};
+
+static Snapshot Make(uint32_t n)
+{
+    Snapshot snapshot;
+    snapshot.Sequence = n;
+    for (auto &byte : snapshot.Bytes)
+        byte = static_cast<uint8_t>(n);
+    snapshot.Check = ~n;
+    snapshot.Wide = (static_cast<uint64_t>(n) << 32) | n;
+    return snapshot;
+}
+
+static bool IsWhole(Snapshot const &snapshot)
+{
+    auto n = snapshot.Sequence;
+    for (auto byte : snapshot.Bytes)
+    {
+        if (byte != static_cast<uint8_t>(n))
+            return false;
+    }
+    return snapshot.Check == ~n && snapshot.Wide == ((static_cast<uint64_t>(n) << 32) | n);
+}
+
+static const int kWriters = 2;
+static const int kReaders = 4;
+static const uint32_t kWrites = 200 * 1000;
+
+// Readers spinning on Load while writers Store never see a torn value, and see each writer's
+// values in the order they were written
+static void TestNoTornSnapshots()
+{
+    SeqLock<Snapshot> shared(Make(0));
+    std::atomic<bool> done(false);
+    std::atomic<int> torn(0);
+    std::atomic<int> backwards(0);
+    std::atomic<long> reads(0);
+
+    std::vector<std::thread> threads;
+    for (int reader = 0; reader < kReaders; reader++)
+    {
+        threads.emplace_back([&]() {
+            uint32_t last[kWriters] = {};
+            long count = 0;
+            while (!done.load(std::memory_order_relaxed))
+            {
+                auto snapshot = shared.Load();
+                count++;
+                if (!IsWhole(snapshot))
+                {
+                    torn++;
+                    continue;
+                }
+                // Writer w stores w + 1, w + 1 + kWriters, ...
+                if (snapshot.Sequence == 0)
+                    continue;
+                auto writer = (snapshot.Sequence - 1) % kWriters;
+                if (snapshot.Sequence < last[writer])
+                    backwards++;
+                last[writer] = snapshot.Sequence;
+            }
+            reads += count;
+        });
+    }
+    std::vector<std::thread> writers;
+    for (int writer = 0; writer < kWriters; writer++)
+    {
+        writers.emplace_back([&shared, writer]() {
+            for (uint32_t i = 0; i < kWrites; i++)
+                shared.Store(Make(writer + 1 + i * kWriters));
+        });
+    }
+    for (auto &thread : writers)
+        thread.join();
+    done = true;
+    for (auto &thread : threads)
+        thread.join();
+
+    CHECK_EQUAL(0, torn.load());
+    CHECK_EQUAL(0, backwards.load());
+    CHECK(reads.load() > 0);
+    CHECK(IsWhole(shared.Load()));
+}
+
+// Concurrent Updates are read-modify-write under the writer lock, none of them is lost
+static void TestUpdatesAreAtomic()
+{
+    SeqLock<Snapshot> shared(Make(0));
+    std::atomic<bool> done(false);
+    std::atomic<int> torn(0);
+
+    std::thread reader([&]() {
+        while (!done.load(std::memory_order_relaxed))
+        {
+            if (!IsWhole(shared.Load()))
+                torn++;
+        }
+    });
+    std::vector<std::thread> writers;
+    for (int writer = 0; writer < kWriters; writer++)
+    {
+        writers.emplace_back([&shared]() {
+            for (uint32_t i = 0; i < kWrites; i++)
+                shared.Update([](Snapshot &snapshot) { snapshot = Make(snapshot.Sequence + 1); });
+        });
+    }
+    for (auto &thread : writers)
+        thread.join();
+    done = true;
+    reader.join();
+
+    CHECK_EQUAL(0, torn.load());
+    CHECK_EQUAL(kWriters * kWrites, shared.Load().Sequence);
+}
+
+// Update hands back the value from before the change
+static void TestUpdateReturnsPrevious()
+{
+    SeqLock<Snapshot> shared(Make(7));
+    auto previous = shared.Update([](Snapshot &snapshot) { snapshot = Make(8); });
+    CHECK_EQUAL(7, previous.Sequence);
+    CHECK_EQUAL(8, shared.Load().Sequence);
+}
+
+int main()
+{
+    TestNoTornSnapshots();
+    TestUpdatesAreAtomic();
+    TestUpdateReturnsPrevious();
+    return TEST_RESULT();
+}